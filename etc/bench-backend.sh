@@ -0,0 +1,101 @@
+#!/usr/bin/env bash
+set -euo pipefail
+source "$(dirname "$0")/lib.sh"
+
+COEXE="$PROJECT/out/opt/co"
+NFILES=16
+NFUNS=200
+NRUNS=3
+BUILDMODE=
+
+while [[ $# -gt 0 ]]; do case "$1" in
+  -co=*)    COEXE=${1:4}; shift ;;
+  -files=*) NFILES=${1:7}; shift ;;
+  -funs=*)  NFUNS=${1:6}; shift ;;
+  -runs=*)  NRUNS=${1:6}; shift ;;
+  -debug)   BUILDMODE=--debug; shift ;;
+  -h|-help|--help) cat << _END
+Compare compile time of the C backend (cgen + clang) with the LLVM backend
+Usage: $0 [options]
+Options:
+  -co=<file>   compis executable to use (default: $(_relpath "$COEXE"))
+  -files=<N>   Number of source files in generated package (default: $NFILES)
+  -funs=<N>    Number of functions per source file (default: $NFUNS)
+  -runs=<N>    Number of builds per backend; best time is reported (default: $NRUNS)
+  -debug       Build in debug mode instead of opt mode
+  -h, --help   Show help on stdout and exit
+_END
+    exit ;;
+  -*) _err "Unexpected option $1" ;;
+  *)  _err "Unexpected argument $1" ;;
+esac; done
+
+[ -x "$COEXE" ] || _err "$COEXE not found (build with ./build.sh or set -co=<file>)"
+
+WORK_DIR=$(mktemp -d -t co-bench-backend.XXXXXX)
+trap "rm -rf '$WORK_DIR'" EXIT
+PKGDIR="$WORK_DIR/pkg"
+mkdir -p "$PKGDIR"
+
+# Separate cache dir, so that the object cache can be cleared between runs.
+# It's kept across invocations since it also holds the sysroot.
+export COCACHE="$PROJECT/out/bench-backend-cache"
+
+# generate a package of NFILES source files with NFUNS functions each,
+# limited to the language subset supported by the LLVM backend
+for ((f = 0; f < NFILES; f++)); do
+  for ((i = 0; i < NFUNS; i++)); do
+    next="f${f}_$(( i + 1 ))"
+    [ $i -lt $(( NFUNS - 1 )) ] || next="f${f}_0"
+    cat << _END
+fun f${f}_$i(n, x i64) i64 {
+  var acc i64 = x
+  if (acc & 1) == 0 && n > $i {
+    acc = acc / 2 + n
+  } else {
+    acc = acc * 3 + $i
+  }
+  acc ^= n << 3
+  if n > 1000 { return $next(n - 1, acc) }
+  acc
+}
+
+_END
+  done > "$PKGDIR/f$f.co"
+done
+cat << _END > "$PKGDIR/main.co"
+fun main() {
+  var acc i64
+$(for ((f = 0; f < NFILES; f++)); do echo "  acc += f${f}_0(10, acc)"; done)
+}
+_END
+
+echo "package: $NFILES files × $NFUNS functions ($(cat "$PKGDIR"/*.co | wc -l | tr -d ' ') lines)"
+
+# bench_build <backend> -> prints best wall time in milliseconds
+bench_build() {
+  local backend=$1
+  local best=
+  for ((r = 0; r < NRUNS; r++)); do
+    # clear object cache so that every unit is compiled
+    rm -rf "$COCACHE/obj"
+    local t0=$(date +%s%N)
+    "$COEXE" build $BUILDMODE --backend=$backend \
+      --build-dir="$WORK_DIR/build" -o "$WORK_DIR/main.exe" "$PKGDIR" >/dev/null
+    local t1=$(date +%s%N)
+    local ms=$(( (t1 - t0) / 1000000 ))
+    [ -z "$best" -o "$ms" -lt "${best:-0}" ] && best=$ms
+  done
+  "$WORK_DIR/main.exe" || _err "main.exe (--backend=$backend) failed"
+  echo $best
+}
+
+# warm up: build sysroot and std/runtime outside of measurements
+"$COEXE" build $BUILDMODE \
+  --build-dir="$WORK_DIR/build" -o "$WORK_DIR/main.exe" "$PKGDIR" >/dev/null
+
+C_MS=$(bench_build c)
+LLVM_MS=$(bench_build llvm)
+printf "backend=c     %6d ms\n" $C_MS
+printf "backend=llvm  %6d ms  (%d.%02dx)\n" $LLVM_MS \
+  $(( C_MS / LLVM_MS )) $(( (C_MS * 100 / LLVM_MS) % 100 ))
@@ -0,0 +1,58 @@
+#!/usr/bin/env bash
+set -euo pipefail
+source "$(dirname "$0")/lib.sh"
+
+COEXE="$PROJECT/out/debug/co"
+NFILES=8
+NDEFS=400
+
+while [[ $# -gt 0 ]]; do case "$1" in
+  -co=*)    COEXE=${1:4}; shift ;;
+  -files=*) NFILES=${1:7}; shift ;;
+  -defs=*)  NDEFS=${1:6}; shift ;;
+  -h|-help|--help) cat << _END
+Measure how fast package metafiles (pub.coast) decode, in each encoding format
+Usage: $0 [options]
+Options:
+  -co=<file>    compis executable to use (default: $(_relpath "$COEXE"))
+                Must have "selftest"; for meaningful numbers build with
+                ./build.sh -opt -DCO_ENABLE_TESTS
+  -files=<N>    Number of source files in generated package (default: $NFILES)
+  -defs=<N>     Number of public types & functions per source file (default: $NDEFS)
+  -h, --help    Show help on stdout and exit
+_END
+    exit ;;
+  -*) _err "Unexpected option $1" ;;
+  *)  _err "Unexpected argument $1" ;;
+esac; done
+
+[ -x "$COEXE" ] || _err "$COEXE not found (build with ./build.sh -debug or set -co=<file>)"
+
+WORK_DIR=$(mktemp -d -t co-bench-metafile.XXXXXX)
+trap "rm -rf '$WORK_DIR'" EXIT
+PKGDIR="$WORK_DIR/pkg"
+mkdir -p "$PKGDIR"
+
+# generate a package with a wide public API of NFILES x NDEFS types and functions
+for ((f = 0; f < NFILES; f++)); do
+  for ((i = 0; i < NDEFS; i++)); do
+    cat << _END
+pub type S${f}_$i {
+  a int
+  b i32
+  c u8
+}
+pub fun f${f}_$i(x, y int) int {
+  x + y + $i
+}
+
+_END
+  done > "$PKGDIR/f$f.co"
+done
+echo "fun main() {}" > "$PKGDIR/main.co"
+
+"$COEXE" build --no-link --build-dir="$WORK_DIR/build" "$PKGDIR" >/dev/null
+
+for f in $(find "$WORK_DIR/build" -name pub.coast); do
+  "$COEXE" selftest --bench-astdecode="$f"
+done
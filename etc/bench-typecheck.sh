@@ -0,0 +1,122 @@
+#!/usr/bin/env bash
+set -euo pipefail
+source "$(dirname "$0")/lib.sh"
+
+COEXE="$PROJECT/out/opt/co"
+NFILES=32
+NFUNS=400
+NRUNS=3
+PHASE=typecheck
+MAXPROC=$(nproc 2>/dev/null || sysctl -n hw.ncpu)
+
+while [[ $# -gt 0 ]]; do case "$1" in
+  -co=*)      COEXE=${1:4}; shift ;;
+  -files=*)   NFILES=${1:7}; shift ;;
+  -funs=*)    NFUNS=${1:6}; shift ;;
+  -runs=*)    NRUNS=${1:6}; shift ;;
+  -phase=*)   PHASE=${1:7}; shift ;;
+  -maxproc=*) MAXPROC=${1:9}; shift ;;
+  -h|-help|--help) cat << _END
+Measure how a compiler phase of a large package scales with the number of threads
+Usage: $0 [options]
+Options:
+  -co=<file>     compis executable to use (default: $(_relpath "$COEXE"))
+  -files=<N>     Number of source files in generated package (default: $NFILES)
+  -funs=<N>      Number of functions per source file (default: $NFUNS)
+  -runs=<N>      Number of builds per thread count; best time is reported (default: $NRUNS)
+  -phase=<name>  Phase to measure: typecheck or iranalyze (default: $PHASE)
+  -maxproc=<N>   Max number of threads to measure (default: $MAXPROC)
+  -h, --help     Show help on stdout and exit
+_END
+    exit ;;
+  -*) _err "Unexpected option $1" ;;
+  *)  _err "Unexpected argument $1" ;;
+esac; done
+
+case "$PHASE" in
+  typecheck|iranalyze) ;;
+  *) _err "Unknown phase \"$PHASE\"" ;;
+esac
+
+[ -x "$COEXE" ] || _err "$COEXE not found (build with ./build.sh or set -co=<file>)"
+
+WORK_DIR=$(mktemp -d -t co-bench-typecheck.XXXXXX)
+trap "rm -rf '$WORK_DIR'" EXIT
+PKGDIR="$WORK_DIR/pkg"
+mkdir -p "$PKGDIR"
+
+# generate a package of NFILES source files with NFUNS functions each
+for ((f = 0; f < NFILES; f++)); do
+  cat << _END
+type Acc$f {
+  sum i64
+  n   int
+}
+fun Acc$f.add(mut this, v i64) {
+  this.sum += v
+  this.n++
+}
+
+_END
+  for ((i = 0; i < NFUNS; i++)); do
+    next="f${f}_$(( i + 1 ))"
+    [ $i -lt $(( NFUNS - 1 )) ] || next="f${f}_0"
+    cat << _END
+fun f${f}_$i(n, x i64) i64 {
+  var acc Acc$f
+  var v i64 = x
+  if (v & 1) == 0 && n > $i {
+    v = v / 2 + n
+  } else {
+    v = v * 3 + $i
+  }
+  acc.add(v ^ (n << 3))
+  acc.add(v)
+  if n > 1000 { return $next(n - 1, acc.sum) }
+  acc.sum
+}
+
+_END
+  done > "$PKGDIR/f$f.co"
+done
+cat << _END > "$PKGDIR/main.co"
+fun main() {
+  var acc i64
+$(for ((f = 0; f < NFILES; f++)); do echo "  acc += f${f}_0(10, acc)"; done)
+}
+_END
+
+echo "package: $NFILES files × $NFUNS functions ($(cat "$PKGDIR"/*.co | wc -l | tr -d ' ') lines)"
+
+# phase_time <nthreads> -> prints best time of PHASE for the package in microseconds
+phase_time() {
+  local best=
+  for ((r = 0; r < NRUNS; r++)); do
+    touch "$PKGDIR"/*.co # make sure the package is rebuilt
+    local us=$("$COEXE" build -vv -j$1 --no-link \
+      --build-dir="$WORK_DIR/build" "$PKGDIR" |
+      grep -F "] $PHASE: " | grep -vF "[std/" | tail -n1 |
+      awk '{ d = $NF; v = d + 0
+             if (d ~ /ms$/) v *= 1000; else if (d ~ /ns$/) v /= 1000; else if (d ~ /[0-9]s$/) v *= 1000000
+             printf "%d\n", v }')
+    [ -n "$us" ] || _err "no $PHASE time in output of $COEXE build -vv"
+    [ -z "$best" -o "$us" -lt "${best:-0}" ] && best=$us
+  done
+  echo $best
+}
+
+# warm up: build sysroot and std/runtime outside of measurements
+"$COEXE" build --no-link --build-dir="$WORK_DIR/build" "$PKGDIR" >/dev/null
+
+# thread counts to measure: 1, 2, 4 ... MAXPROC
+THREADS=()
+for ((j = 1; j < MAXPROC; j *= 2)); do THREADS+=( $j ); done
+THREADS+=( $MAXPROC )
+
+BASE_US=
+for j in ${THREADS[@]}; do
+  US=$(phase_time $j)
+  [ -n "$BASE_US" ] || BASE_US=$US
+  printf "threads=%-3d %8d us  (%d.%02dx)\n" $j $US \
+    $(( BASE_US / US )) $(( (BASE_US * 100 / US) % 100 ))
+done
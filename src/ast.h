@@ -160,6 +160,8 @@ ASSUME_NONNULL_BEGIN
 typedef struct node_ node_t;
 typedef struct nsexpr_ nsexpr_t;
 typedef struct fun_ fun_t;
+typedef struct astdecoder_ astdecoder_t;
+typedef struct pkgstats_ pkgstats_t;
 
 typedef array_type(node_t*) nodearray_t; // cap==len
 DEF_ARRAY_TYPE_API(node_t*, nodearray)
@@ -186,10 +188,12 @@ typedef struct pkg_ {
   ptrarray_t      imports;  // pkg_t*[] -- imported packages (set by import_pkgs)
   sha256_t        api_sha256; // SHA-256 sum of pub.h
 
-  future_t           loadfut;
-  nodearray_t        api;     // package-level declarations, available after loadfut
-  nsexpr_t* nullable api_ns;  // set by pkgbuild after loading api
-  unixtime_t         mtime;
+  future_t               loadfut;
+  nodearray_t            api;     // package-level declarations, available after loadfut
+  nsexpr_t* nullable     api_ns;  // set by pkgbuild after loading api
+  astdecoder_t* nullable apidec;  // decodes NULL entries of api (see pkg_api_member)
+  pkgstats_t* nullable   stats;   // set while building with --stats (see buildstats.h)
+  unixtime_t             mtime;
 } pkg_t;
 
 typedef struct comment_t {
@@ -680,6 +684,9 @@ err_t pkg_def_set(pkg_t* pkg, memalloc_t ma, sym_t name, node_t* n);
 err_t pkg_def_add(pkg_t* pkg, memalloc_t ma, sym_t name, node_t** np_inout);
 err_t pkg_def_addm(pkg_t* pkg, memalloc_t ma, sym_t* namev, node_t** nodev, u32 count);
 str_t pkg_unit_srcdir(const pkg_t* pkg, const unit_t* unit);
+// pkg_api_member returns pkg->api.v[i], decoding it first if it has not been loaded.
+// Returns NULL if decoding fails.
+node_t* nullable pkg_api_member(pkg_t* pkg, u32 i);
 // pkg_imports_add adds dep to importer_pkg->imports (uniquely)
 bool pkg_imports_add(pkg_t* importer_pkg, pkg_t* dep, memalloc_t ma);
 
@@ -764,7 +771,10 @@ static typeid_t typeid_of(const type_t* t);
 void typeid_init(memalloc_t);
 inline static u32 typeid_len(typeid_t t) { return t->len; }
 usize typeid_hash(usize seed, typeid_t);
+usize typeid_intern_hash(typeid_t); // hash used by typeid_intern_typeid_hashed
 typeid_t typeid_intern_typeid(typeid_t);
+typeid_t typeid_intern_typeid_hashed(typeid_t, usize hash);
+usize typeid_count(); // number of interned typeids
 
 typeid_t _typeid(type_t*, bool intern);
 inline static typeid_t typeid_intern(type_t* t) {
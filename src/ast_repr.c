@@ -255,8 +255,13 @@ static void repr_unit(RPARAMS, const unit_t* n) {
 
 static void repr_nsexpr(RPARAMS, const nsexpr_t* n) {
   for (usize i = 0; i < n->members.len; i++) {
+    // note: package members may be decoded concurrently (see pkg_api_member)
+    node_t* member = AtomicLoad(
+      (_Atomic(node_t*)*)&n->members.v[i], memory_order_acquire);
+    if (!member) // not yet decoded
+      continue;
     REPR_BEGIN('(', n->member_names[i]);
-    repr(RARGS, n->members.v[i]);
+    repr(RARGS, member);
     REPR_END(')');
   }
 }
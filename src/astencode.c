@@ -1,7 +1,57 @@
 // SPDX-License-Identifier: Apache-2.0
 /*
 
-AST encoding format:
+AST encoding formats:
+There's a binary format (version 2) which is what astencoder_encode produces,
+and a text format (version 1) produced by astencoder_encode_text, which is easier
+to read when debugging. astdecoder decodes both, telling them apart by their header.
+
+
+Binary format (version 2):
+All integers are little endian and all records are 4-byte aligned, so that an
+mmap'd file can be decoded in place, without tokenization.
+
+  root = header
+         strref{srccount}  // srcfile names
+         import{importcount}
+         strref{symcount}  // symbols
+         nodeid{rootcount}
+         u32{nodecount}    // byte offset of each node in nodedata
+         nodedata          // u8{nodesize}
+         strtab            // u8{strsize}
+
+  header = magic          // "cAST"
+           version        u32 (2)
+           srccount       u32
+           importcount    u32
+           symcount       u32
+           nodecount      u32
+           rootcount      u32
+           nodesize       u32
+           strsize        u32
+           pkgroot        strref
+           pkgpath        strref
+           api_sha256     u8{32} // all zero if unknown
+  import = pkgroot pkgpath api_sha256
+
+  node  = kind            // same four bytes as nodekind in the text format
+          ( flags         u32
+            nuse          u32
+            loc           u64
+            typeid?       strref (only for types)
+            field* )?     // absent for builtin types
+  field = u32             // U8, U16, U32
+        | u64             // U64, F64, LOC
+        | symid | nodeid  // nullable ones use U32_MAX for null
+        | strref
+        | u32 nodeid{len} // nodearray (len, ids...)
+
+  strref = u32 // byte offset in strtab of: len u32, u8{len}, 0x00, pad to 4 bytes
+  symid  = u32 // index in symbol table
+  nodeid = u32 // index of node (nodes only refer to nodes before themselves)
+
+
+Text format (version 1):
 
   root = header
          pkg
@@ -71,7 +121,8 @@ AST encoding format:
 
 
 #define FILE_MAGIC "cAST"
-#define AST_ENC_VERSION 1
+#define AST_ENC_VERSION      2 // binary format
+#define AST_ENC_VERSION_TEXT 1 // text format
 #define AST_ENC_EXCLUDED_NODEFLAGS \
     NF_MARK1 | NF_MARK2
 
@@ -102,6 +153,8 @@ typedef struct astencoder_ {
   map_t             nodemap;    // maps {node_t* => uintptr nodelist index}
   ptrarray_t        symmap;     // maps {sym_t => u32 index} (sorted set)
   usize             symsize;    // total length of all symbol characters
+  buf_t             strtab;     // string table of binary encoding
+  bool              strtab_overflow; // strtab grew past what strrefs can address
   const pkg_t*      pkg;        //
   bool              oom;        // true if memory allocation failed (internal state)
 } astencoder_t;
@@ -442,7 +495,7 @@ static void encode_node(astencoder_t* a, buf_t* outbuf, const node_t* n) {
 static void encode_header(astencoder_t* a, buf_t* outbuf) {
   char* p = outbuf->chars + outbuf->len;
   memcpy(p, FILE_MAGIC, 4); p += 4; *p++ = ' ';
-  p += fmt_u64_base16(p, 8, AST_ENC_VERSION); *p++ = ' ';
+  p += fmt_u64_base16(p, 8, AST_ENC_VERSION_TEXT); *p++ = ' ';
   p += fmt_u64_base16(p, 8, a->srcfileids.len); *p++ = ' ';
   p += fmt_u64_base16(p, 8, a->pkg->imports.len); *p++ = ' ';
   p += fmt_u64_base16(p, 8, a->symmap.len); *p++ = ' ';
@@ -524,7 +577,7 @@ static usize enc_preallocsize(astencoder_t* a) {
   // "the worst"; we will most certainly need to use more space than what
   // we allocate since certain node fields require buffer expansion.
   usize nbyte = 4 + 1  // magic SP
-              + ndigits16(AST_ENC_VERSION) + 1  // version SP
+              + ndigits16(AST_ENC_VERSION_TEXT) + 1  // version SP
               + 8 + 1  // srccount SP
               + 8 + 1  // importcount SP
               + 8 + 1  // symcount SP
@@ -578,8 +631,8 @@ static usize enc_preallocsize(astencoder_t* a) {
 }
 
 
-err_t astencoder_encode(astencoder_t* a, buf_t* outbuf) {
-  assertf(a->pkg != NULL, "astencoder_begin not called before astencoder_encode");
+err_t astencoder_encode_text(astencoder_t* a, buf_t* outbuf) {
+  assertf(a->pkg != NULL, "astencoder_begin not called before astencoder_encode_text");
 
   if (a->oom)
     return ErrNoMem;
@@ -632,6 +685,241 @@ err_t astencoder_encode(astencoder_t* a, buf_t* outbuf) {
 }
 
 
+// ———————————————— binary encoding ————————————————
+
+
+// BIN_NULL is used for null symbol, node and string references
+#define BIN_NULL U32_MAX
+
+// BIN_HEADER_SIZE: bytes of header (magic, 8 x u32, 2 x strref, api_sha256)
+#define BIN_HEADER_SIZE (4ul + 8*4 + 2*4 + 32)
+
+// BIN_IMPORT_SIZE: bytes of an import record (pkgroot, pkgpath, api_sha256)
+#define BIN_IMPORT_SIZE (2ul*4 + 32)
+
+
+inline static u8* bin_put_u32(u8* p, u32 v) {
+  v = co_htole(v);
+  memcpy(p, &v, 4);
+  return p + 4;
+}
+
+inline static u8* bin_put_u64(u8* p, u64 v) {
+  v = co_htole(v);
+  memcpy(p, &v, 8);
+  return p + 8;
+}
+
+
+// bin_strref adds a string to a->strtab, returning its strref
+static u32 bin_strref(astencoder_t* a, const void* str, usize len) {
+  buf_t* strtab = &a->strtab;
+  usize offs = strtab->len;
+  usize nbyte = ALIGN2(4 + len + 1, 4); // len, bytes, NUL
+  if UNLIKELY(len >= U32_MAX || offs + nbyte >= (usize)BIN_NULL) {
+    a->strtab_overflow = true; // astencoder_encode returns ErrOverflow
+    return BIN_NULL;
+  }
+  if UNLIKELY(!buf_reserve(strtab, nbyte)) {
+    a->oom = true;
+    return BIN_NULL;
+  }
+  u8* p = bin_put_u32(strtab->bytes + offs, (u32)len);
+  memcpy(p, str, len);
+  memset(p + len, 0, nbyte - 4 - len); // NUL terminator and padding
+  strtab->len += nbyte;
+  return (u32)offs;
+}
+
+
+// bin_field_size returns the number of bytes needed to encode a field
+static usize bin_field_size(const void* np, ast_field_t f) {
+  switch ((enum ast_fieldtype)f.type) {
+    case AST_FIELD_U64:
+    case AST_FIELD_F64:
+    case AST_FIELD_LOC:
+      return 8;
+    case AST_FIELD_NODEARRAY:
+      return 4 + (usize)((const nodearray_t*)(np + f.offs))->len * 4;
+    case AST_FIELD_UNDEF:
+      UNREACHABLE;
+    default:
+      return 4;
+  }
+}
+
+
+static u8* bin_encode_field(astencoder_t* a, u8* p, const void* np, ast_field_t f) {
+  const void* fp = np + f.offs;
+  switch ((enum ast_fieldtype)f.type) {
+  case AST_FIELD_U8:  return bin_put_u32(p, *(u8*)fp);
+  case AST_FIELD_U16: return bin_put_u32(p, *(u16*)fp);
+  case AST_FIELD_U32: return bin_put_u32(p, *(u32*)fp);
+  case AST_FIELD_U64: return bin_put_u64(p, *(u64*)fp);
+  case AST_FIELD_F64: return bin_put_u64(p, f64_to_u64(*(f64*)fp));
+  case AST_FIELD_LOC: return bin_put_u64(p, enc_remap_loc(a, *(loc_t*)fp));
+
+  case AST_FIELD_SYM:
+  case AST_FIELD_SYMZ: {
+    sym_t sym = *(sym_t*)fp;
+    return bin_put_u32(p, sym ? encoded_sym_index(a, sym) : BIN_NULL);
+  }
+
+  case AST_FIELD_NODE:
+  case AST_FIELD_NODEZ: {
+    const node_t* n = *(const node_t**)fp;
+    return bin_put_u32(p, n ? encoded_node_index(a, n) : BIN_NULL);
+  }
+
+  case AST_FIELD_STR:
+  case AST_FIELD_STRZ: {
+    const char* str = *(const char**)fp;
+    return bin_put_u32(p, str ? bin_strref(a, str, strlen(str)) : BIN_NULL);
+  }
+
+  case AST_FIELD_NODEARRAY: {
+    const nodearray_t* na = fp;
+    p = bin_put_u32(p, na->len);
+    for (u32 i = 0; i < na->len; i++)
+      p = bin_put_u32(p, encoded_node_index(a, na->v[i]));
+    return p;
+  }
+
+  case AST_FIELD_UNDEF:
+    break;
+  }
+  UNREACHABLE;
+  return p;
+}
+
+
+static void bin_encode_node(astencoder_t* a, buf_t* outbuf, const node_t* n) {
+  assertf(n->kind < NODEKIND_COUNT, "%s %u", nodekind_name(n->kind), n->kind);
+
+  const ast_field_t* fieldtab = g_ast_fieldtab[n->kind];
+  u8 fieldlen = g_ast_fieldlentab[n->kind];
+
+  // calculate exact size of node, so that we can write it without bounds checks
+  usize nbyte = 4; // kind
+  if (!n->is_builtin) {
+    nbyte += 4 + 4 + 8; // flags, nuse, loc
+    nbyte += nodekind_istype(n->kind) * 4; // typeid
+    for (u8 i = 0; i < fieldlen; i++)
+      nbyte += bin_field_size(n, fieldtab[i]);
+  }
+  BUF_RESERVE(nbyte);
+
+  u8* p = outbuf->bytes + outbuf->len;
+  memcpy(p, &g_ast_kindtagtab[n->kind], 4); p += 4;
+
+  // builtin universal types are encoded solely by kind
+  if (!n->is_builtin) {
+    p = bin_put_u32(p, (u32)(n->flags & ~AST_ENC_EXCLUDED_NODEFLAGS));
+    p = bin_put_u32(p, n->nuse);
+    p = bin_put_u64(p, enc_remap_loc(a, n->loc));
+    if (nodekind_istype(n->kind)) {
+      typeid_t typeid = ((type_t*)n)->_typeid;
+      p = bin_put_u32(p, typeid ? bin_strref(a, typeid->bytes, typeid->len) : BIN_NULL);
+    }
+    for (u8 i = 0; i < fieldlen; i++)
+      p = bin_encode_field(a, p, n, fieldtab[i]);
+  }
+
+  buf_setlenp(outbuf, p);
+}
+
+
+err_t astencoder_encode(astencoder_t* a, buf_t* outbuf) {
+  assertf(a->pkg != NULL, "astencoder_begin not called before astencoder_encode");
+
+  if (a->oom)
+    return ErrNoMem;
+
+  const pkg_t* pkg = a->pkg;
+  usize start = outbuf->len;
+  a->strtab.len = 0;
+  a->strtab_overflow = false;
+
+  // allocate space for the header and the tables preceding node data
+  usize nbyte = BIN_HEADER_SIZE
+              + (usize)a->srcfileids.len * 4
+              + (usize)pkg->imports.len * BIN_IMPORT_SIZE
+              + (usize)a->symmap.len * 4
+              + (usize)a->rootlist.len * 4
+              + (usize)a->nodelist.len * 4;
+  BUF_RESERVE(nbyte, ErrNoMem);
+
+  // header (nodesize and strsize are written when known)
+  u8* p = outbuf->bytes + start;
+  memcpy(p, FILE_MAGIC, 4); p += 4;
+  p = bin_put_u32(p, AST_ENC_VERSION);
+  p = bin_put_u32(p, a->srcfileids.len);
+  p = bin_put_u32(p, pkg->imports.len);
+  p = bin_put_u32(p, a->symmap.len);
+  p = bin_put_u32(p, a->nodelist.len);
+  p = bin_put_u32(p, a->rootlist.len);
+  usize sizes_offs = (usize)(uintptr)(p - outbuf->bytes); p += 2*4;
+  p = bin_put_u32(p, bin_strref(a, pkg->root.p, pkg->root.len));
+  p = bin_put_u32(p, bin_strref(a, pkg->path.p, pkg->path.len));
+  memcpy(p, &pkg->api_sha256, 32); p += 32;
+
+  // srcfiles
+  for (u32 i = 0; i < a->srcfileids.len; i++) {
+    const srcfile_t* srcfile = locmap_srcfile(&a->c->locmap, a->srcfileids.v[i]);
+    assertf(srcfile->pkg == pkg, "srcfiles from mixed packages %s and %s",
+      pkg->path.p, srcfile->pkg->path.p);
+    p = bin_put_u32(p, bin_strref(a, srcfile->name.p, srcfile->name.len));
+  }
+
+  // imports
+  for (u32 i = 0; i < pkg->imports.len; i++) {
+    const pkg_t* dep = pkg->imports.v[i];
+    p = bin_put_u32(p, bin_strref(a, dep->root.p, dep->root.len));
+    p = bin_put_u32(p, bin_strref(a, dep->path.p, dep->path.len));
+    memcpy(p, &dep->api_sha256, 32); p += 32;
+  }
+
+  // symbols
+  for (u32 i = 0; i < a->symmap.len; i++) {
+    sym_t sym = a->symmap.v[i];
+    p = bin_put_u32(p, bin_strref(a, sym, strlen(sym)));
+  }
+
+  // root node IDs
+  for (u32 i = 0; i < a->rootlist.len; i++)
+    p = bin_put_u32(p, a->rootlist.v[i]);
+
+  // node offsets are written as nodes are encoded, since outbuf may grow
+  usize nodeoffs_start = (usize)(uintptr)(p - outbuf->bytes);
+  p += (usize)a->nodelist.len * 4;
+  buf_setlenp(outbuf, p);
+
+  // nodes
+  usize nodedata_start = outbuf->len;
+  for (u32 i = 0; i < a->nodelist.len && !a->oom; i++) {
+    usize offs = outbuf->len - nodedata_start;
+    if UNLIKELY(offs > U32_MAX)
+      return ErrOverflow;
+    bin_put_u32(outbuf->bytes + nodeoffs_start + i*4, (u32)offs);
+    bin_encode_node(a, outbuf, a->nodelist.v[i]);
+  }
+  if (a->oom)
+    return ErrNoMem;
+  usize nodesize = outbuf->len - nodedata_start;
+  if UNLIKELY(nodesize > U32_MAX || a->strtab_overflow)
+    return ErrOverflow;
+
+  // strtab
+  p = outbuf->bytes + sizes_offs;
+  bin_put_u32(p, (u32)nodesize);
+  bin_put_u32(p + 4, (u32)a->strtab.len);
+  if (!buf_append(outbuf, a->strtab.p, a->strtab.len))
+    return ErrNoMem;
+
+  return 0;
+}
+
+
 // ———————————————— adding AST to be encoded ————————————————
 
 
@@ -818,7 +1106,8 @@ static const node_t* pub_api_filter_node(astencoder_t* a, const node_t* n) {
 
 static void add_ast_visitor(astencoder_t* a, u32 flags, const node_t* n) {
   // assign n to nodemap, returning early if it's already in the map
-  uintptr* vp = (uintptr*)map_assign_ptr(&a->nodemap, a->ma, n);
+  const node_t* key = n;
+  uintptr* vp = (uintptr*)map_assign_ptr(&a->nodemap, a->ma, key);
   if UNLIKELY(!vp) {
     dlog("%s: map_assign_ptr OOM", __FUNCTION__);
     a->oom = true;
@@ -860,6 +1149,9 @@ static void add_ast_visitor(astencoder_t* a, u32 flags, const node_t* n) {
   }
 
   // assign its nodelist index to nodemap
+  // (visiting children may have grown nodemap, invalidating vp)
+  if (!n->is_builtin)
+    vp = assertnotnull((uintptr*)map_lookup_ptr(&a->nodemap, key));
   *vp = a->nodelist.len; // +1 since 0 is initial value, checked for above
 }
 
@@ -956,6 +1248,7 @@ astencoder_t* nullable astencoder_create(compiler_t* c) {
     return NULL;
   a->ma = c->ma;
   a->c = c;
+  buf_init(&a->strtab, c->ma);
   if (!map_init(&a->nodemap, c->ma, 256)) {
     mem_freet(c->ma, a);
     return NULL;
@@ -974,6 +1267,7 @@ void astencoder_free(astencoder_t* a) {
   u32array_dispose(&a->rootlist, a->ma);
   u32array_dispose(&a->srcfileids, a->ma);
   map_dispose(&a->nodemap, a->ma);
+  buf_dispose(&a->strtab);
 
   mem_freet(a->ma, a);
 }
@@ -1010,6 +1304,17 @@ typedef struct astdecoder_ {
   const u8*   pstart;
   const u8*   pend;
   const u8*   pcurr;
+  const u8*   bin_tables;   // binary format: srcfile, import, symbol & root tables
+  const u8*   bin_nodeoffs; // binary format: u32 offset of each node in bin_nodedata
+  const u8*   bin_nodedata; // binary format: node records
+  const u8*   bin_strtab;   // binary format: string table
+  const u8*   bin_symrefs;  // binary format: strref of each symbol
+  const u8*   bin_rootids;  // binary format: node ID of each root
+  u32         bin_nodesize; // binary format: size of bin_nodedata
+  u32         bin_strsize;  // binary format: size of bin_strtab
+  node_t**    lazy_roots;   // lazy decoding: roots, NULL until decoded
+  u32array_t  lazy_stack;   // lazy decoding: IDs of nodes waiting to be decoded
+  mutex_t     lazy_mu;      // lazy decoding: guards nodetab, symtab & lazy_roots
   err_t       err;
   u32         tmpbufcap;
   u8          tmpbuf[];
@@ -1051,6 +1356,12 @@ static const u8* dec_error(DEC_PARAMS, err_t err) {
     return pend;
   d->err = err;
 
+  if (d->version == AST_ENC_VERSION) {
+    elog("AST decoding error: %s: offset 0x%zx",
+      d->srcname, (usize)(uintptr)(p - d->pstart));
+    return pend;
+  }
+
   u32 line, col;
   decoder_error_loc(DEC_ARGS, &line, &col);
   //usize offs = (usize)(uintptr)(p - d->pstart);
@@ -1426,7 +1737,7 @@ static const u8* decode_header(DEC_PARAMS) {
   p = dec_u32x(DEC_ARGS, &d->version);
   p = dec_whitespace(DEC_ARGS);
 
-  if (d->version != AST_ENC_VERSION && !d->err) {
+  if (d->version != AST_ENC_VERSION_TEXT && !d->err) {
     dlog("unsupported version: %u", d->version);
     d->err = ErrNotSupported;
   }
@@ -1466,43 +1777,81 @@ static const u8* decode_bytes_untilchar(
 }
 
 
-static const u8* decode_pkg(DEC_PARAMS, pkg_t* pkg) {
-  // pkg = pkgroot ":" pkgpath (":" sha256x)? LF
-  const char* linep;
-  usize linelen;
+// dec_setpkg assigns root, path & dir of pkg, verifying that root and path are
+// the expected ones in case pkg already has them set
+static err_t dec_setpkg(
+  astdecoder_t* d, pkg_t* pkg, slice_t root, slice_t path,
+  const sha256_t* nullable api_sha256)
+{
   bool ok = true;
 
   // pkg.root
-  p = decode_bytes_untilchar(DEC_ARGS, &linep, &linelen, ':');
   if UNLIKELY(
     pkg->root.len > 0 && coverbose &&
-    (pkg->root.len != linelen || memcmp(pkg->root.p, linep, linelen) != 0) )
+    (pkg->root.len != root.len || memcmp(pkg->root.p, root.p, root.len) != 0) )
   {
     // elog(
     //   "[astdecoder] warning: %s: unexpected pkg root \"%.*s\""
     //   " (expected \"%s\"; using expected path)",
-    //   relpath(d->srcname), (int)linelen, linep, pkg->root.p);
+    //   relpath(d->srcname), (int)root.len, root.chars, pkg->root.p);
     dlog("%s: unexpected pkg root \"%.*s\" (expected \"%s\")",
-      relpath(d->srcname), (int)linelen, linep, pkg->root.p);
+      relpath(d->srcname), (int)root.len, root.chars, pkg->root.p);
     // this is a "soft" error, so not using DEC_ERROR
-    d->err = ErrInvalid;
-    return pend;
+    return ErrInvalid;
   } else {
     pkg->root.len = 0;
-    ok &= str_appendlen(&pkg->root, linep, linelen);
+    ok &= str_appendlen(&pkg->root, root.p, root.len);
+  }
+
+  if (api_sha256)
+    memcpy(&pkg->api_sha256, api_sha256, sizeof(pkg->api_sha256));
+
+  // check pkg.path
+  if UNLIKELY(
+    pkg->path.len > 0 &&
+    (pkg->path.len != path.len || memcmp(pkg->path.p, path.p, path.len) != 0) )
+  {
+    if (coverbose) {
+      elog("[astdecoder] error: %s: unexpected pkg path \"%.*s\" (expected \"%s\")",
+        relpath(d->srcname), (int)path.len, path.chars, pkg->path.p);
+    }
+    return ErrInvalid;
   }
+  pkg->path.len = 0;
+  ok &= str_appendlen(&pkg->path, path.p, path.len);
+
+  // pkg.dir
+  pkg->dir.len = 0;
+  ok &= pkg_dir_of_root_and_path(&pkg->dir, str_slice(pkg->root), str_slice(pkg->path));
+
+  return ok ? 0 : ErrNoMem;
+}
+
+
+static const u8* decode_pkg(DEC_PARAMS, pkg_t* pkg) {
+  // pkg = pkgroot ":" pkgpath (":" sha256x)? LF
+  const char* linep;
+  usize linelen;
+
+  // pkg.root
+  p = decode_bytes_untilchar(DEC_ARGS, &linep, &linelen, ':');
+  slice_t root = { .chars = linep, .len = linelen };
 
   // pkg.path
   p = decode_bytes_untilchar(DEC_ARGS, &linep, &linelen, '\n');
+  if (d->err)
+    return pend;
 
   // decode optional (":" sha256x)?
+  sha256_t api_sha256;
+  bool has_api_sha256 = false;
   isize coloni = string_lastindexof(linep, linelen, ':');
   if (coloni > -1) {
     const u8* hex = (u8*)linep + (coloni + 1);
     usize taillen = linelen - (usize)coloni - 1;
     if (taillen != 64)
       return DEC_ERROR(ErrInvalid, "invalid pkg api hash len (%zu)", taillen);
-    u8* api_sha256_bytes = (u8*)&pkg->api_sha256;
+    u8* api_sha256_bytes = (u8*)&api_sha256;
     for (usize i = 0; i < 32; i++) {
       #define DEC_HEXDIGIT(x) ( \
         ((x) - '0') - \
@@ -1513,30 +1862,18 @@ static const u8* decode_pkg(DEC_PARAMS, pkg_t* pkg) {
       u8 b = hex[i*2 + 1];
       api_sha256_bytes[i] = (DEC_HEXDIGIT(a) << 4) | DEC_HEXDIGIT(b);
     }
+    has_api_sha256 = true;
     linelen = (usize)coloni;
   }
+  slice_t path = { .chars = linep, .len = linelen };
 
-  // check pkg.path
-  if UNLIKELY(
-    pkg->path.len > 0 &&
-    (pkg->path.len != linelen || memcmp(pkg->path.p, linep, linelen) != 0) )
-  {
-    d->err = ErrInvalid;
-    if (coverbose) {
-      elog("[astdecoder] error: %s: unexpected pkg path \"%.*s\" (expected \"%s\")",
-        relpath(d->srcname), (int)linelen, linep, pkg->path.p);
-    }
-    return p;
-  }
-  pkg->path.len = 0;
-  ok &= str_appendlen(&pkg->path, linep, linelen);
-
-  // pkg.dir
-  pkg->dir.len = 0;
-  ok &= pkg_dir_of_root_and_path(&pkg->dir, str_slice(pkg->root), str_slice(pkg->path));
-
-  if UNLIKELY(!ok)
+  err_t err = dec_setpkg(d, pkg, root, path, has_api_sha256 ? &api_sha256 : NULL);
+  if UNLIKELY(err == ErrNoMem)
     return DEC_ERROR(ErrNoMem, "OOM");
+  if UNLIKELY(err) {
+    d->err = err;
+    return pend;
+  }
   return p;
 }
 
@@ -1580,6 +1917,24 @@ static const u8* decode_srcfiles(DEC_PARAMS, pkg_t* pkg) {
 }
 
 
+// dec_import adds package dep (decoded from an import record) to pkg->imports
+static err_t dec_import(astdecoder_t* d, pkg_t* pkg, const pkg_t* dep1) {
+  // Note: we do NOT check if the package actually exists.
+  // That is left for pkgbuild to do as it loads the package.
+
+  // resolve package in compiler's pkgindex
+  pkg_t* dep;
+  err_t err = pkgindex_intern(
+    d->c, str_slice(dep1->dir), str_slice(dep1->path), &dep1->api_sha256, &dep);
+
+  // add dep to pkg->imports
+  if (!err && !pkg_imports_add(pkg, dep, d->c->ma))
+    err = ErrNoMem;
+
+  return err;
+}
+
+
 static const u8* decode_imports(DEC_PARAMS, pkg_t* pkg, sha256_t* api_sha256v) {
   pkg_t tmp = {};
 
@@ -1593,18 +1948,7 @@ static const u8* decode_imports(DEC_PARAMS, pkg_t* pkg, sha256_t* api_sha256v) {
 
     memcpy(&api_sha256v[i], &tmp.api_sha256, sizeof(*api_sha256v));
 
-    // Note: we do NOT check if the package actually exists.
-    // That is left for pkgbuild to do as it loads the package.
-
-    // resolve package in compiler's pkgindex
-    pkg_t* dep;
-    err_t err = pkgindex_intern(
-      d->c, str_slice(tmp.dir), str_slice(tmp.path), &tmp.api_sha256, &dep);
-
-    // add dep to pkg->imports
-    if (!err && !pkg_imports_add(pkg, dep, d->c->ma))
-      err = ErrNoMem;
-
+    err_t err = dec_import(d, pkg, &tmp);
     if UNLIKELY(err) {
       dlog("OOM");
       p = pend;
@@ -1637,32 +1981,35 @@ static const u8* decode_symtab(DEC_PARAMS) {
 }
 
 
-static const u8* decode_builtin_type(DEC_PARAMS, u32 node_id, nodekind_t kind) {
-  node_t* n = NULL;
+static node_t* builtin_type(astdecoder_t* d, nodekind_t kind) {
   switch (kind) {
-    case TYPE_VOID:    n = (node_t*)type_void; break;
-    case TYPE_BOOL:    n = (node_t*)type_bool; break;
-    case TYPE_INT:     n = (node_t*)type_int; break;
-    case TYPE_UINT:    n = (node_t*)type_uint; break;
-    case TYPE_I8:      n = (node_t*)type_i8; break;
-    case TYPE_I16:     n = (node_t*)type_i16; break;
-    case TYPE_I32:     n = (node_t*)type_i32; break;
-    case TYPE_I64:     n = (node_t*)type_i64; break;
-    case TYPE_U8:      n = (node_t*)type_u8; break;
-    case TYPE_U16:     n = (node_t*)type_u16; break;
-    case TYPE_U32:     n = (node_t*)type_u32; break;
-    case TYPE_U64:     n = (node_t*)type_u64; break;
-    case TYPE_F32:     n = (node_t*)type_f32; break;
-    case TYPE_F64:     n = (node_t*)type_f64; break;
-    case TYPE_UNKNOWN: n = (node_t*)type_unknown; break;
-    case TYPE_STR:     n = (node_t*)&d->c->strtype; break;
+    case TYPE_VOID:    return (node_t*)type_void;
+    case TYPE_BOOL:    return (node_t*)type_bool;
+    case TYPE_INT:     return (node_t*)type_int;
+    case TYPE_UINT:    return (node_t*)type_uint;
+    case TYPE_I8:      return (node_t*)type_i8;
+    case TYPE_I16:     return (node_t*)type_i16;
+    case TYPE_I32:     return (node_t*)type_i32;
+    case TYPE_I64:     return (node_t*)type_i64;
+    case TYPE_U8:      return (node_t*)type_u8;
+    case TYPE_U16:     return (node_t*)type_u16;
+    case TYPE_U32:     return (node_t*)type_u32;
+    case TYPE_U64:     return (node_t*)type_u64;
+    case TYPE_F32:     return (node_t*)type_f32;
+    case TYPE_F64:     return (node_t*)type_f64;
+    case TYPE_UNKNOWN: return (node_t*)type_unknown;
+    case TYPE_STR:     return (node_t*)&d->c->strtype;
     default:
       assertf(0, "unexpected node kind %s", nodekind_name(kind));
       UNREACHABLE;
+      return NULL;
   }
+}
 
-  // dlog("nodetab[%u] = (universal node of kind %s)", node_id, nodekind_name(n->kind));
-  d->nodetab[node_id] = n;
+
+static const u8* decode_builtin_type(DEC_PARAMS, u32 node_id, nodekind_t kind) {
+  // dlog("nodetab[%u] = (universal node of kind %s)", node_id, nodekind_name(kind));
+  d->nodetab[node_id] = builtin_type(d, kind);
 
   // read line feed
   return dec_byte(DEC_ARGS, '\n');
@@ -1781,6 +2128,623 @@ static void dec_tmptabs_free(astdecoder_t* d) {
 
 
 
+// ———————————————— binary decoding ————————————————
+
+
+inline static u32 bin_u32(const u8* p) {
+  u32 v;
+  memcpy(&v, p, 4);
+  return co_htole(v);
+}
+
+inline static u64 bin_u64(const u8* p) {
+  u64 v;
+  memcpy(&v, p, 8);
+  return co_htole(v);
+}
+
+
+// bin_str looks up a strref in the string table, returning false if invalid
+static bool bin_str(const astdecoder_t* d, u32 ref, slice_t* result) {
+  if UNLIKELY((usize)ref + 4 + 1 > (usize)d->bin_strsize) // len + NUL
+    return false;
+  usize len = (usize)bin_u32(d->bin_strtab + ref);
+  if UNLIKELY((usize)ref + 4 + len + 1 > (usize)d->bin_strsize)
+    return false;
+  result->bytes = d->bin_strtab + ref + 4;
+  result->len = len;
+  return result->bytes[len] == 0;
+}
+
+
+// bin_sym returns the symbol with index, interning it on first use
+static sym_t nullable bin_sym(astdecoder_t* d, u32 index) {
+  sym_t sym = d->symtab[index];
+  if (!sym) {
+    slice_t name;
+    if UNLIKELY(!bin_str(d, bin_u32(d->bin_symrefs + (usize)index*4), &name))
+      return NULL;
+    // symbols can't contain NUL or LF (see sym_intern_hashed)
+    if UNLIKELY(memchr(name.p, 0, name.len) || memchr(name.p, '\n', name.len))
+      return NULL;
+    sym = sym_intern(name.chars, name.len);
+    d->symtab[index] = sym;
+  }
+  return sym;
+}
+
+
+static bool bin_is_header(const u8* src, usize srclen) {
+  // the text format has a SP after magic while the binary format has a version
+  return srclen >= 5 && memcmp(src, FILE_MAGIC, 4) == 0 && src[4] != ' ';
+}
+
+
+static err_t bin_decode_header(astdecoder_t* d, pkg_t* pkg) {
+  const u8* p = d->pstart;
+  const u8* pend = d->pend;
+
+  if UNLIKELY(DEC_DATA_AVAIL < BIN_HEADER_SIZE) {
+    dlog("header too small");
+    return d->err = ErrInvalid;
+  }
+
+  d->version = bin_u32(p + 4);
+  if (d->version != AST_ENC_VERSION) {
+    dlog("unsupported version: %u", d->version);
+    return d->err = ErrNotSupported;
+  }
+  d->srccount     = bin_u32(p + 8);
+  d->importcount  = bin_u32(p + 12);
+  d->symcount     = bin_u32(p + 16);
+  d->nodecount    = bin_u32(p + 20);
+  d->rootcount    = bin_u32(p + 24);
+  d->bin_nodesize = bin_u32(p + 28);
+  d->bin_strsize  = bin_u32(p + 32);
+
+  // locate sections, making sure that they add up to the size of the data
+  // (all values are u32, so this can't overflow u64)
+  u64 offs = BIN_HEADER_SIZE;
+  d->bin_tables = p + offs;
+  offs += (u64)d->srccount * 4;
+  offs += (u64)d->importcount * BIN_IMPORT_SIZE;
+  d->bin_symrefs = p + offs;  offs += (u64)d->symcount * 4;
+  d->bin_rootids = p + offs;  offs += (u64)d->rootcount * 4;
+  if UNLIKELY(offs + (u64)d->nodecount * 4 + d->bin_nodesize + d->bin_strsize
+              != (u64)DEC_DATA_AVAIL)
+  {
+    DEC_ERROR(ErrInvalid, "section sizes do not add up to %zu", DEC_DATA_AVAIL);
+    return d->err;
+  }
+  d->bin_nodeoffs = p + offs;  offs += (u64)d->nodecount * 4;
+  d->bin_nodedata = p + offs;  offs += d->bin_nodesize;
+  d->bin_strtab = p + offs;
+
+  if UNLIKELY(d->rootcount > d->nodecount) {
+    dlog("invalid rootcount: %u", d->rootcount);
+    return d->err = ErrInvalid;
+  }
+
+  // allocate memory for temporary tables
+  if (!dec_tmptabs_alloc(d)) {
+    dlog("dec_tmptabs_alloc: %s", err_str(d->err));
+    return d->err;
+  }
+  memset(d->symtab, 0, (usize)d->symcount * sizeof(*d->symtab)); // see bin_sym
+
+  // pkg
+  slice_t root, path;
+  if UNLIKELY(!bin_str(d, bin_u32(p + 36), &root) || !bin_str(d, bin_u32(p + 40), &path))
+    return DEC_ERROR(ErrInvalid, "invalid pkg strref"), d->err;
+  sha256_t api_sha256;
+  memcpy(&api_sha256, p + 44, sizeof(api_sha256));
+  err_t err = dec_setpkg(
+    d, pkg, root, path, sha256_iszero(&api_sha256) ? NULL : &api_sha256);
+  if (err)
+    return d->err = err;
+
+  // srcfiles
+  if (d->srccount == 0)
+    return 0;
+  d->srctab = mem_alloc(d->ma, (usize)d->srccount * sizeof(*d->srctab)).p;
+  if UNLIKELY(!d->srctab)
+    return d->err = ErrNoMem;
+  p = d->bin_tables;
+  for (u32 i = 0; i < d->srccount; i++, p += 4) {
+    slice_t name;
+    if UNLIKELY(!bin_str(d, bin_u32(p), &name))
+      return DEC_ERROR(ErrInvalid, "invalid srcfile strref"), d->err;
+    srcfile_t* srcfile = pkg_add_srcfile(pkg, name.chars, name.len, NULL);
+    if UNLIKELY(!srcfile)
+      return DEC_ERROR(ErrNoMem, "pkg_add_srcfile OOM"), d->err;
+    u32 srcfileid = locmap_intern_srcfileid(&d->c->locmap, srcfile, d->ma);
+    if UNLIKELY(srcfileid == 0)
+      return DEC_ERROR(ErrNoMem, "locmap_srcfileid OOM"), d->err;
+    d->srctab[i] = srcfileid;
+  }
+
+  return 0;
+}
+
+
+static err_t bin_decode_imports(
+  astdecoder_t* d, pkg_t* pkg, sha256_t* nullable api_sha256v)
+{
+  const u8* p = d->bin_tables + (usize)d->srccount * 4;
+  const u8* pend = d->pend;
+  pkg_t tmp = {};
+  err_t err = 0;
+
+  for (u32 i = 0; i < d->importcount && !err; i++, p += BIN_IMPORT_SIZE) {
+    slice_t root, path;
+    if UNLIKELY(!bin_str(d, bin_u32(p), &root) || !bin_str(d, bin_u32(p + 4), &path)) {
+      err = (DEC_ERROR(ErrInvalid, "invalid import strref"), d->err);
+      break;
+    }
+    memcpy(&tmp.api_sha256, p + 8, sizeof(tmp.api_sha256));
+    tmp.dir.len = 0;
+    tmp.root.len = 0;
+    tmp.path.len = 0;
+    if (!( err = dec_setpkg(d, &tmp, root, path, NULL) ))
+      err = dec_import(d, pkg, &tmp);
+    if (api_sha256v)
+      memcpy(&api_sha256v[i], &tmp.api_sha256, sizeof(*api_sha256v));
+  }
+
+  str_free(tmp.dir);
+  str_free(tmp.root);
+  str_free(tmp.path);
+
+  if (err && !d->err)
+    d->err = err;
+  return d->err;
+}
+
+
+static const u8* bin_dec_loc(DEC_PARAMS, loc_t* result) {
+  loc_t loc = bin_u64(p);
+  u32 doc_srcfileid = loc_srcfileid(loc);
+  if (doc_srcfileid > 0) {
+    if UNLIKELY(doc_srcfileid > d->srccount)
+      return DEC_ERROR(ErrNotFound, "invalid srcfile ID %u", doc_srcfileid);
+    loc = loc_with_srcfileid(loc, d->srctab[doc_srcfileid - 1]);
+  }
+  *result = loc;
+  return p + 8;
+}
+
+
+static const u8* bin_dec_typeid(DEC_PARAMS, typeid_t* dstp) {
+  u32 ref = bin_u32(p);
+  if (ref == BIN_NULL) {
+    *dstp = NULL;
+    return p + 4;
+  }
+  slice_t str;
+  if UNLIKELY(!bin_str(d, ref, &str))
+    return DEC_ERROR(ErrInvalid, "invalid typeid strref");
+
+  // strtab entries have the same layout as typeid_data_t, so we can usually
+  // intern the typeid directly from the encoded data
+  const typeid_data_t* tid = (const typeid_data_t*)(str.bytes - 4);
+  #if CO_LITTLE_ENDIAN
+  if LIKELY(IS_ALIGN2((uintptr)tid, _Alignof(typeid_data_t))) {
+    *dstp = typeid_intern_typeid(tid);
+    return p + 4;
+  }
+  #endif
+  usize nbyte = sizeof(typeid_data_t) + str.len;
+  typeid_data_t* tid2 = nbyte <= d->tmpbufcap ? (typeid_data_t*)d->tmpbuf :
+                        mem_alloc(d->ast_ma, nbyte).p;
+  if UNLIKELY(!tid2)
+    return DEC_ERROR(ErrNoMem, "out of memory");
+  tid2->len = (u32)str.len;
+  memcpy(tid2->bytes, str.bytes, str.len);
+  *dstp = typeid_intern_typeid(tid2);
+  if ((u8*)tid2 != d->tmpbuf)
+    mem_freex(d->ast_ma, MEM(tid2, nbyte));
+  return p + 4;
+}
+
+
+static const u8* bin_dec_nodearray(DEC_PARAMS, u32 node_id, nodearray_t* dstp) {
+  u32 len = bin_u32(p);
+  p += 4;
+  if UNLIKELY((usize)len > DEC_DATA_AVAIL / 4)
+    return DEC_ERROR(ErrInvalid, "node array too large (%u)", len);
+
+  if (len == 0) {
+    dstp->len = 0;
+    dstp->cap = 0;
+    return p;
+  }
+
+  mem_t m = mem_alloc(d->ast_ma, (usize)len * sizeof(void*));
+  if UNLIKELY(m.p == NULL)
+    return DEC_ERROR(ErrNoMem, "mem_alloc %zu B", (usize)len * sizeof(void*));
+  node_t** v = m.p;
+
+  for (u32 i = 0; i < len; i++, p += 4) {
+    u32 id = bin_u32(p);
+    if UNLIKELY(id >= node_id) {
+      mem_freex(d->ast_ma, m);
+      return DEC_ERROR(ErrInvalid, "invalid node ID 0x%x", id);
+    }
+    v[i] = d->nodetab[id];
+  }
+
+  dstp->v = v;
+  dstp->cap = m.size / sizeof(void*);
+  dstp->len = len;
+  return p;
+}
+
+
+static const u8* bin_decode_field(DEC_PARAMS, u32 node_id, void* fp, ast_field_t f) {
+  fp += f.offs;
+
+  usize nbyte = (f.type == AST_FIELD_U64 || f.type == AST_FIELD_F64 ||
+                 f.type == AST_FIELD_LOC) ? 8 : 4;
+  if UNLIKELY(DEC_DATA_AVAIL < nbyte)
+    return DEC_ERROR(ErrInvalid, "truncated node");
+
+  u32 v = bin_u32(p);
+  bool allow_null = false;
+
+  switch ((enum ast_fieldtype)f.type) {
+  case AST_FIELD_U8:
+    if UNLIKELY(v > 0xff)
+      return DEC_ERROR(ErrOverflow, "value too large");
+    *(u8*)fp = (u8)v;
+    return p + 4;
+  case AST_FIELD_U16:
+    if UNLIKELY(v > 0xffff)
+      return DEC_ERROR(ErrOverflow, "value too large");
+    *(u16*)fp = (u16)v;
+    return p + 4;
+  case AST_FIELD_U32:
+    *(u32*)fp = v;
+    return p + 4;
+  case AST_FIELD_U64:
+    *(u64*)fp = bin_u64(p);
+    return p + 8;
+  case AST_FIELD_F64:
+    *(f64*)fp = u64_to_f64(bin_u64(p));
+    return p + 8;
+  case AST_FIELD_LOC:
+    return bin_dec_loc(DEC_ARGS, fp);
+
+  case AST_FIELD_SYMZ:
+    allow_null = true; FALLTHROUGH;
+  case AST_FIELD_SYM:
+    if (v == BIN_NULL && allow_null) {
+      *(sym_t*)fp = NULL;
+    } else if UNLIKELY(v >= d->symcount || !(*(sym_t*)fp = bin_sym(d, v))) {
+      return DEC_ERROR(ErrInvalid, "invalid symbol ID 0x%x", v);
+    }
+    return p + 4;
+
+  case AST_FIELD_NODEZ:
+    allow_null = true; FALLTHROUGH;
+  case AST_FIELD_NODE:
+    if (v == BIN_NULL && allow_null) {
+      *(node_t**)fp = NULL;
+    } else if UNLIKELY(v >= node_id) {
+      return DEC_ERROR(ErrInvalid, "invalid node ID 0x%x", v);
+    } else {
+      *(node_t**)fp = d->nodetab[v];
+    }
+    return p + 4;
+
+  case AST_FIELD_STRZ:
+    allow_null = true; FALLTHROUGH;
+  case AST_FIELD_STR: {
+    slice_t str;
+    if (v == BIN_NULL && allow_null) {
+      *(u8**)fp = NULL;
+      return p + 4;
+    }
+    if UNLIKELY(!bin_str(d, v, &str))
+      return DEC_ERROR(ErrInvalid, "invalid strref 0x%x", v);
+    u8* dst = mem_alloc(d->ast_ma, str.len + 1).p;
+    if UNLIKELY(!dst)
+      return DEC_ERROR(ErrNoMem, "out of memory");
+    memcpy(dst, str.bytes, str.len + 1); // including NUL terminator
+    *(u8**)fp = dst;
+    return p + 4;
+  }
+
+  case AST_FIELD_NODEARRAY:
+    return bin_dec_nodearray(DEC_ARGS, node_id, fp);
+
+  case AST_FIELD_UNDEF:
+    break;
+  }
+  UNREACHABLE;
+  return p;
+}
+
+
+static const u8* bin_decode_node(DEC_PARAMS, u32 node_id) {
+  // read kind (4 bytes interpreted as u32le)
+  u32 kindid = (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
+  nodekind_t kind = nodekind_of_tag(kindid);
+  if (kind == NODE_BAD)
+    return DEC_ERROR(ErrInvalid, "invalid node kind '%.4s'", p);
+  p += 4;
+
+  const ast_field_t* fieldtab = g_ast_fieldtab[kind];
+
+  // builtins and universal types are encoded solely by kind
+  if (fieldtab == g_fieldsof_type_t) {
+    d->nodetab[node_id] = builtin_type(d, kind);
+    return p;
+  }
+
+  usize nbyte = 4 + 4 + 8 + (nodekind_istype(kind) * 4); // flags, nuse, loc, typeid
+  if UNLIKELY(DEC_DATA_AVAIL < nbyte)
+    return DEC_ERROR(ErrInvalid, "truncated node");
+
+  node_t* n = mem_alloc_zeroed(d->ast_ma, g_ast_sizetab[kind]).p;
+  if UNLIKELY(!n)
+    return DEC_ERROR(ErrNoMem);
+  d->nodetab[node_id] = n;
+  n->kind = kind;
+  n->flags = (nodeflag_t)bin_u32(p) & ~AST_ENC_EXCLUDED_NODEFLAGS;
+  n->nuse = bin_u32(p + 4);
+  p = bin_dec_loc(d, pend, p + 8, &n->loc);
+  if (nodekind_istype(kind))
+    p = bin_dec_typeid(DEC_ARGS, &((type_t*)n)->_typeid);
+
+  for (u8 i = 0; i < g_ast_fieldlentab[kind] && !d->err; i++)
+    p = bin_decode_field(DEC_ARGS, node_id, n, fieldtab[i]);
+
+  return p;
+}
+
+
+// bin_node_bounds locates the encoded data of a node.
+// Each node is bounded by the offset of the next node.
+static bool bin_node_bounds(
+  const astdecoder_t* d, u32 node_id, const u8** pp, const u8** pendp)
+{
+  u32 offs = bin_u32(d->bin_nodeoffs + (usize)node_id*4);
+  u32 end = d->bin_nodesize;
+  if (node_id + 1 < d->nodecount)
+    end = bin_u32(d->bin_nodeoffs + (usize)(node_id + 1)*4);
+  if UNLIKELY(end > d->bin_nodesize || (u64)offs + 4 > (u64)end)
+    return false;
+  *pp = d->bin_nodedata + offs;
+  *pendp = d->bin_nodedata + end;
+  return true;
+}
+
+
+static err_t bin_decode_ast(astdecoder_t* d, node_t** resultv[], u32* resultc) {
+  for (u32 node_id = 0; node_id < d->nodecount && !d->err; node_id++) {
+    const u8* p, *pend;
+    if UNLIKELY(!bin_node_bounds(d, node_id, &p, &pend)) {
+      p = pend = d->bin_nodeoffs + (usize)node_id*4;
+      return DEC_ERROR(ErrInvalid, "invalid node offset"), d->err;
+    }
+    p = bin_decode_node(DEC_ARGS, node_id);
+    if UNLIKELY(p != pend && !d->err)
+      DEC_ERROR(ErrInvalid, "node size mismatch");
+  }
+  if (d->err)
+    return d->err;
+
+  // create list of root nodes
+  node_t** roots = mem_alloc(d->ast_ma, (usize)d->rootcount * sizeof(void*)).p;
+  if (!roots && d->rootcount > 0)
+    return d->err = ErrNoMem;
+  for (u32 i = 0; i < d->rootcount; i++) {
+    u32 id = bin_u32(d->bin_rootids + i*4);
+    if UNLIKELY(id >= d->nodecount) {
+      dlog("invalid root %u; no such node", id);
+      mem_freex(d->ast_ma, MEM(roots, (usize)d->rootcount * sizeof(void*)));
+      return d->err = ErrInvalid;
+    }
+    roots[i] = d->nodetab[id];
+  }
+
+  *resultv = roots;
+  *resultc = d->rootcount;
+  return 0;
+}
+
+
+// ———————————————— lazy decoding ————————————————
+//
+// The binary format has an offset table of nodes, so that a node can be decoded
+// without decoding the nodes before it; only the nodes that it refers to (which all
+// have smaller IDs) need to be decoded first. This is used for package APIs, where
+// typically just a few of the root nodes (declarations) are used by an importer.
+// The names of the root nodes are read directly from the encoded data to build an
+// index, without decoding any nodes.
+
+
+// bin_node_fields returns the start of the fields of an encoded node, or NULL if the
+// node is invalid. *kindp is set to the node's kind. Builtins have no fields.
+static const u8* nullable bin_node_fields(
+  const u8* p, const u8* pend, nodekind_t* kindp)
+{
+  u32 kindid = (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
+  nodekind_t kind = nodekind_of_tag(kindid);
+  *kindp = kind;
+  if (kind == NODE_BAD)
+    return NULL;
+  p += 4;
+  if (g_ast_fieldtab[kind] == g_fieldsof_type_t)
+    return p;
+  usize nbyte = 4 + 4 + 8 + (nodekind_istype(kind) * 4); // flags, nuse, loc, typeid
+  if UNLIKELY(DEC_DATA_AVAIL < nbyte)
+    return NULL;
+  return p + nbyte;
+}
+
+
+// bin_skip_field returns the end of field f which starts at p, or NULL if truncated
+static const u8* nullable bin_skip_field(const u8* p, const u8* pend, ast_field_t f) {
+  u64 nbyte = 4;
+  switch ((enum ast_fieldtype)f.type) {
+    case AST_FIELD_U64:
+    case AST_FIELD_F64:
+    case AST_FIELD_LOC:
+      nbyte = 8;
+      break;
+    case AST_FIELD_NODEARRAY:
+      if UNLIKELY(DEC_DATA_AVAIL < 4)
+        return NULL;
+      nbyte += (u64)bin_u32(p) * 4;
+      break;
+    default:
+      break;
+  }
+  if UNLIKELY((u64)DEC_DATA_AVAIL < nbyte)
+    return NULL;
+  return p + nbyte;
+}
+
+
+// bin_peek_field reads a u32-encoded field of node_id, without decoding the node.
+// fieldoffs is the offset of the field in the node's struct, e.g. offsetof(fun_t,name)
+static bool bin_peek_field(
+  const astdecoder_t* d, u32 node_id, nodekind_t* kindp, usize fieldoffs, u32* result)
+{
+  const u8* p, *pend;
+  if UNLIKELY(!bin_node_bounds(d, node_id, &p, &pend))
+    return false;
+  if UNLIKELY(!( p = bin_node_fields(p, pend, kindp) ))
+    return false;
+  const ast_field_t* fieldtab = g_ast_fieldtab[*kindp];
+  for (u8 i = 0; i < g_ast_fieldlentab[*kindp]; i++) {
+    if (fieldtab[i].offs == fieldoffs) {
+      if UNLIKELY(DEC_DATA_AVAIL < 4)
+        return false;
+      *result = bin_u32(p);
+      return true;
+    }
+    if UNLIKELY(!( p = bin_skip_field(p, pend, fieldtab[i]) ))
+      return false;
+  }
+  return false;
+}
+
+
+// bin_root_name returns the name of a package-level declaration.
+// Returns NULL if the encoded data is invalid.
+static sym_t nullable bin_root_name(astdecoder_t* d, u32 node_id) {
+  nodekind_t kind = NODE_BAD;
+  u32 v;
+
+  // fun name ...
+  bool ok = bin_peek_field(d, node_id, &kind, offsetof(fun_t,name), &v);
+  if (kind == EXPR_FUN) {
+    if (!ok)
+      return NULL;
+    goto sym;
+  }
+  if (kind != STMT_TYPEDEF) {
+    dlog("unexpected %s", nodekind_name(kind));
+    return kind == NODE_BAD ? NULL : sym__;
+  }
+
+  // type Name ...
+  if (!bin_peek_field(d, node_id, &kind, offsetof(typedef_t,type), &v) || v >= node_id)
+    return NULL;
+  u32 type_id = v;
+  if (!bin_peek_field(d, type_id, &kind, offsetof(structtype_t,name), &v) ||
+      kind != TYPE_STRUCT)
+  {
+    if (!bin_peek_field(d, type_id, &kind, offsetof(aliastype_t,name), &v) ||
+        kind != TYPE_ALIAS)
+    {
+      return NULL;
+    }
+  }
+
+sym:
+  if (v == BIN_NULL)
+    return sym__;
+  return v < d->symcount ? bin_sym(d, v) : NULL;
+}
+
+
+// bin_push_refs adds the IDs of nodes which node_id refers to, and which have not yet
+// been decoded, to d->lazy_stack
+static bool bin_push_refs(astdecoder_t* d, u32 node_id, const u8* p, const u8* pend) {
+  nodekind_t kind;
+  if UNLIKELY(!( p = bin_node_fields(p, pend, &kind) ))
+    return false;
+  const ast_field_t* fieldtab = g_ast_fieldtab[kind];
+  if (fieldtab == g_fieldsof_type_t)
+    return true;
+
+  for (u8 i = 0; i < g_ast_fieldlentab[kind]; i++) {
+    ast_field_t f = fieldtab[i];
+    const u8* fend = bin_skip_field(p, pend, f);
+    if UNLIKELY(!fend)
+      return false;
+    u32 idc = 1;
+    switch ((enum ast_fieldtype)f.type) {
+      case AST_FIELD_NODEARRAY:
+        idc = bin_u32(p);
+        p += 4;
+        FALLTHROUGH;
+      case AST_FIELD_NODE:
+      case AST_FIELD_NODEZ:
+        for (u32 j = 0; j < idc; j++, p += 4) {
+          u32 id = bin_u32(p);
+          if (id == BIN_NULL) // checked by bin_decode_field
+            continue;
+          if UNLIKELY(id >= node_id)
+            return false;
+          if (!d->nodetab[id] && !u32array_push(&d->lazy_stack, d->ma, id))
+            return d->err = ErrNoMem, false;
+        }
+        break;
+      default:
+        break;
+    }
+    p = fend;
+  }
+  return true;
+}
+
+
+// bin_decode_lazy decodes node_id and any nodes it refers to which have not yet
+// been decoded. Uses an explicit stack, rather than recursion, since chains of
+// references can be long.
+static node_t* nullable bin_decode_lazy(astdecoder_t* d, u32 node_id) {
+  d->lazy_stack.len = 0;
+  if (!u32array_push(&d->lazy_stack, d->ma, node_id))
+    return d->err = ErrNoMem, NULL;
+
+  while (d->lazy_stack.len > 0 && !d->err) {
+    u32 id = d->lazy_stack.v[d->lazy_stack.len - 1];
+    if (d->nodetab[id]) {
+      d->lazy_stack.len--;
+      continue;
+    }
+    const u8* p = d->bin_nodedata, *pend = p;
+    u32 stacklen = d->lazy_stack.len;
+    if UNLIKELY(!bin_node_bounds(d, id, &p, &pend) || !bin_push_refs(d, id, p, pend)) {
+      DEC_ERROR(ErrInvalid, "invalid node 0x%x", id);
+      break;
+    }
+    if (d->lazy_stack.len > stacklen)
+      continue; // decode dependencies first
+    p = bin_decode_node(DEC_ARGS, id);
+    if UNLIKELY(p != pend && !d->err)
+      DEC_ERROR(ErrInvalid, "node size mismatch");
+    d->lazy_stack.len--;
+  }
+
+  return d->err ? NULL : d->nodetab[node_id];
+}
+
+
 astdecoder_t* nullable astdecoder_open(
   compiler_t* c,
   memalloc_t  ast_ma,
@@ -1814,11 +2778,21 @@ void astdecoder_close(astdecoder_t* d) {
     mem_freex(d->ma, MEM(d->srctab, (usize)d->srccount * sizeof(*d->srctab)));
   dec_tmptabs_free(d);
   nodearray_dispose(&d->tmpnodearray, d->ma);
+  if (d->lazy_roots) {
+    u32array_dispose(&d->lazy_stack, d->ma);
+    mutex_dispose(&d->lazy_mu);
+  }
   mem_freet(d->ma, d);
 }
 
 
 err_t astdecoder_decode_header(astdecoder_t* d, pkg_t* pkg, u32* importcount) {
+  if (bin_is_header(d->pstart, (usize)(uintptr)(d->pend - d->pstart))) {
+    bin_decode_header(d, pkg);
+    *importcount = d->importcount;
+    return d->err;
+  }
+
   // DEC_ARGS
   const u8* p = d->pcurr;
   const u8* pend = d->pend;
@@ -1857,6 +2831,9 @@ end:
 
 
 err_t astdecoder_decode_imports(astdecoder_t* d, pkg_t* pkg, sha256_t* api_sha256v) {
+  if (d->version == AST_ENC_VERSION)
+    return bin_decode_imports(d, pkg, api_sha256v);
+
   // DEC_ARGS
   const u8* p = d->pcurr;
   const u8* pend = d->pend;
@@ -1870,6 +2847,14 @@ err_t astdecoder_decode_imports(astdecoder_t* d, pkg_t* pkg, sha256_t* api_sha25
 err_t astdecoder_decode_ast(astdecoder_t* d, node_t** resultv[], u32* resultc) {
   assertf(d->version > 0, "header not decoded");
 
+  if (d->version == AST_ENC_VERSION) {
+    if (bin_decode_ast(d, resultv, resultc)) {
+      *resultv = NULL;
+      *resultc = 0;
+    }
+    return d->err;
+  }
+
   // DEC_ARGS
   const u8* p = d->pcurr;
   const u8* pend = d->pend;
@@ -1923,3 +2908,196 @@ error:
 end:
   return d->err;
 }
+
+
+err_t astdecoder_decode_lazy(
+  astdecoder_t* d, node_t** resultv[], sym_t* namev[], u32* resultc)
+{
+  assertf(d->version > 0, "header not decoded");
+  assertnull(d->lazy_roots);
+
+  if (d->version != AST_ENC_VERSION)
+    return ErrNotSupported;
+  if (d->err)
+    return d->err;
+
+  // Take a copy of the encoded data, since nodes are decoded after the caller is
+  // done with the source (e.g. has unmapped the file.)
+  // Note that the copy is not needed for decoded nodes; they don't reference it.
+  usize size = (usize)(uintptr)(d->pend - d->pstart);
+  usize srcnamelen = strlen(d->srcname);
+  u8* data = mem_alloc(d->ast_ma, size + srcnamelen + 1).p;
+  if (!data)
+    return d->err = ErrNoMem;
+  memcpy(data, d->pstart, size);
+  memcpy(data + size, d->srcname, srcnamelen + 1);
+  #define REBASE(ptr) ( (ptr) = data + ((ptr) - d->pstart) )
+  REBASE(d->bin_tables);
+  REBASE(d->bin_nodeoffs);
+  REBASE(d->bin_nodedata);
+  REBASE(d->bin_strtab);
+  REBASE(d->bin_symrefs);
+  REBASE(d->bin_rootids);
+  #undef REBASE
+  d->srcname = (const char*)data + size;
+  d->pstart = d->pcurr = data;
+  d->pend = data + size;
+
+  // allocate roots and their names, which are returned to the caller
+  node_t** roots = mem_alloc_zeroed(d->ast_ma, (usize)d->rootcount * sizeof(void*)).p;
+  sym_t* names = mem_alloc(d->ast_ma, (usize)d->rootcount * sizeof(sym_t)).p;
+  if ((!roots || !names) && d->rootcount > 0)
+    return d->err = ErrNoMem;
+  memset(d->nodetab, 0, (usize)d->nodecount * sizeof(*d->nodetab));
+
+  // index roots by name
+  for (u32 i = 0; i < d->rootcount; i++) {
+    u32 id = bin_u32(d->bin_rootids + i*4);
+    if UNLIKELY(id >= d->nodecount || !(names[i] = bin_root_name(d, id))) {
+      const u8* p = d->bin_rootids + i*4, *pend = d->pend;
+      return DEC_ERROR(ErrInvalid, "invalid root node 0x%x", id), d->err;
+    }
+  }
+
+  if (( d->err = mutex_init(&d->lazy_mu) ))
+    return d->err;
+  d->lazy_roots = roots;
+  *resultv = roots;
+  *namev = names;
+  *resultc = d->rootcount;
+  return 0;
+}
+
+
+node_t* nullable astdecoder_decode_root(astdecoder_t* d, u32 i) {
+  assertf(d->lazy_roots, "astdecoder_decode_lazy not called");
+  assert(i < d->rootcount);
+  mutex_lock(&d->lazy_mu);
+  node_t* n = d->lazy_roots[i];
+  if (!n && !d->err) {
+    n = bin_decode_lazy(d, bin_u32(d->bin_rootids + i*4));
+    // release, for readers of pkg->api which don't hold lazy_mu (e.g. ast_repr)
+    AtomicStore((_Atomic(node_t*)*)&d->lazy_roots[i], n, memory_order_release);
+  }
+  mutex_unlock(&d->lazy_mu);
+  return n;
+}
+
+
+#ifdef CO_ENABLE_TESTS
+
+// decode_test decodes data of a binary metafile, returning the first error
+static err_t decode_test(compiler_t* c, const u8* data, usize size, bool lazy) {
+  memalloc_t ast_ma = memalloc_bump2(0, 0);
+  assert(ast_ma != memalloc_null());
+  pkg_t pkg = {};
+  assert(pkg_init(&pkg, c->ma) == 0);
+  astdecoder_t* d = astdecoder_open(c, ast_ma, "test.coast", data, size);
+  assertnotnull(d);
+  u32 importcount;
+  node_t** nodev;
+  sym_t* namev;
+  u32 nodec;
+  err_t err = astdecoder_decode_header(d, &pkg, &importcount);
+  if (!err && importcount == 0)
+    err = astdecoder_decode_imports(d, &pkg, NULL);
+  if (!err && !lazy)
+    err = astdecoder_decode_ast(d, &nodev, &nodec);
+  if (!err && lazy) {
+    err = astdecoder_decode_lazy(d, &nodev, &namev, &nodec);
+    for (u32 i = 0; i < nodec && !err; i++) {
+      if (!astdecoder_decode_root(d, i))
+        err = ErrInvalid;
+    }
+  }
+  astdecoder_close(d);
+  pkg_dispose(&pkg, c->ma);
+  memalloc_bump2_dispose(ast_ma);
+  return err;
+}
+
+UNITTEST_DEF(astdecode_invalid) {
+  compiler_t c = { .ma = memalloc_ctx() };
+  assert(locmap_init(&c.locmap) == 0);
+  pkg_t pkg = {};
+  assert(pkg_init(&pkg, c.ma) == 0);
+  pkg.path = str_make("test");
+
+  // type a i32
+  // type b a
+  aliastype_t a = { .kind = TYPE_ALIAS, .name = sym_cstr("a"), .elem = type_i32 };
+  aliastype_t b = { .kind = TYPE_ALIAS, .name = sym_cstr("b"), .elem = (type_t*)&a };
+  typedef_t ta = { .kind = STMT_TYPEDEF, .type = (type_t*)&a };
+  typedef_t tb = { .kind = STMT_TYPEDEF, .type = (type_t*)&b };
+
+  astencoder_t* enc = astencoder_create(&c);
+  assertnotnull(enc);
+  astencoder_begin(enc, &pkg);
+  assert(astencoder_add_ast(enc, (node_t*)&ta, 0) == 0);
+  assert(astencoder_add_ast(enc, (node_t*)&tb, 0) == 0);
+  buf_t buf = buf_make(c.ma);
+  assert(astencoder_encode(enc, &buf) == 0);
+  astencoder_free(enc);
+
+  assert(decode_test(&c, buf.bytes, buf.len, false) == 0);
+  assert(decode_test(&c, buf.bytes, buf.len, true) == 0);
+
+  // truncated data
+  for (usize len = 0; len < buf.len; len++) {
+    assert(decode_test(&c, buf.bytes, len, false) != 0);
+    assert(decode_test(&c, buf.bytes, len, true) != 0);
+  }
+
+  // corrupt data; some bytes (e.g. api_sha256) are not validated, so we can only
+  // check that decoding does not crash
+  u8* data = mem_alloc(c.ma, buf.len).p;
+  assertnotnull(data);
+  for (usize i = 4; i < buf.len; i++) {
+    for (u32 v = 0; v < 4; v++) {
+      memcpy(data, buf.bytes, buf.len);
+      data[i] = (u8[]){ 0x00, 0x01, 0x7f, 0xff }[v] ^ (v & 1 ? data[i] : 0);
+      decode_test(&c, data, buf.len, false);
+      decode_test(&c, data, buf.len, true);
+    }
+  }
+
+  // corrupt counts, which must be caught as the sections don't add up
+  for (usize i = 8; i < 28; i += 4) {
+    memcpy(data, buf.bytes, buf.len);
+    bin_put_u32(data + i, bin_u32(data + i) + 1);
+    assert(decode_test(&c, data, buf.len, false) != 0);
+    assert(decode_test(&c, data, buf.len, true) != 0);
+  }
+
+  // locate tables (see bin_decode_header)
+  usize rootids = BIN_HEADER_SIZE + (usize)bin_u32(buf.bytes + 8) * 4
+                + (usize)bin_u32(buf.bytes + 12) * BIN_IMPORT_SIZE
+                + (usize)bin_u32(buf.bytes + 16) * 4;
+  usize nodeoffs = rootids + (usize)bin_u32(buf.bytes + 24) * 4;
+  usize nodedata = nodeoffs + (usize)bin_u32(buf.bytes + 20) * 4;
+
+  // bad node kind
+  memcpy(data, buf.bytes, buf.len);
+  bin_put_u32(data + nodedata, 0xffffffff);
+  assert(decode_test(&c, data, buf.len, false) != 0);
+  assert(decode_test(&c, data, buf.len, true) != 0);
+
+  // node offset out of bounds
+  memcpy(data, buf.bytes, buf.len);
+  bin_put_u32(data + nodeoffs + 4, bin_u32(buf.bytes + 28));
+  assert(decode_test(&c, data, buf.len, false) != 0);
+  assert(decode_test(&c, data, buf.len, true) != 0);
+
+  // root ID out of bounds
+  memcpy(data, buf.bytes, buf.len);
+  bin_put_u32(data + rootids, bin_u32(buf.bytes + 20));
+  assert(decode_test(&c, data, buf.len, false) != 0);
+  assert(decode_test(&c, data, buf.len, true) != 0);
+
+  mem_freex(c.ma, MEM(data, buf.len));
+  buf_dispose(&buf);
+  pkg_dispose(&pkg, c.ma);
+  locmap_dispose(&c.locmap, c.ma);
+}
+
+#endif // CO_ENABLE_TESTS
@@ -12,6 +12,10 @@ An encoder can be used multiple times, e.g.
   }
   astencoder_free(astenc);
 
+astencoder_encode produces a compact binary encoding, which is what's used for
+package metafiles. astencoder_encode_text produces a text encoding, which is
+slower to decode but useful for debugging. A decoder accepts either format.
+
 A decoder has a different API since it is usually paused and resumed
 between learning what packages are imported, loading those packages
 and decoding the AST (which refers to the imported packages.)
@@ -48,7 +52,8 @@ void astencoder_begin(astencoder_t* a, const pkg_t* pkg);
 err_t astencoder_add_ast(astencoder_t* a, const node_t* n, u32 flags);
 err_t astencoder_add_srcfileid(astencoder_t* a, u32 srcfileid);
 err_t astencoder_add_srcfile(astencoder_t* a, const srcfile_t* srcfile);
-err_t astencoder_encode(astencoder_t* a, buf_t* outbuf);
+err_t astencoder_encode(astencoder_t* a, buf_t* outbuf); // binary format
+err_t astencoder_encode_text(astencoder_t* a, buf_t* outbuf); // readable text format
 
 
 astdecoder_t* nullable astdecoder_open(
@@ -67,5 +72,21 @@ err_t astdecoder_decode_imports(
   astdecoder_t* d, pkg_t* pkg, sha256_t* nullable api_sha256v);
 err_t astdecoder_decode_ast(astdecoder_t* d, node_t** resultv[], u32* resultc);
 
+// astdecoder_decode_lazy is an alternative to astdecoder_decode_ast which does not
+// decode any nodes. Instead resultv[0:resultc] is set to NULL and namev[0:resultc] to
+// the name of each root node (i.e. package-level declaration), and a root is decoded
+// on demand by astdecoder_decode_root. The decoder keeps a copy of its source in
+// ast_ma, so the source does not need to outlive this call, but the decoder must
+// remain open for as long as roots are decoded.
+// Only supported by the binary format; returns ErrNotSupported for the text format.
+err_t astdecoder_decode_lazy(
+  astdecoder_t* d, node_t** resultv[], sym_t* namev[], u32* resultc);
+
+// astdecoder_decode_root decodes root node i (and the nodes it refers to), unless
+// it has already been decoded, and stores it in resultv[i] of astdecoder_decode_lazy.
+// Returns NULL if the node could not be decoded (an error has been logged.)
+// Thread safe.
+node_t* nullable astdecoder_decode_root(astdecoder_t* d, u32 i);
+
 
 ASSUME_NONNULL_END
@@ -0,0 +1,418 @@
+// frontend micro-benchmarks on generated packages ("compis selftest --bench-frontend")
+// SPDX-License-Identifier: Apache-2.0
+//
+// Synthetic Compis source code of a few different shapes is generated in memory
+// and run through the frontend: scanner, parser, typecheck, iranalyze and cgen.
+// Each phase is measured separately, many rounds, and the best time is reported
+// as tab-separated values, one line per shape & phase.
+//
+// Generated sources can also be written to disk (bench_generate) for benchmarking
+// complete builds.
+//
+#include "colib.h"
+
+#ifdef CO_ENABLE_TESTS
+
+#include "compiler.h"
+#include "path.h"
+
+#include <err.h>
+
+ASSUME_NONNULL_BEGIN
+
+#define BENCH_MAXFILES 4 // max number of source files of a package
+
+typedef void(*genfun_t)(buf_t* b, u32 fileno, u32 ndecls);
+
+typedef struct {
+  const char* name;
+  genfun_t    gen;
+  bool        nocgen; // cgen does not yet support the code (not measured)
+} shape_t;
+
+enum {
+  PHASE_SCAN,
+  PHASE_PARSE,     // includes scanning
+  PHASE_TYPECHECK,
+  PHASE_IRANALYZE,
+  PHASE_CGEN,      // cgen_unit_impl only
+  PHASE_COUNT
+};
+
+static const char* phase_names[PHASE_COUNT] = {
+  "scan", "parse", "typecheck", "iranalyze", "cgen",
+};
+
+
+// many small functions calling each other
+static void gen_funs(buf_t* b, u32 f, u32 n) {
+  for (u32 i = 0; i < n; i++) {
+    buf_printf(b,
+      "fun f%u_%u(x, y int) int {\n"
+      "  let a = x + y * %u\n"
+      "  if a > %u {\n"
+      "    return a - y\n"
+      "  }\n",
+      f, i, i % 7 + 1, i);
+    if (i > 0) {
+      buf_printf(b, "  f%u_%u(a, x)\n}\n\n", f, i - 1);
+    } else {
+      buf_print(b, "  a + x\n}\n\n");
+    }
+  }
+}
+
+
+// functions with deeply nested blocks and many locals
+static void gen_nested(buf_t* b, u32 f, u32 n) {
+  const u32 depth = 16;
+  for (u32 i = 0; i < n; i++) {
+    buf_printf(b, "fun n%u_%u(x int) int {\n  var r = x\n", f, i);
+    for (u32 d = 0; d < depth; d++) {
+      buf_fill(b, ' ', (d + 1) * 2);
+      buf_printf(b, "if r > %u {\n", d);
+      buf_fill(b, ' ', (d + 2) * 2);
+      buf_printf(b, "let v%u = r + %u\n", d, i + d);
+      buf_fill(b, ' ', (d + 2) * 2);
+      buf_printf(b, "r = v%u * 2\n", d);
+    }
+    for (u32 d = depth; d > 0; d--) {
+      buf_fill(b, ' ', d * 2);
+      buf_print(b, "}\n");
+    }
+    buf_print(b, "  r\n}\n\n");
+  }
+}
+
+
+// many structs with fields, methods and constructor functions
+static void gen_structs(buf_t* b, u32 f, u32 n) {
+  for (u32 i = 0; i < n; i++) {
+    buf_printf(b,
+      "type S%u_%u {\n"
+      "  a int\n"
+      "  b f64\n"
+      "  c u8\n",
+      f, i);
+    if (i > 0)
+      buf_printf(b, "  d S%u_%u\n", f, i - 1);
+    buf_printf(b, "}\nfun S%u_%u.sum(this) int {\n", f, i);
+    if (i > 0) {
+      buf_print(b, "  .a + .d.a\n}\n");
+    } else {
+      buf_print(b, "  .a\n}\n");
+    }
+    buf_printf(b,
+      "fun mk%u_%u(x int) S%u_%u {\n"
+      "  var s = S%u_%u(a=x, b=1.5)\n"
+      "  s.a = s.sum() + %u\n"
+      "  s\n"
+      "}\n\n",
+      f, i, f, i,
+      f, i,
+      i);
+  }
+}
+
+
+// many templates, each instantiated with several types
+static void gen_templates(buf_t* b, u32 f, u32 n) {
+  for (u32 i = 0; i < n; i++) {
+    buf_printf(b,
+      "type Box%u_%u<T> {\n"
+      "  v ?&T\n"
+      "  n int\n"
+      "}\n"
+      "type Pair%u_%u<A,B=int> {\n"
+      "  a ?&A\n"
+      "  b ?&B\n"
+      "  n int\n"
+      "}\n"
+      "fun t%u_%u(x int) int {\n"
+      "  var b1 Box%u_%u<int>\n"
+      "  var b2 Box%u_%u<Box%u_%u<u8>>\n"
+      "  var p1 Pair%u_%u<Box%u_%u<i64>>\n"
+      "  var p2 Pair%u_%u<Box%u_%u<int>,Box%u_%u<f32>>\n"
+      "  b1.n = x\n"
+      "  p2.n = b1.n + %u\n"
+      "  p2.n + p1.n + b2.n\n"
+      "}\n\n",
+      f, i,
+      f, i,
+      f, i,
+      f, i,
+      f, i, f, i,
+      f, i, f, i,
+      f, i, f, i, f, i,
+      i);
+  }
+}
+
+
+static const shape_t shapes[] = {
+  { "funs", gen_funs },
+  { "nested", gen_nested },
+  { "structs", gen_structs },
+  { "templates", gen_templates, .nocgen = true },
+};
+
+
+static u32 count_lines(slice_t s) {
+  u32 n = 0;
+  for (usize i = 0; i < s.len; i++)
+    n += s.chars[i] == '\n';
+  return n;
+}
+
+
+// gen_srcfiles generates the source files of shape into bufv.
+// ndecls declarations are distributed over at most BENCH_MAXFILES files.
+static u32 gen_srcfiles(
+  const shape_t* shape, u32 ndecls, buf_t bufv[BENCH_MAXFILES])
+{
+  u32 nfiles = MIN(MAX(ndecls / 100, 1u), (u32)BENCH_MAXFILES);
+  for (u32 f = 0; f < nfiles; f++) {
+    u32 n = ndecls / nfiles + (f < ndecls % nfiles);
+    bufv[f] = buf_make(memalloc_ctx());
+    shape->gen(&bufv[f], f, n);
+    if (!buf_nullterm(&bufv[f]))
+      errx(1, "out of memory");
+  }
+  return nfiles;
+}
+
+
+static void check_errors(compiler_t* c, const shape_t* shape, const char* phase) {
+  if (compiler_errcount(c) > 0)
+    errx(1, "%s: %s failed with %u errors", shape->name, phase, compiler_errcount(c));
+}
+
+
+// bench_cgen generates C code for unitv. Only cgen_unit_impl is measured;
+// the other steps are serial setup.
+static void bench_cgen(
+  compiler_t* c, pkg_t* pkg, unit_t** unitv, u32 nfiles, u64 timev[PHASE_COUNT])
+{
+  err_t err;
+  cgen_t g;
+  cgen_pkgapi_t pkgapi;
+  if (!cgen_init(&g, c, pkg, c->ma, 0))
+    errx(1, "cgen_init: %s", err_str(ErrNoMem));
+  if (( err = cgen_pkgapi(&g, unitv, nfiles, &pkgapi) ))
+    errx(1, "cgen_pkgapi: %s", err_str(err));
+  for (u32 i = 0; i < nfiles; i++) {
+    nodearray_t defs = {};
+    if (( err = cgen_unit_defs(&g, unitv[i], &pkgapi, &defs) ))
+      errx(1, "cgen_unit_defs: %s", err_str(err));
+    u64 t = nanotime();
+    err = cgen_unit_impl(&g, unitv[i], &pkgapi, &defs);
+    timev[PHASE_CGEN] += nanotime() - t;
+    if (err)
+      errx(1, "cgen_unit_impl: %s", err_str(err));
+    nodearray_dispose(&defs, c->ma);
+  }
+  cgen_pkgapi_dispose(&g, &pkgapi);
+  cgen_dispose(&g);
+}
+
+
+// bench_round runs the frontend once on the files of bufv, adding the time
+// spent in each phase to timev
+static void bench_round(
+  compiler_t* c, memalloc_t ast_ma, const shape_t* shape,
+  buf_t* bufv, u32 nfiles, u64 timev[PHASE_COUNT])
+{
+  err_t err;
+  u64 t;
+  compiler_errcount_reset(c);
+
+  pkg_t pkg = {};
+  if (( err = pkg_init(&pkg, c->ma) ))
+    errx(1, "pkg_init: %s", err_str(err));
+  pkg.path = str_make("bench");
+  pkg.root = str_make("");
+  pkg.dir = str_make("");
+  pkg.isadhoc = true;
+  pkg.defs.parent = &c->builtins;
+
+  for (u32 i = 0; i < nfiles; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "f%u.co", i);
+    srcfile_t* sf = pkg_add_srcfile(&pkg, name, strlen(name), NULL);
+    if (!sf)
+      errx(1, "pkg_add_srcfile failed");
+    sf->data = bufv[i].p;
+    sf->size = bufv[i].len;
+  }
+
+  // scan
+  scanner_t scanner;
+  if (!scanner_init(&scanner, c))
+    errx(1, "scanner_init: %s", err_str(ErrNoMem));
+  scanner.ast_ma = ast_ma;
+  t = nanotime();
+  for (u32 i = 0; i < nfiles; i++) {
+    scanner_begin(&scanner, pkg.srcfiles.v[i]);
+    do {
+      scanner_next(&scanner);
+    } while (scanner.tok != TEOF);
+  }
+  timev[PHASE_SCAN] += nanotime() - t;
+  scanner_dispose(&scanner);
+  check_errors(c, shape, "scan");
+
+  // parse
+  parser_t parser;
+  if (!parser_init(&parser, c))
+    errx(1, "parser_init: %s", err_str(ErrNoMem));
+  unit_t* unitv[BENCH_MAXFILES];
+  t = nanotime();
+  for (u32 i = 0; i < nfiles; i++) {
+    if (( err = parser_parse(&parser, ast_ma, pkg.srcfiles.v[i], &unitv[i]) ))
+      errx(1, "parser_parse: %s", err_str(err));
+  }
+  timev[PHASE_PARSE] += nanotime() - t;
+  parser_dispose(&parser);
+  check_errors(c, shape, "parse");
+
+  // typecheck
+  t = nanotime();
+  if (( err = typecheck(c, ast_ma, &pkg, unitv, nfiles) ))
+    errx(1, "typecheck: %s", err_str(err));
+  timev[PHASE_TYPECHECK] += nanotime() - t;
+  check_errors(c, shape, "typecheck");
+
+  // iranalyze
+  t = nanotime();
+  if (( err = iranalyze(c, ast_ma, &pkg, unitv, nfiles) ))
+    errx(1, "iranalyze: %s", err_str(err));
+  timev[PHASE_IRANALYZE] += nanotime() - t;
+  check_errors(c, shape, "iranalyze");
+
+  if (!shape->nocgen)
+    bench_cgen(c, &pkg, unitv, nfiles, timev);
+
+  // srcfile data is owned by bufv
+  for (u32 i = 0; i < nfiles; i++)
+    ((srcfile_t*)pkg.srcfiles.v[i])->data = NULL;
+  pkg_dispose(&pkg, c->ma);
+}
+
+
+static const shape_t* nullable find_shape(const char* name) {
+  for (u32 i = 0; i < countof(shapes); i++) {
+    if (streq(shapes[i].name, name))
+      return &shapes[i];
+  }
+  return NULL;
+}
+
+
+// bench_frontend measures each frontend phase with the generated sources of shape
+// ("all" for every shape), ndecls declarations large, best of nrounds.
+// c must be configured with nostdruntime.
+int bench_frontend(compiler_t* c, const char* shapename, u32 ndecls, u32 nrounds) {
+  const shape_t* shapev = shapes;
+  u32 shapec = countof(shapes);
+  if (!streq(shapename, "all")) {
+    if (!( shapev = find_shape(shapename) ))
+      errx(1, "unknown shape \"%s\"", shapename);
+    shapec = 1;
+  }
+
+  memalloc_t ast_ma = memalloc_bump2(0, 0);
+  if (ast_ma == memalloc_null())
+    errx(1, "memalloc_bump2 failed");
+
+  printf("shape\tphase\tfiles\tlines\tbytes\tbest_ns\tlines_per_sec\tbytes_per_sec\n");
+
+  for (u32 si = 0; si < shapec; si++) {
+    const shape_t* shape = &shapev[si];
+    buf_t bufv[BENCH_MAXFILES];
+    u32 nfiles = gen_srcfiles(shape, ndecls, bufv);
+    u64 nlines = 0, nbytes = 0;
+    for (u32 i = 0; i < nfiles; i++) {
+      nlines += count_lines(buf_slice(bufv[i]));
+      nbytes += bufv[i].len;
+    }
+
+    u64 bestv[PHASE_COUNT];
+    for (u32 i = 0; i < PHASE_COUNT; i++)
+      bestv[i] = U64_MAX;
+
+    for (u32 round = 0; round < nrounds; round++) {
+      u64 timev[PHASE_COUNT] = {};
+      memalloc_bump2_reset(ast_ma, 0);
+      bench_round(c, ast_ma, shape, bufv, nfiles, timev);
+      for (u32 i = 0; i < PHASE_COUNT; i++)
+        bestv[i] = MIN(bestv[i], timev[i]);
+    }
+
+    for (u32 i = 0; i < PHASE_COUNT; i++) {
+      if (i == PHASE_CGEN && shape->nocgen)
+        continue;
+      f64 sec = (f64)MAX(bestv[i], 1ul) / 1e9;
+      printf("%s\t%s\t%u\t%llu\t%llu\t%llu\t%.0f\t%.0f\n",
+        shape->name, phase_names[i], nfiles,
+        (unsigned long long)nlines, (unsigned long long)nbytes,
+        (unsigned long long)bestv[i],
+        (f64)nlines / sec, (f64)nbytes / sec);
+    }
+    fflush(stdout);
+
+    for (u32 i = 0; i < nfiles; i++)
+      buf_dispose(&bufv[i]);
+  }
+
+  memalloc_bump2_dispose(ast_ma);
+  return 0;
+}
+
+
+static err_t write_pkg(const char* dir, const char* pkgname, buf_t* bufv, u32 nfiles) {
+  err_t err = 0;
+  for (u32 i = 0; i < nfiles && !err; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "f%u.co", i);
+    str_t filename = path_join(dir, pkgname, name);
+    if (!filename.p)
+      return ErrNoMem;
+    err = fs_writefile_mkdirs(filename.p, 0644, buf_slice(bufv[i]));
+    str_free(filename);
+  }
+  return err;
+}
+
+
+// bench_generate writes the generated packages of shape ("all" for every shape)
+// to dir, one package directory per shape.
+int bench_generate(const char* dir, const char* shapename, u32 ndecls) {
+  bool all = streq(shapename, "all");
+  err_t err = 0;
+
+  for (u32 si = 0; si < countof(shapes) && !err; si++) {
+    const shape_t* shape = &shapes[si];
+    if (!all && !streq(shape->name, shapename))
+      continue;
+    buf_t bufv[BENCH_MAXFILES];
+    u32 nfiles = gen_srcfiles(shape, ndecls, bufv);
+    // make it an executable
+    buf_t* b = &bufv[0];
+    buf_print(b, "fun main() {}\n");
+    err = buf_nullterm(b) ? write_pkg(dir, shape->name, bufv, nfiles) : ErrNoMem;
+    for (u32 i = 0; i < nfiles; i++)
+      buf_dispose(&bufv[i]);
+  }
+
+  if (!err && !all && !find_shape(shapename))
+    errx(1, "unknown shape \"%s\"", shapename);
+
+  if (err)
+    errx(1, "%s: %s", dir, err_str(err));
+  return 0;
+}
+
+
+ASSUME_NONNULL_END
+
+#endif // CO_ENABLE_TESTS
@@ -0,0 +1,251 @@
+// build statistics: time spent in compiler phases and counters ("compis build --stats")
+// SPDX-License-Identifier: Apache-2.0
+#include "colib.h"
+#include "buildstats.h"
+#include "compiler.h"
+#include "thread.h"
+
+#include <sys/resource.h> // getrusage
+#include <time.h> // clock_gettime
+
+bool g_buildstats_enabled = false;
+
+static memalloc_t            g_ma;
+static mutex_t               g_mu;   // protects g_pkgs
+static bool                  g_mu_init = false;
+static pkgstats_t* nullable  g_pkgs; // finished packages, most recent first
+static u64                   g_start_wall, g_start_cpu, g_start_childcpu;
+static usize                 g_apibytes;    // memory used by API allocators
+static memalloc_t nullable   g_api_ma;      // most recent buildstats_apimem
+static usize                 g_api_ma_use;  // use of g_api_ma at that time
+
+// time of phases measured on the current thread (see buildstats_end)
+static _Thread_local u64 t_nested_wall, t_nested_cpu;
+
+static const char* phase_names[BUILDPHASE_COUNT] = {
+  #define _(NAME, name) name,
+  FOREACH_BUILDPHASE(_)
+  #undef _
+};
+
+
+static u64 thread_cputime() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+    return 0;
+  return (u64)ts.tv_sec*1000000000ull + (u64)ts.tv_nsec;
+}
+
+
+static u64 rusage_cputime(int who) {
+  struct rusage ru;
+  if (getrusage(who, &ru))
+    return 0;
+  return (u64)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)*1000000000ull +
+         (u64)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec)*1000ull;
+}
+
+
+void buildstats_enable(memalloc_t ma) {
+  if (!g_mu_init) {
+    safecheckx(mutex_init(&g_mu) == 0);
+    g_mu_init = true;
+  }
+  g_ma = ma;
+  g_pkgs = NULL;
+  g_apibytes = 0;
+  g_api_ma = NULL;
+  g_api_ma_use = 0;
+  g_start_wall = nanotime();
+  g_start_cpu = rusage_cputime(RUSAGE_SELF);
+  g_start_childcpu = rusage_cputime(RUSAGE_CHILDREN);
+  g_buildstats_enabled = true;
+}
+
+
+bool buildstats_pkg_begin(pkg_t* pkg) {
+  if (!g_buildstats_enabled)
+    return true;
+  pkgstats_t* st = mem_alloct(g_ma, pkgstats_t);
+  if (!st)
+    return false;
+  st->pkgpath = pkg->path.p;
+  pkg->stats = st;
+  return true;
+}
+
+
+void buildstats_pkg_end(pkg_t* pkg, memalloc_t ast_ma) {
+  pkgstats_t* st = pkg->stats;
+  if (!st)
+    return;
+  st->astbytes = memalloc_bump2_highwater(ast_ma);
+  st->astslabs = memalloc_bump2_nslabs(ast_ma);
+  pkg->stats = NULL;
+  mutex_lock(&g_mu);
+  st->next = g_pkgs;
+  g_pkgs = st;
+  mutex_unlock(&g_mu);
+}
+
+
+void buildstats_apimem(memalloc_t api_ma) {
+  if (!g_buildstats_enabled)
+    return;
+  usize use = memalloc_bump2_use(api_ma);
+  mutex_lock(&g_mu);
+  // an allocator may be shared by several top-level packages
+  if (api_ma == g_api_ma) {
+    g_apibytes += use - g_api_ma_use;
+  } else {
+    g_apibytes += use;
+    g_api_ma = api_ma;
+  }
+  g_api_ma_use = use;
+  mutex_unlock(&g_mu);
+}
+
+
+buildtimer_t buildstats_begin(const pkgstats_t* nullable st) {
+  if (!st)
+    return (buildtimer_t){};
+  return (buildtimer_t){
+    .wall = nanotime(),
+    .cpu = thread_cputime(),
+    .nested_wall = t_nested_wall,
+    .nested_cpu = t_nested_cpu,
+  };
+}
+
+
+void buildstats_end(pkgstats_t* nullable st, buildphase_t phase, buildtimer_t* t) {
+  if (!st)
+    return;
+  u64 wall = (nanotime() - t->wall) - (t_nested_wall - t->nested_wall);
+  u64 cpu = (thread_cputime() - t->cpu) - (t_nested_cpu - t->nested_cpu);
+  if (phase < BUILDPHASE_COUNT) {
+    AtomicAdd(&st->wall[phase], wall, memory_order_relaxed);
+    AtomicAdd(&st->cpu[phase], cpu, memory_order_relaxed);
+  }
+  t_nested_wall += wall;
+  t_nested_cpu += cpu;
+}
+
+
+void buildstats_end_cpu(pkgstats_t* nullable st, buildphase_t phase, buildtimer_t* t) {
+  if (!st)
+    return;
+  u64 cpu = (thread_cputime() - t->cpu) - (t_nested_cpu - t->nested_cpu);
+  AtomicAdd(&st->cpu[phase], cpu, memory_order_relaxed);
+  t_nested_cpu += cpu;
+}
+
+
+// peak_rss returns the maximum resident set size of the process, in bytes
+static u64 peak_rss() {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru))
+    return 0;
+  #if defined(__APPLE__)
+    return (u64)ru.ru_maxrss; // bytes
+  #else
+    return (u64)ru.ru_maxrss * 1024; // kilobytes
+  #endif
+}
+
+
+static void print_phases(FILE* fp, const u64 wall[BUILDPHASE_COUNT], const u64 cpu[BUILDPHASE_COUNT]) {
+  fprintf(fp, "  %-10s %12s %12s\n", "phase", "wall ms", "cpu ms");
+  for (u32 i = 0; i < BUILDPHASE_COUNT; i++) {
+    fprintf(fp, "  %-10s %12.3f", phase_names[i], (double)wall[i] / 1e6);
+    if (i == BUILDPHASE_CLANG && cpu[i] == 0) {
+      fprintf(fp, " %12s\n", "-");
+    } else {
+      fprintf(fp, " %12.3f\n", (double)cpu[i] / 1e6);
+    }
+  }
+}
+
+
+static void print_counters(FILE* fp, const pkgstats_t* st) {
+  fprintf(fp, "  %-23s %12llu\n", "source files", (unsigned long long)st->nsrcfiles);
+  fprintf(fp, "  %-23s %12llu\n", "source bytes", (unsigned long long)st->srcbytes);
+  fprintf(fp, "  %-23s %12llu\n", "tokens", (unsigned long long)st->ntokens);
+  fprintf(fp, "  %-23s %12llu\n", "AST nodes", (unsigned long long)st->nnodes);
+  fprintf(fp, "  %-23s %12llu\n", "template instances", (unsigned long long)st->ninstances);
+  fprintf(fp, "  %-23s %12llu\n", "AST memory bytes", (unsigned long long)st->astbytes);
+  fprintf(fp, "  %-23s %12llu\n", "AST memory slabs", (unsigned long long)st->astslabs);
+}
+
+
+void buildstats_print(FILE* fp) {
+  if (!g_buildstats_enabled)
+    return;
+
+  u64 wall = nanotime() - g_start_wall;
+  u64 cpu = rusage_cputime(RUSAGE_SELF) - g_start_cpu;
+  u64 childcpu = rusage_cputime(RUSAGE_CHILDREN) - g_start_childcpu;
+
+  mutex_lock(&g_mu);
+
+  // reverse list, so that packages are printed in order of completion
+  pkgstats_t* list = NULL;
+  for (pkgstats_t* st = g_pkgs; st; ) {
+    pkgstats_t* next = st->next;
+    st->next = list;
+    list = st;
+    st = next;
+  }
+  g_pkgs = NULL;
+
+  pkgstats_t total = {};
+  u64 twall[BUILDPHASE_COUNT] = {}, tcpu[BUILDPHASE_COUNT] = {};
+  u32 npkgs = 0;
+
+  for (pkgstats_t* st = list; st; st = st->next) {
+    u64 pwall[BUILDPHASE_COUNT], pcpu[BUILDPHASE_COUNT];
+    for (u32 i = 0; i < BUILDPHASE_COUNT; i++) {
+      pwall[i] = st->wall[i];
+      pcpu[i] = st->cpu[i];
+      twall[i] += pwall[i];
+      tcpu[i] += pcpu[i];
+    }
+    fprintf(fp, "package %s\n", st->pkgpath);
+    print_phases(fp, pwall, pcpu);
+    print_counters(fp, st);
+    total.nsrcfiles += st->nsrcfiles;
+    total.srcbytes += st->srcbytes;
+    total.ntokens += st->ntokens;
+    total.nnodes += st->nnodes;
+    total.ninstances += st->ninstances;
+    total.astbytes += st->astbytes;
+    total.astslabs += st->astslabs;
+    npkgs++;
+  }
+
+  // CPU time of subprocesses can only be measured as a whole
+  tcpu[BUILDPHASE_CLANG] = childcpu;
+
+  fprintf(fp, "total (%u packages)\n", npkgs);
+  print_phases(fp, twall, tcpu);
+  fprintf(fp, "  %-10s %12.3f %12.3f\n", "process", (double)wall / 1e6, (double)cpu / 1e6);
+  print_counters(fp, &total);
+  fprintf(fp, "  %-23s %12zu\n", "symbols", sym_count());
+  fprintf(fp, "  %-23s %12zu\n", "typeids", typeid_count());
+  fprintf(fp, "  %-23s %12zu\n", "API memory bytes", g_apibytes);
+  memalloc_bump2_poolstats_t pool;
+  memalloc_bump2_poolstats(&pool);
+  fprintf(fp, "  %-23s %12zu\n", "slabs mapped", pool.nmapped);
+  fprintf(fp, "  %-23s %12zu\n", "slabs reused", pool.nreused);
+  fprintf(fp, "  %-23s %12zu\n", "slab pool bytes", pool.pooledbytes);
+  fprintf(fp, "  %-23s %12llu\n", "peak RSS bytes", (unsigned long long)peak_rss());
+
+  g_buildstats_enabled = false;
+  mutex_unlock(&g_mu);
+
+  for (pkgstats_t* st = list; st; ) {
+    pkgstats_t* next = st->next;
+    mem_freet(g_ma, st);
+    st = next;
+  }
+}
@@ -0,0 +1,87 @@
+// build statistics: time spent in compiler phases and counters ("compis build --stats")
+// SPDX-License-Identifier: Apache-2.0
+//
+// Each package being built has a pkgstats_t (pkg_t.stats) while statistics
+// are enabled. Phases are timed with buildstats_begin & buildstats_end.
+// Time is exclusive: when phases nest on one thread (e.g. a dependency is built
+// on the importing package's thread), the time of inner phases is not counted
+// for outer phases. CPU time of work done on behalf of a phase by other threads
+// is recorded with buildstats_end_cpu.
+//
+#pragma once
+#include "ast.h"
+ASSUME_NONNULL_BEGIN
+
+#define FOREACH_BUILDPHASE(_) \
+  _(PARSE,     "parse") /* includes scanning */ \
+  _(IMPORT,    "import") \
+  _(TYPECHECK, "typecheck") \
+  _(IRANALYZE, "iranalyze") \
+  _(CGEN,      "cgen") \
+  _(METAGEN,   "metagen") \
+  _(CLANG,     "clang") /* lifetime of subprocesses; CPU time only in total */ \
+  _(LINK,      "link") \
+// end FOREACH_BUILDPHASE
+
+typedef enum buildphase {
+  #define _(NAME, name) BUILDPHASE_##NAME,
+  FOREACH_BUILDPHASE(_)
+  #undef _
+  BUILDPHASE_COUNT
+} buildphase_t;
+
+typedef struct pkgstats_ pkgstats_t;
+struct pkgstats_ {
+  pkgstats_t* nullable next; // list of packages, in order of completion
+  const char*  pkgpath;
+  _Atomic(u64) wall[BUILDPHASE_COUNT]; // nanoseconds
+  _Atomic(u64) cpu[BUILDPHASE_COUNT];  // nanoseconds, of all threads
+  _Atomic(u64) srcbytes;   // source code parsed
+  _Atomic(u64) nsrcfiles;  // number of source files parsed
+  _Atomic(u64) ntokens;    // tokens scanned
+  _Atomic(u64) nnodes;     // AST nodes created by the parser
+  u64          ninstances; // template instances created by typecheck
+  u64          astbytes;   // high-water memory use of the package's AST allocator
+  u64          astslabs;   // number of slabs of the package's AST allocator
+};
+
+typedef struct {
+  u64 wall, cpu;               // at start
+  u64 nested_wall, nested_cpu; // thread's attributed time at start
+} buildtimer_t;
+
+extern bool g_buildstats_enabled; // read-only
+
+// buildstats_enable starts collecting statistics.
+// ma is used for allocating pkgstats_t structs.
+void buildstats_enable(memalloc_t ma);
+
+// buildstats_print writes statistics of each package and totals to fp,
+// then stops collecting statistics.
+void buildstats_print(FILE* fp);
+
+// buildstats_apimem records memory used by api_ma, the allocator of imported APIs
+void buildstats_apimem(memalloc_t api_ma);
+
+// buildstats_pkg_begin allocates pkg->stats if statistics are enabled.
+// Returns false if memory allocation failed.
+bool buildstats_pkg_begin(pkg_t* pkg);
+
+// buildstats_pkg_end adds pkg->stats to the list of packages to report,
+// sets astbytes and astslabs from ast_ma and clears pkg->stats.
+void buildstats_pkg_end(pkg_t* pkg, memalloc_t ast_ma);
+
+// buildstats_begin returns a timer to be passed to buildstats_end.
+// Returns a zero timer if st is NULL.
+buildtimer_t buildstats_begin(const pkgstats_t* nullable st);
+
+// buildstats_end adds the time since buildstats_begin to phase of st,
+// excluding time of phases nested in it on the same thread.
+// If phase is BUILDPHASE_COUNT, time is only excluded from enclosing phases.
+void buildstats_end(pkgstats_t* nullable st, buildphase_t phase, buildtimer_t* t);
+
+// buildstats_end_cpu is like buildstats_end but only adds CPU time.
+// Used for parallel work done by several threads on behalf of a phase.
+void buildstats_end_cpu(pkgstats_t* nullable st, buildphase_t phase, buildtimer_t* t);
+
+ASSUME_NONNULL_END
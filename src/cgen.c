@@ -3587,72 +3587,72 @@ static isize nodearray_indexof(const nodearray_t* na, const node_t* n) {
 }
 
 
-static void gen_unit(cgen_t* g, unit_t* unit, cgen_pkgapi_t* pkgapi) {
+err_t cgen_unit_defs(
+  cgen_t* g, unit_t* unit, const cgen_pkgapi_t* nullable pkgapi, nodearray_t* defs)
+{
   assert_nodekind(unit, NODE_UNIT);
   nodearray_t children = unit->children;
 
-  if (children.len == 0)
-    return;
-
-  u32 defs_start = pkgapi->defs.len;
-  nodearray_t defs = {};
-
   // add unit-local declarations & definitions to topologically-sorted array "defs"
   nodeflag_t visibility = 0;
   for (u32 i = 0; i < children.len; i++) {
     node_t* n = children.v[i];
     u32 flags = AST_TOPOSORT_TOPLEVEL | AST_TOPOSORT_SKIPEXT;
-    if (!ast_toposort_visit_def(&defs, g->ma, visibility, n, flags))
-      goto end; // OOM
+    if (!ast_toposort_visit_def(defs, g->ma, visibility, n, flags))
+      return ErrNoMem;
   }
 
   #ifdef DEBUG
     if (opt_trace_cgen) {
-      trace("%u unit defs:", defs.len);
-      dlog_defs(g, defs.v, defs.len, "  ");
+      trace("%u unit defs:", defs->len);
+      dlog_defs(g, defs->v, defs->len, "  ");
     }
   #endif
 
-  // reset source tracking
-  g->srcfileid = 0;
-
   // Assign mangledname.
   // We must do this for all definitions before calling gen_def as the mangledname
   // of a node may be needed in the body of another node preceeding it.
-  for (u32 i = 0; i < defs.len; i++) {
-    node_t* n = defs.v[i];
-    if (nodearray_indexof(&pkgapi->defs, n) == -1) {
+  for (u32 i = 0; i < defs->len; i++) {
+    node_t* n = defs->v[i];
+    if (!pkgapi || nodearray_indexof(&pkgapi->defs, n) == -1) {
       assign_mangledname(g, n);
     } else if (n->kind != EXPR_FUN && !nodekind_isvar(n->kind)) {
       // erase node with already-generted code
-      defs.v[i] = NULL;
+      defs->v[i] = NULL;
     }
   }
 
+  return g->err;
+}
+
+
+static void gen_unit(cgen_t* g, const nodearray_t* defs) {
+  // reset source tracking
+  g->srcfileid = 0;
+
   // generate definitions
-  for (u32 i = 0; i < defs.len; i++) {
-    node_t* n = defs.v[i];
+  for (u32 i = 0; i < defs->len; i++) {
+    node_t* n = defs->v[i];
 
     if (!n)
       continue;
 
     // // skip unneccessary forward declaration
     // if (n->kind == NODE_FWDDECL &&
-    //     i+1 < defs.len &&
-    //     ((fwddecl_t*)n)->decl == defs.v[i+1])
+    //     i+1 < defs->len &&
+    //     ((fwddecl_t*)n)->decl == defs->v[i+1])
     // {
     //   continue;
     // }
 
     gen_def(g, n, /*is_impl*/true);
   }
-
-end:
-  pkgapi->defs.len = defs_start;
 }
 
 
-err_t cgen_unit_impl(cgen_t* g, unit_t* u, cgen_pkgapi_t* pkgapi) {
+err_t cgen_unit_impl(
+  cgen_t* g, unit_t* u, const cgen_pkgapi_t* nullable pkgapi, const nodearray_t* defs)
+{
   trace("cgen_unit_impl");
   cgen_reset(g);
 
@@ -3677,7 +3677,7 @@ err_t cgen_unit_impl(cgen_t* g, unit_t* u, cgen_pkgapi_t* pkgapi) {
   usize headstart = g->outbuf.len;
 
   trace("gen_unit");
-  gen_unit(g, u, pkgapi);
+  gen_unit(g, defs);
 
   if (g->mainfun && (g->flags & CGEN_EXE)) {
     trace("gen_main");
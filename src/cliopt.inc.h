@@ -32,6 +32,10 @@ static bool cliopt_parse(int* argc, char** argv[], void(*helpfn)(const char* pro
 // cliopt_print prints a summary of all command options
 static void cliopt_print();
 
+// cliopt_reset restores all options to the values they had before cliopt_parse
+// was first called, so that another command line can be parsed
+UNUSED static void cliopt_reset();
+
 // ———————————————————————————————————————————————————————————————————————————————————
 
 UNUSED static bool cli_valload_str(void* valptr, const char* value) {
@@ -89,6 +93,27 @@ static cliopt_t g_cli_options[] = {
 };
 
 
+// size of each option's value, in the same order as g_cli_options
+static const usize g_cli_valsizes[] = {
+  #define _S( p, ...)  sizeof(*(p)),
+  #ifdef DEBUG
+    #define _DL( p, ...) sizeof(*(p)),
+  #else
+    #define _DL( p, ...)
+  #endif
+
+  FOREACH_CLI_OPTION(_S, _S, _S, _S, _DL, _DL)
+
+  #undef _S
+  #undef _DL
+};
+static_assert(countof(g_cli_valsizes) == countof(g_cli_options), "");
+
+// initial values of options, saved by cliopt_parse for cliopt_reset
+static union { bool b; int i; u8 u; const char* s; } g_cli_defaults[countof(g_cli_options)];
+static bool g_cli_defaults_saved = false;
+
+
 static int dummyvar;
 
 static const struct option longopt_spec[] = {
@@ -126,6 +151,12 @@ static bool cliopt_parse(int* argcp, char** argvp[], void(*helpfn)(const char* p
   char** argv = *argvp;
   int c, i = 0, nerrs = 0, help = 0;
 
+  if (!g_cli_defaults_saved) {
+    for (usize j = 0; j < countof(g_cli_options); j++)
+      memcpy(&g_cli_defaults[j], g_cli_options[j].valptr, g_cli_valsizes[j]);
+    g_cli_defaults_saved = true;
+  }
+
   // e.g. "abc:d:f:h"
   const char optspec[] = {
     #define _S( p, c, name,          descr)  c,
@@ -196,6 +227,22 @@ static bool cliopt_parse(int* argcp, char** argvp[], void(*helpfn)(const char* p
 }
 
 
+UNUSED static void cliopt_reset() {
+  if (g_cli_defaults_saved) {
+    for (usize i = 0; i < countof(g_cli_options); i++)
+      memcpy(g_cli_options[i].valptr, &g_cli_defaults[i], g_cli_valsizes[i]);
+  }
+  // make getopt_long start over from the first argument
+  #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+      defined(__OpenBSD__)
+    optreset = 1;
+    optind = 1;
+  #else
+    optind = 0; // glibc & musl: full reinitialization
+  #endif
+}
+
+
 static void cliopt_print1(bool isdebug) {
   // calculate description column
   int descr_col = 0;
@@ -926,15 +926,29 @@ usize memalloc_bumpuse(memalloc_t ma);
 // If slabsize>0, at least ceil(slabsize/pagesize) vm pages are allocated whenever the
 // allocator grows (including its initial allocation.)
 // If slabsize=0, some default implementation-specific size is chosen.
-// flags is currently unused. Pass 0.
+// Slabs are taken from, and returned to when the allocator is disposed, a process-wide
+// pool of vm pages.
 // Returns memalloc_null() if initial allocation failed.
 memalloc_t memalloc_bump2(usize slabsize, u32 flags);
-// memalloc_bump2_reset forgets all allocations after use
+#define MEMALLOC_BUMP2_HUGEPAGES (1u << 0) // use transparent huge pages if available
+// memalloc_bump2_reset forgets all allocations after use, zeroing the memory
+// they used, and releases all slabs but the first one. use must not exceed the
+// size of the first slab. Must not be called while other threads use ma.
 bool memalloc_bump2_reset(memalloc_t ma, usize use);
 void memalloc_bump2_dispose(memalloc_t ma);
 usize memalloc_bump2_cap(memalloc_t ma); // total capacity, in bytes
 usize memalloc_bump2_use(memalloc_t ma); // allocated memory, in bytes
 usize memalloc_bump2_avail(memalloc_t ma); // free memory, in bytes
+usize memalloc_bump2_highwater(memalloc_t ma); // max use, including before resets
+u32 memalloc_bump2_nslabs(memalloc_t ma); // number of slabs
+// memalloc_bump2_poolstats returns statistics of the process-wide slab pool
+typedef struct {
+  usize nmapped;     // slabs mapped from the OS
+  usize nreused;     // slabs taken from the pool
+  usize nunmapped;   // slabs returned to the OS since the pool was full
+  usize pooledbytes; // memory currently in the pool
+} memalloc_bump2_poolstats_t;
+void memalloc_bump2_poolstats(memalloc_bump2_poolstats_t* st);
 
 // memalloc_ctx_set_scope saves the current contextual allocator on the stack
 // and sets newma as the current contextual allocator.
@@ -3,6 +3,7 @@
 #include "compiler.h"
 #include "path.h"
 #include "subproc.h"
+#include "timeline.h"
 #include "llvm/llvm.h"
 #include "clang/Basic/Version.inc" // CLANG_VERSION_STRING
 
@@ -546,6 +547,7 @@ static err_t configure_builtins(compiler_t* c) {
 
 err_t configure_options(compiler_t* c, const compiler_config_t* config) {
   c->buildmode = config->buildmode;
+  c->backend = config->backend;
   c->opt_nolto = config->nolto;
   c->opt_nomain = config->nomain;
   c->opt_printast = config->printast;
@@ -556,6 +558,7 @@ err_t configure_options(compiler_t* c, const compiler_config_t* config) {
   c->opt_nolibc = config->nolibc;
   c->opt_nolibcxx = config->nolibcxx;
   c->opt_nostdruntime = config->nostdruntime;
+  c->opt_contenthash = config->contenthash;
   return 0;
 }
 
@@ -765,10 +768,16 @@ err_t spawn_tool(
         strcmp(cmd, "clang") == 0 || strcmp(cmd, "clang++") == 0 ||
         strcmp(cmd, "as") == 0)
     {
-      return subproc_fork(p, clang_fork, cwd, argv);
+      err_t err = subproc_fork(p, clang_fork, cwd, argv);
+      if (!err)
+        p->traced = timeline_subproc_begin(p->pid, cmd, NULL);
+      return err;
     }
   }
-  return subproc_spawn(p, coexefile, argv, /*envp*/NULL, cwd);
+  err_t err = subproc_spawn(p, coexefile, argv, /*envp*/NULL, cwd);
+  if (!err)
+    p->traced = timeline_subproc_begin(p->pid, argv[0], NULL);
+  return err;
 }
 
 
@@ -901,7 +910,10 @@ err_t compile_c_to_obj_async(
   subproc_t* p = subprocs_alloc(sp);
   if (!p)
     return ErrNoMem;
-  return subproc_fork(p, cc_to_obj_main, wdir, c, cfile, ofile, srctype);
+  err_t err = subproc_fork(p, cc_to_obj_main, wdir, c, cfile, ofile, srctype);
+  if (!err)
+    p->traced = timeline_subproc_begin(p->pid, "cc", cfile);
+  return err;
 }
 
 
@@ -923,5 +935,8 @@ err_t compile_c_to_asm_async(
   if (!buf_nullterm(&asmfile))
     return ErrNoMem;
 
-  return subproc_fork(p, cc_to_asm_main, wdir, c, cfile, asmfile.chars, srctype);
+  err_t err = subproc_fork(p, cc_to_asm_main, wdir, c, cfile, asmfile.chars, srctype);
+  if (!err)
+    p->traced = timeline_subproc_begin(p->pid, "cc -S", cfile);
+  return err;
 }
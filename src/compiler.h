@@ -26,10 +26,17 @@ enum buildmode {
   BUILDMODE_OPT,
 };
 
+typedef u8 backend_t;
+enum backend {
+  BACKEND_C,    // generate C and compile it with clang
+  BACKEND_LLVM, // generate LLVM IR directly; units it can't handle use BACKEND_C
+};
+
 // compiler_t
 typedef struct compiler_ {
   memalloc_t  ma;            // memory allocator
   buildmode_t buildmode;     // BUILDMODE_ constant
+  backend_t   backend;       // BACKEND_ constant
   char*       buildroot;     // where all generated files go, e.g. "build"
   char*       builddir;      // "{buildroot}/{mode}-{triple}"
   char*       sysroot;       // "{builddir}/sysroot"
@@ -84,6 +91,7 @@ typedef struct compiler_ {
   bool opt_nolibc : 1;
   bool opt_nolibcxx : 1;
   bool opt_nostdruntime : 1;
+  bool opt_contenthash : 1;
   u8   opt_verbose; // 0=off 1=on 2=extra
 
   // userconfig
@@ -97,6 +105,10 @@ typedef struct compiler_ {
   rwmutex_t       pkgindex_mu;    // guards access to pkgindex
   map_t           pkgindex;       // const char* abs_fspath -> pkg_t*
   pkg_t* nullable stdruntime_pkg; // std/runtime package
+
+  // allocator for APIs of packages in pkgindex. When NULL, build_toplevel_pkg
+  // uses an allocator which lives only for the duration of the build.
+  memalloc_t nullable pkgapi_ma;
 } compiler_t;
 
 typedef struct { // compiler_config_t
@@ -106,6 +118,7 @@ typedef struct { // compiler_config_t
 
   // Optional fields; zero value is assumed to be a common default
   buildmode_t buildmode; // BUILDMODE_ constant. 0 = BUILDMODE_DEBUG
+  backend_t   backend;   // BACKEND_ constant. 0 = BACKEND_C
 
   // Options which maps to compiler_t.opt_
   bool nolto;    // prevent use of LTO, even if that would be the default
@@ -117,6 +130,7 @@ typedef struct { // compiler_config_t
   bool nolibc;
   bool nolibcxx;
   bool nostdruntime; // do not include or link with std/runtime
+  bool contenthash;  // decide if sources changed by content rather than mtime (srcfp.h)
   u8   verbose;
 
   // sysver sets the minimum system version. Ignored if NULL or "".
@@ -147,6 +161,7 @@ typedef struct {
   tok_t          tok;            // recently parsed token (current token during scanning)
   u32            lineno;         // monotonic line number counter (!= tok.loc.line)
   u32            errcount;       // number of error diagnostics reported
+  u32            ntokens;        // number of tokens scanned
   err_t          err;            // non-syntax error that occurred
   bool           insertsemi;     // insert a semicolon before next newline
   bool           parse_comments; // parse comments
@@ -178,6 +193,7 @@ typedef struct {
   ptrarray_t       membertypes;
   nodearray_t      toplevel_stmts; // finally transferred to unit->children
   bool             in_shorthand_call;
+  u32              nnodes;   // number of AST nodes created
 
   // free_nodearrays is a free list of nodearray_t's
   struct {
@@ -361,6 +377,12 @@ err_t import_resolve_pkg(
   pkg_t** result);
 err_t import_resolve_fspath(str_t* fspath, usize* rootlen_out);
 
+// import_prescan finds the packages imported by pkg by reading only the import
+// statements at the top of its source files, without parsing them. Found packages
+// are added to imports (sorted set of pkg_t*) and the size of the source files is
+// added to *srcsizep. Errors in import statements are ignored, left to import_pkgs.
+err_t import_prescan(compiler_t* c, pkg_t* pkg, ptrarray_t* imports, u64* srcsizep);
+
 err_t pkgindex_intern(
   compiler_t* c,
   slice_t pkgdir,
@@ -373,7 +395,15 @@ err_t pkgindex_add(compiler_t* c, pkg_t* pkg);
 bool cgen_init(
   cgen_t* g, compiler_t* c, const pkg_t*, memalloc_t out_ma, u32 flags);
 void cgen_dispose(cgen_t* g);
-err_t cgen_unit_impl(cgen_t* g, unit_t* unit, cgen_pkgapi_t* pkgapi);
+// cgen_unit_defs appends the topologically-sorted definitions of unit to defs and
+// assigns their mangled names. It modifies the AST and so must not run concurrently
+// with any other cgen function. Caller disposes defs with nodearray_dispose(g->ma).
+err_t cgen_unit_defs(
+  cgen_t* g, unit_t* unit, const cgen_pkgapi_t* nullable pkgapi, nodearray_t* defs);
+// cgen_unit_impl generates C code for unit into g->outbuf, given defs from
+// cgen_unit_defs. Several units may be generated concurrently using one cgen_t each.
+err_t cgen_unit_impl(
+  cgen_t* g, unit_t* unit, const cgen_pkgapi_t* nullable pkgapi, const nodearray_t* defs);
 err_t cgen_pkgapi(cgen_t* g, unit_t** unitv, u32 unitc, cgen_pkgapi_t* result);
 void cgen_pkgapi_dispose(cgen_t* g, cgen_pkgapi_t* result);
 
@@ -423,6 +453,7 @@ inline static bool tok_isassign(tok_t t) { return TASSIGN <= t && t <= TORASSIGN
 // scope
 void scope_clear(scope_t* s);
 void scope_dispose(scope_t* s, memalloc_t ma);
+bool scope_copy(scope_t* dst, const scope_t* src, memalloc_t ma); // replaces dst
 bool scope_push(scope_t* s, memalloc_t ma);
 void scope_pop(scope_t* s);
 bool scope_stash(scope_t* s, memalloc_t ma);
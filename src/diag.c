@@ -423,3 +423,46 @@ void diag_free_copy(diag_t* d, memalloc_t ma) {
   usize size = strlen(d->msg) + 1 + strlen(d->srclines) + 1;
   mem_freex(ma, MEM((void*)d->msg, size));
 }
+
+
+void diaglog_init(diaglog_t* dl, memalloc_t ma) {
+  memset(dl, 0, sizeof(*dl));
+  buf_init(&dl->msgbuf, ma);
+}
+
+
+void diaglog_dispose(diaglog_t* dl) {
+  array_dispose(diaglogent_t, (array_t*)&dl->entries, dl->msgbuf.ma);
+  buf_dispose(&dl->msgbuf);
+}
+
+
+void diaglog_addv(
+  diaglog_t* dl, origin_t origin, diagkind_t kind, const char* fmt, va_list ap)
+{
+  dl->errcount += (kind == DIAG_ERR);
+  diaglogent_t* e = array_alloc(diaglogent_t, (array_t*)&dl->entries, dl->msgbuf.ma, 1);
+  if UNLIKELY(!e) {
+    dl->msgbuf.oom = true;
+    return;
+  }
+  e->origin = origin;
+  e->kind = kind;
+  e->msgoffs = (u32)dl->msgbuf.len;
+  buf_vprintf(&dl->msgbuf, fmt, ap);
+  buf_push(&dl->msgbuf, 0);
+}
+
+
+void diaglog_report(diaglog_t* dl, compiler_t* c) {
+  if UNLIKELY(dl->msgbuf.oom) {
+    report_diag(c, (origin_t){}, DIAG_ERR, "%s", err_str(ErrNoMem));
+  } else for (u32 i = 0; i < dl->entries.len; i++) {
+    const diaglogent_t* e = &dl->entries.v[i];
+    report_diag(c, e->origin, e->kind, "%s", dl->msgbuf.chars + e->msgoffs);
+  }
+  dl->entries.len = 0;
+  dl->msgbuf.len = 0;
+  dl->msgbuf.oom = false;
+  dl->errcount = 0;
+}
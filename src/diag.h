@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: Apache-2.0
 #pragma once
 #include "loc.h"
+#include "buf.h"
+#include "array.h"
 ASSUME_NONNULL_BEGIN
 
 // forward declarations
@@ -31,6 +33,28 @@ static void report_diag(compiler_t* c, origin_t, diagkind_t, const char* fmt, ..
 bool diag_copy(diag_t* dst, const diag_t* src, memalloc_t ma);
 void diag_free_copy(diag_t* dst, memalloc_t ma); // free memory allocated by diag_copy
 
+// diaglog_t records diagnostics to be reported later, so that work done
+// concurrently can report its diagnostics in a deterministic order.
+// Recorded errors are not counted by compiler_errcount until reported.
+typedef struct {
+  origin_t   origin;
+  diagkind_t kind;
+  u32        msgoffs; // offset in diaglog_t.msgbuf of message
+} diaglogent_t;
+typedef struct {
+  array_type(diaglogent_t) entries;
+  buf_t msgbuf;
+  u32   errcount; // number of DIAG_ERR entries
+} diaglog_t;
+
+void diaglog_init(diaglog_t*, memalloc_t ma);
+void diaglog_dispose(diaglog_t*);
+void diaglog_addv(diaglog_t*, origin_t, diagkind_t, const char* fmt, va_list);
+static void diaglog_add(diaglog_t*, origin_t, diagkind_t, const char* fmt, ...)
+  ATTR_FORMAT(printf,4,5);
+// diaglog_report reports recorded diagnostics with report_diag and clears the log
+void diaglog_report(diaglog_t*, compiler_t* c);
+
 //———————————————————————————————————————————————————————————————————————————————————————
 // implementation
 
@@ -43,5 +67,14 @@ inline static void report_diag(
   va_end(ap);
 }
 
+inline static void diaglog_add(
+  diaglog_t* dl, origin_t origin, diagkind_t kind, const char* fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  diaglog_addv(dl, origin, kind, fmt, ap);
+  va_end(ap);
+}
+
 
 ASSUME_NONNULL_END
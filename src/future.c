@@ -3,14 +3,22 @@
 #include "future.h"
 
 
+// waiters list of a finished future
+#define WAITERS_CLOSED ((futurewaiter_t*)(uintptr)1)
+
+
 err_t future_init(future_t* p) {
   p->status = 0;
+  p->waiters = NULL;
   return sema_init(&p->sem, 0);
 }
 
 
 void future_dispose(future_t* p) {
-  assertf(p->status == 0 || sema_trywait(&p->sem), "future never finished");
+  // A waiter using future_trywait may observe completion before future_finalize
+  // has signalled sem; wait for that signal so we don't dispose sem under it.
+  if (AtomicLoadAcq(&p->status) != 0)
+    safecheckx(sema_wait(&p->sem));
   sema_dispose(&p->sem);
 }
 
@@ -24,6 +32,16 @@ bool future_trywait(future_t* p, err_t* result_errp) {
 }
 
 
+bool future_timedwait(future_t* p, u64 timeout_usecs, err_t* result_errp) {
+  if (future_trywait(p, result_errp))
+    return true;
+  if (!sema_timedwait(&p->sem, timeout_usecs))
+    return false;
+  sema_signal(&p->sem, 1); // restore signal that we "took"
+  return future_trywait(p, result_errp);
+}
+
+
 err_t future_wait(future_t* p) {
   err_t status = AtomicLoadAcq(&p->status);
   if (status == 2)
@@ -41,6 +59,20 @@ err_t future_wait(future_t* p) {
 }
 
 
+bool future_notify(future_t* p, futurewaiter_t* w) {
+  futurewaiter_t* head = AtomicLoadAcq(&p->waiters);
+  do {
+    if (head == WAITERS_CLOSED) {
+      // future_finalize is in progress or done; make sure its result is visible
+      future_wait(p);
+      return false;
+    }
+    w->next = head;
+  } while (!AtomicCASAcqRel(&p->waiters, &head, w));
+  return true;
+}
+
+
 bool future_acquire(future_t* p) {
   err_t status = AtomicLoadAcq(&p->status);
   if (status != 0)
@@ -52,6 +84,17 @@ bool future_acquire(future_t* p) {
 
 void future_finalize(future_t* p, err_t result_err) {
   assertf(AtomicLoadAcq(&p->status) == 1, "unbalanced future_begin/finish calls");
+
+  // Close the waiters list before publishing the result: once status is set and
+  // sem signalled, a waiter may dispose of p, so p must not be touched after that.
+  futurewaiter_t* w = AtomicExchange(&p->waiters, WAITERS_CLOSED, memory_order_acq_rel);
   AtomicStoreRel(&p->status, result_err == 0 ? 2 : result_err);
   sema_signal(&p->sem, 2); // yes, 2 signals
-}
\ No newline at end of file
+
+  // call waiters registered with future_notify
+  while (w) {
+    futurewaiter_t* next = w->next; // load before calling; fn may free w
+    w->fn(w->arg);
+    w = next;
+  }
+}
@@ -4,12 +4,24 @@
 #include "thread.h"
 ASSUME_NONNULL_BEGIN
 
+// futurewaiter_t is a callback registered with future_notify
+typedef struct futurewaiter_ futurewaiter_t;
+struct futurewaiter_ {
+  futurewaiter_t* nullable next;
+  void(*fn)(void* nullable arg);
+  void* nullable arg;
+};
+
 typedef struct {
   sema_t         sem;
   _Atomic(err_t) status; // 0: not started, 1: processing, 2: done(ok), <0: done(error)
+  _Atomic(futurewaiter_t*) waiters; // list of future_notify callbacks
 } future_t;
 
 err_t future_init(future_t* p);
+
+// future_dispose frees resources of p. If p was acquired, blocks until
+// future_finalize no longer accesses p.
 void future_dispose(future_t* p);
 
 // future_trywait returns true immediately if future finished,
@@ -18,11 +30,22 @@ void future_dispose(future_t* p);
 // Returns false if future_finalize has not been called.
 bool future_trywait(future_t* p, err_t* result_errp);
 
+// future_timedwait is like future_trywait but waits up to timeout_usecs for p
+// to finish before returning false.
+bool future_timedwait(future_t* p, u64 timeout_usecs, err_t* result_errp);
+
 // future_wait waits for p to finish production.
 // DEADLOCKS if future_finalize is never called.
 // Returns the value of result_err passed to future_finalize.
 err_t future_wait(future_t* p);
 
+// future_notify arranges for w->fn(w->arg) to be called once p finishes, on the
+// thread calling future_finalize. w must remain valid until then.
+// Returns false (and does not call w->fn) if p has already finished, in which case
+// the result is available via future_trywait. (If p is in the middle of finishing,
+// this blocks until it has.)
+bool future_notify(future_t* p, futurewaiter_t* w);
+
 // future_acquire returns true exactly once, for one thread.
 // If this function returns true, the caller must (eventually) call
 // future_finalize to avoid deadlock from future_wait.
@@ -223,6 +223,22 @@ void* nullable hashtable_assign(
   const void*        keyent,
   bool* nullable     added)
 {
+  usize hash = hashfn(ht->seed, keyent);
+  return hashtable_assign_hashed(ht, hashfn, eqfn, entsize, keyent, hash, added);
+}
+
+
+void* nullable hashtable_assign_hashed(
+  hashtable_t*       ht,
+  hashtable_hashfn_t hashfn,
+  hashtable_eqfn_t   eqfn,
+  usize              entsize,
+  const void*        keyent,
+  usize              hash,
+  bool* nullable     added)
+{
+  assert(hash == hashfn(ht->seed, keyent));
+
   usize growlen = ht->cap - (ht->cap >> LOAD_FACTOR);
   if (UNLIKELY(ht->len >= growlen) && !hashtable_grow(ht, hashfn, eqfn, entsize)) {
     if (added)
@@ -230,13 +246,12 @@ void* nullable hashtable_assign(
     return NULL;
   }
 
-  usize index = hashfn(ht->seed, keyent) & (ht->cap - 1);
+  usize index = hash & (ht->cap - 1);
 
   #ifdef HASHTABLE_TRACE
   char repr[128];
   { usize n = string_repr(repr, sizeof(repr), keyent, ht->entsize);
-    trace("[assign] %.*s (hash=0x%lx, index=%zu)",
-      (int)n, repr, hashfn(ht->seed, keyent), index); }
+    trace("[assign] %.*s (hash=0x%lx, index=%zu)", (int)n, repr, hash, index); }
   #endif
 
   void* entries = ht->entries;
@@ -299,7 +314,18 @@ void* nullable hashtable_lookup(
   usize               entsize,
   const void*         keyent)
 {
-  usize index = hashfn(ht->seed, keyent) & (ht->cap - 1);
+  return hashtable_lookup_hashed(ht, eqfn, entsize, keyent, hashfn(ht->seed, keyent));
+}
+
+
+void* nullable hashtable_lookup_hashed(
+  const hashtable_t*  ht,
+  hashtable_eqfn_t    eqfn,
+  usize               entsize,
+  const void*         keyent,
+  usize               hash)
+{
+  usize index = hash & (ht->cap - 1);
   void* entries = ht->entries;
   void* bitset = entries + ht->cap*entsize;
   void* ent;
@@ -308,8 +334,7 @@ void* nullable hashtable_lookup(
   {
     char repr[128];
     usize n = string_repr(repr, sizeof(repr), keyent, entsize);
-    trace("[lookup] %.*s (hash=0x%lx, index=%zu)",
-      (int)n, repr, hashfn(seed, keyent), index);
+    trace("[lookup] %.*s (hash=0x%lx, index=%zu)", (int)n, repr, hash, index);
   }
   #endif
 
@@ -668,18 +693,20 @@ UNITTEST_DEF(hashtable) {
   assertf(strcmp(samples[2].s, "cat") == 0, "'%s'", samples[1].s);
   assertf(strcmp(ent->s, "cat") == 0, "got '%s'", ent->s);
 
-  // assign more, causing growth
+  // assign more with precomputed hashes, causing growth
   for (usize i = 0; i < countof(samples2); i++) {
-    ent = hashtable_assign(
-      &ht, testent_hash, testent_eq, entsize, &samples2[i], &added);
+    usize hash = testent_hash(ht.seed, &samples2[i]);
+    ent = hashtable_assign_hashed(
+      &ht, testent_hash, testent_eq, entsize, &samples2[i], hash, &added);
     assertf(ent, "out of memory");
     assert(strcmp(ent->s, samples2[i].s) == 0);
     assert(added);
   }
 
-  // hashtable_lookup
+  // hashtable_lookup_hashed
   for (usize i = 0; i < countof(samples2); i++) {
-    ent = hashtable_lookup(&ht, testent_hash, testent_eq, entsize, &samples2[i]);
+    usize hash = testent_hash(ht.seed, &samples2[i]);
+    ent = hashtable_lookup_hashed(&ht, testent_eq, entsize, &samples2[i], hash);
     assertf(ent, "'%s' not found", samples2[i].s);
     assertf(strcmp(ent->s, samples2[i].s) == 0,
       "found '%s' instead of '%s'", ent->s, samples2[i].s);
@@ -30,6 +30,18 @@ void* nullable hashtable_assign(
   const void*        keyent,
   bool* nullable     added);
 
+// hashtable_assign_hashed is like hashtable_assign but uses a precomputed hash
+// of keyent, which must equal hashfn(ht->seed, keyent).
+// hashfn is only used when the table grows.
+void* nullable hashtable_assign_hashed(
+  hashtable_t*       ht,
+  hashtable_hashfn_t hashfn,
+  hashtable_eqfn_t   eqfn,
+  usize              entsize,
+  const void*        keyent,
+  usize              hash,
+  bool* nullable     added);
+
 // hashtable_lookup returns a pointer to an entry equivalent to keyent,
 // or NULL if not found.
 void* nullable hashtable_lookup(
@@ -39,6 +51,15 @@ void* nullable hashtable_lookup(
   usize              entsize,
   const void*        keyent);
 
+// hashtable_lookup_hashed is like hashtable_lookup but uses a precomputed hash
+// of keyent, which must equal hashfn(ht->seed, keyent)
+void* nullable hashtable_lookup_hashed(
+  const hashtable_t* ht,
+  hashtable_eqfn_t   eqfn,
+  usize              entsize,
+  const void*        keyent,
+  usize              hash);
+
 // hashtable_del removes an entry equivalent to keyent. Returns fals if not found.
 // Optimization detail: if keyent is a pointer to an entry in ht, for example from
 // hashtable_lookup, no additional lookup is performed internally.
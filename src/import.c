@@ -3,9 +3,11 @@
 #include "colib.h"
 #include "compiler.h"
 #include "path.h"
+#include "dirwalk.h"
 #include "sha256.h"
 
 #include <string.h>
+#include <sys/stat.h>
 
 
 #define trace_import(fmt, va...) \
@@ -573,3 +575,270 @@ end:
 
   return err;
 }
+
+
+
+// prescan_t is a minimal tokenizer for the import statements at the top of a
+// source file. It knows just enough syntax to find import paths and stops at
+// the first thing that is not part of an import statement.
+typedef struct {
+  const u8* p;
+  const u8* end;
+  u8        tok; // 'i' identifier, 's' string, 0 end or unknown, else punctuation
+  slice_t   lit; // identifier, or string value (without quotes)
+  bool      escaped; // string has escape sequences; lit is not its value
+  bool      oom;
+} prescan_t;
+
+
+static void prescan_next(prescan_t* s) {
+  // skip whitespace and comments
+  while (s->p < s->end) {
+    u8 c = *s->p;
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      s->p++;
+    } else if (c == '/' && s->p + 1 < s->end && s->p[1] == '/') {
+      while (s->p < s->end && *s->p != '\n')
+        s->p++;
+    } else if (c == '/' && s->p + 1 < s->end && s->p[1] == '*') {
+      const u8* p = s->p + 2;
+      while (p + 1 < s->end && !(p[0] == '*' && p[1] == '/'))
+        p++;
+      s->p = p + 1 < s->end ? p + 2 : s->end;
+    } else {
+      break;
+    }
+  }
+
+  s->tok = 0;
+  if (s->p == s->end)
+    return;
+
+  const u8* start = s->p;
+  u8 c = *s->p++;
+  if (c == '_' || (c|0x20) - 'a' < 26u || c >= 0x80) {
+    while (s->p < s->end) {
+      c = *s->p;
+      if (c != '_' && (c|0x20) - 'a' >= 26u && c - '0' >= 10u && c < 0x80)
+        break;
+      s->p++;
+    }
+    s->tok = 'i';
+    s->lit = (slice_t){ .p = start, .len = (usize)(s->p - start) };
+  } else if (c == '"') {
+    s->escaped = false;
+    while (s->p < s->end && *s->p != '"' && *s->p != '\n') {
+      if (*s->p == '\\') {
+        s->escaped = true;
+        s->p++;
+      }
+      s->p++;
+    }
+    if (s->p >= s->end || *s->p != '"')
+      return; // unterminated
+    s->tok = 's';
+    s->lit = (slice_t){ .p = start + 1, .len = (usize)(s->p - start - 1) };
+    s->p++;
+  } else if (c == '{' || c == '}' || c == ';' || c == ',' || c == '*') {
+    s->tok = c;
+  }
+}
+
+
+// prescan_spec reads an importspec (see parse_import_spec) and adds its path to paths
+static bool prescan_spec(prescan_t* s, memalloc_t ma, array_t* paths) {
+  if (s->tok != 's')
+    return false;
+  // Leave paths with escape sequences for the parser to decode
+  if (!s->escaped && !array_push(slice_t, paths, ma, s->lit)) {
+    s->oom = true;
+    return false;
+  }
+  prescan_next(s);
+
+  // ("as" id ","?)?
+  if (s->tok == 'i' && slice_eq(s->lit, slice_cstr("as"))) {
+    prescan_next(s);
+    if (s->tok != 'i')
+      return false;
+    prescan_next(s);
+    if (s->tok == ',')
+      prescan_next(s);
+  }
+
+  // membergroup?
+  if (s->tok == '{') {
+    do {
+      prescan_next(s);
+    } while (s->tok != '}' && s->tok != 0);
+    if (s->tok == 0)
+      return false;
+    prescan_next(s);
+  }
+
+  return true;
+}
+
+
+// prescan_imports adds the paths of import statements at the top of a source file
+// to paths (slice_t[], pointing into src). Returns false when running out of memory.
+static bool prescan_imports(
+  const void* src, usize size, memalloc_t ma, array_t* paths)
+{
+  prescan_t s = { .p = src, .end = src + size };
+  prescan_next(&s);
+  for (;;) {
+    if (s.tok == ';') {
+      prescan_next(&s);
+      continue;
+    }
+    if (s.tok != 'i' || !slice_eq(s.lit, slice_cstr("import")))
+      break;
+    prescan_next(&s);
+    if (s.tok != '{') {
+      // import "path" ...
+      if (!prescan_spec(&s, ma, paths))
+        break;
+      continue;
+    }
+    // import { "path" ...; ... }
+    prescan_next(&s);
+    while (s.tok != '}') {
+      if (s.tok == ';') {
+        prescan_next(&s);
+      } else if (!prescan_spec(&s, ma, paths)) {
+        goto end;
+      }
+    }
+    prescan_next(&s);
+  }
+end:
+  return !s.oom;
+}
+
+
+// prescan_srcfile adds packages imported by source file at path to imports
+static err_t prescan_srcfile(
+  compiler_t* c, pkg_t* pkg, const char* path, array_t* paths, ptrarray_t* imports)
+{
+  const void* src;
+  struct stat st;
+  err_t err = mmap_file_ro(path, &src, &st);
+  if (err) {
+    // leave it to the parser to report the error
+    dlog("%s: %s", relpath(path), err_str(err));
+    return 0;
+  }
+
+  paths->len = 0;
+  if (!prescan_imports(src, (usize)st.st_size, c->ma, paths)) {
+    err = ErrNoMem;
+    goto end;
+  }
+
+  str_t srcdir = path_dir(path);
+  if (srcdir.len == 0) {
+    err = ErrNoMem;
+    goto end;
+  }
+
+  for (u32 i = 0; i < paths->len && !err; i++) {
+    slice_t lit = ((slice_t*)paths->ptr)[i];
+    str_t impath = str_makelen(lit.chars, lit.len);
+    str_t fspath = {};
+    const char* errmsg;
+    usize erroffs;
+    pkg_t* dep;
+    if (impath.cap == 0) {
+      err = ErrNoMem;
+    } else if (
+      import_validate_path(impath.p, &errmsg, &erroffs) &&
+      import_clean_path(pkg, srcdir.p, &impath, &fspath) == 0 &&
+      import_resolve_pkg(c, pkg, str_slice(impath), &fspath, &dep) == 0 &&
+      dep != pkg)
+    {
+      if (!ptrarray_sortedset_addptr(imports, c->ma, dep, NULL))
+        err = ErrNoMem;
+    }
+    // note: invalid and unresolvable imports are reported by import_pkgs
+    str_free(impath);
+    str_free(fspath);
+  }
+
+  str_free(srcdir);
+end:
+  mmap_unmap(src, (usize)st.st_size);
+  return err;
+}
+
+
+err_t import_prescan(compiler_t* c, pkg_t* pkg, ptrarray_t* imports, u64* srcsizep) {
+  err_t err = 0;
+  array_type(slice_t) paths = {};
+
+  // use the package's source files if known (e.g. for an ad-hoc package)
+  if (pkg->srcfiles.len > 0) {
+    for (u32 i = 0; i < pkg->srcfiles.len && !err; i++) {
+      srcfile_t* f = pkg->srcfiles.v[i];
+      if (f->type != FILE_CO)
+        continue;
+      str_t path = pkg->dir.len ? path_join(pkg->dir.p, f->name.p) : f->name;
+      if (path.len == 0) {
+        err = ErrNoMem;
+        break;
+      }
+      *srcsizep += f->size;
+      err = prescan_srcfile(c, pkg, path.p, (array_t*)&paths, imports);
+      if (pkg->dir.len)
+        str_free(path);
+    }
+    goto end;
+  }
+
+  dirwalk_t* dw;
+  if (( err = dirwalk_open(&dw, c->ma, pkg->dir.p, 0) ))
+    return err;
+  while ((err = dirwalk_next(dw)) > 0) {
+    if (dw->type != S_IFREG || filetype_guess(dw->name) != FILE_CO)
+      continue;
+    *srcsizep += (u64)dirwalk_stat(dw)->st_size;
+    if (( err = prescan_srcfile(c, pkg, dw->path, (array_t*)&paths, imports) ))
+      break;
+  }
+  dirwalk_close(dw);
+
+end:
+  array_dispose(slice_t, (array_t*)&paths, c->ma);
+  return err;
+}
+
+
+#ifdef CO_ENABLE_TESTS
+UNITTEST_DEF(import_prescan) {
+  memalloc_t ma = memalloc_default();
+  array_type(slice_t) paths = {};
+
+  #define TEST_PRESCAN(src, expect...) { \
+    const char* expectv[] = { expect }; \
+    paths.len = 0; \
+    assert(prescan_imports(src, strlen(src), ma, (array_t*)&paths)); \
+    assertf(paths.len == countof(expectv), "%u == %zu", paths.len, countof(expectv)); \
+    for (u32 i = 0; i < paths.len; i++) \
+      assert_slice_eq(paths.v[i], slice_cstr(expectv[i])); \
+  }
+
+  TEST_PRESCAN("import \"a\"\nimport \"b/c\"\nfun main() {}\nimport \"x\"", "a", "b/c");
+  TEST_PRESCAN("// hello\n/* import \"x\" */ import \"a\"; import \"b\"", "a", "b");
+  TEST_PRESCAN("import \"a\" as x\nimport \"b\" { y; z as w }\nimport \"c\" as v, { *; }",
+    "a", "b", "c");
+  TEST_PRESCAN("import {\n  \"a\"\n  \"b\" as x\n  \"c\" { y }\n}\nimport \"d\"",
+    "a", "b", "c", "d");
+  TEST_PRESCAN("import \"a\\x62\"\nimport \"c\"", "c"); // escapes are left to the parser
+  TEST_PRESCAN("import \"a\" as\n", "a");
+  TEST_PRESCAN("import \"a");
+  TEST_PRESCAN("type x int\nimport \"a\"");
+
+  #undef TEST_PRESCAN
+  array_dispose(slice_t, (array_t*)&paths, ma);
+}
+#endif
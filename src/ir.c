@@ -2,7 +2,9 @@
 #include "colib.h"
 #include "ir.h"
 #include "bits.h"
+#include "buildstats.h"
 #include "compiler.h"
+#include "threadpool.h"
 
 #include <stdlib.h> // for debug_graphviz hack
 
@@ -23,14 +25,16 @@ typedef struct {
   pkg_t*      pkg;
   memalloc_t  ma;          // compiler->ma
   memalloc_t  ir_ma;       // allocator for ir data
-  irunit_t*   unit;        // current unit
   irfun_t*    f;           // current function
   irblock_t*  b;           // current block
   err_t       err;         // result of build process
   u32         errcount;    // number of DIAG_ERR produced
   u32         condnest;    // >0 when inside conditional ("if", "for", etc)
-  ptrarray_t  funqueue;    // [fun_t*] queue of functions awaiting build
-  map_t       funm;        // {fun_t* => irfun_t*} for breaking cycles
+  ptrarray_t  funqueue;    // [irfun_t*] queue of functions awaiting build
+  map_t*      funm;        // {fun_t* => irfun_t*} for breaking cycles (shared)
+  mutex_t* nullable funmu; // guards funm when functions are analyzed in parallel
+  ptrarray_t* functions;   // [irfun_t*] functions added (by addfun)
+  diaglog_t*  diaglog;     // diagnostics of the function being analyzed
   map_t       vars;        // {sym_t => irval_t*} (moved to defvars by end_block)
   maparray_t  defvars;     // {[block_id] => map_t}
   maparray_t  pendingphis; // {[block_id] => map_t}
@@ -58,7 +62,6 @@ static irblock_t bad_irblock = { 0 };
 static funtype_t bad_astfuntype = { .kind = TYPE_FUN };
 static fun_t     bad_astfun = { .kind = EXPR_FUN, .type = (type_t*)&bad_astfuntype };
 static irfun_t   bad_irfun = { .ast = &bad_astfun };
-static irunit_t  bad_irunit = { 0 };
 
 
 static void seterr(ircons_t* c, err_t err) {
@@ -196,7 +199,7 @@ inline static locmap_t* locmap(ircons_t* c) {
 // where T is one of: origin_t | loc_t | irval_t* | node_t* | expr_t*
 #define diag(c, origin, diagkind, fmt, args...) ( \
   (c)->errcount++, \
-  report_diag((c)->compiler, to_origin((c), (origin)), (diagkind), (fmt), ##args) \
+  diaglog_add((c)->diaglog, to_origin((c), (origin)), (diagkind), (fmt), ##args) \
 )
 
 #define error(c, origin, fmt, args...)    diag(c, origin, DIAG_ERR, (fmt), ##args)
@@ -1477,14 +1480,6 @@ static irval_t* var_define(ircons_t* c, local_t* var, irval_t* init) {
 }
 
 
-static void global_vardef(ircons_t* c, local_t* n) {
-  // TODO: global
-  irval_t* v = make_TODO_val(c, n->type,
-    "global %s", (n->flags & NF_CONST) ? "constant" : "variable");
-  var_write(c, n->name, v);
-}
-
-
 static irval_t* vardef(ircons_t* c, local_t* n) {
   irval_t* v;
 
@@ -2199,33 +2194,48 @@ UNUSED static void check_borrowing(ircons_t* c, irfun_t* f) {
 }
 
 
+static irfun_t* nullable mkirfun(memalloc_t ir_ma, fun_t* n) {
+  irfun_t* f = mem_alloct(ir_ma, irfun_t);
+  if UNLIKELY(!f)
+    return NULL;
+  if (n->name)
+    f->name = mem_strdup(ir_ma, slice_cstr(n->name), 0);
+  f->ast = n;
+  return f;
+}
+
+
 static bool addfun(ircons_t* c, fun_t* n, irfun_t** fp) {
   // make sure *fp is initialized no matter what happens
   *fp = &bad_irfun;
 
-  // functions may refer to themselves, so we record "ongoing" functions in a map
-  irfun_t** funmp = (irfun_t**)map_assign_ptr(&c->funm, c->ma, n);
-  if UNLIKELY(!funmp)
+  // functions may refer to themselves, so we record "ongoing" functions in a map.
+  // The map is shared with other threads, which makes sure that every function is
+  // built exactly once.
+  irfun_t* f = NULL;
+  bool isnew = false;
+  if (c->funmu)
+    mutex_lock(c->funmu);
+  irfun_t** funmp = (irfun_t**)map_assign_ptr(c->funm, c->ma, n);
+  if LIKELY(funmp) {
+    if (*funmp == NULL) {
+      *funmp = mkirfun(c->ir_ma, n);
+      isnew = true;
+    }
+    f = *funmp;
+  }
+  if (c->funmu)
+    mutex_unlock(c->funmu);
+  if UNLIKELY(!f)
     return out_of_mem(c), false;
+  *fp = f;
 
   // stop short if function is already built or in progress of being built
-  if (*funmp) {
-    *fp = *funmp;
+  if (!isnew)
     return false;
-  }
 
-  // allocate irfun_t
-  irfun_t* f = mem_alloct(c->ir_ma, irfun_t);
-  if UNLIKELY(!f)
-    return out_of_mem(c), &bad_irfun;
-  *fp = f;
-  *funmp = f;
-  if (n->name)
-    f->name = mem_strdup(c->ir_ma, slice_cstr(n->name), 0);
-  f->ast = n;
-
-  // add to current unit
-  if UNLIKELY(!ptrarray_push(&c->unit->functions, c->ir_ma, f)) {
+  // add to the functions of the current unit
+  if UNLIKELY(!ptrarray_push(c->functions, c->ma, f)) {
     out_of_mem(c);
     return false;
   }
@@ -2237,7 +2247,7 @@ static bool addfun(ircons_t* c, fun_t* n, irfun_t** fp) {
   // handle function refs and nested function definitions
   if (c->f != &bad_irfun) {
     trace("funqueue push %s", fmtnode(0, n));
-    if UNLIKELY(!ptrarray_push(&c->funqueue, c->ma, n))
+    if UNLIKELY(!ptrarray_push(&c->funqueue, c->ma, f))
       out_of_mem(c);
     return false;
   }
@@ -2501,107 +2511,199 @@ static irval_t* expr(ircons_t* c, void* expr_node) {
 }
 
 
-static irunit_t* unit(ircons_t* c, unit_t* n) {
-  irunit_t* u = mem_alloct(c->ir_ma, irunit_t);
-  if UNLIKELY(!u)
-    return out_of_mem(c), &bad_irunit;
+static void dispose_maparray(memalloc_t ma, maparray_t* a) {
+  for (u32 i = 0; i < a->len; i++) {
+    if (a->v[i].cap)
+      map_dispose(&a->v[i], ma);
+  }
+  maparray_dispose(a, ma);
+}
 
-  assert(c->unit == &bad_irunit);
-  u->srcfile = n->srcfile;
-  c->unit = u;
 
-  for (u32 i = 0; i < n->children.len && c->errcount == 0; i++) {
-    stmt_t* cn = (stmt_t*)n->children.v[i];
-    {
-      TRACE_NODE("stmt ", cn);
-      switch (cn->kind) {
-        case STMT_TYPEDEF:
-          // ignore
-          break;
-        case EXPR_FUN:
-          fun(c, (fun_t*)cn, NULL);
-          break;
-        case EXPR_LET:
-        case EXPR_VAR:
-          global_vardef(c, (local_t*)cn);
-          break;
-        default:
-          assertf(0, "unexpected node %s", nodekind_name(cn->kind));
-      }
-    }
+//———————————————————————————————————————————————————————————————————————————————————————
+// package analysis
+//
+// Functions are analyzed independently of each other; the only state they share is
+// the map of functions (ircons_t.funm) which makes sure that each function is built
+// once, even when it's referenced from other functions. Every unit-level function
+// of the package is a work item, analyzed by one of several threads, each with an
+// ircons_t of its own. Nested functions are built by the thread of the function
+// which first references them. Diagnostics of each work item are recorded and
+// reported in source order once all work items have been analyzed.
 
-    // flush funqueue
-    for (u32 i = 0; i < c->funqueue.len; i++) {
-      fun_t* cn = c->funqueue.v[i];
-      irfun_t** fp = (irfun_t**)map_lookup_ptr(&c->funm, cn);
-      assertnotnull(fp);
-      assertnotnull(*fp);
-      TRACE_NODE("stmt ", cn);
-      fun(c, cn, *fp);
-    }
-    c->funqueue.len = 0;
-  }
 
-  c->unit = &bad_irunit;
+// IR_FUNS_MIN_PER_THREAD is the minimum number of functions per thread
+#define IR_FUNS_MIN_PER_THREAD 8
 
-  return u;
-}
 
+typedef struct {
+  fun_t*     fn;
+  irfun_t*   f;
+  u32        unit_i;
+  err_t      err;
+  u32        errcount;
+  ptrarray_t functions; // [irfun_t*] functions added while analyzing fn
+  diaglog_t  diaglog;
+} irwork_t;
 
-static void dispose_maparray(memalloc_t ma, maparray_t* a) {
-  for (u32 i = 0; i < a->len; i++) {
-    if (a->v[i].cap)
-      map_dispose(&a->v[i], ma);
+
+typedef struct {
+  compiler_t*   compiler;
+  pkg_t*        pkg;
+  memalloc_t    ir_ma;
+  irwork_t*     workv;
+  u32           workc;
+  map_t*        funm;
+  mutex_t*      funmu;      // NULL if analyzing on one thread
+  _Atomic(u32)  next;       // index of next work item to analyze
+  _Atomic(u32)  nremaining; // number of work items not yet analyzed
+  _Atomic(u32)  refcount;   // threads referencing this struct
+  sema_t        donesem;    // signalled when nremaining reaches zero
+  mutex_t       funmu_storage;
+} irjob_t;
+
+
+static err_t ircons_init(ircons_t* c, irjob_t* job) {
+  *c = (ircons_t){
+    .compiler = job->compiler,
+    .pkg = job->pkg,
+    .ma = job->compiler->ma,
+    .ir_ma = job->ir_ma,
+    .f = &bad_irfun,
+    .b = &bad_irblock,
+    .funm = job->funm,
+    .funmu = job->funmu,
+  };
+  // note: not bitset_make, which allocates on the stack
+  if (!( c->deadset = bitset_alloc(c->ma, BITSET_STACK_CAP) ))
+    return ErrNoMem;
+  if (!map_init(&c->vars, c->ma, 8)) {
+    bitset_dispose(c->deadset, c->ma);
+    return ErrNoMem;
   }
-  maparray_dispose(a, ma);
+  return 0;
 }
 
 
-static void ircons_reset(ircons_t* c) {
-  // reset state, making c ready to process another unit
+static void ircons_dispose(ircons_t* c) {
+  ptrarray_dispose(&c->funqueue, c->ma);
+  ptrarray_dispose(&c->dropstack, c->ma);
+  ptrarray_dispose(&c->owners.entries, c->ma);
+
+  dispose_maparray(c->ma, &c->defvars);
+  dispose_maparray(c->ma, &c->pendingphis);
+  dispose_maparray(c->ma, &c->freemaps);
+
+  map_dispose(&c->vars, c->ma);
+  bitset_dispose(c->deadset, c->ma);
+}
+
+
+static void analyze_fun(ircons_t* c, irwork_t* w) {
+  c->err = 0;
+  c->errcount = 0;
+  c->functions = &w->functions;
+  c->diaglog = &w->diaglog;
+
+  TRACE_NODE("fun ", w->fn);
+  fun(c, w->fn, w->f);
+
+  // flush funqueue
+  for (u32 i = 0; i < c->funqueue.len; i++) {
+    irfun_t* f = c->funqueue.v[i];
+    TRACE_NODE("fun ", f->ast);
+    fun(c, f->ast, f);
+  }
   c->funqueue.len = 0;
-  c->dropstack.len = 0;
 
-  c->owners.base = 0;
-  c->owners.entries.len = 0;
+  w->err = c->err;
+  w->errcount = c->errcount;
+}
 
-  map_clear(&c->vars);
-  map_clear(&c->funm);
 
-  bitset_clear(c->deadset);
+static void analyze_funs(irjob_t* job) {
+  ircons_t c;
+  err_t initerr = ErrCanceled; // ircons_init not yet called
 
-  // move maps in defvars and pendingphis to freemaps
-  u32 nmaps = 0;
-  for (u32 i = 0; i < c->defvars.len; i++)
-    nmaps += (u32)(c->defvars.v[i].cap != 0);
-  for (u32 i = 0; i < c->pendingphis.len; i++)
-    nmaps += (u32)(c->pendingphis.v[i].cap != 0);
-  if (nmaps > 0) {
-    map_t* mv = maparray_alloc(&c->freemaps, c->ma, nmaps);
-    if UNLIKELY(!mv) {
-      dispose_maparray(c->ma, &c->defvars);
-      dispose_maparray(c->ma, &c->pendingphis);
-      memset(&c->defvars, 0, sizeof(c->defvars));
-      memset(&c->pendingphis, 0, sizeof(c->pendingphis));
-    } else {
-      for (u32 i = 0; i < c->defvars.len; i++) {
-        if (c->defvars.v[i].cap > 0) {
-          *mv = c->defvars.v[i];
-          map_clear(mv);
-          mv++;
-        }
-      }
-      c->defvars.len = 0;
-      for (u32 i = 0; i < c->pendingphis.len; i++) {
-        if (c->pendingphis.v[i].cap > 0) {
-          *mv = c->pendingphis.v[i];
-          map_clear(mv);
-          mv++;
-        }
-      }
-      c->pendingphis.len = 0;
+  for (;;) {
+    u32 i = AtomicAdd(&job->next, 1, memory_order_relaxed);
+    if (i >= job->workc)
+      break;
+    irwork_t* w = &job->workv[i];
+    buildtimer_t timer = buildstats_begin(job->pkg->stats);
+    if (initerr == ErrCanceled)
+      initerr = ircons_init(&c, job);
+    if (initerr) {
+      w->err = initerr;
+    } else if (w->fn->body) {
+      analyze_fun(&c, w);
     }
+    buildstats_end_cpu(job->pkg->stats, BUILDPHASE_IRANALYZE, &timer);
+    if (AtomicSub(&job->nremaining, 1, memory_order_acq_rel) == 1)
+      sema_signal(&job->donesem, 1);
   }
+
+  if (initerr == 0)
+    ircons_dispose(&c);
+}
+
+
+static void irjob_release(irjob_t* job) {
+  if (AtomicSub(&job->refcount, 1, memory_order_acq_rel) > 1)
+    return;
+  sema_dispose(&job->donesem);
+  if (job->funmu)
+    mutex_dispose(job->funmu);
+  mem_freet(job->compiler->ma, job);
+}
+
+
+static void analyze_funs_thread(irjob_t* job) {
+  analyze_funs(job);
+  irjob_release(job);
+}
+
+
+static err_t analyze_pkg(
+  compiler_t* compiler, memalloc_t ir_ma, pkg_t* pkg,
+  irwork_t* workv, u32 workc, map_t* funm)
+{
+  if (workc == 0)
+    return 0;
+
+  u32 nthreads = 1;
+  if (!opt_trace_ir)
+    nthreads = MAX(1u, MIN(comaxproc, workc / IR_FUNS_MIN_PER_THREAD));
+
+  // Note: job is heap allocated since threads that start after all functions have
+  // been analyzed (by other threads) may outlive this function call.
+  irjob_t* job = mem_alloct(compiler->ma, irjob_t);
+  if UNLIKELY(!job)
+    return ErrNoMem;
+  job->compiler = compiler;
+  job->pkg = pkg;
+  job->ir_ma = ir_ma;
+  job->workv = workv;
+  job->workc = workc;
+  job->funm = funm;
+  job->nremaining = workc;
+  safecheckx(sema_init(&job->donesem, 0) == 0);
+  if (nthreads > 1 && mutex_init(&job->funmu_storage) == 0) {
+    job->funmu = &job->funmu_storage;
+  } else {
+    nthreads = 1;
+  }
+  job->refcount = nthreads;
+
+  for (u32 i = 1; i < nthreads; i++) {
+    if (threadpool_submit(analyze_funs_thread, job))
+      AtomicSub(&job->refcount, 1, memory_order_relaxed);
+  }
+  analyze_funs(job);
+  safecheckx(sema_wait(&job->donesem));
+  irjob_release(job);
+
+  return 0;
 }
 
 
@@ -2611,63 +2713,119 @@ err_t iranalyze(
   bad_irval.type = type_void;
   bad_astfuntype.result = type_void;
 
-  // initialize ircons_t
-  ircons_t c = {
-    .compiler = compiler,
-    .ma = compiler->ma,
-    .ir_ma = ir_ma,
-    .unit = &bad_irunit,
-    .f = &bad_irfun,
-    .b = &bad_irblock,
-    .deadset = assertnotnull( bitset_make(compiler->ma, BITSET_STACK_CAP) ),
-  };
-  if (!map_init(&c.funm, c.ma, 64)) {
-    c.err = ErrNoMem;
-    goto end1;
+  memalloc_t ma = compiler->ma;
+  err_t err = 0;
+  map_t funm;
+  irunit_t** irunitv = NULL;
+  irwork_t* workv = NULL;
+
+  // count unit-level functions
+  u32 workc = 0;
+  for (u32 i = 0; i < unitc; i++) {
+    for (u32 j = 0; j < unitv[i]->children.len; j++)
+      workc += (u32)(((node_t*)unitv[i]->children.v[j])->kind == EXPR_FUN);
   }
-  if (!map_init(&c.vars, c.ma, 8)) {
-    c.err = ErrNoMem;
-    goto end2;
+
+  if (!map_init(&funm, ma, workc + 8))
+    return ErrNoMem;
+  irunitv = mem_alloctv(ma, irunit_t*, MAX(unitc, 1u));
+  workv = mem_alloctv(ma, irwork_t, MAX(workc, 1u));
+  if (!irunitv || !workv) {
+    err = ErrNoMem;
+    goto end;
   }
+  for (u32 i = 0; i < workc; i++)
+    diaglog_init(&workv[i].diaglog, ma);
 
-  // visit unit by unit
-  for (u32 i = 0; i < unitc; i++) {
-    dlog("[ir] analyzing %s", node_srcfilename((node_t*)unitv[i], &compiler->locmap));
+  // create a work item for each unit-level function
+  irwork_t* w = workv;
+  for (u32 unit_i = 0; unit_i < unitc; unit_i++) {
+    unit_t* unit = unitv[unit_i];
+    dlog("[ir] analyzing %s", node_srcfilename((node_t*)unit, &compiler->locmap));
 
-    irunit_t* u = unit(&c, unitv[i]);
-    if (c.err)
-      break;
+    irunit_t* u = mem_alloct(ir_ma, irunit_t);
+    if UNLIKELY(!u) {
+      err = ErrNoMem;
+      goto end;
+    }
+    u->srcfile = unit->srcfile;
+    irunitv[unit_i] = u;
 
-    if (u != &bad_irunit) {
-      if (compiler->opt_printir)
-        dump_irunit(compiler, pkg, u);
-      if (compiler->opt_genirdot)
-        debug_graphviz(compiler, pkg, u);
+    for (u32 i = 0; i < unit->children.len; i++) {
+      stmt_t* cn = (stmt_t*)unit->children.v[i];
+      switch (cn->kind) {
+        case STMT_TYPEDEF:
+          // ignore
+          break;
+        case EXPR_FUN: {
+          fun_t* fn = (fun_t*)cn;
+          irfun_t** fp = (irfun_t**)map_assign_ptr(&funm, ma, fn);
+          if UNLIKELY(!fp || !( *fp = mkirfun(ir_ma, fn) )) {
+            err = ErrNoMem;
+            goto end;
+          }
+          w->fn = fn;
+          w->f = *fp;
+          w->unit_i = unit_i;
+          w++;
+          break;
+        }
+        case EXPR_LET:
+        case EXPR_VAR:
+          // TODO: global
+          // For now, reads of globals in functions produce TODO values.
+          break;
+        default:
+          assertf(0, "unexpected node %s", nodekind_name(cn->kind));
+      }
     }
+  }
+  assert(w == workv + workc);
 
-    // Note: For now, we just discard the irunit. We have no use for it anymore.
-    // It is allocated in ir_ma, which is expected to be a bump allocator,
-    // so no need to deallocate irunit here.
+  if (( err = analyze_pkg(compiler, ir_ma, pkg, workv, workc, &funm) ))
+    goto end;
 
-    // reset state before parsing next unit
-    if (i + 1 < unitc)
-      ircons_reset(&c);
+  // Report diagnostics and add functions to their units, in source order.
+  // Only diagnostics up until the first function with errors are reported.
+  bool stop = false;
+  for (u32 i = 0; i < workc; i++) {
+    w = &workv[i];
+    if (!stop) {
+      diaglog_report(&w->diaglog, compiler);
+      stop = w->errcount > 0;
+    }
+    if (w->err && !err)
+      err = w->err;
+    void** fv = ptrarray_alloc(&irunitv[w->unit_i]->functions, ir_ma, 1 + w->functions.len);
+    if UNLIKELY(!fv) {
+      err = ErrNoMem;
+      continue;
+    }
+    fv[0] = w->f;
+    memcpy(&fv[1], w->functions.v, w->functions.len * sizeof(void*));
   }
 
-  // end
-  ptrarray_dispose(&c.funqueue, c.ma);
-  ptrarray_dispose(&c.dropstack, c.ma);
-  ptrarray_dispose(&c.owners.entries, c.ma);
-
-  dispose_maparray(c.ma, &c.defvars);
-  dispose_maparray(c.ma, &c.pendingphis);
-  dispose_maparray(c.ma, &c.freemaps);
+  for (u32 i = 0; i < unitc && err == 0; i++) {
+    if (compiler->opt_printir)
+      dump_irunit(compiler, pkg, irunitv[i]);
+    if (compiler->opt_genirdot)
+      debug_graphviz(compiler, pkg, irunitv[i]);
+  }
 
-  map_dispose(&c.vars, c.ma);
-end2:
-  map_dispose(&c.funm, c.ma);
-end1:
-  bitset_dispose(c.deadset, c.ma);
+  // Note: For now, we just discard the irunits. We have no use for them anymore.
+  // They are allocated in ir_ma, which is expected to be a bump allocator,
+  // so no need to deallocate them here.
 
-  return c.err;
+end:
+  if (workv) {
+    for (u32 i = 0; i < workc; i++) {
+      ptrarray_dispose(&workv[i].functions, ma);
+      diaglog_dispose(&workv[i].diaglog);
+    }
+    mem_freetv(ma, workv, MAX(workc, 1u));
+  }
+  if (irunitv)
+    mem_freetv(ma, irunitv, MAX(unitc, 1u));
+  map_dispose(&funm, ma);
+  return err;
 }
@@ -0,0 +1,466 @@
+// process-wide job scheduler for subprocesses
+// SPDX-License-Identifier: Apache-2.0
+#include "colib.h"
+#include "jobserver.h"
+#include "thread.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h> // getenv
+#include <string.h> // strerror
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define trace(fmt, va...) _trace(opt_trace_subproc, 3, "jobserver", fmt, ##va)
+
+// POLL_TIMEOUT_MS: how long to wait for a token from make's jobserver before
+// checking if any of our own jobs have exited (which may free up a token.)
+#define POLL_TIMEOUT_MS  10
+// WAIT_TIMEOUT_US: how long to wait for a job to be released before polling
+// for exited processes.
+#define WAIT_TIMEOUT_US  10000
+
+enum jobstate {
+  JOB_FREE,     // slot is available
+  JOB_RESERVED, // acquired but no process started yet
+  JOB_RUNNING,  // process is running
+  JOB_AWAITING, // someone is blocked in waitpid on the process
+  JOB_EXITED,   // process exited (reaped by poll_exited); status is valid
+};
+
+// token values other than a byte read from make's jobserver
+#define TOKEN_NONE     (-2) // we are not using a make jobserver
+#define TOKEN_IMPLICIT (-1) // the implicit token every make job owns
+
+typedef struct {
+  pid_t pid;
+  int   status;
+  i16   token;
+  u8    state; // enum jobstate
+} job_t;
+
+static memalloc_t g_ma;
+static mutex_t    g_mu;       // protects all fields below
+static sema_t     g_sema;     // signalled when a job is released
+static job_t*     g_jobv = NULL;
+static u32        g_jobcap = 0;
+static u32        g_nrunning = 0; // number of jobs consuming concurrency
+static u32        g_maxjobs = 0;  // limit on g_nrunning; 0 means comaxproc
+static bool       g_implicit_used = false;
+static int        g_make_rfd = -1; // make jobserver read end (nonblocking if possible)
+static int        g_make_wfd = -1; // make jobserver write end
+static bool       g_make_rfd_owned = false; // g_make_rfd was opened by us
+static bool       g_make_wfd_owned = false; // g_make_wfd was opened by us
+static bool       g_detached = false; // jobserver_detach was called
+static char       g_make_desc[64];
+static mutex_t    g_readmu; // serializes reading tokens from make's jobserver
+
+
+err_t jobserver_parse_makeflags(
+  const char* makeflags, int* rfd, int* wfd,
+  const char* nullable* fifopath, usize* fifopathlen)
+{
+  const char* auth = NULL;
+  usize authlen = 0;
+
+  for (const char* p = makeflags; *p;) {
+    while (*p == ' ')
+      p++;
+    const char* word = p;
+    while (*p && *p != ' ')
+      p++;
+    usize wordlen = (usize)(p - word);
+    // "--" separates flags from command-line variable definitions
+    if (wordlen == 2 && word[0] == '-' && word[1] == '-')
+      break;
+    // last occurrence wins; make appends the jobserver flag for sub-makes
+    #define TRY_PREFIX(PREFIX) \
+      if (wordlen > strlen(PREFIX) && memcmp(word, PREFIX, strlen(PREFIX)) == 0) { \
+        auth = word + strlen(PREFIX); \
+        authlen = wordlen - strlen(PREFIX); \
+        continue; \
+      }
+    TRY_PREFIX("--jobserver-auth=")
+    TRY_PREFIX("--jobserver-fds=")
+    #undef TRY_PREFIX
+  }
+
+  if (!auth)
+    return ErrNotFound;
+
+  if (authlen > 5 && memcmp(auth, "fifo:", 5) == 0) {
+    *fifopath = auth + 5;
+    *fifopathlen = authlen - 5;
+    return 0;
+  }
+
+  // "R,W"
+  char* end;
+  long r = strtol(auth, &end, 10);
+  if (end == auth || *end != ',')
+    return ErrInvalid;
+  const char* wstart = end + 1;
+  long w = strtol(wstart, &end, 10);
+  if (end == wstart || (*end && *end != ' ') || r < 0 || w < 0 || r > I32_MAX || w > I32_MAX)
+    return ErrInvalid;
+  *rfd = (int)r;
+  *wfd = (int)w;
+  *fifopath = NULL;
+  return 0;
+}
+
+
+// open_nonblocking returns a new nonblocking file description for fd, if possible.
+// Setting O_NONBLOCK on the fd itself would affect make and other jobserver
+// clients sharing the same file description.
+static int open_nonblocking(int fd) {
+  #if defined(__linux__)
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    int fd2 = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd2 > -1)
+      return fd2;
+  #endif
+  return fd;
+}
+
+
+static void connect_make_jobserver() {
+  const char* makeflags = getenv("MAKEFLAGS");
+  if (!makeflags || !*makeflags)
+    return;
+
+  int rfd = -1, wfd = -1;
+  const char* fifopath = NULL;
+  usize fifopathlen = 0;
+  err_t err = jobserver_parse_makeflags(makeflags, &rfd, &wfd, &fifopath, &fifopathlen);
+  if (err) {
+    if (err != ErrNotFound)
+      vlog("ignoring malformed jobserver in MAKEFLAGS: %s", makeflags);
+    return;
+  }
+
+  if (fifopath) {
+    char path[PATH_MAX];
+    if (fifopathlen >= sizeof(path)) {
+      vlog("ignoring jobserver fifo: path too long");
+      return;
+    }
+    memcpy(path, fifopath, fifopathlen);
+    path[fifopathlen] = 0;
+    // Note: we own these file descriptions, so O_NONBLOCK is fine
+    rfd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    wfd = open(path, O_WRONLY | O_CLOEXEC);
+    if (rfd < 0 || wfd < 0) {
+      // make does not consider this an error and falls back to -j1
+      elog("%s: warning: jobserver unavailable: %s: %s", coprogname, path, strerror(errno));
+      goto unavailable;
+    }
+    snprintf(g_make_desc, sizeof(g_make_desc), "make (fifo:%.50s)", path);
+  } else {
+    // make only passes the pipe to commands marked as recursive ("+" or $(MAKE))
+    if (fcntl(rfd, F_GETFD) == -1 || fcntl(wfd, F_GETFD) == -1) {
+      elog("%s: warning: jobserver unavailable: using -j1."
+           " Add '+' to parent make rule.", coprogname);
+      goto unavailable;
+    }
+    snprintf(g_make_desc, sizeof(g_make_desc), "make (fds %d,%d)", rfd, wfd);
+    int rfd2 = open_nonblocking(rfd);
+    g_make_rfd_owned = rfd2 != rfd;
+    rfd = rfd2;
+  }
+
+  g_make_rfd = rfd;
+  g_make_wfd = wfd;
+  if (fifopath)
+    g_make_rfd_owned = g_make_wfd_owned = true;
+  trace("using %s", g_make_desc);
+  return;
+
+unavailable:
+  if (fifopath) {
+    if (rfd > -1) close(rfd);
+    if (wfd > -1) close(wfd);
+  }
+  g_maxjobs = 1;
+}
+
+
+err_t jobserver_init(memalloc_t ma) {
+  err_t err;
+  g_ma = ma;
+  if (( err = mutex_init(&g_mu) ))
+    return err;
+  if (( err = mutex_init(&g_readmu) ))
+    goto error1;
+  if (( err = sema_init(&g_sema, 0) ))
+    goto error2;
+  connect_make_jobserver();
+  return 0;
+error2:
+  mutex_dispose(&g_readmu);
+error1:
+  mutex_dispose(&g_mu);
+  return err;
+}
+
+
+void jobserver_detach() {
+  mutex_lock(&g_mu);
+  assertf(g_nrunning == 0, "jobserver_detach called with jobs running");
+  // close file descriptions we opened (but not those inherited from make)
+  if (g_make_rfd_owned)
+    close(g_make_rfd);
+  if (g_make_wfd_owned)
+    close(g_make_wfd);
+  g_make_rfd = -1;
+  g_make_wfd = -1;
+  g_make_rfd_owned = false;
+  g_make_wfd_owned = false;
+  g_maxjobs = 0;
+  g_detached = true;
+  mutex_unlock(&g_mu);
+}
+
+
+void jobserver_reattach() {
+  mutex_lock(&g_mu);
+  assertf(g_nrunning == 0, "jobserver_reattach called with jobs running");
+  if (g_detached) {
+    g_detached = false;
+    connect_make_jobserver();
+  }
+  mutex_unlock(&g_mu);
+}
+
+
+void jobserver_describe(char* buf, usize bufcap) {
+  if (g_make_wfd > -1) {
+    snprintf(buf, bufcap, "%s", g_make_desc);
+  } else {
+    snprintf(buf, bufcap, "internal (max %u jobs)", g_maxjobs ? g_maxjobs : comaxproc);
+  }
+}
+
+
+// release_token returns the concurrency held by job. Must hold g_mu.
+static void release_token(job_t* job) {
+  if (job->token == TOKEN_IMPLICIT) {
+    g_implicit_used = false;
+  } else if (job->token >= 0) {
+    u8 b = (u8)job->token;
+    while (write(g_make_wfd, &b, 1) == -1 && errno == EINTR) {}
+  }
+  job->token = TOKEN_NONE;
+  assert(g_nrunning > 0);
+  g_nrunning--;
+}
+
+
+// poll_exited reaps running processes which have exited, releasing their
+// tokens as early as possible. Must hold g_mu.
+static void poll_exited() {
+  for (u32 i = 0; i < g_jobcap; i++) {
+    job_t* job = &g_jobv[i];
+    if (job->state != JOB_RUNNING)
+      continue;
+    int status;
+    pid_t pid = waitpid(job->pid, &status, WNOHANG);
+    if (pid == 0)
+      continue;
+    if (pid == -1) {
+      if (errno == EINTR)
+        continue;
+      status = -1;
+    }
+    trace("job %u (proc[%d]) exited", i + 1, job->pid);
+    job->state = JOB_EXITED;
+    job->status = status;
+    release_token(job);
+    sema_signal(&g_sema, 1);
+  }
+}
+
+
+// alloc_job reserves a job slot. Must hold g_mu.
+static u32 alloc_job() {
+  for (u32 i = 0; i < g_jobcap; i++) {
+    if (g_jobv[i].state == JOB_FREE) {
+      g_jobv[i].state = JOB_RESERVED;
+      return i + 1;
+    }
+  }
+  u32 newcap = MAX(8u, g_jobcap * 2);
+  job_t* v = mem_resizev(g_ma, g_jobv, g_jobcap, newcap, sizeof(job_t));
+  if (!v)
+    panic("out of memory");
+  g_jobv = v;
+  u32 i = g_jobcap;
+  g_jobcap = newcap;
+  g_jobv[i].state = JOB_RESERVED;
+  return i + 1;
+}
+
+
+// read_make_token attempts to read a token from make's jobserver.
+// Returns -1 on timeout.
+static int read_make_token() {
+  int token = -1;
+  mutex_lock(&g_readmu);
+  struct pollfd pfd = { .fd = g_make_rfd, .events = POLLIN };
+  if (poll(&pfd, 1, POLL_TIMEOUT_MS) > 0) {
+    // Note: if g_make_rfd is blocking (no /proc) this may block until
+    // another client returns a token.
+    u8 b;
+    if (read(g_make_rfd, &b, 1) == 1)
+      token = b;
+  }
+  mutex_unlock(&g_readmu);
+  return token;
+}
+
+
+u32 jobserver_acquire() {
+  u32 jobid;
+
+  // wait for a local slot (bounded by comaxproc)
+  mutex_lock(&g_mu);
+  for (;;) {
+    u32 maxjobs = g_maxjobs ? g_maxjobs : comaxproc;
+    if (g_nrunning < maxjobs)
+      break;
+    poll_exited();
+    if (g_nrunning < maxjobs)
+      break;
+    trace("saturated (%u jobs); waiting", g_nrunning);
+    mutex_unlock(&g_mu);
+    sema_timedwait(&g_sema, WAIT_TIMEOUT_US);
+    mutex_lock(&g_mu);
+  }
+  g_nrunning++;
+  jobid = alloc_job();
+  job_t* job = &g_jobv[jobid - 1];
+  job->token = TOKEN_NONE;
+
+  // when using a make jobserver, acquire a token
+  while (g_make_wfd > -1) {
+    if (!g_implicit_used) {
+      g_implicit_used = true;
+      g_jobv[jobid - 1].token = TOKEN_IMPLICIT;
+      break;
+    }
+    mutex_unlock(&g_mu);
+    int token = read_make_token();
+    mutex_lock(&g_mu);
+    if (token > -1) {
+      g_jobv[jobid - 1].token = (i16)token;
+      break;
+    }
+    poll_exited();
+  }
+
+  mutex_unlock(&g_mu);
+  trace("job %u acquired", jobid);
+  return jobid;
+}
+
+
+void jobserver_start(u32 jobid, pid_t pid) {
+  mutex_lock(&g_mu);
+  assert(jobid > 0 && jobid <= g_jobcap);
+  job_t* job = &g_jobv[jobid - 1];
+  assert(job->state == JOB_RESERVED);
+  job->state = JOB_RUNNING;
+  job->pid = pid;
+  mutex_unlock(&g_mu);
+}
+
+
+void jobserver_release(u32 jobid) {
+  mutex_lock(&g_mu);
+  assert(jobid > 0 && jobid <= g_jobcap);
+  job_t* job = &g_jobv[jobid - 1];
+  assert(job->state == JOB_RESERVED);
+  release_token(job);
+  job->state = JOB_FREE;
+  mutex_unlock(&g_mu);
+  sema_signal(&g_sema, 1);
+}
+
+
+int jobserver_wait(u32 jobid, int* status_out) {
+  mutex_lock(&g_mu);
+  assert(jobid > 0 && jobid <= g_jobcap);
+  job_t* job = &g_jobv[jobid - 1];
+
+  if (job->state == JOB_EXITED) {
+    // already reaped by poll_exited
+    int status = job->status;
+    job->state = JOB_FREE;
+    mutex_unlock(&g_mu);
+    if (status == -1) {
+      errno = ECHILD;
+      return -1;
+    }
+    *status_out = status;
+    return 0;
+  }
+
+  assert(job->state == JOB_RUNNING);
+  job->state = JOB_AWAITING; // keep poll_exited away
+  pid_t pid = job->pid;
+  mutex_unlock(&g_mu);
+
+  int result;
+  while ((result = waitpid(pid, status_out, 0)) == -1 && errno == EINTR) {}
+  int errnoval = errno;
+
+  mutex_lock(&g_mu);
+  job = &g_jobv[jobid - 1]; // g_jobv may have been reallocated
+  release_token(job);
+  job->state = JOB_FREE;
+  mutex_unlock(&g_mu);
+  sema_signal(&g_sema, 1);
+
+  trace("job %u (proc[%d]) released", jobid, pid);
+  errno = errnoval;
+  return result == -1 ? -1 : 0;
+}
+
+
+#ifdef CO_ENABLE_TESTS
+UNITTEST_DEF(jobserver_parse_makeflags) {
+  int rfd, wfd;
+  const char* fifopath;
+  usize fifopathlen;
+  #define PARSE(flags) \
+    jobserver_parse_makeflags((flags), &rfd, &wfd, &fifopath, &fifopathlen)
+
+  assert(PARSE("") == ErrNotFound);
+  assert(PARSE("s -j") == ErrNotFound);
+  assert(PARSE(" -- --jobserver-auth=3,4") == ErrNotFound);
+
+  assert(PARSE(" -j4 --jobserver-auth=3,4") == 0);
+  assert(rfd == 3 && wfd == 4 && fifopath == NULL);
+
+  // older make
+  assert(PARSE("--jobserver-fds=5,6 -j") == 0);
+  assert(rfd == 5 && wfd == 6 && fifopath == NULL);
+
+  // last one wins
+  assert(PARSE("-j --jobserver-auth=3,4 --jobserver-auth=7,8 -- X=1") == 0);
+  assert(rfd == 7 && wfd == 8);
+
+  // make >=4.4
+  assert(PARSE("-j8 --jobserver-auth=fifo:/tmp/GMfifo123 -- X=1") == 0);
+  assert(fifopath != NULL);
+  assert(fifopathlen == strlen("/tmp/GMfifo123"));
+  assert(memcmp(fifopath, "/tmp/GMfifo123", fifopathlen) == 0);
+
+  assert(PARSE("--jobserver-auth=3") == ErrInvalid);
+  assert(PARSE("--jobserver-auth=3,x") == ErrInvalid);
+
+  #undef PARSE
+}
+#endif // CO_ENABLE_TESTS
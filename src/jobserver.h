@@ -0,0 +1,57 @@
+// process-wide job scheduler for subprocesses
+// SPDX-License-Identifier: Apache-2.0
+//
+// All subprocesses (see subproc.h) are started via a job slot. The number of
+// concurrently running jobs is capped by comaxproc (-j, COMAXPROC).
+//
+// When compis is invoked by GNU make with a jobserver (MAKEFLAGS contains
+// --jobserver-auth=R,W, --jobserver-fds=R,W or --jobserver-auth=fifo:PATH)
+// we act as a jobserver client: every job but the first one must hold a token
+// read from make's jobserver, which is written back when the job has exited.
+// This way a recursive make → compis build shares one pool of tokens.
+//
+#pragma once
+ASSUME_NONNULL_BEGIN
+
+// jobserver_init initializes the job scheduler and, unless disabled by
+// jobserver_detach, connects to a GNU make jobserver found in MAKEFLAGS.
+// Must be called once before any other jobserver function.
+err_t jobserver_init(memalloc_t ma);
+
+// jobserver_detach stops using any inherited GNU make jobserver.
+// Used when the user explicitly asks for a parallelism level with -j.
+void jobserver_detach();
+
+// jobserver_reattach undoes jobserver_detach, connecting to the GNU make
+// jobserver in MAKEFLAGS again, if any. Used by "compis serve" between builds.
+void jobserver_reattach();
+
+// jobserver_acquire blocks until a job can be started.
+// Returns a job id (>0) which must be passed to either
+// jobserver_start (process was started) or jobserver_release (it was not.)
+u32 jobserver_acquire();
+
+// jobserver_start associates a started process with a job
+void jobserver_start(u32 job, pid_t pid);
+
+// jobserver_release gives back a job which never started a process
+void jobserver_release(u32 job);
+
+// jobserver_wait waits for the job's process to exit (like waitpid),
+// stores its status in status_out and releases the job.
+// Returns -1 and sets errno on failure.
+int jobserver_wait(u32 job, int* status_out);
+
+// jobserver_describe writes a human-readable description of the jobserver
+// configuration to buf, e.g. "make (fifo:/tmp/GMfifo123)" or "internal"
+void jobserver_describe(char* buf, usize bufcap);
+
+// jobserver_parse_makeflags parses a MAKEFLAGS value.
+// On success, either *rfd and *wfd are set (pipe form) or *fifopath is set
+// to a pointer into makeflags and *fifopathlen to its length (fifo form.)
+// Returns ErrNotFound if makeflags does not mention a jobserver.
+err_t jobserver_parse_makeflags(
+  const char* makeflags, int* rfd, int* wfd,
+  const char* nullable* fifopath, usize* fifopathlen);
+
+ASSUME_NONNULL_END
@@ -36,12 +36,13 @@ static err_t select_target_machine(
   LLVMCodeModel         codeModel,
   LLVMTargetMachineRef* resultp)
 {
-  // select host CPU and features (NOT PORTABLE!) when optimizing
+  // select host CPU and features (NOT PORTABLE!) when optimizing for the host.
+  // When cross compiling, use generic CPU and features.
   const char* CPU = "";      // "" for generic
   const char* features = ""; // "" for none
   char* hostCPUName = NULL; // needs LLVMDisposeMessage
   char* hostFeatures = NULL; // needs LLVMDisposeMessage
-  if (optLevel != LLVMCodeGenLevelNone && strcmp(triple, llvm_host_triple())) {
+  if (optLevel != LLVMCodeGenLevelNone && strcmp(triple, llvm_host_triple()) == 0) {
     hostCPUName = LLVMGetHostCPUName();
     hostFeatures = LLVMGetHostCPUFeatures();
     CPU = hostCPUName;
@@ -49,7 +50,7 @@ static err_t select_target_machine(
   }
 
   LLVMTargetMachineRef tm = LLVMCreateTargetMachine(
-    target, triple, CPU, features, optLevel, LLVMRelocStatic, codeModel);
+    target, triple, CPU, features, optLevel, LLVMRelocPIC, codeModel);
   if (!tm) {
     dlog("LLVMCreateTargetMachine failed");
     return ErrNotSupported;
@@ -93,6 +94,8 @@ void llvm_module_dispose(CoLLVMModule* m) {
     return;
   LLVMModuleRef mod = m->M;
   LLVMContextRef ctx = LLVMGetModuleContext(mod);
+  if (m->TM)
+    LLVMDisposeTargetMachine(m->TM);
   LLVMDisposeModule(mod);
   LLVMContextDispose(ctx);
   memset(m, 0, sizeof(*m));
@@ -135,6 +138,7 @@ err_t llvm_module_set_target(CoLLVMModule* m, const char* triple) {
   LLVMSetTarget(mod, triple);
   LLVMTargetDataRef dataLayout = LLVMCreateTargetDataLayout(targetm);
   LLVMSetModuleDataLayout(mod, assertnotnull(dataLayout));
+  LLVMDisposeTargetData(dataLayout); // module has a copy
 
   m->TM = targetm;
   return 0;
@@ -351,6 +351,23 @@ EXTERN_C err_t llvm_module_write(
 EXTERN_C err_t llvm_module_emit(
   CoLLVMModule*, const char* filename, CoLLVMEmitType, CoLLVMEmitFlags);
 
+// —————————————————————————————————————————————————————————————————————————————————————
+// IR generator (llvmgen.c)
+
+typedef struct compiler_ compiler_t;
+typedef struct pkg_      pkg_t;
+typedef struct node_     node_t;
+
+#define LLVMGEN_EXE (1u << 0) // generate C ABI "main" for main.main
+
+// llvm_gen_unit generates IR for a typechecked unit (NODE_UNIT) into m.
+// ast_ma is the allocator of the unit's AST, used for data stored in AST nodes.
+// Returns ErrNotSupported if the unit uses language features which the IR
+// generator does not handle; the unit should then be compiled via cgen.
+EXTERN_C err_t llvm_gen_unit(
+  CoLLVMModule* m, compiler_t* c, memalloc_t ast_ma,
+  const pkg_t* pkg, node_t* unit, u32 flags);
+
 // —————————————————————————————————————————————————————————————————————————————————————
 // utils
 
@@ -0,0 +1,869 @@
+// LLVM IR generator
+// SPDX-License-Identifier: Apache-2.0
+//
+// Generates LLVM IR directly from a typechecked AST, bypassing C code
+// generation and the clang subprocess. Only a subset of the language is
+// supported: functions on primitive types, locals, arithmetic, calls and
+// control flow. Units using anything else are rejected with ErrNotSupported
+// and the caller falls back to cgen.
+//
+#include "llvmimpl.h"
+#include "../compiler.h"
+
+
+#define trace(fmt, va...) _trace(opt_trace_cgen, 3, "llvmgen", fmt, ##va)
+
+
+typedef struct {
+  compiler_t*    c;
+  const pkg_t*   pkg;
+  memalloc_t     ma;
+  memalloc_t     ast_ma;
+  u32            flags;
+  err_t          err;
+  LLVMContextRef ctx;
+  LLVMModuleRef  mod;
+  LLVMBuilderRef b;
+  LLVMBuilderRef allocab; // builder for allocas in entry block
+  LLVMValueRef   fn;      // current function
+  map_t          locals;  // local_t* => LLVMValueRef (alloca)
+  const fun_t* nullable mainfun;
+} gen_t;
+
+
+static LLVMValueRef gen_expr(gen_t* g, const expr_t* n);
+static LLVMValueRef gen_block(gen_t* g, const block_t* n);
+
+
+static void seterr(gen_t* g, err_t err) {
+  if (!g->err)
+    g->err = err;
+}
+
+
+static void notsupported(gen_t* g, const void* n) {
+  trace("unsupported %s %s", nodekind_name(((node_t*)n)->kind), fmtnode(0, n));
+  seterr(g, ErrNotSupported);
+}
+
+
+static const type_t* unwrap_alias(const type_t* t) {
+  while (t->kind == TYPE_ALIAS)
+    t = assertnotnull(((aliastype_t*)t)->elem);
+  return t;
+}
+
+
+// basetype returns the primitive type of t with int and uint resolved
+static const type_t* basetype(gen_t* g, const type_t* t) {
+  return canonical_primtype(g->c, unwrap_alias(t));
+}
+
+
+static bool is_supported_type(const type_t* t) {
+  t = unwrap_alias(t);
+  return type_isprim(t) && t->kind != TYPE_ANY && t->kind != TYPE_UNKNOWN;
+}
+
+
+static bool is_float(gen_t* g, const type_t* t) {
+  t = basetype(g, t);
+  return t->kind == TYPE_F32 || t->kind == TYPE_F64;
+}
+
+
+static LLVMTypeRef gen_type(gen_t* g, const type_t* t) {
+  const type_t* bt = basetype(g, t);
+  switch (bt->kind) {
+    case TYPE_VOID: return LLVMVoidTypeInContext(g->ctx);
+    case TYPE_BOOL: return LLVMInt1TypeInContext(g->ctx);
+    case TYPE_I8:
+    case TYPE_U8:   return LLVMInt8TypeInContext(g->ctx);
+    case TYPE_I16:
+    case TYPE_U16:  return LLVMInt16TypeInContext(g->ctx);
+    case TYPE_I32:
+    case TYPE_U32:  return LLVMInt32TypeInContext(g->ctx);
+    case TYPE_I64:
+    case TYPE_U64:  return LLVMInt64TypeInContext(g->ctx);
+    case TYPE_F32:  return LLVMFloatTypeInContext(g->ctx);
+    case TYPE_F64:  return LLVMDoubleTypeInContext(g->ctx);
+  }
+  notsupported(g, t);
+  return LLVMInt8TypeInContext(g->ctx);
+}
+
+
+// extattr returns the C ABI extension attribute ("zeroext" or "signext") for
+// values of type t passed to or returned from functions, or NULL if none.
+static const char* nullable extattr(gen_t* g, const type_t* t) {
+  switch (basetype(g, t)->kind) {
+    case TYPE_BOOL:
+    case TYPE_U8:
+    case TYPE_U16: return "zeroext";
+    case TYPE_I8:
+    case TYPE_I16: return "signext";
+  }
+  return NULL;
+}
+
+
+static LLVMAttributeRef enumattr(gen_t* g, const char* name) {
+  u32 kind = LLVMGetEnumAttributeKindForName(name, strlen(name));
+  return LLVMCreateEnumAttribute(g->ctx, kind, 0);
+}
+
+
+static bool is_terminated(gen_t* g) {
+  return LLVMGetBasicBlockTerminator(LLVMGetInsertBlock(g->b)) != NULL;
+}
+
+
+// ensure_block makes sure the builder is positioned in a block which has
+// not been terminated, e.g. for code following a "return"
+static void ensure_block(gen_t* g) {
+  if (is_terminated(g)) {
+    LLVMBasicBlockRef bb = LLVMAppendBasicBlockInContext(g->ctx, g->fn, "dead");
+    LLVMPositionBuilderAtEnd(g->b, bb);
+  }
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// functions
+
+
+static LLVMTypeRef gen_funtype(gen_t* g, const funtype_t* ft) {
+  LLVMTypeRef paramsv[16];
+  if (ft->params.len > countof(paramsv)) {
+    notsupported(g, ft);
+    return LLVMFunctionType(LLVMVoidTypeInContext(g->ctx), NULL, 0, false);
+  }
+  for (u32 i = 0; i < ft->params.len; i++) {
+    const local_t* param = (local_t*)ft->params.v[i];
+    if (!is_supported_type(param->type) || param->type->kind == TYPE_VOID)
+      notsupported(g, param);
+    paramsv[i] = gen_type(g, param->type);
+  }
+  if (!is_supported_type(ft->result))
+    notsupported(g, ft->result);
+  LLVMTypeRef result = gen_type(g, ft->result);
+  return LLVMFunctionType(result, paramsv, ft->params.len, /*isvararg*/false);
+}
+
+
+static const char* fun_name(gen_t* g, fun_t* fn) {
+  if (fn->mangledname)
+    return fn->mangledname;
+  buf_t* buf = tmpbuf_get(0);
+  if (compiler_mangle(g->c, g->pkg, buf, (node_t*)fn)) {
+    // note: fn is shared with other units, so allocate in AST memory
+    if (( fn->mangledname = mem_strdup(g->ast_ma, buf_slice(*buf), 0) ))
+      return fn->mangledname;
+  }
+  seterr(g, ErrNoMem);
+  return "";
+}
+
+
+// get_fun returns the LLVM function for fn, declaring it if needed
+static LLVMValueRef get_fun(gen_t* g, fun_t* fn) {
+  const char* name = fun_name(g, fn);
+  LLVMValueRef f = LLVMGetNamedFunction(g->mod, name);
+  if (f)
+    return f;
+
+  const funtype_t* ft = (funtype_t*)fn->type;
+  f = LLVMAddFunction(g->mod, name, gen_funtype(g, ft));
+
+  switch (fn->flags & NF_VIS_MASK) {
+    case NF_VIS_UNIT:
+      if (fn->body)
+        LLVMSetLinkage(f, LLVMInternalLinkage);
+      break;
+    case NF_VIS_PKG:
+      // __attribute__((visibility("internal"))) in C
+      LLVMSetVisibility(f, LLVMHiddenVisibility);
+      break;
+    case NF_VIS_PUB:
+      break;
+  }
+
+  LLVMAddAttributeAtIndex(f, LLVMAttributeFunctionIndex, enumattr(g, "nounwind"));
+  const char* attr = extattr(g, ft->result);
+  if (attr)
+    LLVMAddAttributeAtIndex(f, LLVMAttributeReturnIndex, enumattr(g, attr));
+  for (u32 i = 0; i < ft->params.len; i++) {
+    const local_t* param = (local_t*)ft->params.v[i];
+    if (( attr = extattr(g, param->type) ))
+      LLVMAddAttributeAtIndex(f, i + 1, enumattr(g, attr));
+    if (param->name && param->name != sym__)
+      LLVMSetValueName2(LLVMGetParam(f, i), param->name, strlen(param->name));
+  }
+
+  return f;
+}
+
+
+static LLVMValueRef gen_alloca(gen_t* g, const local_t* n) {
+  LLVMBasicBlockRef entry = LLVMGetEntryBasicBlock(g->fn);
+  LLVMValueRef first = LLVMGetFirstInstruction(entry);
+  if (first) {
+    LLVMPositionBuilderBefore(g->allocab, first);
+  } else {
+    LLVMPositionBuilderAtEnd(g->allocab, entry);
+  }
+  const char* name = (n->name && n->name != sym__) ? n->name : "";
+  LLVMValueRef ptr = LLVMBuildAlloca(g->allocab, gen_type(g, n->type), name);
+  void** vp = map_assign_ptr(&g->locals, g->ma, n);
+  if (!vp) {
+    seterr(g, ErrNoMem);
+  } else {
+    *vp = ptr;
+  }
+  return ptr;
+}
+
+
+static void gen_fun_def(gen_t* g, fun_t* fn) {
+  const funtype_t* ft = (funtype_t*)fn->type;
+  trace("fun %s", fmtnode(0, fn));
+
+  if (fn->name == sym_main)
+    g->mainfun = fn;
+
+  g->fn = get_fun(g, fn);
+  if (g->err)
+    return;
+  map_clear(&g->locals);
+
+  LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(g->ctx, g->fn, "entry");
+  LLVMPositionBuilderAtEnd(g->b, entry);
+
+  // spill parameters to the stack; mem2reg will undo this when optimizing
+  for (u32 i = 0; i < fn->params.len; i++) {
+    const local_t* param = (local_t*)fn->params.v[i];
+    LLVMValueRef ptr = gen_alloca(g, param);
+    LLVMBuildStore(g->b, LLVMGetParam(g->fn, i), ptr);
+  }
+
+  // note: typecheck converts the last expression of a non-void function
+  // into a "return" expression, so there's no result to handle here
+  gen_block(g, assertnotnull(fn->body));
+
+  if (!is_terminated(g)) {
+    if (basetype(g, ft->result)->kind == TYPE_VOID) {
+      LLVMBuildRetVoid(g->b);
+    } else {
+      LLVMBuildUnreachable(g->b);
+    }
+  }
+}
+
+
+// gen_main generates "int main(int argc, char* argv[])" which calls mainfun
+static void gen_main(gen_t* g) {
+  LLVMTypeRef i32 = LLVMInt32TypeInContext(g->ctx);
+  LLVMTypeRef paramsv[2] = { i32, CoLLVMOpaquePointerType(g->ctx, 0) };
+  LLVMTypeRef ft = LLVMFunctionType(i32, paramsv, 2, false);
+  LLVMValueRef f = LLVMAddFunction(g->mod, "main", ft);
+  LLVMPositionBuilderAtEnd(g->b, LLVMAppendBasicBlockInContext(g->ctx, f, "entry"));
+  LLVMValueRef mainfun = get_fun(g, (fun_t*)g->mainfun);
+  LLVMBuildCall2(g->b, LLVMGlobalGetValueType(mainfun), mainfun, NULL, 0, "");
+  LLVMBuildRet(g->b, LLVMConstInt(i32, 0, false));
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// expressions
+
+
+static LLVMValueRef zeroval(gen_t* g, const type_t* t) {
+  return LLVMConstNull(gen_type(g, t));
+}
+
+
+static LLVMValueRef local_ptr(gen_t* g, const node_t* ref) {
+  void** vp = map_lookup_ptr(&g->locals, ref);
+  if (vp)
+    return *vp;
+  // e.g. global variable
+  notsupported(g, ref);
+  return NULL;
+}
+
+
+// lvalue_ptr returns the stack address of an assignable expression
+static LLVMValueRef lvalue_ptr(gen_t* g, const expr_t* n) {
+  if (n->kind == EXPR_ID)
+    return local_ptr(g, assertnotnull(((idexpr_t*)n)->ref));
+  notsupported(g, n);
+  return NULL;
+}
+
+
+static LLVMValueRef gen_local(gen_t* g, const local_t* n) {
+  if (!is_supported_type(n->type) || n->type->kind == TYPE_VOID) {
+    notsupported(g, n);
+    return NULL;
+  }
+  LLVMValueRef init = n->init ? gen_expr(g, n->init) : zeroval(g, n->type);
+  if (g->err)
+    return NULL;
+  LLVMValueRef ptr = gen_alloca(g, n);
+  LLVMBuildStore(g->b, init, ptr);
+  return init;
+}
+
+
+// is_smallint returns true for integer types narrower than C's int
+static bool is_smallint(gen_t* g, const type_t* t) {
+  switch (basetype(g, t)->kind) {
+    case TYPE_I8:
+    case TYPE_U8:
+    case TYPE_I16:
+    case TYPE_U16: return true;
+  }
+  return false;
+}
+
+
+// promote extends a value of small integer type t to i32, like C does
+static LLVMValueRef promote(gen_t* g, const type_t* t, LLVMValueRef v) {
+  bool issigned = !type_isunsigned(basetype(g, t));
+  return LLVMBuildIntCast2(g->b, v, LLVMInt32TypeInContext(g->ctx), issigned, "");
+}
+
+
+static LLVMValueRef gen_idexpr(gen_t* g, const idexpr_t* n) {
+  LLVMValueRef ptr = local_ptr(g, assertnotnull(n->ref));
+  if (!ptr)
+    return NULL;
+  return LLVMBuildLoad2(g->b, gen_type(g, n->type), ptr, "");
+}
+
+
+static LLVMValueRef gen_arith1(
+  gen_t* g, op_t op, const type_t* t, LLVMValueRef x, LLVMValueRef y)
+{
+  bool isfloat = is_float(g, t);
+  bool issigned = !type_isunsigned(basetype(g, t));
+  switch (op) {
+    case OP_ADD_ASSIGN:
+    case OP_ADD: return isfloat ? LLVMBuildFAdd(g->b, x, y, "") : LLVMBuildAdd(g->b, x, y, "");
+    case OP_SUB_ASSIGN:
+    case OP_SUB: return isfloat ? LLVMBuildFSub(g->b, x, y, "") : LLVMBuildSub(g->b, x, y, "");
+    case OP_MUL_ASSIGN:
+    case OP_MUL: return isfloat ? LLVMBuildFMul(g->b, x, y, "") : LLVMBuildMul(g->b, x, y, "");
+    case OP_DIV_ASSIGN:
+    case OP_DIV:
+      if (isfloat) return LLVMBuildFDiv(g->b, x, y, "");
+      return issigned ? LLVMBuildSDiv(g->b, x, y, "") : LLVMBuildUDiv(g->b, x, y, "");
+    case OP_MOD_ASSIGN:
+    case OP_MOD:
+      if (isfloat) return LLVMBuildFRem(g->b, x, y, "");
+      return issigned ? LLVMBuildSRem(g->b, x, y, "") : LLVMBuildURem(g->b, x, y, "");
+    case OP_AND_ASSIGN:
+    case OP_AND: if (isfloat) break; return LLVMBuildAnd(g->b, x, y, "");
+    case OP_OR_ASSIGN:
+    case OP_OR:  if (isfloat) break; return LLVMBuildOr(g->b, x, y, "");
+    case OP_XOR_ASSIGN:
+    case OP_XOR: if (isfloat) break; return LLVMBuildXor(g->b, x, y, "");
+    case OP_SHL_ASSIGN:
+    case OP_SHL: if (isfloat) break; return LLVMBuildShl(g->b, x, y, "");
+    case OP_SHR_ASSIGN:
+    case OP_SHR:
+      if (isfloat) break;
+      return issigned ? LLVMBuildAShr(g->b, x, y, "") : LLVMBuildLShr(g->b, x, y, "");
+  }
+  seterr(g, ErrNotSupported);
+  return NULL;
+}
+
+
+// gen_arith generates "x op y". Like in C, integers narrower than 32 bits are
+// extended to i32, operated on and truncated, which e.g. makes i8 -128/-1 defined.
+static LLVMValueRef gen_arith(
+  gen_t* g, op_t op, const type_t* t, LLVMValueRef x, LLVMValueRef y)
+{
+  if (!is_smallint(g, t))
+    return gen_arith1(g, op, t, x, y);
+  x = promote(g, t, x);
+  y = promote(g, t, y);
+  LLVMValueRef v = gen_arith1(g, op, t, x, y);
+  if (!v)
+    return NULL;
+  return LLVMBuildTrunc(g->b, v, gen_type(g, t), "");
+}
+
+
+static LLVMValueRef gen_cmp(
+  gen_t* g, op_t op, const type_t* t, LLVMValueRef x, LLVMValueRef y)
+{
+  if (is_smallint(g, t)) {
+    x = promote(g, t, x);
+    y = promote(g, t, y);
+  }
+  if (is_float(g, t)) {
+    LLVMRealPredicate pred;
+    switch (op) {
+      case OP_EQ:   pred = LLVMRealOEQ; break;
+      case OP_NEQ:  pred = LLVMRealUNE; break;
+      case OP_LT:   pred = LLVMRealOLT; break;
+      case OP_GT:   pred = LLVMRealOGT; break;
+      case OP_LTEQ: pred = LLVMRealOLE; break;
+      case OP_GTEQ: pred = LLVMRealOGE; break;
+      default:
+        seterr(g, ErrNotSupported);
+        return NULL;
+    }
+    return LLVMBuildFCmp(g->b, pred, x, y, "");
+  }
+  bool issigned = !type_isunsigned(basetype(g, t)) && !type_isbool(basetype(g, t));
+  LLVMIntPredicate pred;
+  switch (op) {
+    case OP_EQ:   pred = LLVMIntEQ; break;
+    case OP_NEQ:  pred = LLVMIntNE; break;
+    case OP_LT:   pred = issigned ? LLVMIntSLT : LLVMIntULT; break;
+    case OP_GT:   pred = issigned ? LLVMIntSGT : LLVMIntUGT; break;
+    case OP_LTEQ: pred = issigned ? LLVMIntSLE : LLVMIntULE; break;
+    case OP_GTEQ: pred = issigned ? LLVMIntSGE : LLVMIntUGE; break;
+    default:
+      seterr(g, ErrNotSupported);
+      return NULL;
+  }
+  return LLVMBuildICmp(g->b, pred, x, y, "");
+}
+
+
+// gen_logical generates short-circuiting "x && y" or "x || y"
+static LLVMValueRef gen_logical(gen_t* g, const binop_t* n) {
+  LLVMValueRef x = gen_expr(g, n->left);
+  if (g->err)
+    return NULL;
+  bool isand = n->op == OP_LAND;
+  LLVMBasicBlockRef xbb = LLVMGetInsertBlock(g->b);
+  LLVMBasicBlockRef ybb = LLVMAppendBasicBlockInContext(
+    g->ctx, g->fn, isand ? "land.rhs" : "lor.rhs");
+  LLVMBasicBlockRef endbb = LLVMAppendBasicBlockInContext(
+    g->ctx, g->fn, isand ? "land.end" : "lor.end");
+  if (isand) {
+    LLVMBuildCondBr(g->b, x, ybb, endbb);
+  } else {
+    LLVMBuildCondBr(g->b, x, endbb, ybb);
+  }
+
+  LLVMPositionBuilderAtEnd(g->b, ybb);
+  LLVMValueRef y = gen_expr(g, n->right);
+  if (g->err)
+    return NULL;
+  ybb = LLVMGetInsertBlock(g->b);
+  LLVMBuildBr(g->b, endbb);
+
+  LLVMPositionBuilderAtEnd(g->b, endbb);
+  LLVMTypeRef booltype = LLVMInt1TypeInContext(g->ctx);
+  LLVMValueRef phi = LLVMBuildPhi(g->b, booltype, "");
+  LLVMValueRef valv[2] = { LLVMConstInt(booltype, !isand, false), y };
+  LLVMBasicBlockRef bbv[2] = { xbb, ybb };
+  LLVMAddIncoming(phi, valv, bbv, 2);
+  return phi;
+}
+
+
+static LLVMValueRef gen_binop(gen_t* g, const binop_t* n) {
+  if (n->op == OP_LAND || n->op == OP_LOR)
+    return gen_logical(g, n);
+  if (!is_supported_type(n->left->type)) {
+    notsupported(g, n);
+    return NULL;
+  }
+  LLVMValueRef x = gen_expr(g, n->left);
+  LLVMValueRef y = gen_expr(g, n->right);
+  if (g->err)
+    return NULL;
+  if (OP_EQ <= n->op && n->op <= OP_GTEQ)
+    return gen_cmp(g, n->op, n->left->type, x, y);
+  LLVMValueRef v = gen_arith(g, n->op, n->type, x, y);
+  if (!v)
+    notsupported(g, n);
+  return v;
+}
+
+
+static LLVMValueRef gen_assign(gen_t* g, const binop_t* n) {
+  if (n->flags & NF_DROP)
+    return notsupported(g, n), NULL;
+
+  // "_ = expr"
+  if (n->left->kind == EXPR_ID && ((idexpr_t*)n->left)->name == sym__)
+    return gen_expr(g, n->right);
+
+  LLVMValueRef ptr = lvalue_ptr(g, n->left);
+  LLVMValueRef v = gen_expr(g, n->right);
+  if (g->err)
+    return NULL;
+  if (n->op != OP_ASSIGN) {
+    LLVMValueRef curr = LLVMBuildLoad2(g->b, gen_type(g, n->left->type), ptr, "");
+    if (!( v = gen_arith(g, n->op, n->left->type, curr, v) ))
+      return notsupported(g, n), NULL;
+  }
+  LLVMBuildStore(g->b, v, ptr);
+  return v;
+}
+
+
+// gen_incdec generates "++x", "--x", "x++" or "x--"
+static LLVMValueRef gen_incdec(gen_t* g, const unaryop_t* n, bool isprefix) {
+  LLVMValueRef ptr = lvalue_ptr(g, n->expr);
+  if (g->err)
+    return NULL;
+  LLVMTypeRef t = gen_type(g, n->expr->type);
+  LLVMValueRef curr = LLVMBuildLoad2(g->b, t, ptr, "");
+  LLVMValueRef newval;
+  if (is_float(g, n->expr->type)) {
+    LLVMValueRef one = LLVMConstReal(t, 1.0);
+    newval = n->op == OP_INC ? LLVMBuildFAdd(g->b, curr, one, "")
+                             : LLVMBuildFSub(g->b, curr, one, "");
+  } else {
+    LLVMValueRef one = LLVMConstInt(t, 1, false);
+    newval = n->op == OP_INC ? LLVMBuildAdd(g->b, curr, one, "")
+                             : LLVMBuildSub(g->b, curr, one, "");
+  }
+  LLVMBuildStore(g->b, newval, ptr);
+  return isprefix ? newval : curr;
+}
+
+
+static LLVMValueRef gen_prefixop(gen_t* g, const unaryop_t* n) {
+  if (!is_supported_type(n->expr->type))
+    return notsupported(g, n), NULL;
+  if (n->op == OP_INC || n->op == OP_DEC)
+    return gen_incdec(g, n, /*isprefix*/true);
+
+  LLVMValueRef v = gen_expr(g, n->expr);
+  if (g->err)
+    return NULL;
+  switch (n->op) {
+    case OP_ADD:
+      return v;
+    case OP_SUB:
+      return is_float(g, n->type) ? LLVMBuildFNeg(g->b, v, "") : LLVMBuildNeg(g->b, v, "");
+    case OP_NOT:
+    case OP_INV:
+      if (!is_float(g, n->type))
+        return LLVMBuildNot(g->b, v, "");
+      break;
+  }
+  notsupported(g, n);
+  return NULL;
+}
+
+
+static LLVMValueRef gen_postfixop(gen_t* g, const unaryop_t* n) {
+  if (!is_supported_type(n->expr->type) || (n->op != OP_INC && n->op != OP_DEC))
+    return notsupported(g, n), NULL;
+  return gen_incdec(g, n, /*isprefix*/false);
+}
+
+
+static LLVMValueRef gen_cast(
+  gen_t* g, LLVMValueRef v, const type_t* srctype, const type_t* dsttype)
+{
+  const type_t* src = basetype(g, srctype);
+  const type_t* dst = basetype(g, dsttype);
+  LLVMTypeRef t = gen_type(g, dst);
+  if (src == dst)
+    return v;
+
+  bool srcfloat = src->kind == TYPE_F32 || src->kind == TYPE_F64;
+  bool dstfloat = dst->kind == TYPE_F32 || dst->kind == TYPE_F64;
+  bool srcsigned = !srcfloat && !type_isunsigned(src) && src->kind != TYPE_BOOL;
+
+  // (bool)x is x != 0, like in C
+  if (dst->kind == TYPE_BOOL) {
+    if (srcfloat)
+      return LLVMBuildFCmp(g->b, LLVMRealUNE, v, LLVMConstNull(LLVMTypeOf(v)), "");
+    return LLVMBuildICmp(g->b, LLVMIntNE, v, LLVMConstNull(LLVMTypeOf(v)), "");
+  }
+
+  if (srcfloat && dstfloat)
+    return LLVMBuildFPCast(g->b, v, t, "");
+  if (srcfloat) {
+    return type_isunsigned(dst) ? LLVMBuildFPToUI(g->b, v, t, "")
+                                : LLVMBuildFPToSI(g->b, v, t, "");
+  }
+  if (dstfloat) {
+    return srcsigned ? LLVMBuildSIToFP(g->b, v, t, "")
+                     : LLVMBuildUIToFP(g->b, v, t, "");
+  }
+  return LLVMBuildIntCast2(g->b, v, t, srcsigned, "");
+}
+
+
+static LLVMValueRef gen_typecons(gen_t* g, const typecons_t* n) {
+  if (!is_supported_type(n->type) || n->type->kind == TYPE_VOID)
+    return notsupported(g, n), NULL;
+  if (!n->expr)
+    return zeroval(g, n->type);
+  if (!is_supported_type(n->expr->type))
+    return notsupported(g, n), NULL;
+  LLVMValueRef v = gen_expr(g, n->expr);
+  if (g->err)
+    return NULL;
+  return gen_cast(g, v, n->expr->type, n->type);
+}
+
+
+static LLVMValueRef gen_call(gen_t* g, const call_t* n) {
+  fun_t* fn = NULL;
+  const expr_t* thisarg = NULL;
+
+  // resolve callee; only direct calls are supported
+  switch (n->recv->kind) {
+    case EXPR_ID:
+      fn = (fun_t*)((idexpr_t*)n->recv)->ref;
+      break;
+    case EXPR_MEMBER: {
+      const member_t* m = (member_t*)n->recv;
+      fn = (fun_t*)m->target;
+      if (fn && fn->kind == EXPR_FUN && funtype_hasthis((funtype_t*)fn->type)) {
+        thisarg = m->recv;
+      } else if (m->recv->type->kind != TYPE_NS) {
+        fn = NULL;
+      }
+      break;
+    }
+    case EXPR_FUN:
+      fn = (fun_t*)n->recv;
+      break;
+  }
+  if (!fn || fn->kind != EXPR_FUN || fn->is_builtin || (fn->flags & NF_TEMPLATE))
+    return notsupported(g, n), NULL;
+
+  const funtype_t* ft = (funtype_t*)fn->type;
+  u32 argc = (u32)!!thisarg + n->args.len;
+  LLVMValueRef argv[16];
+  if (argc > countof(argv) || argc != ft->params.len)
+    return notsupported(g, n), NULL;
+
+  // receiver passed by reference ("mut this" or a non-primitive type)
+  if (thisarg && !is_supported_type(((local_t*)ft->params.v[0])->type))
+    return notsupported(g, n), NULL;
+
+  u32 argi = 0;
+  if (thisarg)
+    argv[argi++] = gen_expr(g, thisarg);
+  for (u32 i = 0; i < n->args.len; i++) {
+    const expr_t* arg = (expr_t*)n->args.v[i];
+    if (arg->kind == EXPR_PARAM) // named argument
+      arg = assertnotnull(((local_t*)arg)->init);
+    argv[argi++] = gen_expr(g, arg);
+  }
+
+  LLVMValueRef f = get_fun(g, fn);
+  if (g->err)
+    return NULL;
+  LLVMValueRef call = LLVMBuildCall2(g->b, LLVMGlobalGetValueType(f), f, argv, argc, "");
+
+  // call-site ABI attributes must match those of the callee
+  const char* attr = extattr(g, ft->result);
+  if (attr)
+    LLVMAddCallSiteAttribute(call, LLVMAttributeReturnIndex, enumattr(g, attr));
+  for (u32 i = 0; i < ft->params.len; i++) {
+    if (( attr = extattr(g, ((local_t*)ft->params.v[i])->type) ))
+      LLVMAddCallSiteAttribute(call, i + 1, enumattr(g, attr));
+  }
+
+  return call;
+}
+
+
+static LLVMValueRef gen_retexpr(gen_t* g, const retexpr_t* n) {
+  if (n->value && basetype(g, n->value->type)->kind != TYPE_VOID) {
+    LLVMValueRef v = gen_expr(g, n->value);
+    if (g->err)
+      return NULL;
+    LLVMBuildRet(g->b, v);
+  } else {
+    if (n->value)
+      gen_expr(g, n->value);
+    LLVMBuildRetVoid(g->b);
+  }
+  return NULL;
+}
+
+
+static LLVMValueRef gen_ifexpr(gen_t* g, const ifexpr_t* n) {
+  // "if let x = y" and optional conditions are not supported
+  if (n->cond->kind == EXPR_LET || n->cond->kind == EXPR_VAR ||
+      basetype(g, n->cond->type)->kind != TYPE_BOOL)
+  {
+    return notsupported(g, n), NULL;
+  }
+
+  bool isrvalue = (n->flags & NF_RVALUE) && basetype(g, n->type)->kind != TYPE_VOID;
+  if (isrvalue && (!n->elseb || !is_supported_type(n->type)))
+    return notsupported(g, n), NULL;
+
+  LLVMValueRef cond = gen_expr(g, n->cond);
+  if (g->err)
+    return NULL;
+
+  LLVMBasicBlockRef thenbb = LLVMAppendBasicBlockInContext(g->ctx, g->fn, "if.then");
+  LLVMBasicBlockRef elsebb = NULL;
+  if (n->elseb)
+    elsebb = LLVMAppendBasicBlockInContext(g->ctx, g->fn, "if.else");
+  LLVMBasicBlockRef endbb = LLVMAppendBasicBlockInContext(g->ctx, g->fn, "if.end");
+  LLVMBuildCondBr(g->b, cond, thenbb, elsebb ? elsebb : endbb);
+
+  LLVMValueRef valv[2];
+  LLVMBasicBlockRef bbv[2];
+  u32 nincoming = 0;
+
+  LLVMPositionBuilderAtEnd(g->b, thenbb);
+  LLVMValueRef v = gen_block(g, n->thenb);
+  if (!is_terminated(g)) {
+    valv[nincoming] = v;
+    bbv[nincoming++] = LLVMGetInsertBlock(g->b);
+    LLVMBuildBr(g->b, endbb);
+  }
+
+  if (elsebb) {
+    LLVMPositionBuilderAtEnd(g->b, elsebb);
+    v = gen_block(g, n->elseb);
+    if (!is_terminated(g)) {
+      valv[nincoming] = v;
+      bbv[nincoming++] = LLVMGetInsertBlock(g->b);
+      LLVMBuildBr(g->b, endbb);
+    }
+  }
+
+  LLVMPositionBuilderAtEnd(g->b, endbb);
+  if (!isrvalue || g->err)
+    return NULL;
+  if (nincoming == 0) // both branches return
+    return LLVMGetUndef(gen_type(g, n->type));
+  LLVMValueRef phi = LLVMBuildPhi(g->b, gen_type(g, n->type), "");
+  LLVMAddIncoming(phi, valv, bbv, nincoming);
+  return phi;
+}
+
+
+static LLVMValueRef gen_block(gen_t* g, const block_t* n) {
+  if (n->drops.len > 0)
+    return notsupported(g, n), NULL;
+  LLVMValueRef v = NULL;
+  for (u32 i = 0; i < n->children.len && !g->err; i++) {
+    ensure_block(g);
+    v = gen_expr(g, (expr_t*)n->children.v[i]);
+  }
+  return v;
+}
+
+
+static LLVMValueRef gen_expr(gen_t* g, const expr_t* n) {
+  if (g->err)
+    return NULL;
+  switch ((enum nodekind)n->kind) {
+    case EXPR_BOOLLIT:
+    case EXPR_INTLIT:
+      if (!is_supported_type(n->type) || is_float(g, n->type))
+        break;
+      return LLVMConstInt(gen_type(g, n->type), ((intlit_t*)n)->intval, false);
+    case EXPR_FLOATLIT:
+      if (!is_float(g, n->type))
+        break;
+      return LLVMConstReal(gen_type(g, n->type), ((floatlit_t*)n)->f64val);
+    case EXPR_ID:        return gen_idexpr(g, (idexpr_t*)n);
+    case EXPR_LET:
+    case EXPR_VAR:       return gen_local(g, (local_t*)n);
+    case EXPR_BINOP:     return gen_binop(g, (binop_t*)n);
+    case EXPR_ASSIGN:    return gen_assign(g, (binop_t*)n);
+    case EXPR_PREFIXOP:  return gen_prefixop(g, (unaryop_t*)n);
+    case EXPR_POSTFIXOP: return gen_postfixop(g, (unaryop_t*)n);
+    case EXPR_TYPECONS:  return gen_typecons(g, (typecons_t*)n);
+    case EXPR_CALL:      return gen_call(g, (call_t*)n);
+    case EXPR_RETURN:    return gen_retexpr(g, (retexpr_t*)n);
+    case EXPR_IF:        return gen_ifexpr(g, (ifexpr_t*)n);
+    case EXPR_BLOCK:     return gen_block(g, (block_t*)n);
+    default:
+      break;
+  }
+  notsupported(g, n);
+  return NULL;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+
+
+static void gen_unit(gen_t* g, unit_t* unit) {
+  // check top-level definitions and declare functions before generating any
+  // function body, as a function may call another one defined after it
+  for (u32 i = 0; i < unit->children.len && !g->err; i++) {
+    node_t* n = unit->children.v[i];
+    switch (n->kind) {
+      case STMT_TYPEDEF:
+      case STMT_IMPORT:
+        // types have no representation of their own in IR
+        break;
+      case EXPR_FUN: {
+        fun_t* fn = (fun_t*)n;
+        if (fn->is_builtin || (fn->flags & NF_TEMPLATE))
+          return notsupported(g, n);
+        if (fn->body)
+          get_fun(g, fn);
+        break;
+      }
+      default:
+        return notsupported(g, n);
+    }
+  }
+
+  for (u32 i = 0; i < unit->children.len && !g->err; i++) {
+    fun_t* fn = (fun_t*)unit->children.v[i];
+    if (fn->kind == EXPR_FUN && fn->body)
+      gen_fun_def(g, fn);
+  }
+
+  if (g->mainfun && (g->flags & LLVMGEN_EXE) && !g->err)
+    gen_main(g);
+}
+
+
+err_t llvm_gen_unit(
+  CoLLVMModule* m, compiler_t* c, memalloc_t ast_ma,
+  const pkg_t* pkg, node_t* unit, u32 flags)
+{
+  assert(unit->kind == NODE_UNIT);
+  gen_t g = {
+    .c = c,
+    .pkg = pkg,
+    .ma = c->ma,
+    .ast_ma = ast_ma,
+    .flags = flags,
+    .mod = m->M,
+  };
+  g.ctx = LLVMGetModuleContext(g.mod);
+  if (!map_init(&g.locals, g.ma, 8))
+    return ErrNoMem;
+  g.b = LLVMCreateBuilderInContext(g.ctx);
+  g.allocab = LLVMCreateBuilderInContext(g.ctx);
+
+  gen_unit(&g, (unit_t*)unit);
+
+  #if DEBUG
+    if (!g.err) {
+      char* errmsg;
+      if (LLVMVerifyModule(g.mod, LLVMReturnStatusAction, &errmsg)) {
+        dlog("llvmgen produced invalid IR: %s", errmsg);
+        g.err = ErrInvalid;
+      }
+      LLVMDisposeMessage(errmsg);
+    }
+  #endif
+
+  LLVMDisposeBuilder(g.allocab);
+  LLVMDisposeBuilder(g.b);
+  map_dispose(&g.locals, g.ma);
+  return g.err;
+}
@@ -3,6 +3,7 @@
 #include "compiler.h"
 #include "path.h"
 #include "userconfig.h"
+#include "jobserver.h"
 #include "clang/Basic/Version.inc" // CLANG_VERSION_STRING
 
 #include <stdlib.h>
@@ -30,6 +31,7 @@ u32 comaxproc = 1;
 
 // externally-implemented tools
 int main_build(int argc, char* argv[]); // main_build.c
+int main_serve(int argc, char* argv[]); // main_serve.c
 int main_selftest(int argc, char* argv[]); // main_selftest.c
 int main_build_sysroot(int argc, char* argv[]); // main_build_sysroot.c
 int cc_main(int argc, char* argv[], bool iscxx); // cc.c
@@ -57,6 +59,7 @@ static int help() {
     "Usage: %s <command> [args ...]\n"
     "Commands:\n"
     "  build         Build a package\n"
+    "  serve         Run a compile server for faster repeated builds\n"
     "\n"
     "  ar            Archiver\n"
     "  cc            C compiler (clang)\n"
@@ -93,6 +96,7 @@ static int help() {
     "  COROOT    Bundled resources. Defaults to executable directory\n"
     "  COCACHE   Build cache. Defaults to ~/" COCACHE_DEFAULT "\n"
     "  COMAXPROC Parallelism limit. Defaults to number of CPUs (%u)\n"
+    "  COSERVE   Compile server socket. Defaults to $COCACHE/serve.sock\n"
     "\n",
     coprogname,
     sys_ncpu());
@@ -296,7 +300,10 @@ int main(int argc, char* argv[]) {
 
   // initialize global state
   memalloc_t ma = memalloc_ctx();
+  err_t err;
   comaxproc_init();
+  if (( err = jobserver_init(ma) ))
+    errx(1, "jobserver_init: %s", err_str(err));
   relpath_init();
   tmpbuf_init(ma);
   sym_init(ma);
@@ -305,13 +312,14 @@ int main(int argc, char* argv[]) {
   coroot_init(ma);
   copath_init(ma);
   cocachedir_init(ma);
-  err_t err = llvm_init();
+  err = llvm_init();
   if (err) errx(1, "llvm_init: %s", err_str(err));
 
   userconfig_load(argc, argv);
 
   // command dispatch
   if IS("build")                return main_build(argc, argv);
+  if IS("serve")                return main_serve(argc, argv);
   if IS("build-sysroot")        return main_build_sysroot(argc, argv);
   if IS("cc", "clang")          return cc_main(argc, argv, /*iscxx*/false);
   if IS("c++", "clang++")       return cc_main(argc, argv, /*iscxx*/true);
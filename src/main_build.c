@@ -3,15 +3,19 @@
 #include "path.h"
 #include "compiler.h"
 #include "subproc.h"
+#include "jobserver.h"
 #include "bgtask.h"
+#include "buildstats.h"
 #include "dirwalk.h"
 #include "thread.h"
 #include "threadpool.h"
+#include "timeline.h"
 #include "hash.h"
 #include "chan.h"
 #include "pkgbuild.h"
+#include "serve.h"
 
-#include <stdlib.h> // exit
+#include <stdlib.h> // strtoul
 #include <unistd.h> // getopt
 #include <string.h> // strdup
 #include <err.h>
@@ -33,8 +37,13 @@ static bool opt_genasm = false;
 static bool opt_nolink = false;
 static bool opt_nomain = false;
 static bool opt_nostdruntime = false;
+static bool opt_contenthash = false;
 static bool opt_version = false;
 static const char* opt_builddir = "build";
+static const char* opt_backend = "c";
+static bool opt_server = false;
+static const char* opt_tracejson = "";
+static bool opt_stats = false;
 #if DEBUG
   static bool opt_trace_all = false;
   bool opt_trace_scan = false;
@@ -61,12 +70,17 @@ static const char* opt_builddir = "build";
   /* advanced options (long form only) */ \
   LV(&opt_targetstr,    "target", "<target>", "Build for <target> instead of host")\
   LV(&opt_builddir,     "build-dir", "<dir>", "Use <dir> instead of ./build")\
+  LV(&opt_backend,      "backend", "<c|llvm>", "Code generator to use (default: c)")\
+  L( &opt_server,       "server",             "Build with a running \"compis serve\" process")\
+  LV(&opt_tracejson,    "trace-json", "<file>", "Write build timeline to <file> (Chrome trace)")\
+  L( &opt_stats,        "stats",              "Print time spent in compiler phases, and counters")\
   L( &opt_printast,     "print-ast",          "Print AST to stderr")\
   L( &opt_printir,      "print-ir",           "Print IR to stderr")\
   L( &opt_genirdot,     "write-ir-dot",       "Write IR as Graphviz .dot file to build dir")\
   L( &opt_nolink,       "no-link",            "Only compile, don't link")\
   L( &opt_nomain,       "no-main",            "Don't auto-generate C ABI \"main\" for main.main")\
   L( &opt_nostdruntime, "no-stdruntime",      "Don't automatically import std/runtime")\
+  L( &opt_contenthash,  "content-hash",       "Detect changed sources by content, not mtime")\
   L( &opt_version,      "version",            "Print Compis version on stdout and exit")\
   /* debug-only options */\
   DEBUG_L( &opt_trace_all,       "trace",           "Trace everything")\
@@ -82,6 +96,20 @@ static const char* opt_builddir = "build";
 
 #include "cliopt.inc.h"
 
+// RESIDENT_MAX_BUILDS limits the number of builds made with the same compiler
+// instance in resident mode, which bounds memory held by e.g. c->locmap
+#define RESIDENT_MAX_BUILDS 256
+
+// resident state, kept between builds made by main_build_resident
+static struct {
+  bool              hascompiler;
+  bool              threadpool_ready;
+  compiler_t        c;
+  compiler_config_t cfg;      // configuration of c (cfg.buildroot is c->buildroot)
+  u32               nbuilds;  // number of builds made with c
+} g_resident;
+
+
 static void help(const char* prog) {
   printf(
     "Compis " CO_VERSION_STR ", your friendly neighborhood compiler\n"
@@ -94,19 +122,24 @@ static void help(const char* prog) {
     coprogname, prog,
     coprogname, prog);
   cliopt_print();
-  exit(0);
 }
 
 
-static void set_comaxproc() {
+static bool set_comaxproc() {
   char* end;
+  errno = 0;
   unsigned long n = strtoul(opt_maxproc, &end, 10);
-  if (n == ULONG_MAX || n > U32_MAX || *end || (n == 0 && errno))
-    errx(1, "invalid value for -j: %s", opt_maxproc);
+  if (n == ULONG_MAX || n > U32_MAX || *end || (n == 0 && errno)) {
+    elog("invalid value for -j: %s", opt_maxproc);
+    return false;
+  }
   if (n != 0) {
     comaxproc = (u32)n;
     dlog("setting comaxproc=%u from -j option", comaxproc);
+    // explicit -j takes precedence over a jobserver inherited from make
+    jobserver_detach();
   }
+  return true;
 }
 
 
@@ -120,6 +153,9 @@ static void diaghandler(const diag_t* d, void* nullable userdata) {
 
 static void vlog_config(const compiler_t* c) {
   printf("COMAXPROC: %u\n", comaxproc);
+  char jobserver[128];
+  jobserver_describe(jobserver, sizeof(jobserver));
+  printf("jobserver: %s\n", jobserver);
   printf("COROOT:    %s\n", coroot);
   printf("COCACHE:   %s\n", cocachedir);
   printf("COPATH:    ");
@@ -144,6 +180,7 @@ static void vlog_config(const compiler_t* c) {
     case BUILDMODE_OPT:   printf("opt\n"); break;
   }
 
+  printf("backend:   %s\n", c->backend == BACKEND_LLVM ? "llvm" : "c");
   printf("buildroot: %s\n", c->buildroot);
   printf("builddir:  %s\n", c->builddir);
   printf("ldname:    %s\n", c->ldname);
@@ -154,9 +191,106 @@ static void vlog_config(const compiler_t* c) {
 }
 
 
-int main_build(int argc, char* argv[]) {
+static bool config_eq(const compiler_config_t* a, const compiler_config_t* b) {
+  return a->target == b->target &&
+         a->buildmode == b->buildmode &&
+         a->backend == b->backend &&
+         a->nolto == b->nolto &&
+         a->nomain == b->nomain &&
+         a->printast == b->printast &&
+         a->printir == b->printir &&
+         a->genirdot == b->genirdot &&
+         a->genasm == b->genasm &&
+         a->nolibc == b->nolibc &&
+         a->nolibcxx == b->nolibcxx &&
+         a->nostdruntime == b->nostdruntime &&
+         a->contenthash == b->contenthash &&
+         a->verbose == b->verbose;
+}
+
+
+static void resident_compiler_dispose() {
+  if (!g_resident.hascompiler)
+    return;
+  compiler_t* c = &g_resident.c;
+  compiler_dispose(c);
+  memalloc_bump2_dispose(assertnotnull(c->pkgapi_ma));
+  g_resident.hascompiler = false;
+}
+
+
+// resident_compiler_reusable returns true if the compiler instance of an
+// earlier build can be used to build pkgv with the configuration cfg
+static bool resident_compiler_reusable(
+  const compiler_config_t* cfg, const pkg_t* pkgv, u32 pkgc)
+{
+  compiler_t* c = &g_resident.c;
+  if (g_resident.nbuilds >= RESIDENT_MAX_BUILDS || !config_eq(cfg, &g_resident.cfg))
+    return false;
+  str_t buildroot = path_abs(cfg->buildroot);
+  bool same_buildroot = buildroot.p && streq(buildroot.p, c->buildroot);
+  str_free(buildroot);
+  if (!same_buildroot)
+    return false;
+  // a package being built as a top-level package must not be loaded as a dependency
+  for (u32 i = 0; i < pkgc; i++) {
+    if (map_lookup(&c->pkgindex, pkgv[i].dir.p, pkgv[i].dir.len))
+      return false;
+  }
+  // all dependencies loaded by earlier builds must be up to date
+  return pkgindex_uptodate(c);
+}
+
+
+static err_t resident_compiler(
+  compiler_t** cp, const compiler_config_t* cfg, const pkg_t* pkgv, u32 pkgc)
+{
+  if (g_resident.hascompiler) {
+    if (resident_compiler_reusable(cfg, pkgv, pkgc)) {
+      vlog("reusing compiler instance (%u builds)", g_resident.nbuilds);
+      compiler_errcount_reset(&g_resident.c);
+      g_resident.nbuilds++;
+      *cp = &g_resident.c;
+      return 0;
+    }
+    resident_compiler_dispose();
+  }
+
+  compiler_t* c = &g_resident.c;
+  compiler_init(c, memalloc_ctx(), &diaghandler);
+  c->pkgapi_ma = memalloc_bump2(/*slabsize*/0, /*flags*/0);
+  if (c->pkgapi_ma == memalloc_null()) {
+    c->pkgapi_ma = NULL;
+    compiler_dispose(c);
+    return ErrNoMem;
+  }
+  g_resident.hascompiler = true;
+  g_resident.nbuilds = 1;
+  err_t err = compiler_configure(c, cfg);
+  if (err) {
+    resident_compiler_dispose();
+    return err;
+  }
+  g_resident.cfg = *cfg;
+  g_resident.cfg.buildroot = c->buildroot; // cfg->buildroot is only valid for this build
+  *cp = c;
+  return 0;
+}
+
+
+static int build(int argc, char* argv[], bool resident) {
+  // copy of command line, in case we forward it to a server
+  // (cliopt_parse reorders argv)
+  int argc_orig = argc;
+  char** argv_orig = alloca(sizeof(char*) * (usize)(argc + 1));
+  memcpy(argv_orig, argv, sizeof(char*) * (usize)(argc + 1));
+
+  if (resident)
+    cliopt_reset();
   if (!cliopt_parse(&argc, &argv, help))
     return 1;
+  if (opt_help)
+    return 0;
 
   #if DEBUG
     // --co-trace turns on all trace flags
@@ -175,11 +309,26 @@ int main_build(int argc, char* argv[]) {
     return 0;
   }
 
+  // forward request to a "compis serve" process
+  if (opt_server && !resident) {
+    char sockpath[PATH_MAX];
+    serve_sockpath(sockpath);
+    int status;
+    err_t err = serve_request(sockpath, argc_orig, argv_orig, &status);
+    if (!err)
+      return status;
+    if (err != ErrNotFound) {
+      elog("%s: %s", relpath(sockpath), err_str(err));
+      return 1;
+    }
+    vlog("no server listening at %s; building in this process", relpath(sockpath));
+  }
+
   // if (optind == argc)
   //   errx(1, "no input (see %s %s --help)", coprogname, argv[0]);
 
-  if (*opt_maxproc)
-    set_comaxproc();
+  if (*opt_maxproc && !set_comaxproc())
+    return 1;
 
   if (opt_nolink && *opt_out) {
     elog("cannot specify both --no-link and -o (nothing to output when not linking)");
@@ -193,6 +342,15 @@ int main_build(int argc, char* argv[]) {
     return 1;
   }
 
+  // select code generator
+  backend_t backend = BACKEND_C;
+  if (strcmp(opt_backend, "llvm") == 0) {
+    backend = BACKEND_LLVM;
+  } else if (strcmp(opt_backend, "c") != 0) {
+    elog("Invalid backend \"%s\" (expected \"c\" or \"llvm\")", opt_backend);
+    return 1;
+  }
+
   // decide what package to build
   pkg_t* pkgv;
   u32 pkgc;
@@ -202,22 +360,24 @@ int main_build(int argc, char* argv[]) {
   assert(pkgc > 0);
 
   // -o <path> makes no sense when building multiple packages
-  if (pkgc > 1 && *opt_out)
-    errx(1, "cannot specify -o option when building multiple packages");
+  if (pkgc > 1 && *opt_out) {
+    elog("cannot specify -o option when building multiple packages");
+    return 1;
+  }
 
   // initialize thread pool
-  if (( err = threadpool_init() ))
-    elog("failed to initialize thread pool: %s", err_str(err));
-
-  // create a compiler instance
-  compiler_t c;
-  compiler_init(&c, memalloc_ctx(), &diaghandler);
+  if (!g_resident.threadpool_ready) {
+    if (( err = threadpool_init() ))
+      elog("failed to initialize thread pool: %s", err_str(err));
+    g_resident.threadpool_ready = true;
+  }
 
   // configure compiler
   compiler_config_t ccfg = {
     .target = opt_target,
     .buildroot = opt_builddir,
     .buildmode = opt_debug ? BUILDMODE_DEBUG : BUILDMODE_OPT,
+    .backend = backend,
     .printast = opt_printast,
     .printir = opt_printir,
     .genirdot = opt_genirdot,
@@ -225,38 +385,101 @@ int main_build(int argc, char* argv[]) {
     .verbose = coverbose,
     .nomain = opt_nomain,
     .nostdruntime = opt_nostdruntime,
+    .contenthash = opt_contenthash,
   };
-  if (err || ( err = compiler_configure(&c, &ccfg) )) {
+
+  // create a compiler instance
+  compiler_t c_local;
+  compiler_t* c = &c_local;
+  if (resident) {
+    if (!err)
+      err = resident_compiler(&c, &ccfg, pkgv, pkgc);
+  } else {
+    compiler_init(c, memalloc_ctx(), &diaghandler);
+    if (!err)
+      err = compiler_configure(c, &ccfg);
+  }
+  if (err) {
     dlog("compiler_configure: %s", err_str(err));
     return 1;
   }
 
   if (coverbose)
-    vlog_config(&c);
+    vlog_config(c);
+
+  // start recording timeline, if requested
+  if (*opt_tracejson && ( err = timeline_open(memalloc_ctx(), opt_tracejson) )) {
+    elog("--trace-json: %s", err_str(err));
+    return 1;
+  }
+
+  if (opt_stats)
+    buildstats_enable(memalloc_ctx());
 
   // build sysroot if needed (only reads compiler attributes; never mutates it)
-  if (( err = build_sysroot(&c, /*flags*/0) )) {
+  u64 timeline_start = timeline_begin();
+  err = build_sysroot(c, /*flags*/0);
+  timeline_end(timeline_start, "build sysroot", NULL, NULL);
+  if (err) {
     dlog("build_sysroot: %s", err_str(err));
+    timeline_close();
     return 1;
   }
 
   // build packages
   u32 pkgbuild_flags = 0;
   if (opt_nolink) pkgbuild_flags |= PKGBUILD_NOLINK;
-  pkgbuild_flags |= PKGBUILD_NOCLEANUP; // since we exit the process after this
+  if (!resident)
+    pkgbuild_flags |= PKGBUILD_NOCLEANUP; // since we exit the process after this
 
+  u32 nindexed = 0;
   for (u32 i = 0; i < pkgc; i++) {
     pkg_t* pkg = &pkgv[i];
-    if (( err = pkgindex_add(&c, pkg) )) {
+    if (( err = pkgindex_add(c, pkg) )) {
       dlog("pkgindex_add(pkg_t{dir=\"%s\"}) failed: %s", pkg->dir.p, err_str(err));
       break;
     }
-    if (( err = build_toplevel_pkg(pkg, &c, opt_out, pkgbuild_flags) )) {
+    nindexed++;
+    if (( err = build_toplevel_pkg(pkg, c, opt_out, pkgbuild_flags) )) {
       dlog("error while building pkg %s: %s", pkg->path.p, err_str(err));
       break;
     }
   }
 
-  // compiler_dispose(&c); // would need to do this if we didn't just exit
+  if (resident) {
+    // Remove top-level packages from the index, so that the next build starts
+    // over with them. (Dependencies are kept, along with their decoded APIs.)
+    rwmutex_lock(&c->pkgindex_mu);
+    for (u32 i = 0; i < nindexed; i++)
+      map_del(&c->pkgindex, pkgv[i].dir.p, pkgv[i].dir.len);
+    rwmutex_unlock(&c->pkgindex_mu);
+    for (u32 i = 0; i < pkgc; i++)
+      pkg_dispose(&pkgv[i], memalloc_ctx());
+    mem_freetv(memalloc_ctx(), pkgv, pkgc);
+    // don't reuse a compiler which has seen errors, as it may hold partial state
+    if (err || compiler_errcount(c) > 0)
+      resident_compiler_dispose();
+  }
+
+  if (timeline_close() && !err)
+    err = ErrCanceled;
+  buildstats_print(stdout);
+
+  // compiler_dispose(c); // would need to do this if we didn't just exit
   return (int)!!err;
 }
+
+
+int main_build(int argc, char* argv[]) {
+  return build(argc, argv, /*resident*/false);
+}
+
+
+int main_build_resident(int argc, char* argv[]) {
+  // note: comaxproc may be changed by -j, which also detaches the jobserver
+  u32 comaxproc_saved = comaxproc;
+  int status = build(argc, argv, /*resident*/true);
+  comaxproc = comaxproc_saved;
+  jobserver_reattach();
+  return status;
+}
@@ -3,6 +3,7 @@
 #include "dirwalk.h"
 #include "path.h"
 #include "s-expr.h"
+#include "astencode.h"
 
 #include <stdlib.h>
 #include <sys/ioctl.h>
@@ -18,6 +19,13 @@ static bool opt_help = false;
 static bool opt_v = false; // ignored; we use coverbose instead
 static bool opt_colors = false;
 static bool opt_no_colors = false;
+static const char* opt_bench_astdecode = "";
+static bool opt_bench_frontend = false;
+static const char* opt_bench_gen = "";
+static bool opt_bench_map = false;
+static const char* opt_bench_shape = "all";
+static const char* opt_bench_size = "1000";
+static const char* opt_bench_sym = "";
 
 #define FOREACH_CLI_OPTION(S, SV, L, LV,  DEBUG_L, DEBUG_LV) \
   /* S( var, ch, name,          descr) */\
@@ -26,6 +34,20 @@ static bool opt_no_colors = false;
   /* LV(var,     name, valname, descr) */\
   L( &opt_colors,    "colors",    "Enable colors regardless of TTY status")\
   L( &opt_no_colors, "no-colors", "Disable colors regardless of TTY status")\
+  LV(&opt_bench_astdecode, "bench-astdecode", "<file>",\
+    "Measure decoding speed of metafile <file> in all formats and exit")\
+  L( &opt_bench_frontend, "bench-frontend",\
+    "Measure frontend speed on generated packages and exit")\
+  LV(&opt_bench_gen, "bench-gen", "<dir>",\
+    "Write generated packages to <dir> and exit")\
+  L( &opt_bench_map, "bench-map",\
+    "Measure hash map operations on compiler-like workloads and exit")\
+  LV(&opt_bench_shape, "bench-shape", "<shape>",\
+    "Shape of generated packages: funs|nested|structs|templates|all")\
+  LV(&opt_bench_size, "bench-size", "<n>",\
+    "Number of declarations of generated packages (default 1000)")\
+  LV(&opt_bench_sym, "bench-sym", "<maxthreads>",\
+    "Measure symbol interning at 1, 2, 4 ... <maxthreads> threads and exit")\
   S( &opt_v,    'v', "verbose",   "Verbose mode")\
   S( &opt_help, 'h', "help",      "Print help on stdout and exit")\
 // end FOREACH_CLI_OPTION
@@ -45,6 +67,10 @@ static void help(const char* cmdname) {
 
 
 u32 unittest_runall(); // unittest.c
+int bench_frontend(compiler_t* c, const char* shape, u32 ndecls, u32 nrounds); // bench_frontend.c
+int bench_generate(const char* dir, const char* shape, u32 ndecls); // bench_frontend.c
+int bench_sym(u32 maxthreads); // sym.c
+int bench_map(); // map.c
 
 
 static err_t dump_ast(const node_t* ast) {
@@ -562,6 +588,171 @@ static bool parser_tests(memalloc_t ma) {
 }
 
 
+// bench_astdecode1 decodes a metafile. With lazy=true, only the index of roots is
+// decoded, plus every lazy_stride'th root (in reverse order) when lazy_stride > 0.
+static err_t bench_astdecode1(
+  compiler_t* c, memalloc_t ast_ma, pkg_t* pkg, const char* filename, slice_t data,
+  bool lazy, u32 lazy_stride, node_t*** nodevp, u32* nodecp)
+{
+  astdecoder_t* d = astdecoder_open(c, ast_ma, filename, data.bytes, data.len);
+  if (!d)
+    return ErrNoMem;
+  u32 importcount;
+  err_t err = astdecoder_decode_header(d, pkg, &importcount);
+  sha256_t* api_sha256v = NULL;
+  if (!err && importcount > 0) {
+    if (!( api_sha256v = mem_alloctv(c->ma, sha256_t, importcount) ))
+      err = ErrNoMem;
+  }
+  if (!err)
+    err = astdecoder_decode_imports(d, pkg, api_sha256v);
+  if (!err && !lazy)
+    err = astdecoder_decode_ast(d, nodevp, nodecp);
+  if (!err && lazy) {
+    sym_t* namev;
+    err = astdecoder_decode_lazy(d, nodevp, &namev, nodecp);
+    for (u32 i = *nodecp; i-- > 0 && lazy_stride > 0 && !err;) {
+      if (i % lazy_stride == 0 && !astdecoder_decode_root(d, i))
+        err = ErrInvalid;
+    }
+  }
+  if (api_sha256v)
+    mem_freetv(c->ma, api_sha256v, importcount);
+  astdecoder_close(d);
+  return err;
+}
+
+
+static err_t bench_astencode(
+  compiler_t* c, pkg_t* pkg, node_t** nodev, u32 nodec, buf_t* bin, buf_t* text)
+{
+  astencoder_t* a = astencoder_create(c);
+  if (!a)
+    return ErrNoMem;
+  astencoder_begin(a, pkg);
+  err_t err = 0;
+  for (u32 i = 0; i < nodec && !err; i++)
+    err = astencoder_add_ast(a, nodev[i], 0);
+  for (u32 i = 0; i < pkg->srcfiles.len && !err; i++)
+    err = astencoder_add_srcfile(a, pkg->srcfiles.v[i]);
+  if (!err)
+    err = astencoder_encode(a, bin);
+  if (!err && text)
+    err = astencoder_encode_text(a, text);
+  astencoder_free(a);
+  return err;
+}
+
+
+// bench_astdecode re-encodes the AST of a metafile in every format, checks that
+// each encoding decodes to the same AST, and measures how fast each one decodes.
+static int bench_astdecode(const char* filename) {
+  const u32 nrounds = 50;
+  compiler_t c;
+  create_compiler(&c, parser_test_diaghandler, &(compiler_config_t){});
+
+  const void* filedata;
+  struct stat st;
+  err_t err = mmap_file_ro(filename, &filedata, &st);
+  if (err)
+    errx(1, "%s: %s", filename, err_str(err));
+
+  memalloc_t ast_ma = memalloc_bump2(0, 0);
+  memalloc_t bench_ma = memalloc_bump2(0, 0);
+  if (ast_ma == memalloc_null() || bench_ma == memalloc_null())
+    errx(1, "memalloc_bump2 failed");
+
+  pkg_t pkg = {};
+  if (( err = pkg_init(&pkg, c.ma) ))
+    errx(1, "pkg_init: %s", err_str(err));
+
+  // decode the metafile to get an AST which we can encode in all formats
+  node_t** nodev;
+  u32 nodec;
+  slice_t filedatas = { .p = filedata, .len = (usize)st.st_size };
+  if (( err = bench_astdecode1(
+    &c, ast_ma, &pkg, filename, filedatas, false, 0, &nodev, &nodec) ))
+  {
+    errx(1, "%s: failed to decode: %s", filename, err_str(err));
+  }
+  buf_t encv[2] = { buf_make(c.ma), buf_make(c.ma) };
+  if (( err = bench_astencode(&c, &pkg, nodev, nodec, &encv[0], &encv[1]) ))
+    errx(1, "astencoder: %s", err_str(err));
+
+  // lazy decoding is measured for the index alone and with 1% of roots decoded
+  const struct {
+    const char* name;
+    u32         enc; // index into encv
+    bool        lazy;
+    u32         lazy_stride;
+  } modev[] = {
+    { "binary", 0 },
+    { "text", 1 },
+    { "lazy", 0, true, 0 },
+    { "lazy1%", 0, true, 100 },
+  };
+  u64 bestv[countof(modev)];
+  usize memusev[countof(modev)];
+
+  for (u32 i = 0; i < countof(modev); i++) {
+    slice_t data = buf_slice(encv[modev[i].enc]);
+    bool lazy = modev[i].lazy;
+
+    // check that decoding and then re-encoding produces identical data.
+    // For lazy decoding, decode all roots, in reverse order.
+    if (modev[i].lazy_stride == 0) {
+      buf_t bin = buf_make(c.ma);
+      memalloc_bump2_reset(bench_ma, 0);
+      if (( err = bench_astdecode1(
+        &c, bench_ma, &pkg, filename, data, lazy, 1, &nodev, &nodec) ))
+      {
+        errx(1, "%s: failed to decode: %s", modev[i].name, err_str(err));
+      }
+      if (( err = bench_astencode(&c, &pkg, nodev, nodec, &bin, NULL) ))
+        errx(1, "astencoder: %s", err_str(err));
+      if (!slice_eq(buf_slice(bin), buf_slice(encv[0])))
+        errx(1, "%s: re-encoded AST differs from original", modev[i].name);
+      buf_dispose(&bin);
+    }
+
+    bestv[i] = U64_MAX;
+    for (u32 round = 0; round < nrounds; round++) {
+      memalloc_bump2_reset(bench_ma, 0);
+      u64 t = nanotime();
+      err = bench_astdecode1(
+        &c, bench_ma, &pkg, filename, data, lazy, modev[i].lazy_stride, &nodev, &nodec);
+      t = nanotime() - t;
+      if (err)
+        errx(1, "%s: failed to decode: %s", modev[i].name, err_str(err));
+      bestv[i] = MIN(bestv[i], t);
+    }
+    memusev[i] = memalloc_bump2_use(bench_ma);
+  }
+
+  printf("%s: %u roots, best of %u rounds\n", relpath(filename), nodec, nrounds);
+  for (u32 i = 0; i < countof(modev); i++) {
+    char durstr[25];
+    usize size = encv[modev[i].enc].len;
+    fmtduration(durstr, bestv[i]);
+    printf("%-6s %10zu B  %10s  %8.1f MB/s  %.2fx  %10zu B ast_ma\n",
+      modev[i].name, size, durstr,
+      ((f64)size / 1000000.0) / ((f64)MAX(bestv[i], 1ul) / 1000000000.0),
+      (f64)bestv[1] / (f64)MAX(bestv[i], 1ul),
+      memusev[i]);
+  }
+
+  for (u32 i = 0; i < countof(encv); i++)
+    buf_dispose(&encv[i]);
+  pkg_dispose(&pkg, c.ma);
+  memalloc_bump2_dispose(bench_ma);
+  memalloc_bump2_dispose(ast_ma);
+  mmap_unmap(filedata, (usize)st.st_size);
+  compiler_dispose(&c);
+  return 0;
+}
+
+
+
 int main_selftest(int argc, char* argv[]) {
   if (!cliopt_parse(&argc, &argv, help))
     return 1;
@@ -570,6 +761,36 @@ int main_selftest(int argc, char* argv[]) {
   if (!opt_colors && !opt_no_colors && isatty(2))
     opt_colors = true;
 
+  if (*opt_bench_astdecode)
+    return bench_astdecode(opt_bench_astdecode);
+
+  if (opt_bench_map)
+    return bench_map();
+
+  if (*opt_bench_sym) {
+    char* end;
+    unsigned long maxthreads = strtoul(opt_bench_sym, &end, 10);
+    if (maxthreads == 0 || maxthreads > 1024 || *end)
+      errx(1, "invalid value for --bench-sym: %s", opt_bench_sym);
+    return bench_sym((u32)maxthreads);
+  }
+
+  if (opt_bench_frontend || *opt_bench_gen) {
+    char* end;
+    unsigned long ndecls = strtoul(opt_bench_size, &end, 10);
+    if (ndecls == 0 || ndecls > U32_MAX || *end)
+      errx(1, "invalid value for --bench-size: %s", opt_bench_size);
+    if (*opt_bench_gen)
+      return bench_generate(opt_bench_gen, opt_bench_shape, (u32)ndecls);
+    compiler_t c;
+    create_compiler(&c, parser_test_diaghandler, &(compiler_config_t){
+      .nostdruntime = true,
+    });
+    int status = bench_frontend(&c, opt_bench_shape, (u32)ndecls, /*nrounds*/10);
+    compiler_dispose(&c);
+    return status;
+  }
+
   // run all integrated unit tests (defined with UNITTEST_DEF)
   if (unittest_runall())
     return 1;
@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: Apache-2.0
+#include "colib.h"
+#include "path.h"
+#include "serve.h"
+
+#include <stdlib.h> // exit
+#include <string.h>
+
+// cli options
+static bool opt_help = false;
+static int opt_verbose = 0; // ignored; we use coverbose
+static const char* opt_socket = "";
+
+#define FOREACH_CLI_OPTION(S, SV, L, LV,  DEBUG_L, DEBUG_LV) \
+  /* S( var, ch, name,          descr) */\
+  /* SV(var, ch, name, valname, descr) */\
+  /* L( var,     name,          descr) */\
+  /* LV(var,     name, valname, descr) */\
+  S( &opt_verbose,'v', "verbose",       "Log each request")\
+  S( &opt_help,   'h', "help",          "Print help on stdout and exit")\
+  LV(&opt_socket,      "socket", "<file>", "Listen on <file> instead of $COSERVE or default")\
+// end FOREACH_CLI_OPTION
+
+#include "cliopt.inc.h"
+
+int main_build_resident(int argc, char* argv[]); // main_build.c
+
+static void help(const char* prog) {
+  char sockpath[PATH_MAX];
+  serve_sockpath(sockpath);
+  printf(
+    "Usage: %s %s [options]\n"
+    "Run a compile server which keeps compiler state in memory between builds.\n"
+    "Builds are sent to the server with `%s build --server ...`\n"
+    "Options:\n"
+    "",
+    coprogname, prog, coprogname);
+  cliopt_print();
+  printf(
+    "Environment variables:\n"
+    "  COSERVE   Socket file (default: %s)\n"
+    "\n"
+    "Builds use the server's environment (e.g. COROOT, COCACHE, COPATH) and the\n"
+    "client's working directory, command line and output.\n"
+    "",
+    relpath(sockpath));
+  exit(0);
+}
+
+
+static int handle_request(int argc, char* argv[]) {
+  if (argc == 0 || strcmp(argv[0], "build") != 0) {
+    elog("%s serve: unsupported command \"%s\"", coprogname, argc ? argv[0] : "");
+    return 1;
+  }
+
+  // parse coverbose the same way as main() does
+  u8 coverbose_serve = coverbose;
+  coverbose = 0;
+  for (int i = 0; i < argc; i++) {
+    if (argv[i][0] == '-' && argv[i][1] == 'v') {
+      if (strcmp(argv[i]+2, "") == 0) coverbose += 1;
+      if (strcmp(argv[i]+2, "v") == 0) coverbose += 2;
+      if (strcmp(argv[i]+2, "vv") == 0) coverbose += 3;
+      if (strcmp(argv[i]+2, "vvv") == 0) coverbose += 4;
+    }
+  }
+
+  int status = main_build_resident(argc, argv);
+
+  coverbose = coverbose_serve;
+  return status;
+}
+
+
+int main_serve(int argc, char* argv[]) {
+  if (!cliopt_parse(&argc, &argv, help))
+    return 1;
+  if (argc > 0) {
+    elog("%s: unexpected argument \"%s\"", coprogname, argv[0]);
+    return 1;
+  }
+
+  char sockpath[PATH_MAX];
+  if (*opt_socket) {
+    str_t s = path_abs(opt_socket);
+    safecheckf(s.p, "out of memory");
+    snprintf(sockpath, sizeof(sockpath), "%s", s.p);
+    str_free(s);
+  } else {
+    serve_sockpath(sockpath);
+  }
+
+  log("%s: listening on %s", coprogname, relpath(sockpath));
+  fflush(stdout);
+
+  err_t err = serve_listen(sockpath, handle_request);
+  if (err == ErrExists) {
+    elog("%s: another server is already listening on %s", coprogname, relpath(sockpath));
+  } else {
+    elog("%s: %s: %s", coprogname, relpath(sockpath), err_str(err));
+  }
+  return 1;
+}
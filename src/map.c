@@ -4,13 +4,65 @@
 #include "abuf.h"
 #include "hash.h"
 
-#define DELMARK ((const char*)1)
+// PTRKEY is the keysize of entries added with map_assign_ptr, which are hashed
+// by their address rather than by their contents
+#define PTRKEY USIZE_MAX
+
+// Each entry has a control byte which is either CTRL_EMPTY, CTRL_DELETED or,
+// for entries in use, the low 7 bits of the hash of its key (its "tag".)
+// The rest of the hash selects the group where probing starts. Groups are probed
+// in triangular order, which visits every group once when cap is a power of two.
+// Probing stops at the first group that has an empty entry, so deleted entries
+// stay marked CTRL_DELETED until the map is rehashed or cleared.
+#define CTRL_EMPTY   ((u8)0x80)
+#define CTRL_DELETED ((u8)0xfe)
+#define HASH_TAG(hash)  ((u8)((hash) & 0x7f))
+#define HASH_POS(hash)  ((hash) >> 7)
+
+// group_match returns a mask of the control bytes in ctrl[0:MAP_GROUPSIZE] that
+// are equal to b, GROUP_MASKBITS bits per byte, lowest address in the least
+// significant bits. group_match_free does the same for empty and deleted entries.
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+  #define GROUP_MASKBITS 1
+  inline static u64 group_match(const u8* ctrl, u8 b) {
+    __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+    return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)b)));
+  }
+  inline static u64 group_match_free(const u8* ctrl) {
+    return (u32)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  #include <arm_neon.h>
+  // narrowing shift leaves 4 bits per byte, of which we keep one
+  #define GROUP_MASKBITS 4
+  inline static u64 group_mask(uint8x16_t v) {
+    return vget_lane_u64(vreinterpret_u64_u8(
+      vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0) & 0x8888888888888888llu;
+  }
+  inline static u64 group_match(const u8* ctrl, u8 b) {
+    return group_mask(vceqq_u8(vld1q_u8(ctrl), vdupq_n_u8(b)));
+  }
+  inline static u64 group_match_free(const u8* ctrl) {
+    return group_mask(vtstq_u8(vld1q_u8(ctrl), vdupq_n_u8(0x80)));
+  }
+#else
+  #define GROUP_MASKBITS 1
+  inline static u64 group_match(const u8* ctrl, u8 b) {
+    u64 mask = 0;
+    for (u32 i = 0; i < MAP_GROUPSIZE; i++)
+      mask |= (u64)(ctrl[i] == b) << i;
+    return mask;
+  }
+  inline static u64 group_match_free(const u8* ctrl) {
+    u64 mask = 0;
+    for (u32 i = 0; i < MAP_GROUPSIZE; i++)
+      mask |= (u64)(ctrl[i] >> 7) << i;
+    return mask;
+  }
+#endif
 
-// lf is a bit shift magnitude that does fast integer division
-// i.e. cap-(cap>>lf) == (u32)((double)cap*0.75)
-// i.e. grow when 1=50% 2=75% 3=88% 4=94% full
-#define LOAD_FACTOR     2
-#define LOAD_FACTOR_MUL 0.25 // with LOAD_FACTOR 1=0.5 2=0.25 3=0.125 4=0.0625
+#define GROUP_FIRST(mask) ((usize)__builtin_ctzll(mask) / GROUP_MASKBITS)
 
 
 static usize keyhash(const void *key, usize keysize, u64 seed) {
@@ -32,72 +84,122 @@ static usize ptrhash(const void *key, u64 seed) {
 }
 
 
+inline static usize enthash(const mapent_t* ent, u64 seed) {
+  return (ent->keysize == PTRKEY) ?
+    ptrhash(ent->key, seed) : keyhash(ent->key, ent->keysize, seed);
+}
+
+
 inline static bool keyeq(const mapent_t* ent, const void* key, usize keysize) {
   return ent->keysize == keysize && memcmp(ent->key, key, keysize) == 0;
 }
 
 
-static u32 idealcap(u32 lenhint) {
-  // lenhint + 1: must always have one free slot
-  double f = (double)(lenhint + 1u)*LOAD_FACTOR_MUL + 0.5;
-  if UNLIKELY(f > (double)U32_MAX)
-    return U32_MAX;
-  return CEIL_POW2(lenhint + 1u + (u32)f);
+inline static u8* map_ctrl(const map_t* m) {
+  return (u8*)(m->entries + m->cap);
+}
+
+
+// setctrl sets the control byte of entry i, and its mirror(s) after the last entry
+inline static void setctrl(u8* ctrl, u32 cap, usize i, u8 b) {
+  ctrl[i] = b;
+  for (usize j = i + cap; j < (usize)cap + MAP_GROUPSIZE; j += cap)
+    ctrl[j] = b;
+}
+
+
+// growlimit returns the number of entries, including deleted ones, that a map
+// with capacity cap can hold before it needs to be rehashed.
+// At least one entry is always empty, which guarantees that probing terminates.
+inline static u32 growlimit(u32 cap) {
+  return cap - MAX(cap >> 3, 1u); // 7/8
+}
+
+
+static u32 idealcap(u32 len) {
+  if UNLIKELY(len >= 0x40000000u)
+    return 0;
+  u32 cap = MAX(CEIL_POW2(len + 1u), 2u);
+  if (growlimit(cap) < len)
+    cap *= 2;
+  return cap;
+}
+
+
+static bool map_alloc(map_t* m, memalloc_t ma, u32 cap) {
+  if UNLIKELY(cap == 0)
+    return false;
+  mapent_t* entries = mem_alloc(ma, MAP_ALLOCSIZE_X(cap)).p;
+  if UNLIKELY(!entries)
+    return false;
+  m->entries = entries;
+  m->cap = cap;
+  memset(map_ctrl(m), CTRL_EMPTY, (usize)cap + MAP_GROUPSIZE);
+  return true;
 }
 
 
 bool map_init(map_t* m, memalloc_t ma, u32 lenhint) {
   assert(lenhint > 0);
-  u32 cap = idealcap(lenhint);
   m->len = 0;
-  m->cap = cap;
+  m->ndel = 0;
   m->seed = fastrand();
-  m->entries = mem_alloctv(ma, mapent_t, cap);
-  return m->entries != NULL;
+  m->parent = NULL;
+  m->cap = 0;
+  m->entries = NULL;
+  return map_alloc(m, ma, idealcap(lenhint));
 }
 
 
 void map_clear(map_t* m) {
   m->len = 0;
-  memset(m->entries, 0, m->cap * sizeof(mapent_t));
+  m->ndel = 0;
+  memset(map_ctrl(m), CTRL_EMPTY, (usize)m->cap + MAP_GROUPSIZE);
 }
 
 
-static void map_relocate(u64 seed, mapent_t* entries, u32 cap, mapent_t* ent) {
-  usize index = keyhash(ent->key, ent->keysize, seed) & (cap - 1);
-  while (entries[index].key) {
-    if (keyeq(&entries[index], ent->key, ent->keysize))
-      break;
-    if (++index == cap)
-      index = 0;
+// map_freeslot returns the index of the first unused entry in the probe sequence
+// of hash. Deleted entries are reused.
+static usize map_freeslot(const map_t* m, usize hash) {
+  const u8* ctrl = map_ctrl(m);
+  usize mask = m->cap - 1;
+  usize pos = HASH_POS(hash) & mask;
+  for (usize step = MAP_GROUPSIZE;; step += MAP_GROUPSIZE) {
+    u64 avail = group_match_free(ctrl + pos);
+    if (avail)
+      return (pos + GROUP_FIRST(avail)) & mask;
+    pos = (pos + step) & mask;
   }
-  entries[index] = *ent;
 }
 
 
-static bool map_grow1(map_t* m, memalloc_t ma, u32 newcap) {
-  //dlog("grow cap %u => %u (%zu B)", m->cap, newcap, (usize)newcap*sizeof(mapent_t));
-  mapent_t* newentries = mem_alloctv(ma, mapent_t, newcap);
-  if UNLIKELY(!newentries)
+static bool map_rehash(map_t* m, memalloc_t ma, u32 newcap) {
+  //dlog("rehash cap %u => %u (%zu B)", m->cap, newcap, MAP_ALLOCSIZE_X(newcap));
+  map_t old = *m;
+  if UNLIKELY(!map_alloc(m, ma, newcap))
     return false;
-  m->seed = fastrand();
-  for (u32 i = 0; i < m->cap; i++) {
-    mapent_t ent = m->entries[i];
-    if (ent.key && ent.key != DELMARK)
-      map_relocate(m->seed, newentries, newcap, &ent);
+  const u8* oldctrl = map_ctrl(&old);
+  u8* ctrl = map_ctrl(m);
+  for (u32 i = 0; i < old.cap; i++) {
+    if (oldctrl[i] & 0x80)
+      continue;
+    usize hash = enthash(&old.entries[i], m->seed);
+    usize index = map_freeslot(m, hash); // keys are unique
+    setctrl(ctrl, newcap, index, HASH_TAG(hash));
+    m->entries[index] = old.entries[i];
   }
-  mem_freetv(ma, m->entries, m->cap);
-  m->entries = newentries;
-  m->cap = newcap;
+  m->ndel = 0;
+  map_dispose(&old, ma);
   return true;
 }
 
 
 static bool map_grow(map_t* m, memalloc_t ma) {
-  u32 newcap;
-  if (check_mul_overflow(m->cap, (u32)2u, &newcap))
-    return false;
-  return map_grow1(m, ma, newcap);
+  // If there are many deleted entries, rehashing to the same capacity may suffice
+  u32 newcap = idealcap(m->len + 1);
+  if (newcap != 0 && newcap < m->cap)
+    newcap = m->cap;
+  return map_rehash(m, ma, newcap);
 }
 
 
@@ -105,32 +207,66 @@ bool map_reserve(map_t* m, memalloc_t ma, u32 addlen) {
   u32 newlen;
   if (check_add_overflow(m->len, addlen, &newlen))
     return false;
-  u32 newcap = idealcap(newlen);
-  if (newcap <= m->cap)
+  if (newlen + (u64)m->ndel <= (u64)growlimit(m->cap))
     return true;
-  return map_grow1(m, ma, newcap);
+  u32 newcap = idealcap(newlen);
+  if (newcap != 0 && newcap < m->cap)
+    newcap = m->cap;
+  return map_rehash(m, ma, newcap);
 }
 
 
-mapent_t* nullable map_assign_ent(
-  map_t* m, memalloc_t ma, const void* key, usize keysize)
+// map_find returns the entry for key, or NULL if not found.
+// keysize==PTRKEY looks for a key by address.
+// This is inlined into its callers, which specializes it for either kind of key.
+inline static mapent_t* nullable map_find(
+  const map_t* m, usize hash, const void* key, usize keysize)
 {
-  u32 growlen = m->cap - (m->cap >> LOAD_FACTOR);
-  if (UNLIKELY(m->len >= growlen) && !map_grow(m, ma))
-    return NULL;
-  usize index = keyhash(key, keysize, m->seed) & (m->cap - 1);
-  while (m->entries[index].key) {
-    if (keyeq(&m->entries[index], key, keysize))
-      return &m->entries[index];
-    if (m->entries[index].key == DELMARK) // recycle deleted slot
-      break;
-    if (++index == m->cap)
-      index = 0;
+  const u8* ctrl = map_ctrl(m);
+  usize mask = m->cap - 1;
+  usize pos = HASH_POS(hash) & mask;
+  u8 tag = HASH_TAG(hash);
+  for (usize step = MAP_GROUPSIZE;; step += MAP_GROUPSIZE) {
+    for (u64 match = group_match(ctrl + pos, tag); match; match &= match - 1) {
+      mapent_t* ent = &m->entries[(pos + GROUP_FIRST(match)) & mask];
+      if (keysize == PTRKEY ? ent->key == key : keyeq(ent, key, keysize))
+        return ent;
+    }
+    if (group_match(ctrl + pos, CTRL_EMPTY))
+      return NULL;
+    pos = (pos + step) & mask;
   }
+}
+
+
+// map_insert adds a new entry for key, which must not be in the map
+static mapent_t* nullable map_insert(
+  map_t* m, memalloc_t ma, usize hash, const void* key, usize keysize)
+{
+  if (UNLIKELY(m->len + m->ndel >= growlimit(m->cap)) && !map_grow(m, ma))
+    return NULL;
+  usize index = map_freeslot(m, hash);
+  u8* ctrl = map_ctrl(m);
+  if (ctrl[index] == CTRL_DELETED)
+    m->ndel--;
+  setctrl(ctrl, m->cap, index, HASH_TAG(hash));
   m->len++;
-  m->entries[index].key = key;
-  m->entries[index].keysize = keysize;
-  return &m->entries[index];
+  mapent_t* ent = &m->entries[index];
+  ent->key = key;
+  ent->keysize = keysize;
+  ent->value = NULL;
+  return ent;
+}
+
+
+mapent_t* nullable map_assign_ent(
+  map_t* m, memalloc_t ma, const void* key, usize keysize)
+{
+  usize hash = keyhash(key, keysize, m->seed);
+  mapent_t* ent = map_find(m, hash, key, keysize);
+  if (ent)
+    return ent;
+  return map_insert(m, ma, hash, key, keysize);
 }
 
 
@@ -141,13 +277,9 @@ void** nullable map_assign(map_t* m, memalloc_t ma, const void* key, usize keysi
 
 
 void** nullable map_lookup(const map_t* m, const void* key, usize keysize) {
-  usize index = keyhash(key, keysize, m->seed) & (m->cap - 1);
-  while (m->entries[index].key) {
-    if (keyeq(&m->entries[index], key, keysize))
-      return &m->entries[index].value;
-    if (++index == m->cap)
-      index = 0;
-  }
+  mapent_t* ent = map_find(m, keyhash(key, keysize, m->seed), key, keysize);
+  if (ent)
+    return &ent->value;
   if (m->parent)
     return map_lookup(m->parent, key, keysize);
   return NULL;
@@ -155,80 +287,50 @@ void** nullable map_lookup(const map_t* m, const void* key, usize keysize) {
 
 
 static void map_del_ent1(map_t* m, mapent_t* ent) {
+  if (m->len == 1)
+    return map_clear(m); // clear all deleted entries
+  setctrl(map_ctrl(m), m->cap, (usize)(ent - m->entries), CTRL_DELETED);
   m->len--;
-  ent->key = DELMARK;
-  ent->keysize = 0;
+  m->ndel++;
 }
 
 
 void map_del_ent(map_t* m, mapent_t* ent) {
-  #if DEBUG
-  {
-    // can't use lookup since key might be ptr or bytes; we don't know
-    bool ok = false;
-    for (const mapent_t* e = map_it(m); map_itnext(m, &e); ) {
-      if (e == ent) {
-        ok = true;
-        break;
-      }
-    }
-    assertf(ok, "ent not in map");
-  }
-  #endif
-
-  if (m->len == 1)
-    return map_clear(m); // clear all DELMARK entries
+  assertf(ent >= m->entries && ent < m->entries + m->cap &&
+          (map_ctrl(m)[ent - m->entries] & 0x80) == 0,
+          "ent not in map");
   map_del_ent1(m, ent);
 }
 
 
-static bool map_del1(map_t* m, void* nullable vp) {
-  if UNLIKELY(vp == NULL)
+// map_del1 deletes ent, if any. Note that, unlike lookup, deletion does not
+// consider m->parent; entries can only be deleted from the map that holds them.
+static bool map_del1(map_t* m, mapent_t* nullable ent) {
+  if UNLIKELY(ent == NULL)
     return false;
-  if (m->len == 1) {
-    map_clear(m); // clear all DELMARK entries
-    return true;
-  }
-  mapent_t* ent = vp - offsetof(mapent_t,value);
   map_del_ent1(m, ent);
   return true;
 }
 
 
 bool map_del(map_t* m, const void* key, usize keysize) {
-  void* vp = map_lookup(m, key, keysize);
-  return map_del1(m, vp);
+  return map_del1(m, map_find(m, keyhash(key, keysize, m->seed), key, keysize));
 }
 
 
 void** nullable map_assign_ptr(map_t* m, memalloc_t ma, const void* key) {
-  u32 growlen = m->cap - (m->cap >> LOAD_FACTOR);
-  if (UNLIKELY(m->len >= growlen) && !map_grow(m, ma))
+  usize hash = ptrhash(key, m->seed);
+  mapent_t* ent = map_find(m, hash, key, PTRKEY);
+  if (!ent && !( ent = map_insert(m, ma, hash, key, PTRKEY) ))
     return NULL;
-  usize index = ptrhash(key, m->seed) & (m->cap - 1);
-  while (m->entries[index].key) {
-    if (m->entries[index].key == key)
-      return &m->entries[index].value;
-    if (m->entries[index].key == DELMARK) // recycle deleted slot
-      break;
-    if (++index == m->cap)
-      index = 0;
-  }
-  m->len++;
-  m->entries[index].key = key;
-  m->entries[index].keysize = sizeof(void*);
-  return &m->entries[index].value;
+  return &ent->value;
 }
 
 
 void** nullable map_lookup_ptr(const map_t* m, const void* key) {
-  usize index = ptrhash(key, m->seed) & (m->cap - 1);
-  while (m->entries[index].key) {
-    if (m->entries[index].key == key)
-      return &m->entries[index].value;
-    if (++index == m->cap)
-      index = 0;
-  }
+  mapent_t* ent = map_find(m, ptrhash(key, m->seed), key, PTRKEY);
+  if (ent)
+    return &ent->value;
   if (m->parent)
     return map_lookup_ptr(m->parent, key);
   return NULL;
@@ -236,15 +338,15 @@ void** nullable map_lookup_ptr(const map_t* m, const void* key) {
 
 
 bool map_del_ptr(map_t* m, const void* key) {
-  void* vp = map_lookup_ptr(m, key);
-  return map_del1(m, vp);
+  return map_del1(m, map_find(m, ptrhash(key, m->seed), key, PTRKEY));
 }
 
 
 bool map_itnext(const map_t* m, const mapent_t** ep) {
-  for (const mapent_t* e = (*ep)+1, *end = m->entries + m->cap; e != end; e++) {
-    if (e->key && e->key != DELMARK) {
-      *ep = e;
+  const u8* ctrl = map_ctrl(m);
+  for (usize i = (usize)((*ep + 1) - m->entries); i < m->cap; i++) {
+    if ((ctrl[i] & 0x80) == 0) {
+      *ep = &m->entries[i];
       return true;
     }
   }
@@ -263,3 +365,362 @@ bool map_update_replace_ptr(map_t* m, memalloc_t ma, const map_t* src) {
   }
   return true;
 }
+
+
+#ifdef CO_ENABLE_TESTS
+UNITTEST_DEF(map_grow) {
+  // entries must remain reachable after the map has grown many times
+  memalloc_t ma = memalloc_default();
+  static char ptrkeys[200]; // map_assign_ptr keys are only compared by address
+  const char* strkeys[] = { "anne", "bob", "cat", "robin", "mark", "laila" };
+  map_t m;
+  assert(map_init(&m, ma, 1));
+
+  for (usize i = 0; i < countof(ptrkeys); i++) {
+    void** vp = map_assign_ptr(&m, ma, &ptrkeys[i]);
+    assertnotnull(vp);
+    *vp = (void*)(uintptr)(i + 1);
+    if (i < countof(strkeys)) {
+      vp = map_assign(&m, ma, strkeys[i], strlen(strkeys[i]));
+      assertnotnull(vp);
+      *vp = (void*)strkeys[i];
+    }
+  }
+
+  assert(m.len == countof(ptrkeys) + countof(strkeys));
+  for (usize i = 0; i < countof(ptrkeys); i++) {
+    void** vp = map_lookup_ptr(&m, &ptrkeys[i]);
+    assertf(vp && *vp == (void*)(uintptr)(i + 1), "ptrkeys[%zu]", i);
+  }
+  for (usize i = 0; i < countof(strkeys); i++) {
+    void** vp = map_lookup(&m, strkeys[i], strlen(strkeys[i]));
+    assertf(vp && *vp == strkeys[i], "%s", strkeys[i]);
+  }
+
+  map_dispose(&m, ma);
+}
+
+
+UNITTEST_DEF(map_del) {
+  // deleted entries must not be found, must not end probing and must be reused
+  memalloc_t ma = memalloc_default();
+  static char keys[1000];
+  map_t m;
+  assert(map_init(&m, ma, 1));
+
+  for (u32 round = 0; round < 3; round++) {
+    for (usize i = 0; i < countof(keys); i++) {
+      void** vp = map_assign_ptr(&m, ma, &keys[i]);
+      assertf(vp && *vp == NULL, "keys[%zu]", i);
+      *vp = (void*)(uintptr)(i + 1);
+    }
+    assert(m.len == countof(keys));
+    u32 cap = m.cap;
+
+    // delete every other key, then every key again
+    for (usize i = 0; i < countof(keys); i += 2)
+      assert(map_del_ptr(&m, &keys[i]));
+    assert(!map_del_ptr(&m, &keys[0]));
+    for (usize i = 0; i < countof(keys); i++) {
+      void** vp = map_lookup_ptr(&m, &keys[i]);
+      if (i % 2) {
+        assertf(vp && *vp == (void*)(uintptr)(i + 1), "keys[%zu]", i);
+      } else {
+        assertf(vp == NULL, "keys[%zu]", i);
+      }
+    }
+    u32 n = 0;
+    for (const mapent_t* e = map_it(&m); map_itnext(&m, &e); n++)
+      assert(((const char*)e->key - keys) % 2 == 1);
+    assert(n == m.len);
+
+    // re-adding the deleted keys must not grow the map
+    for (usize i = 0; i < countof(keys); i += 2)
+      assertnotnull(map_assign_ptr(&m, ma, &keys[i]));
+    assert(m.cap == cap);
+
+    if (round == 0) {
+      // deleting the last key clears the map
+      for (usize i = 0; i < countof(keys); i++)
+        assert(map_del_ptr(&m, &keys[i]));
+      assert(m.len == 0 && m.ndel == 0);
+    } else {
+      map_clear(&m);
+    }
+    assert(map_lookup_ptr(&m, &keys[1]) == NULL);
+  }
+
+  // deleting a key which is only in the parent map must fail and leave the
+  // parent unchanged
+  map_t child;
+  assert(map_init(&child, ma, 1));
+  child.parent = &m;
+  assertnotnull(map_assign_ptr(&m, ma, &keys[0]));
+  assertnotnull(map_assign_ptr(&child, ma, &keys[1]));
+  assert(!map_del_ptr(&child, &keys[0]));
+  assert(!map_del(&child, "k", 1));
+  assert(m.len == 1 && map_lookup_ptr(&m, &keys[0]) != NULL);
+  assert(map_lookup_ptr(&child, &keys[0]) != NULL);
+  assert(map_del_ptr(&child, &keys[1]));
+  assert(child.len == 0 && map_lookup_ptr(&child, &keys[1]) == NULL);
+  map_dispose(&child, ma);
+
+  // after map_reserve(n), n assignments must not rehash
+  map_clear(&m);
+  assert(map_reserve(&m, ma, 5000));
+  mapent_t* entries = m.entries;
+  for (u32 i = 0; i < 5000; i++) {
+    char key[16];
+    usize len = (usize)snprintf(key, sizeof(key), "k%u", i);
+    char* key2 = mem_strdup(ma, (slice_t){ .p = key, .len = len }, 0);
+    assertnotnull(map_assign(&m, ma, key2, len));
+  }
+  assert(m.entries == entries);
+  for (const mapent_t* e = map_it(&m); map_itnext(&m, &e); )
+    mem_freex(ma, MEM((void*)e->key, e->keysize + 1));
+
+  map_dispose(&m, ma);
+}
+
+
+
+// lpmap is the map implementation that map_t replaced, kept for comparison:
+// linear probing over mapent_t entries, with no hash bits stored
+typedef struct { u32 cap, len; usize seed; mapent_t* entries; } lpmap_t;
+#define LPMAP_DELMARK ((const char*)1)
+
+static void lpmap_init(lpmap_t* m, memalloc_t ma, u32 lenhint) {
+  m->cap = CEIL_POW2(lenhint + 1u + (u32)((f64)(lenhint + 1u)*0.25 + 0.5));
+  m->len = 0;
+  m->seed = fastrand();
+  safecheckx(( m->entries = mem_alloctv(ma, mapent_t, m->cap) ));
+}
+
+static void lpmap_clear(lpmap_t* m) {
+  m->len = 0;
+  memset(m->entries, 0, m->cap * sizeof(mapent_t));
+}
+
+static void lpmap_grow(lpmap_t* m, memalloc_t ma) {
+  u32 newcap = m->cap * 2;
+  mapent_t* newentries = mem_alloctv(ma, mapent_t, newcap);
+  safecheckx(newentries);
+  for (u32 i = 0; i < m->cap; i++) {
+    mapent_t* ent = &m->entries[i];
+    if (!ent->key || ent->key == LPMAP_DELMARK)
+      continue;
+    usize index = enthash(ent, m->seed) & (newcap - 1);
+    while (newentries[index].key)
+      index = (index + 1) & (newcap - 1);
+    newentries[index] = *ent;
+  }
+  mem_freetv(ma, m->entries, m->cap);
+  m->entries = newentries;
+  m->cap = newcap;
+}
+
+static void** lpmap_assign(
+  lpmap_t* m, memalloc_t ma, const void* key, usize keysize)
+{
+  if UNLIKELY(m->len >= m->cap - (m->cap >> 2))
+    lpmap_grow(m, ma);
+  usize index = (keysize == PTRKEY ? ptrhash(key, m->seed) :
+    keyhash(key, keysize, m->seed)) & (m->cap - 1);
+  while (m->entries[index].key) {
+    mapent_t* ent = &m->entries[index];
+    if (keysize == PTRKEY ? ent->key == key : keyeq(ent, key, keysize))
+      return &ent->value;
+    if (ent->key == LPMAP_DELMARK)
+      break;
+    index = (index + 1) & (m->cap - 1);
+  }
+  m->len++;
+  m->entries[index].key = key;
+  m->entries[index].keysize = keysize;
+  return &m->entries[index].value;
+}
+
+static void** nullable lpmap_lookup(const lpmap_t* m, const void* key, usize keysize) {
+  usize index = (keysize == PTRKEY ? ptrhash(key, m->seed) :
+    keyhash(key, keysize, m->seed)) & (m->cap - 1);
+  while (m->entries[index].key) {
+    mapent_t* ent = &m->entries[index];
+    if (keysize == PTRKEY ? ent->key == key : keyeq(ent, key, keysize))
+      return &ent->value;
+    index = (index + 1) & (m->cap - 1);
+  }
+  return NULL;
+}
+
+
+// maptest_impl_t abstracts over map_t and lpmap_t for bench_map
+typedef struct {
+  const char* name;
+  void   (*init)(void* m, memalloc_t ma, u32 lenhint);
+  void   (*dispose)(void* m, memalloc_t ma);
+  void   (*clear)(void* m);
+  void** (*assign)(void* m, memalloc_t ma, const void* key, usize keysize);
+  void** (*lookup)(const void* m, const void* key, usize keysize);
+} maptest_impl_t;
+
+static void mt_map_init(void* m, memalloc_t ma, u32 lenhint) {
+  safecheckx(map_init(m, ma, lenhint));
+}
+static void mt_map_dispose(void* m, memalloc_t ma) { map_dispose(m, ma); }
+static void mt_map_clear(void* m) { map_clear(m); }
+static void** mt_map_assign(void* m, memalloc_t ma, const void* key, usize keysize) {
+  void** vp = keysize == PTRKEY ? map_assign_ptr(m, ma, key) : map_assign(m, ma, key, keysize);
+  return safechecknotnull(vp);
+}
+static void** mt_map_lookup(const void* m, const void* key, usize keysize) {
+  return keysize == PTRKEY ? map_lookup_ptr(m, key) : map_lookup(m, key, keysize);
+}
+static void mt_lpmap_init(void* m, memalloc_t ma, u32 lenhint) { lpmap_init(m, ma, lenhint); }
+static void mt_lpmap_dispose(void* m, memalloc_t ma) {
+  mem_freetv(ma, ((lpmap_t*)m)->entries, ((lpmap_t*)m)->cap);
+}
+static void mt_lpmap_clear(void* m) { lpmap_clear(m); }
+static void** mt_lpmap_assign(void* m, memalloc_t ma, const void* key, usize keysize) {
+  return lpmap_assign(m, ma, key, keysize);
+}
+static void** mt_lpmap_lookup(const void* m, const void* key, usize keysize) {
+  return lpmap_lookup(m, key, keysize);
+}
+
+static const maptest_impl_t maptest_impls[] = {
+  { "map", mt_map_init, mt_map_dispose, mt_map_clear, mt_map_assign, mt_map_lookup },
+  { "linear", mt_lpmap_init, mt_lpmap_dispose, mt_lpmap_clear,
+    mt_lpmap_assign, mt_lpmap_lookup },
+};
+
+
+// Workloads of bench_map, modeled on how the compiler uses maps:
+//   defs     lookups of symbols (pointer keys) in a package-sized map,
+//            half of them missing (e.g. falling through to the parent scope)
+//   scratch  a map that is cleared and refilled for every function, as with
+//            local variables in ir.c and cgen's tmpmap; most are small,
+//            a few are large, which grows the map
+//   paths    lookups of byte-string keys, as with the package index
+typedef struct {
+  const maptest_impl_t* impl;
+  memalloc_t ma;
+  const char** symv; // pointer keys
+  u32 nsyms;
+  slice_t* pathv; // byte keys
+  u32 npaths;
+} maptest_bench_t;
+
+static u64 maptest_defs(maptest_bench_t* b) {
+  const u32 nkeys = b->nsyms / 2, nlookups = 2000000;
+  u64 m[8];
+  b->impl->init(m, b->ma, 64);
+  for (u32 i = 0; i < nkeys; i++)
+    *b->impl->assign(m, b->ma, b->symv[i], PTRKEY) = (void*)b->symv[i];
+  u64 seed = 1, nfound = 0;
+  for (u32 i = 0; i < nlookups; i++) {
+    seed = wyhash64(seed, i);
+    nfound += b->impl->lookup(m, b->symv[seed % b->nsyms], PTRKEY) != NULL;
+  }
+  safecheckx(nfound > 0);
+  b->impl->dispose(m, b->ma);
+  return nkeys + nlookups;
+}
+
+static u64 maptest_scratch(maptest_bench_t* b) {
+  const u32 nfuns = 100000;
+  u64 m[8], nops = 0;
+  b->impl->init(m, b->ma, 8);
+  for (u32 f = 0; f < nfuns; f++) {
+    u32 nvars = (f % 64 == 0) ? 256 : 4 + f % 8;
+    const char** vars = &b->symv[(f * 7) % (b->nsyms - nvars)];
+    b->impl->clear(m);
+    for (u32 i = 0; i < nvars; i++)
+      *b->impl->assign(m, b->ma, vars[i], PTRKEY) = (void*)vars[i];
+    for (u32 i = 0; i < nvars*2; i++)
+      safecheckx(b->impl->lookup(m, vars[(i * 3) % nvars], PTRKEY));
+    nops += nvars*3;
+  }
+  b->impl->dispose(m, b->ma);
+  return nops;
+}
+
+static u64 maptest_paths(maptest_bench_t* b) {
+  const u32 nlookups = 1000000;
+  u64 m[8];
+  b->impl->init(m, b->ma, 16);
+  for (u32 i = 0; i < b->npaths; i++) {
+    const slice_t* k = &b->pathv[i];
+    *b->impl->assign(m, b->ma, k->p, k->len) = (void*)k->p;
+  }
+  u64 seed = 1, nfound = 0;
+  for (u32 i = 0; i < nlookups; i++) {
+    seed = wyhash64(seed, i);
+    // lookup with a copy of the key, as callers usually have
+    const slice_t* k = &b->pathv[seed % b->npaths];
+    char key[128];
+    memcpy(key, k->p, k->len);
+    key[k->len - 1] ^= (seed >> 32) % 8 == 0; // 1 in 8 misses
+    nfound += b->impl->lookup(m, key, k->len) != NULL;
+  }
+  safecheckx(nfound > 0);
+  b->impl->dispose(m, b->ma);
+  return b->npaths + nlookups;
+}
+
+
+int bench_map() {
+  static_assert(sizeof(u64[8]) >= sizeof(map_t) && sizeof(u64[8]) >= sizeof(lpmap_t), "");
+  const u32 nrounds = 5;
+  maptest_bench_t b = { .ma = memalloc_default(), .nsyms = 8000, .npaths = 1000 };
+
+  b.symv = mem_alloctv(b.ma, const char*, b.nsyms);
+  b.pathv = mem_alloctv(b.ma, slice_t, b.npaths);
+  safecheckx(b.symv && b.pathv);
+  for (u32 i = 0; i < b.nsyms; i++) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "bench_map_%u", i);
+    b.symv[i] = mem_strdup(b.ma, (slice_t){ .p = buf, .len = (usize)len }, 0);
+    safecheckx(b.symv[i]);
+  }
+  for (u32 i = 0; i < b.npaths; i++) {
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "/home/user/src/project/%s/pkg%u",
+      (i % 3) ? "lib" : "vendor/github.com/someone", i);
+    b.pathv[i].p = mem_strdup(b.ma, (slice_t){ .p = buf, .len = (usize)len }, 0);
+    b.pathv[i].len = (usize)len;
+    safecheckx(b.pathv[i].p);
+  }
+
+  static const struct { const char* name; u64(*fn)(maptest_bench_t*); } workloads[] = {
+    { "defs", maptest_defs },
+    { "scratch", maptest_scratch },
+    { "paths", maptest_paths },
+  };
+
+  printf("workload\timpl\tops\tbest_ns\tns_per_op\n");
+  for (u32 w = 0; w < countof(workloads); w++) {
+    for (u32 impl = 0; impl < countof(maptest_impls); impl++) {
+      b.impl = &maptest_impls[impl];
+      u64 best = U64_MAX, ops = 0;
+      for (u32 round = 0; round < nrounds; round++) {
+        u64 t = nanotime();
+        ops = workloads[w].fn(&b);
+        best = MIN(best, nanotime() - t);
+      }
+      printf("%s\t%s\t%llu\t%llu\t%.2f\n",
+        workloads[w].name, b.impl->name,
+        (unsigned long long)ops, (unsigned long long)best, (f64)best / (f64)ops);
+      fflush(stdout);
+    }
+  }
+
+  for (u32 i = 0; i < b.npaths; i++)
+    mem_freex(b.ma, MEM((void*)b.pathv[i].p, b.pathv[i].len + 1));
+  mem_freetv(b.ma, b.pathv, b.npaths);
+  for (u32 i = 0; i < b.nsyms; i++)
+    mem_freex(b.ma, MEM((void*)b.symv[i], strlen(b.symv[i]) + 1));
+  mem_freetv(b.ma, b.symv, b.nsyms);
+  return 0;
+}
+
+#endif // CO_ENABLE_TESTS
@@ -4,21 +4,32 @@
 ASSUME_NONNULL_BEGIN
 
 typedef struct {
-  const void* nullable key; // NULL if this entry is empty
+  const void* nullable key; // not copied; must outlive the entry
   usize                keysize;
   void* nullable       value;
 } mapent_t;
 
 typedef struct map {
   u32       cap, len; // capacity of entries, current number of items in map
+  u32       ndel;     // number of deleted entries still occupying slots
   usize     seed;     // hash seed
   mapent_t* nullable entries; // not null in practice, just to satisfy msan
   const struct map* nullable parent;
 } map_t;
 
+// Entries are followed in memory by cap+MAP_GROUPSIZE control bytes, one per entry,
+// which are probed MAP_GROUPSIZE at a time. The last MAP_GROUPSIZE bytes mirror
+// the first ones, so that a group can start at any entry.
+#define MAP_GROUPSIZE 16
+
+// MAP_ALLOCSIZE_X calculates the size of the memory allocation of a map with cap
+#define MAP_ALLOCSIZE_X(cap) \
+  ( ((usize)(cap))*(sizeof(mapent_t) + 1) + MAP_GROUPSIZE )
+
 bool map_init(map_t* m, memalloc_t ma, u32 lenhint); // false if mem_alloc fails
 inline static void map_dispose(map_t* m, memalloc_t ma) {
-  mem_freetv(ma, m->entries, m->cap);
+  if (m->cap)
+    mem_freex(ma, MEM(m->entries, MAP_ALLOCSIZE_X(m->cap)));
 }
 void map_clear(map_t* m); // remove all items (m remains valid)
 
@@ -55,6 +66,6 @@ inline static bool map_itnext_mut(map_t* m, mapent_t** ep) {
 
 // MAP_STORAGE_X calculates the number of bytes needed to store len entries
 #define MAP_STORAGE_X(len) \
-  ( CEIL_POW2_X( ( ((usize)(len)) +1 ) * 2) * sizeof(mapent_t) )
+  MAP_ALLOCSIZE_X( CEIL_POW2_X( ((usize)(len)) + ((usize)(len))/7 + 1 ) )
 
 ASSUME_NONNULL_END
@@ -1,14 +1,17 @@
 // thread safe bump allocator backed by vm pages
 // SPDX-License-Identifier: Apache-2.0
 //
-// Currently it sources vm pages as it grows and then when it's disposed all vm pages
-// are returned to the OS. This could probably be made more efficient by using a
-// page manager (like "memory manager" in RSM) to centrally pool all pages for the
-// process, handing out and taking back pages for allocators.
+// Allocators source slabs of vm pages as they grow. When an allocator is disposed
+// its slabs are put in a process-wide pool (up to POOL_MAXBYTES) from which other
+// allocators take slabs, instead of returning the pages to the OS and mapping new
+// ones. A pooled slab remembers how much of it was written to ("dirty") and only
+// that part is zeroed, when the slab is taken from the pool.
 //
 #include "colib.h"
 #include "thread.h"
 
+#include <sys/mman.h> // madvise
+
 
 // MIN_ALIGNMENT: minimum alignment for allocations
 #define MIN_ALIGNMENT sizeof(void*)
@@ -18,6 +21,19 @@
 #define DEFAULT_SLABSIZE (1024ul * 1024ul)
 
 
+// HUGEPAGE_SIZE: size and alignment of slabs of MEMALLOC_BUMP2_HUGEPAGES allocators
+#define HUGEPAGE_SIZE (2ul * 1024ul * 1024ul)
+
+
+// POOL_MAXBYTES: maximum amount of memory kept in the slab pool
+#define POOL_MAXBYTES (64ul * 1024ul * 1024ul)
+
+
+// POOL_MAXWASTE: a pooled slab is not used for requests smaller than
+// 1/POOL_MAXWASTE of its size
+#define POOL_MAXWASTE 4
+
+
 // ALWAYS_ISZERO is defined if the target we are building for always and
 // unconditionally returns zeroed pages from mmap(MAP_ANONYMOUS).
 //
@@ -48,10 +64,28 @@ typedef struct slab_ {
 // bump_alloc_grow assumes that sizeof(slab_t) is an even multiple of MIN_ALIGNMENT
 static_assert(IS_ALIGN2(sizeof(slab_t), MIN_ALIGNMENT), "");
 
+// poolslab_t is the header of a slab in the pool
+typedef struct poolslab_ poolslab_t;
+typedef struct poolslab_ {
+  usize       size;
+  usize       dirty; // bytes at the start of the slab which may be non-zero
+  poolslab_t* next;
+} poolslab_t;
+
+static struct {
+  mutex_t              mu;
+  poolslab_t* nullable head;  // protected by mu
+  usize                bytes; // total size of slabs in pool, protected by mu
+  _Atomic(usize)       nmapped, nreused, nunmapped;
+} g_pool;
+
 // bump_allocator_t contains book-keeping data for the allocator
 typedef struct {
   slab_t           head;   // caution: cyclic; head->prev initially points to &head
   rwmutex_t        tailmu; // guards modifications to tail
+  u32              flags;
+  u32              nslabs;
+  _Atomic(usize)   highwater; // use before most recent memalloc_bump2_reset
 
   #if defined(DEBUG) && defined(__SIZEOF_INT128__)
   union { struct {
@@ -91,11 +125,106 @@ typedef union {
 #define ATOMIC_LOAD(p)     AtomicLoad((p), memory_order_acquire)
 
 
+__attribute__((constructor)) static void init_pool() {
+  safecheckx(mutex_init(&g_pool.mu) == 0);
+}
+
+
+// vm_alloc_hugepages maps size bytes aligned to HUGEPAGE_SIZE and asks the OS to
+// back them by transparent huge pages
+static mem_t vm_alloc_hugepages(usize size) {
+  size = ALIGN2(size, HUGEPAGE_SIZE);
+  mem_t m = sys_vm_alloc(NULL, size + HUGEPAGE_SIZE);
+  if (!m.p)
+    return m;
+  // unmap the parts outside of the aligned range
+  void* p = (void*)ALIGN2((uintptr)m.p, HUGEPAGE_SIZE);
+  if (p > m.p)
+    sys_vm_free(MEM(m.p, (usize)(p - m.p)));
+  if (p + size < m.p + m.size)
+    sys_vm_free(MEM(p + size, (usize)((m.p + m.size) - (p + size))));
+  #ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);
+  #endif
+  return MEM(p, size);
+}
+
+
+// slab_alloc returns at least size bytes of zeroed vm pages, from the pool if possible
+static mem_t slab_alloc(void* nullable at_addr, usize size, u32 flags) {
+  size = ALIGN2(size, sys_pagesize());
+
+  // find the smallest pooled slab that is large enough
+  mutex_lock(&g_pool.mu);
+  poolslab_t** bestp = NULL;
+  for (poolslab_t** pp = &g_pool.head; *pp; pp = &(*pp)->next) {
+    usize slabsize = (*pp)->size;
+    if (slabsize >= size && slabsize / POOL_MAXWASTE <= size &&
+        (!bestp || slabsize < (*bestp)->size) &&
+        (!(flags & MEMALLOC_BUMP2_HUGEPAGES) || IS_ALIGN2((uintptr)*pp, HUGEPAGE_SIZE)))
+    {
+      bestp = pp;
+    }
+  }
+  poolslab_t* ps = NULL;
+  if (bestp) {
+    ps = *bestp;
+    *bestp = ps->next;
+    g_pool.bytes -= ps->size;
+  }
+  mutex_unlock(&g_pool.mu);
+
+  if (ps) {
+    mem_t m = MEM(ps, ps->size);
+    #ifdef ALWAYS_ISZERO
+      // memory from the OS is assumed to be zeroed (otherwise bump_alloc zeroes it)
+      memset(m.p, 0, ps->dirty);
+    #endif
+    AtomicAdd(&g_pool.nreused, 1, memory_order_relaxed);
+    return m;
+  }
+
+  AtomicAdd(&g_pool.nmapped, 1, memory_order_relaxed);
+  if (flags & MEMALLOC_BUMP2_HUGEPAGES)
+    return vm_alloc_hugepages(size);
+  return sys_vm_alloc(at_addr, size);
+}
+
+
+// slab_free puts a slab into the pool, or returns it to the OS if the pool is full.
+// dirty is the number of bytes at the start of the slab that may have been written to.
+static void slab_free(mem_t m, usize dirty) {
+  poolslab_t* ps = m.p;
+  mutex_lock(&g_pool.mu);
+  bool pooled = g_pool.bytes + m.size <= POOL_MAXBYTES;
+  if (pooled) {
+    ps->size = m.size;
+    ps->dirty = MIN(MAX(dirty, sizeof(poolslab_t)), m.size);
+    ps->next = g_pool.head;
+    g_pool.head = ps;
+    g_pool.bytes += m.size;
+  }
+  mutex_unlock(&g_pool.mu);
+  if (pooled)
+    return;
+  AtomicAdd(&g_pool.nunmapped, 1, memory_order_relaxed);
+  err_t err = sys_vm_free(m);
+  if (err)
+    dlog("%s: sys_vm_free failed: %s", __FUNCTION__, err_str(err));
+}
+
+
 static bool bump_alloc_grow(bump_allocator_t* a, usize size) {
   assert(IS_ALIGN2(size, MIN_ALIGNMENT)); // bump_alloc has aligned it
 
   rwmutex_lock(&a->tailmu);
 
+  // another thread may have grown the allocator while we waited for the lock
+  if (ATOMIC_LOAD(&a->ptr) + size <= ATOMIC_LOAD(&a->end)) {
+    rwmutex_unlock(&a->tailmu);
+    return true;
+  }
+
   // load current tail
   slab_t* oldtail = ATOMIC_LOAD(&a->tail);
 
@@ -108,10 +237,10 @@ static bool bump_alloc_grow(bump_allocator_t* a, usize size) {
   // calculate ideal address for new pages, just after our current range
   void* at_addr = (void*)oldtail + oldtail->size;
 
-  mem_t m = sys_vm_alloc(at_addr, size);
+  mem_t m = slab_alloc(at_addr, size, a->flags);
 
   if UNLIKELY(m.p == NULL) {
-    dlog("%s: sys_vm_alloc(%p, %zu) failed", __FUNCTION__, at_addr, size);
+    dlog("%s: slab_alloc(%p, %zu) failed", __FUNCTION__, at_addr, size);
     rwmutex_unlock(&a->tailmu);
     return false;
   }
@@ -122,6 +251,7 @@ static bool bump_alloc_grow(bump_allocator_t* a, usize size) {
   slab_t* slab = m.p;
   slab->size = m.size;
   ATOMIC_STORE(&slab->prev, assertnotnull(oldtail));
+  a->nslabs++;
 
   ATOMIC_STORE(&a->tail, slab);
 
@@ -150,23 +280,28 @@ static bool bump_alloc(bump_allocator_t* a, mem_t* m, usize size, bool zeroed) {
   size = ALIGN2(size, MIN_ALIGNMENT);
   void* oldptr = ATOMIC_LOAD(&a->ptr);
 
-  // allocate another slab if needed
-  while UNLIKELY(oldptr + size > ATOMIC_LOAD(&a->end)) {
-    // release read lock so that bump_alloc_grow can acquire write lock
-    rwmutex_runlock(&a->tailmu);
+  for (;;) {
+    // allocate another slab if needed
+    if UNLIKELY(oldptr + size > ATOMIC_LOAD(&a->end)) {
+      // release read lock so that bump_alloc_grow can acquire write lock
+      rwmutex_runlock(&a->tailmu);
 
-    if UNLIKELY(!bump_alloc_grow(a, size)) {
-      *m = (mem_t){};
-      return false;
-    }
+      if UNLIKELY(!bump_alloc_grow(a, size)) {
+        *m = (mem_t){};
+        return false;
+      }
 
-    // acquire read lock again and load new ptr
-    rwmutex_rlock(&a->tailmu);
-    oldptr = ATOMIC_LOAD(&a->ptr);
+      // acquire read lock again and load new ptr
+      rwmutex_rlock(&a->tailmu);
+      oldptr = ATOMIC_LOAD(&a->ptr);
+      continue;
+    }
+    // Other threads may be allocating at the same time (we only hold a read lock.)
+    // If another thread raced us and won, AtomicCAS updates oldptr.
+    if LIKELY(AtomicCASAcqRel(&a->ptr, &oldptr, oldptr + size))
+      break;
   }
 
-  ATOMIC_STORE(&a->ptr, oldptr + size);
-
   rwmutex_runlock(&a->tailmu);
 
   m->p = oldptr;
@@ -277,18 +412,20 @@ static bool _memalloc_bump_impl(void* ma, mem_t* m, usize size, bool zeroed) {
 
 
 memalloc_t memalloc_bump2(usize slabsize, u32 flags) {
-  assert(flags == 0); // no flags, for now
+  assert((flags & ~MEMALLOC_BUMP2_HUGEPAGES) == 0);
 
   // adjust slabsize
   usize pagesize = sys_pagesize();
   if (slabsize == 0)
     slabsize = DEFAULT_SLABSIZE;
+  if (flags & MEMALLOC_BUMP2_HUGEPAGES)
+    pagesize = MAX(pagesize, HUGEPAGE_SIZE);
   slabsize = ALIGN2(slabsize, pagesize);
 
-  // map initial vm pages
-  mem_t m = sys_vm_alloc(NULL, slabsize);
+  // get initial vm pages
+  mem_t m = slab_alloc(NULL, slabsize, flags);
   if (!m.p) {
-    dlog("%s: sys_vm_alloc(%zu) failed", __FUNCTION__, slabsize);
+    dlog("%s: slab_alloc(%zu) failed", __FUNCTION__, slabsize);
     return &_memalloc_null;
   }
   safecheckf(m.size > sizeof(bump_allocator_t),
@@ -303,6 +440,8 @@ memalloc_t memalloc_bump2(usize slabsize, u32 flags) {
   a->end = m.p + m.size;
   a->ptr = (void*)ALIGN2((uintptr)&a->head + sizeof(bump_allocator_t), MIN_ALIGNMENT);
   a->ma.f = _memalloc_bump_impl;
+  a->flags = flags;
+  a->nslabs = 1;
 
   if UNLIKELY(err) {
     dlog("%s: rwmutex_init failed (%s)", __FUNCTION__, err_str(err));
@@ -317,12 +456,43 @@ memalloc_t memalloc_bump2(usize slabsize, u32 flags) {
 bool memalloc_bump2_reset(memalloc_t ma, usize use) {
   assert(ma->f == _memalloc_bump_impl);
   bump_allocator_t* a = BUMPALLOC_OF_MEMALLOC(ma);
+  usize oldhighwater = memalloc_bump2_highwater(ma);
   assert(memalloc_bump2_use(ma) >= use);
-  void* oldptr = ATOMIC_LOAD(&a->ptr);
+  AtomicStore(&a->highwater, oldhighwater, memory_order_relaxed);
+
+  rwmutex_lock(&a->tailmu);
+
+  slab_t* head = &a->head;
+  void* headend = (void*)head + head->size;
   void* newptr =
-    (void*)ALIGN2((uintptr)&a->head + sizeof(bump_allocator_t), MIN_ALIGNMENT);
+    (void*)ALIGN2((uintptr)head + sizeof(bump_allocator_t), MIN_ALIGNMENT);
   newptr += use;
-  return AtomicCASAcqRel(&a->ptr, &oldptr, newptr);
+  assertf(newptr <= headend, "use %zu larger than first slab", use);
+
+  // return all but the first slab to the pool
+  slab_t* slab = ATOMIC_LOAD(&a->tail);
+  void* dirtyend = ATOMIC_LOAD(&a->ptr); // end of memory written to in head
+  if (slab != head) {
+    dirtyend = headend;
+    usize dirty = (usize)(ATOMIC_LOAD(&a->ptr) - (void*)slab);
+    while (slab != head) {
+      slab_t* prev_slab = assertnotnull(ATOMIC_LOAD(&slab->prev));
+      slab_free(MEM(slab, slab->size), dirty);
+      dirty = slab->size;
+      slab = prev_slab;
+    }
+    ATOMIC_STORE(&a->tail, head);
+    ATOMIC_STORE(&a->end, headend);
+    a->nslabs = 1;
+  }
+
+  // keep free memory zeroed, which bump_alloc assumes when ISZERO
+  if (ISZERO(a) && dirtyend > newptr)
+    memset(newptr, 0, (usize)(dirtyend - newptr));
+
+  ATOMIC_STORE(&a->ptr, newptr);
+  rwmutex_unlock(&a->tailmu);
+  return true;
 }
 
 
@@ -334,15 +504,20 @@ void memalloc_bump2_dispose(memalloc_t ma) {
 
   rwmutex_dispose(&a->tailmu);
 
-  err_t err;
+  // Only the tail slab may be partially used
+  // (memalloc_bump2_reset zeroes memory past ptr)
   slab_t* slab = a->tail;
   slab_t* head = &a->head;
+  void* ptr = a->ptr;
+  usize taildirty = slab->size;
+  if (ptr > (void*)slab && ptr <= (void*)slab + slab->size)
+    taildirty = (usize)(ptr - (void*)slab);
+
   slab_t* prev_slab;
   for (;;) {
     prev_slab = ATOMIC_LOAD(&slab->prev);
     assertnotnull(prev_slab);
-    if (( err = sys_vm_free(MEM(slab, slab->size)) ))
-      dlog("%s: sys_vm_free failed: %s", __FUNCTION__, err_str(err));
+    slab_free(MEM(slab, slab->size), slab == a->tail ? taildirty : slab->size);
     if (slab == head)
       break;
     slab = prev_slab;
@@ -416,6 +591,31 @@ usize memalloc_bump2_avail(memalloc_t ma) {
 }
 
 
+usize memalloc_bump2_highwater(memalloc_t ma) {
+  bump_allocator_t* a = BUMPALLOC_OF_MEMALLOC(ma);
+  return MAX(AtomicLoad(&a->highwater, memory_order_relaxed), memalloc_bump2_use(ma));
+}
+
+
+u32 memalloc_bump2_nslabs(memalloc_t ma) {
+  bump_allocator_t* a = BUMPALLOC_OF_MEMALLOC(ma);
+  rwmutex_rlock(&a->tailmu);
+  u32 n = a->nslabs;
+  rwmutex_runlock(&a->tailmu);
+  return n;
+}
+
+
+void memalloc_bump2_poolstats(memalloc_bump2_poolstats_t* st) {
+  mutex_lock(&g_pool.mu);
+  st->pooledbytes = g_pool.bytes;
+  mutex_unlock(&g_pool.mu);
+  st->nmapped = AtomicLoad(&g_pool.nmapped, memory_order_relaxed);
+  st->nreused = AtomicLoad(&g_pool.nreused, memory_order_relaxed);
+  st->nunmapped = AtomicLoad(&g_pool.nunmapped, memory_order_relaxed);
+}
+
+
 //———————————————————————————————————————————————————————————————————————————————————————
 // tests
 #ifdef CO_ENABLE_TESTS
@@ -505,6 +705,44 @@ UNITTEST_DEF(memalloc_bump2) {
 }
 
 
+UNITTEST_DEF(memalloc_bump2_pool) {
+  // slabs of a disposed allocator are reused, and are zeroed when reused
+  memalloc_bump2_poolstats_t st1, st2;
+  memalloc_t ma = memalloc_bump2(0, 0);
+  assert(ma != memalloc_null());
+  mem_t m = mem_alloc(ma, 64);
+  assertnotnull(m.p);
+  memset(m.p, 0xff, m.size);
+  assert(memalloc_bump2_highwater(ma) == memalloc_bump2_use(ma));
+  memalloc_bump2_reset(ma, 0);
+  assert(memalloc_bump2_use(ma) == 0 && memalloc_bump2_highwater(ma) >= 64);
+  // memory is zeroed by reset
+  m = mem_alloc_zeroed(ma, 64);
+  for (usize i = 0; i < m.size; i++)
+    assert(((u8*)m.p)[i] == 0);
+  memalloc_bump2_reset(ma, 0);
+  usize size = memalloc_bump2_avail(ma) + 64; // cause a second slab to be used
+  m = mem_alloc(ma, size);
+  assertnotnull(m.p);
+  memset(m.p, 0xff, m.size);
+  assert(memalloc_bump2_nslabs(ma) == 2);
+  memalloc_bump2_reset(ma, 0); // returns the second slab to the pool
+  assert(memalloc_bump2_nslabs(ma) == 1 && memalloc_bump2_use(ma) == 0);
+  memalloc_bump2_dispose(ma);
+
+  memalloc_bump2_poolstats(&st1);
+  ma = memalloc_bump2(0, 0);
+  assert(ma != memalloc_null());
+  m = mem_alloc_zeroed(ma, size);
+  assertnotnull(m.p);
+  for (usize i = 0; i < m.size; i++)
+    assertf(((u8*)m.p)[i] == 0, "byte %zu of %zu is 0x%02x", i, m.size, ((u8*)m.p)[i]);
+  memalloc_bump2_poolstats(&st2);
+  assertf(st2.nreused >= st1.nreused + 2, "%zu, %zu", st1.nreused, st2.nreused);
+  memalloc_bump2_dispose(ma);
+}
+
+
 typedef struct {
   thrd_t         t;  // thread handle
   memalloc_t     ma; // shared bump2 allocator
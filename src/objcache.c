@@ -0,0 +1,186 @@
+// content-addressed cache of objects compiled from generated C
+// SPDX-License-Identifier: Apache-2.0
+#include "colib.h"
+#include "objcache.h"
+#include "path.h"
+#include "dirwalk.h"
+
+#include <errno.h>
+#include <fcntl.h> // AT_FDCWD
+#include <stdio.h> // rename
+#include <sys/stat.h>
+#include <unistd.h> // getpid, unlink
+
+
+// buckets pruned by this process (one bit per {key[0]} directory)
+static _Atomic(u32) g_pruned[256/32];
+
+
+static void write_str(SHA256* state, const char* s) {
+  // include terminating NUL to separate strings
+  sha256_write(state, s, strlen(s) + 1);
+}
+
+
+void objcache_hash_compiler_version(SHA256* state) {
+  write_str(state, CO_VERSION_STR);
+  #if DEBUG
+    // debug builds of compis compile .co.c with different warning flags
+    write_str(state, "debug");
+  #endif
+  #if !defined(CO_DISTRIBUTION)
+    // development builds change without the version changing
+    // (note: CO_VERSION_GIT is only defined for main.c)
+    struct stat st;
+    if (stat(coexefile, &st) == 0) {
+      i64 v[2] = { (i64)st.st_size, (i64)st.st_mtime };
+      sha256_write(state, v, sizeof(v));
+    }
+  #endif
+}
+
+
+// add_deps adds pkg and all packages it depends on to the set pkgs
+static bool add_deps(ptrarray_t* pkgs, memalloc_t ma, const pkg_t* pkg) {
+  bool added;
+  if (!ptrarray_sortedset_addptr(pkgs, ma, pkg, &added))
+    return false;
+  if (!added)
+    return true;
+  for (u32 i = 0; i < pkg->imports.len; i++) {
+    if (!add_deps(pkgs, ma, pkg->imports.v[i]))
+      return false;
+  }
+  return true;
+}
+
+
+static int pkg_path_cmp(const pkg_t** a, const pkg_t** b, void* ctx) {
+  return strcmp((*a)->path.p, (*b)->path.p);
+}
+
+
+void objcache_key(
+  sha256_t* key, const compiler_t* c, const pkg_t* pkg, const char* cfile, slice_t ctext)
+{
+  SHA256 state;
+  sha256_init(&state, key);
+
+  objcache_hash_compiler_version(&state);
+  write_str(&state, c->target.triple);
+  for (usize i = 0; i < c->cflags_co.len; i++)
+    write_str(&state, c->cflags_co.strings[i]);
+
+  // source filename and working directory (pkg->dir) are recorded in debug info
+  write_str(&state, cfile);
+  write_str(&state, pkg->dir.p);
+
+  // The generated C includes the API headers of dependencies, which in turn
+  // may include headers of their dependencies. Each package is hashed once,
+  // in order of import path, so that the key does not depend on import order.
+  ptrarray_t deps = {};
+  bool ok = true;
+  for (u32 i = 0; ok && i < pkg->imports.len; i++)
+    ok = add_deps(&deps, c->ma, pkg->imports.v[i]);
+  if (ok && c->stdruntime_pkg && c->stdruntime_pkg != pkg)
+    ok = add_deps(&deps, c->ma, c->stdruntime_pkg);
+  if UNLIKELY(!ok) {
+    // OOM; no key means no caching
+    ptrarray_dispose(&deps, c->ma);
+    sha256_close(&state);
+    memset(key, 0, sizeof(*key));
+    return;
+  }
+  co_qsort(deps.v, deps.len, sizeof(deps.v[0]), (co_qsort_cmp)pkg_path_cmp, NULL);
+  for (u32 i = 0; i < deps.len; i++) {
+    const pkg_t* dep = deps.v[i];
+    write_str(&state, dep->path.p);
+    sha256_write(&state, &dep->api_sha256, sizeof(dep->api_sha256));
+  }
+  ptrarray_dispose(&deps, c->ma);
+
+  sha256_write(&state, ctext.p, ctext.len);
+  sha256_close(&state);
+}
+
+
+static void cachefile_path(char buf[PATH_MAX], const sha256_t* key, const char* suffix) {
+  const u8* k = (const u8*)key;
+  char hex[sizeof(sha256_t)*2 + 1];
+  for (usize i = 0; i < sizeof(sha256_t); i++) {
+    hex[i*2]   = "0123456789abcdef"[k[i] >> 4];
+    hex[i*2+1] = "0123456789abcdef"[k[i] & 0xf];
+  }
+  hex[sizeof(hex) - 1] = 0;
+  snprintf(buf, PATH_MAX, "%s" PATH_SEP_STR "obj" PATH_SEP_STR "%.2s" PATH_SEP_STR "%s%s",
+    cocachedir, hex, hex, suffix);
+}
+
+
+err_t objcache_get(const sha256_t* key, const char* ofile) {
+  char cachefile[PATH_MAX];
+  cachefile_path(cachefile, key, ".o");
+  if (!fs_isfile(cachefile))
+    return ErrNotFound;
+  // Note: copy rather than link since clang may write to ofile in place later
+  err_t err = fs_copyfile(cachefile, ofile, 0);
+  if (!err) {
+    // update mtime to keep the object from being pruned.
+    // Note: not fs_touch, which would create an empty file if the object was
+    // pruned by another process in the meantime.
+    struct timespec timebuf[2] = { {.tv_nsec = UTIME_NOW}, {.tv_nsec = UTIME_NOW} };
+    utimensat(AT_FDCWD, cachefile, timebuf, 0);
+  }
+  return err;
+}
+
+
+// prune_bucket removes objects (and abandoned temporary files) that have not been
+// used for OBJCACHE_MAX_AGE from the directory of bucket
+static void prune_bucket(u8 bucket) {
+  u32 bit = 1u << (bucket % 32);
+  if (AtomicOr(&g_pruned[bucket / 32], bit, memory_order_relaxed) & bit)
+    return; // already pruned by this process
+
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s" PATH_SEP_STR "obj" PATH_SEP_STR "%02x",
+    cocachedir, bucket);
+
+  unixtime_t mintime = unixtime_now() - OBJCACHE_MAX_AGE;
+  dirwalk_t* dw;
+  if (dirwalk_open(&dw, memalloc_ctx(), dir, 0))
+    return;
+  u32 npruned = 0;
+  while (dirwalk_next(dw) > 0) {
+    if (dw->type != S_IFREG)
+      continue;
+    struct stat* st = dirwalk_lstat(dw);
+    if (unixtime_of_stat_mtime(st) < mintime && unlink(dw->path) == 0)
+      npruned++;
+  }
+  dirwalk_close(dw);
+  if (npruned)
+    vlog("objcache: pruned %u unused object%s from %s",
+      npruned, npruned == 1 ? "" : "s", dir);
+}
+
+
+err_t objcache_put(const sha256_t* key, const char* ofile) {
+  char cachefile[PATH_MAX];
+  char tmpfile[PATH_MAX];
+  cachefile_path(cachefile, key, ".o");
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".o.tmp%d", (int)getpid());
+  cachefile_path(tmpfile, key, suffix);
+
+  // copy to a temporary file and rename it, so that a concurrent
+  // objcache_get never sees a partially-written object
+  err_t err = fs_copyfile(ofile, tmpfile, 0);
+  if (!err && rename(tmpfile, cachefile) != 0) {
+    err = err_errno();
+    unlink(tmpfile);
+  }
+  if (!err)
+    prune_bucket(*(const u8*)key);
+  return err;
+}
@@ -0,0 +1,38 @@
+// content-addressed cache of objects compiled from generated C
+// SPDX-License-Identifier: Apache-2.0
+//
+// Objects are stored in {cocachedir}/obj/{key[0]}/{key}.o where key is the
+// SHA-256 of the generated C text, the C flags used to compile it, the target,
+// the compiler version and the public APIs of all packages the C text includes.
+//
+// Objects that have not been used for OBJCACHE_MAX_AGE are removed. Each process
+// prunes a bucket directory {key[0]} the first time it adds an object to it, so the
+// cache is cleaned up as a side effect of building. To clear the cache entirely,
+// delete {cocachedir}/obj; it's recreated as needed.
+//
+#pragma once
+#include "compiler.h"
+#include "sha256.h"
+ASSUME_NONNULL_BEGIN
+
+// OBJCACHE_MAX_AGE is the time after which an unused object is pruned
+#define OBJCACHE_MAX_AGE ((unixtime_t)30*24*60*60*1000000) // 30 days
+
+// objcache_key computes the cache key for a generated C translation unit cfile
+// of pkg with C source text ctext.
+// key is all zeroes (meaning "don't cache") if memory allocation failed.
+void objcache_key(
+  sha256_t* key, const compiler_t* c, const pkg_t* pkg, const char* cfile, slice_t ctext);
+
+// objcache_hash_compiler_version adds the identity of the running compiler to state,
+// as it is in keys made by objcache_key
+void objcache_hash_compiler_version(SHA256* state);
+
+// objcache_get copies a cached object to ofile.
+// Returns ErrNotFound if there's no object for key in the cache.
+err_t objcache_get(const sha256_t* key, const char* ofile);
+
+// objcache_put adds ofile to the cache
+err_t objcache_put(const sha256_t* key, const char* ofile);
+
+ASSUME_NONNULL_END
@@ -15,7 +15,57 @@
 
 //——————————————————————— AST stats ———————————————————————
 #ifdef CO_DEBUG_AST_STATS
-typedef struct { const char* name; usize size; } ast_typeinfo_t;
+#include "ast_field.h"
+
+// The "ref32" sizes are estimates of what AST nodes would use if node and string
+// references were 32-bit offsets into the package's AST memory, symbols were
+// 32-bit IDs and nodearray_t were {u32 offset, u32 len}.
+// Only fields described by g_ast_fieldtab are considered.
+
+typedef struct {
+  const char* name;
+  usize size, ref32size;
+  usize nnodes, ref32saved; // counts of parsed nodes (see ast_stats_node)
+} ast_typeinfo_t;
+
+// counts of parsed nodes (updated by ast_stats_node & ast_stats_array)
+static _Atomic(usize) ast_stats_nnodes;
+static _Atomic(usize) ast_stats_nodebytes;
+static _Atomic(usize) ast_stats_node_ref32saved;
+static _Atomic(usize) ast_stats_arraybytes; // pointers in node arrays
+static _Atomic(usize) ast_stats_kind_nnodes[NODEKIND_COUNT];
+
+static usize ast_ref32_size(nodekind_t kind) {
+  usize size = g_ast_sizetab[kind];
+  const ast_field_t* fieldtab = g_ast_fieldtab[kind];
+  for (u8 i = 0; i < g_ast_fieldlentab[kind]; i++) {
+    switch ((enum ast_fieldtype)fieldtab[i].type) {
+      case AST_FIELD_SYM:  case AST_FIELD_SYMZ:
+      case AST_FIELD_NODE: case AST_FIELD_NODEZ:
+      case AST_FIELD_STR:  case AST_FIELD_STRZ:
+        size -= sizeof(void*) - 4; break;
+      case AST_FIELD_NODEARRAY:
+        size -= sizeof(nodearray_t) - 8; break;
+      default:
+        break;
+    }
+  }
+  return ALIGN2(size, sizeof(loc_t));
+}
+
+static void ast_stats_node(nodekind_t kind, usize size) {
+  AtomicAdd(&ast_stats_nnodes, 1, memory_order_relaxed);
+  AtomicAdd(&ast_stats_kind_nnodes[kind], 1, memory_order_relaxed);
+  AtomicAdd(&ast_stats_nodebytes, size, memory_order_relaxed);
+  if (size == g_ast_sizetab[kind]) {
+    AtomicAdd(&ast_stats_node_ref32saved, size - ast_ref32_size(kind),
+      memory_order_relaxed);
+  }
+}
+
+static void ast_stats_array(u32 len) {
+  AtomicAdd(&ast_stats_arraybytes, (usize)len * sizeof(void*), memory_order_relaxed);
+}
 
 static int sort_ast_typeinfo(
   const ast_typeinfo_t* x, const ast_typeinfo_t* y, void* nullable ctx)
@@ -23,72 +73,104 @@ static int sort_ast_typeinfo(
   return x->size < y->size ? -1 : y->size < x->size ? 1 : 0;
 }
 
-__attribute__((constructor)) static void print_ast_stats() {
-  ast_typeinfo_t ast_types[] = {
-    { "node_t", sizeof(node_t) },
-    { "type_t", sizeof(type_t) },
-    { "expr_t", sizeof(expr_t) },
-    { "unit_t", sizeof(unit_t) },
-    { "aliastype_t", sizeof(aliastype_t) },
-    { "arraylit_t", sizeof(arraylit_t) },
-    { "arraytype_t", sizeof(arraytype_t) },
-    { "binop_t", sizeof(binop_t) },
-    { "block_t", sizeof(block_t) },
-    { "call_t", sizeof(call_t) },
-    { "forexpr_t", sizeof(forexpr_t) },
-    { "fun_t", sizeof(fun_t) },
-    { "funtype_t", sizeof(funtype_t) },
-    { "idexpr_t", sizeof(idexpr_t) },
-    { "ifexpr_t", sizeof(ifexpr_t) },
-    { "local_t", sizeof(local_t) },
-    { "member_t", sizeof(member_t) },
-    { "retexpr_t", sizeof(retexpr_t) },
-    { "structtype_t", sizeof(structtype_t) },
-    { "subscript_t", sizeof(subscript_t) },
-    { "typecons_t", sizeof(typecons_t) },
-    { "typedef_t", sizeof(typedef_t) },
-    { "unaryop_t", sizeof(unaryop_t) },
-    { "unresolvedtype_t", sizeof(unresolvedtype_t) },
-    { "intlit_t", sizeof(intlit_t) },
-    { "floatlit_t", sizeof(floatlit_t) },
-    { "strlit_t", sizeof(strlit_t) },
-  };
-
-  co_qsort(ast_types, countof(ast_types), sizeof(ast_types[0]),
-    (co_qsort_cmp)sort_ast_typeinfo, NULL);
-
-  printf("——————————————————————— AST stats ———————————————————————\n");
-
+static void pct_fmt(char buf[16], usize before, usize after) {
+  if (before == 0) {
+    buf[0] = 0;
+  } else {
+    snprintf(buf, 16, "%+.0f%%", ((f64)after - (f64)before) * 100.0 / (f64)before);
+  }
+}
+
+// ast_typeinfo returns per-struct information, unique by struct type
+static usize ast_typeinfo(ast_typeinfo_t* types, usize cap) {
+  usize n = 0;
+  #define _(kind, TYPE, ...) { \
+    usize i = 0; \
+    while (i < n && strcmp(types[i].name, #TYPE) != 0) i++; \
+    if (i == n && n < cap) { \
+      types[n++] = (ast_typeinfo_t){ \
+        .name = #TYPE, .size = sizeof(TYPE), .ref32size = ast_ref32_size(kind) }; \
+    } \
+    if (i < n) { \
+      usize nnodes = AtomicLoad(&ast_stats_kind_nnodes[kind], memory_order_relaxed); \
+      types[i].nnodes += nnodes; \
+      types[i].ref32saved += nnodes * (sizeof(TYPE) - ast_ref32_size(kind)); \
+    } \
+  }
+  FOREACH_NODEKIND(_)
+  #undef _
+  return n;
+}
 
-  // #ifdef CO_DEBUG_AST_STATS
-  {
-    usize size_avg = 0;
-    usize size_max = 0;
-    int namew = 0;
-    for (usize i = 0; i < countof(ast_types); i++) {
-      namew = MAX(namew, (int)strlen(ast_types[i].name));
-      size_avg += ast_types[i].size;
-      size_max = MAX(size_max, ast_types[i].size);
-    }
-    size_avg /= countof(ast_types);
+// print_ast_usage prints the memory used by nodes created by parsers in this process
+static void print_ast_usage() {
+  usize nnodes = AtomicLoad(&ast_stats_nnodes, memory_order_relaxed);
+  if (nnodes == 0)
+    return;
+  usize nodebytes = AtomicLoad(&ast_stats_nodebytes, memory_order_relaxed);
+  usize node32 = nodebytes - AtomicLoad(&ast_stats_node_ref32saved, memory_order_relaxed);
+  usize arraybytes = AtomicLoad(&ast_stats_arraybytes, memory_order_relaxed);
+  usize array32 = arraybytes / 2;
+
+  ast_typeinfo_t types[NODEKIND_COUNT];
+  usize ntypes = ast_typeinfo(types, countof(types));
+
+  char pct[16];
+  printf("——————————————————— AST memory of parsed nodes ———————————————————\n");
+  printf("%-18s %10s %12s %12s %6s\n", "", "count", "bytes", "ref32 bytes", "");
+  for (usize i = 0; i < ntypes; i++) {
+    ast_typeinfo_t* t = &types[i];
+    if (t->nnodes == 0)
+      continue;
+    usize bytes = t->nnodes * t->size;
+    pct_fmt(pct, bytes, bytes - t->ref32saved);
+    printf("%-18s %10zu %12zu %12zu %6s\n",
+      t->name, t->nnodes, bytes, bytes - t->ref32saved, pct);
+  }
+  pct_fmt(pct, nodebytes, node32);
+  printf("%-18s %10zu %12zu %12zu %6s\n", "(all nodes)", nnodes, nodebytes, node32, pct);
+  pct_fmt(pct, arraybytes, array32);
+  printf("%-18s %10s %12zu %12zu %6s\n", "(node arrays)", "", arraybytes, array32, pct);
+  pct_fmt(pct, nodebytes + arraybytes, node32 + array32);
+  printf("%-18s %10s %12zu %12zu %6s\n", "total", "",
+    nodebytes + arraybytes, node32 + array32, pct);
+}
 
-    for (usize i = 0; i < countof(ast_types); i++)
-      printf("%-*s %3zu\n", namew, ast_types[i].name, ast_types[i].size);
-    printf("%-*s    \n",  namew, "");
-    printf("%-*s %3zu\n", namew, "average", size_avg);
-    printf("%-*s %3zu\n", namew, "max", size_max);
+__attribute__((constructor)) static void print_ast_stats() {
+  ast_typeinfo_t ast_types[NODEKIND_COUNT];
+  usize ntypes = ast_typeinfo(ast_types, countof(ast_types));
 
-    printf("\n");
-  }
-  // #else
-  //   printf("(build with -DCO_DEBUG_AST_STATS for more details)\n");
-  // #endif
+  co_qsort(ast_types, ntypes, sizeof(ast_types[0]),
+    (co_qsort_cmp)sort_ast_typeinfo, NULL);
 
+  printf("——————————————————————— AST stats ———————————————————————\n");
 
-  usize histogram_labels[countof(ast_types)] = {};
-  usize histogram_counts[countof(ast_types)] = {};
+  usize size_avg = 0, size_max = 0, ref32_avg = 0, ref32_max = 0;
+  int namew = 0;
+  for (usize i = 0; i < ntypes; i++) {
+    namew = MAX(namew, (int)strlen(ast_types[i].name));
+    size_avg += ast_types[i].size;
+    size_max = MAX(size_max, ast_types[i].size);
+    ref32_avg += ast_types[i].ref32size;
+    ref32_max = MAX(ref32_max, ast_types[i].ref32size);
+  }
+  size_avg /= ntypes;
+  ref32_avg /= ntypes;
+
+  printf("%-*s %4s %6s\n", namew, "", "size", "ref32");
+  for (usize i = 0; i < ntypes; i++) {
+    printf("%-*s %4zu %6zu\n",
+      namew, ast_types[i].name, ast_types[i].size, ast_types[i].ref32size);
+  }
+  printf("%-*s    \n",  namew, "");
+  printf("%-*s %4zu %6zu\n", namew, "average", size_avg, ref32_avg);
+  printf("%-*s %4zu %6zu\n", namew, "max", size_max, ref32_max);
+  printf("\n");
+
+  usize histogram_labels[NODEKIND_COUNT] = {};
+  usize histogram_counts[NODEKIND_COUNT] = {};
   usize histogram_len = 0;
-  for (usize i = 0; i < countof(ast_types); i++) {
+  for (usize i = 0; i < ntypes; i++) {
     bool found = false;
     for (usize j = 0; j < histogram_len; j++) {
       if (ast_types[i].size == histogram_labels[j]) {
@@ -108,6 +190,8 @@ __attribute__((constructor)) static void print_ast_stats() {
   fwrite(buf.p, buf.len, 1, stdout);
   buf_dispose(&buf);
   printf("—————————————————————————————————————————————————————————\n");
+
+  atexit(print_ast_usage);
 } // print_ast_stats
 #endif // CO_DEBUG_AST_STATS
 //——————————————————————— end AST stats ———————————————————————
@@ -496,6 +580,10 @@ static node_t* _mknode(parser_t* p, usize size, nodekind_t kind) {
   node_t* n = m.p;
   n->kind = kind;
   n->loc = currloc(p);
+  p->nnodes++;
+  #ifdef CO_DEBUG_AST_STATS
+    ast_stats_node(kind, size);
+  #endif
   return n;
 }
 
@@ -578,6 +666,9 @@ static bool nodearray_copy(nodearray_t* dst, memalloc_t ma, const nodearray_t* s
     dst->v = v;
     dst->len = src->len;
     dst->cap = src->len;
+    #ifdef CO_DEBUG_AST_STATS
+      ast_stats_array(src->len);
+    #endif
   }
   return true;
 }
@@ -646,6 +737,9 @@ static void pnodearray_assign1(parser_t* p, nodearray_t* dst, void* n1) {
   dst->v = v;
   dst->len = 1;
   dst->cap = 1;
+  #ifdef CO_DEBUG_AST_STATS
+    ast_stats_array(1);
+  #endif
 }
 
 
@@ -3,6 +3,7 @@
 #include "compiler.h"
 #include "path.h"
 #include "dirwalk.h"
+#include "astencode.h"
 
 #include <sys/stat.h>
 #include <err.h>
@@ -43,6 +44,8 @@ void pkg_dispose(pkg_t* pkg, memalloc_t ma) {
     map_dispose(&pkg->defs, ma);
   rwmutex_dispose(&pkg->defs_mu);
   typefuntab_dispose(&pkg->tfundefs);
+  if (pkg->apidec)
+    astdecoder_close(pkg->apidec);
 }
 
 
@@ -605,9 +608,8 @@ bool pkg_libfile(const pkg_t* pkg, const compiler_t* c, str_t* dst) {
 bool pkg_exefile(const pkg_t* pkg, const compiler_t* c, str_t* dst) {
   #define PKG_EXEDIRNAME "bin"
 
-  isize slashi = string_indexof(pkg->path.p, pkg->path.len, '/');
-  assert(slashi > -1);
-  slashi++;
+  // note: not PATH_SEP but "/" since pkg path is always POSIX style
+  isize slashi = string_indexof(pkg->path.p, pkg->path.len, '/') + 1;
 
   slice_t suffix = {};
   if (target_is_wasm(&c->target))
@@ -675,6 +677,22 @@ bool pkg_dir_of_root_and_path(str_t* dst, slice_t root, slice_t path) {
 }
 
 
+node_t* nullable pkg_api_member(pkg_t* pkg, u32 i) {
+  assert(i < pkg->api.len);
+  if (!pkg->apidec)
+    return pkg->api.v[i];
+  node_t* n = astdecoder_decode_root(pkg->apidec, i);
+  if (n && n->kind == EXPR_FUN && pkg->api_ns) {
+    // update the namespace type, which has type_unknown for members not yet
+    // decoded (see create_pkg_api_ns.) Several threads may store the same type.
+    nstype_t* nst = (nstype_t*)pkg->api_ns->type;
+    AtomicStore((_Atomic(node_t*)*)&nst->members.v[i],
+      (node_t*)((fun_t*)n)->type, memory_order_release);
+  }
+  return n;
+}
+
+
 node_t* nullable pkg_def_get(pkg_t* pkg, sym_t name) {
   node_t* n = NULL;
   rwmutex_rlock(&pkg->defs_mu);
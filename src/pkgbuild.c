@@ -2,12 +2,16 @@
 #include "colib.h"
 #include "pkgbuild.h"
 #include "astencode.h"
+#include "buildstats.h"
 #include "llvm/llvm.h"
+#include "objcache.h"
 #include "path.h"
 #include "sha256.h"
 #include "threadpool.h"
+#include "timeline.h"
 
 #include <sys/stat.h>
+#include <unistd.h> // unlink
 
 
 enum build_reason {
@@ -26,14 +30,16 @@ enum build_reason {
   _trace(opt_trace_import, 3, "import", "%*s" fmt, (indent), "", ##va)
 
 
-static err_t build_pkg(
+static err_t build_pkg_begin(
+  pkgbuild_t** pbp,
   pkgcell_t pkgc,
   compiler_t* c,
-  const char* outfile,
   memalloc_t api_ma,
   u32 pkgbuild_flags,
   enum build_reason build_reason);
 
+static err_t build_pkg_finish(pkgbuild_t* pb, err_t err, const char* outfile);
+
 static void load_dependency(
   compiler_t* c, memalloc_t api_ma, const pkgcell_t* parent, pkg_t* pkg, bool sync);
 
@@ -68,6 +74,7 @@ err_t pkgbuild_init(
 
   strlist_init(&pb->cfiles, c->ma);
   strlist_init(&pb->ofiles, c->ma);
+  srcfpdb_init(&pb->srcfpdb, c->ma);
 
   return 0;
 }
@@ -92,20 +99,29 @@ void pkgbuild_dispose(pkgbuild_t* pb) {
   memalloc_bump2_dispose(pb->ast_ma);
   strlist_dispose(&pb->cfiles);
   strlist_dispose(&pb->ofiles);
+  srcfpdb_dispose(&pb->srcfpdb);
   if (pb->promisev) {
     assert_promises_completed(pb);
     mem_freetv(pb->c->ma, pb->promisev, (usize)pb->pkgc.pkg->srcfiles.len);
   }
+  if (pb->objkeyv)
+    mem_freetv(pb->c->ma, pb->objkeyv, (usize)pb->pkgc.pkg->srcfiles.len);
+  if (pb->startedv)
+    mem_freetv(pb->c->ma, pb->startedv, (usize)pb->pkgc.pkg->srcfiles.len);
 }
 
 
 ATTR_FORMAT(printf,2,3)
 static void pkgbuild_begintask(pkgbuild_t* pb, const char* fmt, ...) {
+  if (pb->bgtmu)
+    mutex_lock(pb->bgtmu);
   pb->bgt->n++;
   va_list ap;
   va_start(ap, fmt);
   bgtask_setstatusv(pb->bgt, fmt, ap);
   va_end(ap);
+  if (pb->bgtmu)
+    mutex_unlock(pb->bgtmu);
 }
 
 
@@ -195,12 +211,12 @@ static const char* cfile_of_srcfile_id(pkgbuild_t* pb, u32 srcfile_id) {
 }
 
 
-static const char* cfile_of_unit(pkgbuild_t* pb, const unit_t* unit) {
+static u32 srcfile_id_of_unit(pkgbuild_t* pb, const unit_t* unit) {
   assert(pb->cfiles.len == pb->pkgc.pkg->srcfiles.len);
   assertnotnull(unit->srcfile);
   u32 srcfile_idx = ptrarray_rindexof(&pb->pkgc.pkg->srcfiles, unit->srcfile);
   assert(srcfile_idx < U32_MAX);
-  return cfile_of_srcfile_id(pb, (u32)srcfile_idx);
+  return (u32)srcfile_idx;
 }
 
 
@@ -224,6 +240,8 @@ static err_t compile_c_source(
   subprocs_t* subprocs = subprocs_create_promise(c->ma, promise);
   if (!subprocs)
     return ErrNoMem;
+  if (pb->pkgc.pkg->stats)
+    subprocs->lifetime = &pb->pkgc.pkg->stats->wall[BUILDPHASE_CLANG];
 
   // compile C -> object
   err_t err = compile_c_to_obj_async(c, subprocs, wdir, cfile, ofile, srctype);
@@ -262,13 +280,19 @@ err_t pkgbuild_locate_sources(pkgbuild_t* pb) {
   if (pb->c->opt_verbose)
     pb->bgt->ntotal += ncosrc;       // "cgen foo.co"
 
-  // allocate promise array
+  // allocate promise, objcache key and backend arrays
   if (pb->promisev) {
     assert_promises_completed(pb);
     mem_freetv(pb->c->ma, pb->promisev, (usize)pkg->srcfiles.len);
   }
+  if (pb->objkeyv)
+    mem_freetv(pb->c->ma, pb->objkeyv, (usize)pkg->srcfiles.len);
+  if (pb->startedv)
+    mem_freetv(pb->c->ma, pb->startedv, (usize)pkg->srcfiles.len);
   pb->promisev = mem_alloctv(pb->c->ma, promise_t, (usize)pkg->srcfiles.len);
-  if UNLIKELY(!pb->promisev) {
+  pb->objkeyv = mem_alloctv(pb->c->ma, sha256_t, (usize)pkg->srcfiles.len);
+  pb->startedv = mem_alloctv(pb->c->ma, bool, (usize)pkg->srcfiles.len);
+  if UNLIKELY(!pb->promisev || !pb->objkeyv || !pb->startedv) {
     pkgbuild_dispose(pb);
     return ErrNoMem;
   }
@@ -328,6 +352,8 @@ static void parse_co_file(
 {
   err_t err;
   parser_t parser;
+  u64 timeline_start = timeline_begin();
+  buildtimer_t timer = buildstats_begin(pkg->stats);
 
   if (( err = srcfile_open(srcfile) )) {
     elog("%s: %s", srcfile->name.p, err_str(err));
@@ -357,10 +383,19 @@ static void parse_co_file(
     dump_ast(assertnotnull((node_t*)result->unit));
   }
 
+  if (pkg->stats) {
+    AtomicAdd(&pkg->stats->nsrcfiles, 1, memory_order_relaxed);
+    AtomicAdd(&pkg->stats->srcbytes, srcfile->size, memory_order_relaxed);
+    AtomicAdd(&pkg->stats->ntokens, parser.scanner.ntokens, memory_order_relaxed);
+    AtomicAdd(&pkg->stats->nnodes, parser.nnodes, memory_order_relaxed);
+  }
+
   parser_dispose(&parser);
 
 end:
   srcfile_close(srcfile);
+  timeline_end(timeline_start, "parse", pkg->path.p, srcfile->name.p);
+  buildstats_end_cpu(pkg->stats, BUILDPHASE_PARSE, &timer);
   AtomicStoreRel(&result->err, err);
   sema_signal(&result->sem, 1);
 }
@@ -420,14 +455,16 @@ static err_t pkgbuild_parse(pkgbuild_t* pb) {
       // Parse sources serially when tracing is enabled or if there're no threads.
       // Also, parse last one on the current thread to make the most of what we have.
       parse_co_file(pkg, c, srcfile, pb->ast_ma, result);
-    } else {
-      threadpool_submit(parse_co_file, pkg, c, srcfile, pb->ast_ma, result);
+    } else if (threadpool_submit_for(
+      &result->sem, parse_co_file, pkg, c, srcfile, pb->ast_ma, result))
+    {
+      parse_co_file(pkg, c, srcfile, pb->ast_ma, result);
     }
   }
 
   // wait for results
   for (u32 i = 0; i < ncosrc; i++) {
-    safecheckx(sema_wait(&resultv[i].sem));
+    threadpool_sema_wait(&resultv[i].sem);
     err_t err1 = AtomicLoadAcq(&resultv[i].err);
     if (err1 && !err) {
       err = err1;
@@ -452,13 +489,35 @@ static err_t pkgbuild_parse(pkgbuild_t* pb) {
 }
 
 
+// srcfile_content_uptodate returns true if the contents of f are the same as
+// recorded in db. If only the stat data of f differs, its entry in db is updated.
+static bool srcfile_content_uptodate(srcfpdb_t* db, const pkg_t* pkg, const srcfile_t* f) {
+  srcfp_t* prev = srcfpdb_get(db, f->name.p);
+  if (!prev)
+    return false;
+  srcfp_t fp;
+  str_t path = path_join(pkg->dir.p, f->name.p);
+  bool ok = path.p && srcfp_make(&fp, path.p, prev) == 0 &&
+            memcmp(&fp.sha256, &prev->sha256, sizeof(fp.sha256)) == 0;
+  str_free(path);
+  if (ok && !srcfp_stat_eq(&fp, prev))
+    srcfpdb_set(db, f->name.p, &fp);
+  return ok;
+}
+
+
 // check_pkg_src_uptodate stats pkg->files and compares their mtime to product_mtime.
 // It also compares the names at pkg->files to readdir(pkg->dir).
 // product_mtime should be the timestamp of a package product, like metafile or libfile.
 // If a source file is newer than product_mtime, the set of files on disk has changed
 // or an I/O error occurred, false is returned to signal ""
-static bool check_pkg_src_uptodate(pkg_t* pkg, unixtime_t product_mtime) {
+// With c->opt_contenthash, the contents of source files are instead compared to
+// those recorded in the package's fingerprint database, when there is one.
+static bool check_pkg_src_uptodate(compiler_t* c, pkg_t* pkg, unixtime_t product_mtime) {
   bool ok = false;
+  str_t dbfile = {};
+  srcfpdb_t db;
+  srcfpdb_init(&db, c->ma);
 
   // First we need to scan for added or removed source files on disk.
   // Since we "own" pkg here, it's safe to modify its srcfiles array, which we'll
@@ -481,10 +540,15 @@ static bool check_pkg_src_uptodate(pkg_t* pkg, unixtime_t product_mtime) {
   if (cached_srcfiles.len != pkg->srcfiles.len)
     goto end;
 
+  // a package last built without --content-hash has no fingerprint database
+  bool usedb = c->opt_contenthash &&
+               pkg_buildfile(pkg, c, &dbfile, PKG_SRCFP_NAME) &&
+               srcfpdb_load(&db, dbfile.p) == 0;
+
   // Find renamed, added, removed or modified files.
   // Since srcfilearray_t is sorted (by name) we can find name differences
   // simply by comparing file by file.
-  // We also take this opportunity to check mtime.
+  // We also take this opportunity to check mtime (or contents.)
   for (u32 i = 0; i < cached_srcfiles.len; i++) {
     srcfile_t* cached_srcfile = cached_srcfiles.v[i];
     srcfile_t* found_srcfile = pkg->srcfiles.v[i];
@@ -492,7 +556,10 @@ static bool check_pkg_src_uptodate(pkg_t* pkg, unixtime_t product_mtime) {
       //dlog("newfound srcfile: %s", found_srcfile->name.p);
       goto end;
     }
-    if (found_srcfile->mtime > product_mtime) {
+    if (usedb) {
+      if (!srcfile_content_uptodate(&db, pkg, found_srcfile))
+        goto end;
+    } else if (found_srcfile->mtime > product_mtime) {
       //dlog("modified srcfile: %s", pkg->srcfiles.v[i].name.p);
       goto end;
     }
@@ -501,16 +568,26 @@ static bool check_pkg_src_uptodate(pkg_t* pkg, unixtime_t product_mtime) {
   // pkg is up-to-date; source files have not changed since product was created
   ok = true;
 
+  // record new stat data of files which were touched without being modified,
+  // so that they need not be hashed again next time
+  if (usedb && db.modified)
+    srcfpdb_save(&db, dbfile.p);
+
 end:
   // note: we are NOT using srcfilearray_dispose here since that would dispose
   // of the srcfile structs as well, which are owned by the pkg->srcfiles array.
   ptrarray_dispose(&cached_srcfiles, memalloc_ctx());
+  srcfpdb_dispose(&db);
+  str_free(dbfile);
   return ok;
 }
 
 
-// create_pkg_api_ns creates pkg->api_ns from pkg->api
-static err_t create_pkg_api_ns(memalloc_t api_ma, pkg_t* pkg) {
+// create_pkg_api_ns creates pkg->api_ns from pkg->api.
+// If names is not NULL, it holds the name of each member and is used as
+// api_ns->member_names, and members which are not yet decoded are NULL.
+// The type of such members is type_unknown until pkg_api_member decodes them.
+static err_t create_pkg_api_ns(memalloc_t api_ma, pkg_t* pkg, sym_t* nullable names) {
   nsexpr_t* ns = NULL;
 
   // allocate namespace type
@@ -525,9 +602,12 @@ static err_t create_pkg_api_ns(memalloc_t api_ma, pkg_t* pkg) {
   ns = (nsexpr_t*)ast_mknode(api_ma, sizeof(nsexpr_t), EXPR_NS);
   if (!ns)
     goto oom;
-  sym_t* member_names = mem_alloc(api_ma, sizeof(sym_t) * (usize)pkg->api.len).p;
-  if (!member_names)
-    goto oom;
+  sym_t* member_names = names;
+  if (!member_names) {
+    member_names = mem_alloc(api_ma, sizeof(sym_t) * (usize)pkg->api.len).p;
+    if (!member_names)
+      goto oom;
+  }
   ns->flags |= NF_CHECKED | NF_PKGNS;
   ns->name = sym__;
   ns->type = (type_t*)nst;
@@ -538,6 +618,11 @@ static err_t create_pkg_api_ns(memalloc_t api_ma, pkg_t* pkg) {
   // populate namespace type members and member_names
   for (u32 i = 0; i < pkg->api.len; i++) {
     node_t* n = pkg->api.v[i];
+    if (!n) {
+      // not yet decoded (see pkg_api_member)
+      nst->members.v[i] = (node_t*)type_unknown;
+      continue;
+    }
     switch (n->kind) {
       case EXPR_FUN: {
         fun_t* fn = (fun_t*)n;
@@ -585,11 +670,18 @@ oom:
 }
 
 
-// load_pkg_api decodes AST from astdec and assigns it to pkg->api
-static err_t load_pkg_api(memalloc_t api_ma, pkg_t* pkg, astdecoder_t* astdec) {
+// load_pkg_api decodes AST from astdec and assigns it to pkg->api.
+// With a binary metafile, only the names of the declarations are decoded;
+// declarations are decoded as they are used (see pkg_api_member), which
+// for most importers is a small fraction of the API. In that case astdec is
+// assigned to pkg->apidec and *astdecp is set to NULL.
+static err_t load_pkg_api(memalloc_t api_ma, pkg_t* pkg, astdecoder_t** astdecp) {
   node_t** nodev;
+  sym_t* namev = NULL;
   u32 nodec;
-  err_t err = astdecoder_decode_ast(astdec, &nodev, &nodec);
+  err_t err = astdecoder_decode_lazy(*astdecp, &nodev, &namev, &nodec);
+  if (err == ErrNotSupported) // text format
+    err = astdecoder_decode_ast(*astdecp, &nodev, &nodec);
   if (err) {
     dlog("astdecode error: %s", err_str(err));
     return err;
@@ -602,7 +694,14 @@ static err_t load_pkg_api(memalloc_t api_ma, pkg_t* pkg, astdecoder_t* astdec) {
   pkg->api.cap = nodec;
   pkg->api.len = nodec;
 
-  return create_pkg_api_ns(api_ma, pkg);
+  if (( err = create_pkg_api_ns(api_ma, pkg, namev) ))
+    return err;
+
+  if (namev) {
+    pkg->apidec = *astdecp;
+    *astdecp = NULL;
+  }
+  return 0;
 }
 
 
@@ -617,159 +716,225 @@ static const char* build_reason_str(enum build_reason build_reason) {
 }
 
 
-static err_t build_dependency(
-  compiler_t* c, memalloc_t api_ma, pkgcell_t pkgc, enum build_reason build_reason)
-{
-  trace_import("\"%s\" building dependency \"%s\" (%s)",
-    pkgc.parent->pkg->path.p, pkgc.pkg->path.p, build_reason_str(build_reason));
-  u32 pkgbuildflags = PKGBUILD_DEP;
-  err_t err = build_pkg(pkgc, c, /*outfile*/"", api_ma, pkgbuildflags, build_reason);
-  if (err)
-    dlog("error while building pkg %s: %s", pkgc.pkg->path.p, err_str(err));
-  return err;
-}
-
+// pkgtask_t is a package being loaded (and possibly built) as a dependency.
+// Rather than blocking a thread while its own dependencies load, a task parks
+// (see pkgtask_await) and is resumed on a pool thread once they have all finished,
+// so any number of packages can be in flight with only comaxproc threads.
+typedef struct pkgtask_ pkgtask_t;
+typedef void(*pkgtask_fun_t)(pkgtask_t* t);
+struct pkgtask_ {
+  compiler_t*       c;
+  memalloc_t        api_ma;
+  pkgcell_t         pkgc;
+  err_t             err;
+  pkgtask_fun_t     resume;     // called when the futures of pkgtask_await finish
+  _Atomic(u32)      nwait;      // number of futures not yet finished (+1 while parking)
+  u32               waitercap;
+  futurewaiter_t*   waiterv;    // registered with the futures of pkgtask_await
+  pkgbuild_t*       pb;         // package being built by build_dependency
+  pkgtask_fun_t     build_done; // called when build_dependency is done
+
+  // load_dependency0 state
+  str_t             metafile;   // path to metafile
+  unixtime_t        libmtime;   // mtime of package library file
+  const void*       encdata;    // contents of metafile
+  struct stat       metast;     // status of metafile
+  astdecoder_t*     astdec;
+  bool              did_build;  // true if we have called build_dependency
+  sha256_t*         imports_api_sha256v;
+  u32               imports_api_sha256c;
+  enum build_reason build_reason;
+};
 
-static bool load_dependency1(
-  compiler_t* c,
-  memalloc_t api_ma,
-  pkgcell_t pkgc,
-  const sha256_t* old_api_sha256v,
-  err_t* errp)
-{
-  pkg_t* pkg = pkgc.pkg;
 
-  // check if source files have been modified
-  if (pkg->mtime == 0)
-    return false;
-  if (!check_pkg_src_uptodate(pkg, pkg->mtime))
-    return false;
+static void pkgtask_run(pkgtask_t* t) {
+  t->resume(t);
+}
 
-  err_t err = 0;
-  bool is_uptodate = true;
 
-  // load sub-dependencies packages (which might cause us to build them.)
-  for (u32 i = 0; i < pkg->imports.len; i++) {
-    pkg_t* dep = pkg->imports.v[i];
-    // load last one sync to make full use of the current thread
-    bool use_curr_thread = (i == pkg->imports.len - 1);
-    load_dependency(c, api_ma, &pkgc, dep, use_curr_thread);
-  }
+static void pkgtask_wake(void* arg) {
+  pkgtask_t* t = arg;
+  if (AtomicSub(&t->nwait, 1, memory_order_acq_rel) > 1)
+    return;
+  // Last future finished. Resume on a pool thread rather than on the stack of
+  // the thread which finished it; that thread is in the middle of future_finalize.
+  if (threadpool_submit(pkgtask_run, t))
+    t->resume(t);
+}
 
-  // wait for dependencies to finish loading and check their status
-  for (u32 i = 0; i < pkg->imports.len; i++) {
-    pkg_t* dep = pkg->imports.v[i];
-    trace_import("%s: waiting for pkg(%s) to load...", __FUNCTION__, dep->path.p);
-    if (( err = future_wait(&dep->loadfut) ))
-      goto end;
 
-    // if the dependency was modified earlier than the dependant, it's up to date
-    if (dep->mtime <= pkg->mtime)
-      continue;
+// pkgtask_await parks t until the loadfut of every package in depv has finished,
+// then calls resume(t). If they have all already finished, resume is called
+// immediately, on the calling thread.
+static void pkgtask_await(pkgtask_t* t, pkg_t*const* depv, u32 depc, pkgtask_fun_t resume) {
+  t->resume = resume;
+
+  if (depc > t->waitercap) {
+    void* p = mem_resizev(
+      t->c->ma, t->waiterv, t->waitercap, depc, sizeof(futurewaiter_t));
+    if (!p) {
+      // can't park without waiters; block this thread instead
+      dlog("mem_resizev(%p,%u,%u) OOM", t->waiterv, t->waitercap, depc);
+      for (u32 i = 0; i < depc; i++)
+        threadpool_future_wait(&depv[i]->loadfut);
+      return resume(t);
+    }
+    t->waiterv = p;
+    t->waitercap = depc;
+  }
+
+  // hold one extra count while registering waiters, so that t is not resumed
+  // before we are done registering
+  AtomicStore(&t->nwait, depc + 1, memory_order_relaxed);
+  u32 nfinished = 1;
+  for (u32 i = 0; i < depc; i++) {
+    futurewaiter_t* w = &t->waiterv[i];
+    w->fn = pkgtask_wake;
+    w->arg = t;
+    if (!future_notify(&depv[i]->loadfut, w))
+      nfinished++;
+  }
+  if (AtomicSub(&t->nwait, nfinished, memory_order_acq_rel) == nfinished)
+    resume(t);
+}
 
-    // The dependency has recently been modified (maybe we just built it.)
-    // Check if its API changed
-    if (memcmp(&old_api_sha256v[i], &dep->api_sha256, 32) != 0) {
-      // dep API changed (or was previously unknown)
-      trace_import("[%s] dep \"%s\" changed", pkg->path.p, relpath(dep->dir.p));
 
-      // note: it's okay to stop early and not future_wait all dependencies since
-      // load_dependency0 will call build_dependency when we return false, which in turn
-      // will future_wait all its dependencies.
-      is_uptodate = false;
-      break;
-    }
+static void build_dependency1(pkgtask_t* t) {
+  t->err = build_pkg_finish(t->pb, t->err, /*outfile*/"");
+  t->pb = NULL;
+  if (t->err)
+    dlog("error while building pkg %s: %s", t->pkgc.pkg->path.p, err_str(t->err));
+  t->build_done(t);
+}
 
-    trace_import("[%s] API of \"%s\" unchanged", pkg->path.p, dep->path.p);
-  }
 
-end:
-  return is_uptodate && err == 0;
+// build_dependency builds t's package and then calls done(t), with t->err set
+// to the result of the build
+static void build_dependency(pkgtask_t* t, pkgtask_fun_t done) {
+  pkgcell_t pkgc = t->pkgc;
+  trace_import("\"%s\" building dependency \"%s\" (%s)",
+    pkgc.parent->pkg->path.p, pkgc.pkg->path.p, build_reason_str(t->build_reason));
+  t->did_build = true;
+  t->build_done = done;
+  u32 pkgbuildflags = PKGBUILD_DEP;
+  t->err = build_pkg_begin(
+    &t->pb, pkgc, t->c, t->api_ma, pkgbuildflags, t->build_reason);
+  if (!t->pb) {
+    dlog("error while building pkg %s: %s", pkgc.pkg->path.p, err_str(t->err));
+    return done(t);
+  }
+  if (t->err)
+    return build_dependency1(t);
+  // wait for the package's imports to load
+  pkgtask_await(t, (pkg_t*const*)pkgc.pkg->imports.v, pkgc.pkg->imports.len,
+    build_dependency1);
 }
 
 
-// load_dependency0
+// Loading a dependency is done in steps, each of which ends by calling the next
+// one, either directly or as a continuation when waiting for other packages:
 //
-// 1. check if there's a valid metafile, and if so, load it, and:
-//    1. parse header of metafile
-//    2. compare mtime of sources to metafile; if a src is newer, we must rebuild
+// load_dependency0
+//   1. check if there's a library file; if not, build the package
+// load_open_metafile
+//   2. check if there's a valid metafile, and if so, load it, and:
+//      1. parse header of metafile
+//      2. compare mtime of sources to metafile; if a src is newer, we must rebuild
+//      3. load sub-dependencies
+// load_check_imports
+//   3. compare API checksums of sub-dependencies; if an API changed, we must rebuild
+// load_api
+//   4. load the package's API
+// load_end
+//   5. finalize pkg->loadfut and free t
 //
-static void load_dependency0(
-  compiler_t* c, memalloc_t api_ma, const pkgcell_t* parent, pkg_t* pkg)
-{
-  err_t err;
-  str_t metafile = {};       // path to metafile
-  unixtime_t libmtime = 0;    // mtime of package library file
-  const void* encdata = NULL; // contents of metafile
-  struct stat metast;         // status of metafile
-  astdecoder_t* astdec = NULL;
-  bool did_build = false; // true if we have called build_dependency
-  pkgcell_t pkgc = { .parent = parent, .pkg = pkg };
-  sha256_t* imports_api_sha256v = NULL;
-  u32 imports_api_sha256c = 0;
-  enum build_reason build_reason = BUILD_REASON_DEFAULT;
+static void load_open_metafile(pkgtask_t* t);
+static void load_check(pkgtask_t* t);
+static void load_end(pkgtask_t* t);
+
+
+static void load_dependency0(pkgtask_t* t) {
+  compiler_t* c = t->c;
+  pkg_t* pkg = t->pkgc.pkg;
 
   // get library file mtime
   str_t libfile = {};
   if (!pkg_libfile(pkg, c, &libfile)) {
-    err = ErrNoMem;
-    goto end;
+    t->err = ErrNoMem;
+    return load_end(t);
   }
-  libmtime = fs_mtime(libfile.p);
-  vlog("load dependency \"%s\"", pkgc.pkg->path.p);
+  t->libmtime = fs_mtime(libfile.p);
+  vlog("load dependency \"%s\"", pkg->path.p);
   str_free(libfile);
 
   // construct metafile path
-  if (!pkg_buildfile(pkg, c, &metafile, PKG_METAFILE_NAME)) {
-    err = ErrNoMem;
-    goto end;
+  if (!pkg_buildfile(pkg, c, &t->metafile, PKG_METAFILE_NAME)) {
+    t->err = ErrNoMem;
+    return load_end(t);
   }
 
   // if no libfile exist, build
-  if (libmtime == 0) {
-    did_build = true;
-    build_reason = BUILD_REASON_NO_LIBFILE;
-    if (( err = build_dependency(c, api_ma, pkgc, build_reason) )) {
-      dlog("build_dependency: %s", err_str(err));
-      encdata = NULL;
-      goto end;
+  if (t->libmtime == 0) {
+    t->build_reason = BUILD_REASON_NO_LIBFILE;
+    return build_dependency(t, load_open_metafile);
+  }
+
+  load_open_metafile(t);
+}
+
+
+// load_open_metafile opens & decodes the metafile.
+// It is also the continuation of build_dependency.
+static void load_open_metafile(pkgtask_t* t) {
+  compiler_t* c = t->c;
+  pkg_t* pkg = t->pkgc.pkg;
+  err_t err;
+
+  if (t->did_build) {
+    if (t->err) {
+      dlog("build_dependency: %s", err_str(t->err));
+      return load_end(t);
+    }
+    // close old metafile and associated resources
+    if (t->astdec) {
+      astdecoder_close(t->astdec);
+      t->astdec = NULL;
+    }
+    if (t->encdata) {
+      mmap_unmap((void*)t->encdata, t->metast.st_size);
+      t->encdata = NULL;
     }
   }
 
   // try to open metafile in read-only mode
-open_metafile:
-  if UNLIKELY(( err = mmap_file_ro(metafile.p, &encdata, &metast) )) {
+  if UNLIKELY(( err = mmap_file_ro(t->metafile.p, &t->encdata, &t->metast) )) {
     // note: encdata is set to NULL when mmap_file_ro fails
+    t->err = err;
     if (err != ErrNotFound) {
-      elog("%s: failed to read (%s)", relpath(metafile.p), err_str(err));
-      goto end;
+      elog("%s: failed to read (%s)", relpath(t->metafile.p), err_str(err));
+      return load_end(t);
     }
 
     // if this is our second attempt and the file is still not showing;
     // something is broken with build_pkg or the file system (or a race happened)
-    if (did_build) {
-      elog("%s: failed to build", relpath(metafile.p));
-      goto end;
+    if (t->did_build) {
+      elog("%s: failed to build", relpath(t->metafile.p));
+      return load_end(t);
     }
 
     // build package and then try opening metafile again
-    did_build = true;
-    build_reason = BUILD_REASON_NO_METAFILE;
-    if (( err = build_dependency(c, api_ma, pkgc, build_reason) )) {
-      dlog("build_dependency: %s", err_str(err));
-      goto end;
-    }
-    goto open_metafile;
+    t->build_reason = BUILD_REASON_NO_METAFILE;
+    return build_dependency(t, load_open_metafile);
   }
 
   // when we get here, the metafile is open for reading
 
   // open an AST decoder
-  astdec = astdecoder_open(c, api_ma, metafile.p, encdata, metast.st_size);
-  if (!astdec) {
-    err = ErrNoMem;
-    dlog("astdecoder_open: %s", err_str(err));
-    goto end;
+  t->astdec = astdecoder_open(c, t->api_ma, t->metafile.p, t->encdata, t->metast.st_size);
+  if (!t->astdec) {
+    t->err = ErrNoMem;
+    dlog("astdecoder_open: %s", err_str(t->err));
+    return load_end(t);
   }
 
   // decode package information; astdecoder_decode_header populates ...
@@ -777,79 +942,138 @@ open_metafile:
   // - decpkg.files via pkg_add_srcfile
   // - length of decpkg.imports
   u32 importcount;
-  if (( err = astdecoder_decode_header(astdec, pkg, &importcount) )) {
+  if (( err = astdecoder_decode_header(t->astdec, pkg, &importcount) )) {
     dlog("astdecoder_decode_header: %s", err_str(err));
   } else {
     // update pkg->mtime to mtime of metafile
-    pkg->mtime = MIN(libmtime, unixtime_of_stat_mtime(&metast));
+    pkg->mtime = MIN(t->libmtime, unixtime_of_stat_mtime(&t->metast));
 
     // allocate memory for memorized API checksums
-    if (importcount > 0) {
-      void* p = mem_resizev(
-        c->ma, imports_api_sha256v, imports_api_sha256c, importcount, sizeof(sha256_t));
+    if (importcount > t->imports_api_sha256c) {
+      void* p = mem_resizev(c->ma, t->imports_api_sha256v, t->imports_api_sha256c,
+        importcount, sizeof(sha256_t));
       if (!p) {
         dlog("mem_resizev(%p,%u,%u) OOM",
-          imports_api_sha256v, imports_api_sha256c, importcount);
-        err = ErrNoMem;
-        goto end;
+          t->imports_api_sha256v, t->imports_api_sha256c, importcount);
+        t->err = ErrNoMem;
+        return load_end(t);
       }
-      imports_api_sha256v = p;
+      t->imports_api_sha256v = p;
+      t->imports_api_sha256c = importcount;
     }
-    imports_api_sha256c = importcount;
 
     // decode imports
-    if (( err = astdecoder_decode_imports(astdec, pkg, imports_api_sha256v)) )
+    if (( err = astdecoder_decode_imports(t->astdec, pkg, t->imports_api_sha256v)) )
       dlog("astdecoder_decode_imports: %s", err_str(err));
   }
 
   // check for decoding errors
   if (err) {
-    if (did_build)
-      goto end;
-    dlog("attempting rebuild (invalid metafile \"%s\")", relpath(metafile.p));
+    t->err = err;
+    if (t->did_build)
+      return load_end(t);
+    dlog("attempting rebuild (invalid metafile \"%s\")", relpath(t->metafile.p));
     // try building; maybe the metafile is b0rked
-    build_reason = BUILD_REASON_BAD_METAFILE;
+    t->build_reason = BUILD_REASON_BAD_METAFILE;
     pkg->mtime = 0;
-    err = 0;
   }
+  t->err = 0;
 
-  // unless we just built the package, check source files and load sub-dependencies
-rebuild:
-  if (!did_build &&
-      ( pkg->mtime == 0 ||
-        !load_dependency1(c, api_ma, pkgc, imports_api_sha256v, &err) ) )
-  {
-    if (err)
-      goto end;
-    // source files have been modified
-    // must clear any srcfiles & imports loaded from (possibly stale) metafile
-    pkg->srcfiles.len = 0;
-    pkg->imports.len = 0;
+  load_check(t);
+}
 
-    // at least one source file has been modified since metafile was modified
-    did_build = true;
-    if (build_reason == BUILD_REASON_DEFAULT)
-      build_reason = BUILD_REASON_SRC_CHANGE;
-    if (( err = build_dependency(c, api_ma, pkgc, build_reason) ))
-      goto end;
 
-    // close old metafile and associated resources
-    astdecoder_close(astdec); astdec = NULL;
-    mmap_unmap((void*)encdata, metast.st_size); encdata = NULL;
+static void load_api(pkgtask_t* t);
+static void load_check_imports(pkgtask_t* t);
+
+
+static void load_rebuild(pkgtask_t* t) {
+  pkg_t* pkg = t->pkgc.pkg;
+
+  // must clear any srcfiles & imports loaded from (possibly stale) metafile
+  pkg->srcfiles.len = 0;
+  pkg->imports.len = 0;
+
+  if (t->build_reason == BUILD_REASON_DEFAULT)
+    t->build_reason = BUILD_REASON_SRC_CHANGE;
+
+  // build, then open the new metafile
+  build_dependency(t, load_open_metafile);
+}
+
+
+// load_check checks source files and loads sub-dependencies, unless we just
+// built the package
+static void load_check(pkgtask_t* t) {
+  pkg_t* pkg = t->pkgc.pkg;
+
+  if (t->did_build)
+    return load_api(t);
+
+  // check if source files have been modified
+  if (pkg->mtime == 0 || !check_pkg_src_uptodate(t->c, pkg, pkg->mtime))
+    return load_rebuild(t);
+
+  // load sub-dependencies packages (which might cause us to build them.)
+  for (u32 i = 0; i < pkg->imports.len; i++) {
+    pkg_t* dep = pkg->imports.v[i];
+    // load last one sync to make full use of the current thread
+    bool use_curr_thread = (i == pkg->imports.len - 1);
+    load_dependency(t->c, t->api_ma, &t->pkgc, dep, use_curr_thread);
+  }
+
+  // wait for dependencies to finish loading
+  trace_import("[%s] waiting for %u dependencies to load", pkg->path.p, pkg->imports.len);
+  pkgtask_await(t, (pkg_t*const*)pkg->imports.v, pkg->imports.len, load_check_imports);
+}
+
+
+static void load_check_imports(pkgtask_t* t) {
+  pkg_t* pkg = t->pkgc.pkg;
+
+  // check status of dependencies
+  for (u32 i = 0; i < pkg->imports.len; i++) {
+    pkg_t* dep = pkg->imports.v[i];
+    safecheckx(future_trywait(&dep->loadfut, &t->err));
+    if (t->err)
+      return load_end(t);
+
+    // if the dependency was modified earlier than the dependant, it's up to date
+    if (dep->mtime <= pkg->mtime)
+      continue;
+
+    // The dependency has recently been modified (maybe we just built it.)
+    // Check if its API changed
+    if (memcmp(&t->imports_api_sha256v[i], &dep->api_sha256, 32) != 0) {
+      // dep API changed (or was previously unknown)
+      trace_import("[%s] dep \"%s\" changed", pkg->path.p, relpath(dep->dir.p));
+      return load_rebuild(t);
+    }
 
-    // open the new metafile
-    goto open_metafile;
+    trace_import("[%s] API of \"%s\" unchanged", pkg->path.p, dep->path.p);
   }
 
+  load_api(t);
+}
+
+
+static void load_api(pkgtask_t* t) {
   // Load the package's API
-  if (( err = load_pkg_api(api_ma, pkg, astdec) ) && !did_build) {
+  t->err = load_pkg_api(t->api_ma, t->pkgc.pkg, &t->astdec);
+  if (t->err && !t->did_build) {
     // try building; maybe the metafile is b0rked
-    pkg->mtime = 0;
-    err = 0;
-    goto rebuild;
+    t->pkgc.pkg->mtime = 0;
+    t->err = 0;
+    return load_check(t);
   }
+  load_end(t);
+}
 
-end:
+
+static void load_end(pkgtask_t* t) {
+  compiler_t* c = t->c;
+  pkg_t* pkg = t->pkgc.pkg;
+  err_t err = t->err;
 
   future_finalize(&pkg->loadfut, err);
   if (err) {
@@ -858,13 +1082,16 @@ end:
     trace_import("loaded package \"%s\" OK", pkg->path.p);
   }
 
-  if (astdec)
-    astdecoder_close(astdec);
-  if (encdata)
-    mmap_unmap((void*)encdata, metast.st_size);
-  if (imports_api_sha256v)
-    mem_freetv(c->ma, imports_api_sha256v, imports_api_sha256c);
-  str_free(metafile);
+  if (t->astdec)
+    astdecoder_close(t->astdec);
+  if (t->encdata)
+    mmap_unmap((void*)t->encdata, t->metast.st_size);
+  if (t->imports_api_sha256v)
+    mem_freetv(c->ma, t->imports_api_sha256v, t->imports_api_sha256c);
+  if (t->waiterv)
+    mem_freetv(c->ma, t->waiterv, t->waitercap);
+  str_free(t->metafile);
+  mem_freet(c->ma, t);
 }
 
 
@@ -876,17 +1103,26 @@ static void load_dependency(
     return;
   }
 
+  pkgtask_t* t = mem_alloct(c->ma, pkgtask_t);
+  if (!t) {
+    future_finalize(&pkg->loadfut, ErrNoMem);
+    return;
+  }
+  t->c = c;
+  t->api_ma = api_ma;
+  t->pkgc = (pkgcell_t){ .parent = parent, .pkg = pkg };
+
   // if COMAXPROC is set to 1 or there is only one CPU available, don't use threads
   if (comaxproc == 1 || sync) {
-    load_dependency0(c, api_ma, parent, pkg);
+    load_dependency0(t);
     return;
   }
 
-  UNUSED err_t err;
-  err = threadpool_submit(load_dependency0, c, api_ma, parent, pkg);
-  // threadpool_submit only fails if we pass more than THREADPOOL_MAX_ARGS, which is
-  // checked at compile time when using threadpool_submit instead of threadpool_submitv.
-  assertf(!err, "threadpool_submit: %s", err_str(err));
+  // Submitting for loadfut allows a thread waiting for the package to load it,
+  // if no other thread has started loading it yet.
+  // threadpool_submit_for only fails when the job queue can't grow; load it here.
+  if (threadpool_submit_for(&pkg->loadfut, load_dependency0, t))
+    load_dependency0(t);
 }
 
 
@@ -994,14 +1230,27 @@ err_t pkgbuild_import(pkgbuild_t* pb) {
     load_dependency(pb->c, pb->api_ma, &pb->pkgc, dep, use_curr_thread);
   }
 
+  return 0;
+}
+
+
+err_t pkgbuild_import_wait(pkgbuild_t* pb) {
+  pkg_t* pkg = pb->pkgc.pkg;
+  err_t err = 0;
+
+  if (pkg->imports.len == 0)
+    return 0;
+
   // wait for imported packages to load
+  u64 timeline_start = timeline_begin();
   for (u32 i = 0; i < pkg->imports.len; i++) {
     pkg_t* dep = pkg->imports.v[i];
     trace_import("%s: waiting for pkg(%s) to load...", __FUNCTION__, dep->path.p);
     // note: it's okay to stop early and not future_wait all dependencies
-    if (( err = future_wait(&dep->loadfut) ))
+    if (( err = threadpool_future_wait(&dep->loadfut) ))
       break;
   }
+  timeline_end(timeline_start, "import wait", pkg->path.p, NULL);
 
   #ifdef DEBUG
   if (opt_trace_import) {
@@ -1054,10 +1303,21 @@ err_t pkgbuild_analyze(pkgbuild_t* pb) {
   }
 
   // typecheck
-  if (( err = typecheck(c, pb->ast_ma, pb->pkgc.pkg, pb->unitv, pb->unitc) )) {
+  u64 typecheck_start = nanotime();
+  u64 timeline_start = timeline_begin();
+  buildtimer_t timer = buildstats_begin(pb->pkgc.pkg->stats);
+  err = typecheck(c, pb->ast_ma, pb->pkgc.pkg, pb->unitv, pb->unitc);
+  buildstats_end(pb->pkgc.pkg->stats, BUILDPHASE_TYPECHECK, &timer);
+  timeline_end(timeline_start, "typecheck", pb->pkgc.pkg->path.p, NULL);
+  if (err) {
     dlog("typecheck: %s", err_str(err));
     return err;
   }
+  if (coverbose > 1) {
+    char duration[25];
+    fmtduration(duration, nanotime() - typecheck_start);
+    vvlog("[%s] typecheck: %s", pb->pkgc.pkg->path.p, duration);
+  }
   if (compiler_errcount(c) > 0) {
     dlog("typecheck: %u diagnostic errors", compiler_errcount(c));
     if (c->opt_printast)
@@ -1073,10 +1333,21 @@ err_t pkgbuild_analyze(pkgbuild_t* pb) {
 
   // build IR -- performs ownership analysis; updates "drops" lists in AST
   dlog_if(opt_trace_ir, "————————— IR —————————");
-  if (( err = iranalyze(c, pb->ast_ma, pb->pkgc.pkg, pb->unitv, pb->unitc) )) {
+  u64 iranalyze_start = nanotime();
+  timeline_start = timeline_begin();
+  timer = buildstats_begin(pb->pkgc.pkg->stats);
+  err = iranalyze(c, pb->ast_ma, pb->pkgc.pkg, pb->unitv, pb->unitc);
+  buildstats_end(pb->pkgc.pkg->stats, BUILDPHASE_IRANALYZE, &timer);
+  timeline_end(timeline_start, "iranalyze", pb->pkgc.pkg->path.p, NULL);
+  if (err) {
     dlog("iranalyze: %s", err_str(err));
     return err;
   }
+  if (coverbose > 1) {
+    char duration[25];
+    fmtduration(duration, nanotime() - iranalyze_start);
+    vvlog("[%s] iranalyze: %s", pb->pkgc.pkg->path.p, duration);
+  }
   if (compiler_errcount(c) > 0) {
     dlog("iranalyze: %u diagnostic errors", compiler_errcount(c));
     return ErrCanceled;
@@ -1218,85 +1489,366 @@ err_t pkgbuild_cgen_pub(pkgbuild_t* pb) {
 }
 
 
-err_t pkgbuild_cgen_pkg(pkgbuild_t* pb) {
-  err_t err = 0;
+// llvmgen_unit compiles a unit directly to an object file with the LLVM backend.
+// Returns ErrNotSupported if the unit must be compiled via C instead.
+static err_t llvmgen_unit(pkgbuild_t* pb, unit_t* unit, u32 srcfile_id) {
+  compiler_t* c = pb->c;
 
-  // generate one C file for each unit
-  for (u32 i = 0; i < pb->unitc; i++) {
-    unit_t* unit = pb->unitv[i];
-    const char* cfile = cfile_of_unit(pb, unit);
+  // ARM and RISC-V need ISA and float ABI flags which are only passed to clang,
+  // and WASM objects are not position independent
+  if (target_is_arm(&c->target) || target_is_riscv(&c->target) ||
+      target_is_wasm(&c->target))
+  {
+    return ErrNotSupported;
+  }
 
-    if (pb->c->opt_verbose)
-      pkgbuild_begintask(pb, "cgen %s", relpath(cfile));
+  BuildCtx build = {
+    .opt = c->buildmode == BUILDMODE_OPT ? '2' : '0',
+    .debug = c->buildmode == BUILDMODE_DEBUG,
+    .safe = true,
+  };
+  CoLLVMModule m;
+  llvm_module_init(&m, &build, unit->srcfile->name.p);
 
-    if (( err = cgen_unit_impl(&pb->cgen, unit, &pb->pkgapi) ))
-      break;
+  u32 flags = (pb->flags & PKGBUILD_EXE) ? LLVMGEN_EXE : 0;
+  err_t err = llvm_module_set_target(&m, c->target.triple);
+  if (!err)
+    err = llvm_gen_unit(&m, c, pb->ast_ma, pb->pkgc.pkg, (node_t*)unit, flags);
+  if (err) {
+    dlog_if(err != ErrNotSupported, "llvm_gen_unit: %s", err_str(err));
+    goto end;
+  }
 
-    if (opt_trace_cgen) {
-      fprintf(stderr, "—————————— cgen %s ——————————\n", relpath(cfile));
-      fwrite(pb->cgen.outbuf.p, pb->cgen.outbuf.len, 1, stderr);
-      fputs("\n——————————————————————————————————\n", stderr);
-    }
+  const char* ofile = ofile_of_srcfile_id(pb, srcfile_id);
+  pkgbuild_begintask(pb, "compile %s (llvm)",
+    c->opt_verbose ? relpath(ofile) : unit->srcfile->name.p);
 
-    if (( err = fs_writefile_mkdirs(cfile, 0660, buf_slice(pb->cgen.outbuf)) ))
-      break;
+  CoLLVMBuild buildopt = {
+    .target_triple = c->target.triple,
+    .enable_lto = c->lto > 0,
+  };
+  if (( err = llvm_module_optimize(&m, &buildopt) ))
+    goto end;
+
+  // with LTO enabled, objects are LLVM bitcode (like clang -flto)
+  err = llvm_module_emit(&m, ofile, c->lto ? CoLLVMEmit_bc : CoLLVMEmit_obj, 0);
+
+  if (!err && c->opt_genasm) {
+    char asmfile[PATH_MAX];
+    snprintf(asmfile, sizeof(asmfile), "%.*sS", (int)strlen(ofile) - 1, ofile);
+    err = llvm_module_emit(&m, asmfile, CoLLVMEmit_asm, 0);
   }
 
+end:
+  llvm_module_dispose(&m);
   return err;
 }
 
 
-err_t pkgbuild_metagen(pkgbuild_t* pb) {
-  err_t err = 0;
-  pkg_t* pkg = pb->pkgc.pkg;
+// begin_unit_compilation starts compiling the C file generated for a unit, or uses
+// a cached object if the same C code has been compiled before
+static err_t begin_unit_compilation(pkgbuild_t* pb, u32 srcfile_id) {
+  srcfile_t* srcfile = pb->pkgc.pkg->srcfiles.v[srcfile_id];
+  const char* cfile = cfile_of_srcfile_id(pb, srcfile_id);
+  const char* ofile = ofile_of_srcfile_id(pb, srcfile_id);
+
+  pb->startedv[srcfile_id] = true;
+
+  // use object from cache if the generated C has been compiled before
+  if (!sha256_iszero(&pb->objkeyv[srcfile_id])) {
+    if (objcache_get(&pb->objkeyv[srcfile_id], ofile) == 0) {
+      pkgbuild_begintask(pb, "compile %s (cached)",
+        pb->c->opt_verbose ? relpath(cfile) : srcfile->name.p);
+      // clear key so that pkgbuild_await_compilation does not store it again
+      memset(&pb->objkeyv[srcfile_id], 0, sizeof(pb->objkeyv[srcfile_id]));
+      return 0;
+    }
+  }
+
+  pkgbuild_begintask(pb, "compile %s",
+    pb->c->opt_verbose ? relpath(cfile) : srcfile->name.p);
+  err_t err = compile_c_source(
+    pb, &pb->promisev[srcfile_id], cfile, ofile, srcfile->type);
+  if (err)
+    dlog("compile_c_source: %s", err_str(err));
+  return err;
+}
 
-  str_t filename = {};
-  if (!pkg_buildfile(pkg, pb->c, &filename, PKG_METAFILE_NAME))
-    return ErrNoMem;
+
+typedef struct {
+  unit_t*     unit;
+  u32         srcfile_id;
+  nodearray_t defs; // definitions of unit, from cgen_unit_defs
+} cgenwork_t;
+
+
+typedef struct {
+  pkgbuild_t*    pb;
+  memalloc_t     ma;
+  cgenwork_t*    workv;
+  u32            workc;
+  _Atomic(u32)   next;       // index of next work item to generate
+  _Atomic(u32)   refcount;   // threads referencing this struct
+  _Atomic(err_t) err;        // first error encountered
+  sema_t         donesem;    // signalled each time a work item is done
+  mutex_t        bgtmu;
+  mutex_t        readymu;    // protects readyv, readystart & readylen
+  u32*           readyv;     // srcfile_id of units with C files ready to compile
+  u32            readystart; // index of next readyv entry to start compiling
+  u32            readylen;
+} cgenjob_t;
+
+
+static err_t cgen_unit(pkgbuild_t* pb, cgen_t* g, cgenwork_t* w) {
+  const char* cfile = cfile_of_srcfile_id(pb, w->srcfile_id);
+  err_t err;
 
   if (pb->c->opt_verbose)
-    pkgbuild_begintask(pb, "metagen %s", relpath(filename.p));
+    pkgbuild_begintask(pb, "cgen %s", relpath(cfile));
 
-  buf_t outbuf = buf_make(pb->c->ma);
+  u64 timeline_start = timeline_begin();
+  buildtimer_t timer = buildstats_begin(pb->pkgc.pkg->stats);
+  err = cgen_unit_impl(g, w->unit, &pb->pkgapi, &w->defs);
+  buildstats_end_cpu(pb->pkgc.pkg->stats, BUILDPHASE_CGEN, &timer);
+  timeline_end(timeline_start, "cgen", pb->pkgc.pkg->path.p, cfile);
+  if (err)
+    return err;
 
-  // create AST encoder
-  astencoder_t* astenc = astencoder_create(pb->c);
-  if (!astenc) {
-    err = ErrNoMem;
-    goto end;
+  if (opt_trace_cgen) {
+    fprintf(stderr, "—————————— cgen %s ——————————\n", relpath(cfile));
+    fwrite(g->outbuf.p, g->outbuf.len, 1, stderr);
+    fputs("\n——————————————————————————————————\n", stderr);
   }
 
-  // encoders can be reused, so we need to tell it to start an encoding session
-  astencoder_begin(astenc, pkg);
+  if (( err = fs_writefile_mkdirs(cfile, 0660, buf_slice(g->outbuf)) ))
+    return err;
 
-  // add top-level declarations from pkg->api
-  for (u32 i = 0; i < pkg->api.len && err == 0; i++) {
-    err = astencoder_add_ast(astenc, pkg->api.v[i], ASTENCODER_PUB_API);
-    if (err)
-      dlog("astencoder_add_ast: %s", err_str(err));
+  // compute object cache key (assembly output is not cached)
+  if (!pb->c->opt_genasm) {
+    objcache_key(&pb->objkeyv[w->srcfile_id], pb->c, pb->pkgc.pkg,
+      cfile, buf_slice(g->outbuf));
   }
+  return 0;
+}
 
-  // Register all source files.
-  // This is needed since, even though astencoder_add_ast implicitly registers source
-  // files for us, it only does so for nodes which are part of the public package API.
-  // I.e. if a source file does not contain any public definitions, it will not be
-  // automatically registered.
-  // Note that it does not matter if we call astencoder_add_srcfile before or after
-  // calling astencoder_add_ast, as source files are ordered by the encoder, so the
-  // results are the same no matter the order we call these functions.
-  for (u32 i = 0; i < pkg->srcfiles.len && err == 0; i++) {
-    err = astencoder_add_srcfile(astenc, pkg->srcfiles.v[i]);
+
+// start_ready_units starts compiling units which C files have been generated.
+// Only called on the build thread, since starting a compiler process may block
+// waiting for a job slot (jobserver_acquire) and must not hold up pool threads.
+static void start_ready_units(cgenjob_t* job) {
+  for (;;) {
+    mutex_lock(&job->readymu);
+    if (job->readystart == job->readylen || AtomicLoad(&job->err, memory_order_relaxed)) {
+      mutex_unlock(&job->readymu);
+      return;
+    }
+    u32 srcfile_id = job->readyv[job->readystart++];
+    mutex_unlock(&job->readymu);
+    err_t err = begin_unit_compilation(job->pb, srcfile_id);
     if (err) {
-      dlog("astencoder_add_srcfile(%s): %s",
-        ((srcfile_t*)pkg->srcfiles.v[i])->name.p, err_str(err));
+      err_t noerr = 0;
+      AtomicCAS(&job->err, &noerr, err, memory_order_relaxed, memory_order_relaxed);
     }
   }
+}
 
-  // finalize
-  if (!err)
-    err = astencoder_encode(astenc, &outbuf);
-  astencoder_free(astenc);
-  if (err)
+
+static void cgen_units(cgenjob_t* job, bool isbuildthread) {
+  pkgbuild_t* pb = NULL;
+  cgen_t g;
+
+  for (;;) {
+    u32 i = AtomicAdd(&job->next, 1, memory_order_relaxed);
+    if (i >= job->workc)
+      break;
+    err_t err = AtomicLoad(&job->err, memory_order_relaxed);
+    if (!err && !pb) {
+      pb = job->pb;
+      if (!cgen_init(&g, pb->c, pb->pkgc.pkg, pb->c->ma, pb->cgen.flags))
+        err = ErrNoMem;
+    }
+    if (!err)
+      err = cgen_unit(pb, &g, &job->workv[i]);
+    if (err) {
+      err_t noerr = 0;
+      AtomicCAS(&job->err, &noerr, err, memory_order_relaxed, memory_order_relaxed);
+    } else {
+      // hand the C file to clang right away instead of waiting for other units
+      mutex_lock(&job->readymu);
+      job->readyv[job->readylen++] = job->workv[i].srcfile_id;
+      mutex_unlock(&job->readymu);
+    }
+    sema_signal(&job->donesem, 1);
+    if (isbuildthread)
+      start_ready_units(job);
+  }
+
+  if (pb)
+    cgen_dispose(&g);
+}
+
+
+static void cgenjob_release(cgenjob_t* job) {
+  if (AtomicSub(&job->refcount, 1, memory_order_acq_rel) > 1)
+    return;
+  sema_dispose(&job->donesem);
+  mutex_dispose(&job->bgtmu);
+  mutex_dispose(&job->readymu);
+  mem_freetv(job->ma, job->readyv, (usize)job->workc);
+  mem_freet(job->ma, job);
+}
+
+
+static void cgen_units_thread(cgenjob_t* job) {
+  cgen_units(job, /*isbuildthread*/false);
+  cgenjob_release(job);
+}
+
+
+// cgen_units_parallel generates workv on up to comaxproc threads.
+// Compilation of each unit is started by the calling thread as soon as its C
+// file has been generated.
+static err_t cgen_units_parallel(pkgbuild_t* pb, cgenwork_t* workv, u32 workc) {
+  memalloc_t ma = pb->c->ma;
+
+  // Note: job is heap allocated since threads that start after all units have
+  // been generated (by other threads) may outlive this function call.
+  cgenjob_t* job = mem_alloct(ma, cgenjob_t);
+  if UNLIKELY(!job)
+    return ErrNoMem;
+  if UNLIKELY(!( job->readyv = mem_alloctv(ma, u32, (usize)workc) )) {
+    mem_freet(ma, job);
+    return ErrNoMem;
+  }
+  job->pb = pb;
+  job->ma = ma;
+  job->workv = workv;
+  job->workc = workc;
+  safecheckx(sema_init(&job->donesem, 0) == 0);
+  safecheckx(mutex_init(&job->bgtmu) == 0);
+  safecheckx(mutex_init(&job->readymu) == 0);
+
+  // trace output of several units would be interleaved
+  u32 nthreads = opt_trace_cgen ? 1 : MAX(1u, MIN(comaxproc, workc));
+  job->refcount = nthreads;
+  if (nthreads > 1)
+    pb->bgtmu = &job->bgtmu;
+
+  for (u32 i = 1; i < nthreads; i++) {
+    if (threadpool_submit(cgen_units_thread, job))
+      AtomicSub(&job->refcount, 1, memory_order_relaxed);
+  }
+  cgen_units(job, /*isbuildthread*/true);
+
+  // wait for units generated by other threads, starting their compilation
+  for (u32 i = 0; i < workc; i++) {
+    safecheckx(sema_wait(&job->donesem));
+    start_ready_units(job);
+  }
+
+  pb->bgtmu = NULL;
+  err_t err = job->err;
+  cgenjob_release(job);
+  return err;
+}
+
+
+err_t pkgbuild_cgen_pkg(pkgbuild_t* pb) {
+  err_t err = 0;
+
+  cgenwork_t* workv = mem_alloctv(pb->c->ma, cgenwork_t, MAX(pb->unitc, 1u));
+  if (!workv)
+    return ErrNoMem;
+  u32 workc = 0;
+
+  // Generate objects directly with the LLVM backend where possible and toposort
+  // definitions of the rest, which modifies the AST and thus can't be done in
+  // parallel. Then generate one C file for each remaining unit in parallel.
+  for (u32 i = 0; i < pb->unitc; i++) {
+    unit_t* unit = pb->unitv[i];
+    u32 srcfile_id = srcfile_id_of_unit(pb, unit);
+
+    // try generating an object directly, falling back to C for unsupported units
+    if (pb->c->backend == BACKEND_LLVM) {
+      err = llvmgen_unit(pb, unit, srcfile_id);
+      if (!err) {
+        pb->startedv[srcfile_id] = true;
+        continue;
+      }
+      if (err != ErrNotSupported)
+        goto end;
+      err = 0;
+    }
+
+    cgenwork_t* w = &workv[workc++];
+    w->unit = unit;
+    w->srcfile_id = srcfile_id;
+    if (( err = cgen_unit_defs(&pb->cgen, unit, &pb->pkgapi, &w->defs) ))
+      goto end;
+  }
+
+  if (workc > 0)
+    err = cgen_units_parallel(pb, workv, workc);
+
+end:
+  for (u32 i = 0; i < workc; i++)
+    nodearray_dispose(&workv[i].defs, pb->c->ma);
+  mem_freetv(pb->c->ma, workv, MAX(pb->unitc, 1u));
+  return err;
+}
+
+
+err_t pkgbuild_metagen(pkgbuild_t* pb) {
+  err_t err = 0;
+  pkg_t* pkg = pb->pkgc.pkg;
+
+  str_t filename = {};
+  if (!pkg_buildfile(pkg, pb->c, &filename, PKG_METAFILE_NAME))
+    return ErrNoMem;
+
+  if (pb->c->opt_verbose)
+    pkgbuild_begintask(pb, "metagen %s", relpath(filename.p));
+
+  buf_t outbuf = buf_make(pb->c->ma);
+
+  // create AST encoder
+  astencoder_t* astenc = astencoder_create(pb->c);
+  if (!astenc) {
+    err = ErrNoMem;
+    goto end;
+  }
+
+  // encoders can be reused, so we need to tell it to start an encoding session
+  astencoder_begin(astenc, pkg);
+
+  // add top-level declarations from pkg->api
+  for (u32 i = 0; i < pkg->api.len && err == 0; i++) {
+    err = astencoder_add_ast(astenc, pkg->api.v[i], ASTENCODER_PUB_API);
+    if (err)
+      dlog("astencoder_add_ast: %s", err_str(err));
+  }
+
+  // Register all source files.
+  // This is needed since, even though astencoder_add_ast implicitly registers source
+  // files for us, it only does so for nodes which are part of the public package API.
+  // I.e. if a source file does not contain any public definitions, it will not be
+  // automatically registered.
+  // Note that it does not matter if we call astencoder_add_srcfile before or after
+  // calling astencoder_add_ast, as source files are ordered by the encoder, so the
+  // results are the same no matter the order we call these functions.
+  for (u32 i = 0; i < pkg->srcfiles.len && err == 0; i++) {
+    err = astencoder_add_srcfile(astenc, pkg->srcfiles.v[i]);
+    if (err) {
+      dlog("astencoder_add_srcfile(%s): %s",
+        ((srcfile_t*)pkg->srcfiles.v[i])->name.p, err_str(err));
+    }
+  }
+
+  // finalize
+  if (!err)
+    err = astencoder_encode(astenc, &outbuf);
+  astencoder_free(astenc);
+  if (err)
     goto end;
 
   // write to file
@@ -1318,17 +1870,13 @@ err_t pkgbuild_begin_late_compilation(pkgbuild_t* pb) {
   err_t err = 0;
   assertf(pb->ofiles.len > 0, "prepare_builddir not called");
 
+  // Compilation of units is usually started by pkgbuild_cgen_pkg as soon as
+  // each C file has been written, or the LLVM backend produced the object
   for (u32 i = 0; i < pkg->srcfiles.len && err == 0; i++) {
     srcfile_t* srcfile = pkg->srcfiles.v[i];
-    if (srcfile->type != FILE_CO)
+    if (srcfile->type != FILE_CO || pb->startedv[i])
       continue;
-    const char* cfile = cfile_of_srcfile_id(pb, i);
-    const char* ofile = ofile_of_srcfile_id(pb, i);
-    pkgbuild_begintask(pb, "compile %s",
-      pb->c->opt_verbose ? relpath(cfile) : srcfile->name.p);
-    err = compile_c_source(pb, &pb->promisev[i], cfile, ofile, srcfile->type);
-    if (err)
-      dlog("compile_c_source: %s", err_str(err));
+    err = begin_unit_compilation(pb, i);
   }
 
   return err;
@@ -1341,6 +1889,13 @@ err_t pkgbuild_await_compilation(pkgbuild_t* pb) {
     err_t err1 = promise_await(&pb->promisev[i]);
     if (!err)
       err = err1;
+
+    // add newly compiled object to the cache
+    if (err1 == 0 && pb->objkeyv && !sha256_iszero(&pb->objkeyv[i])) {
+      const char* ofile = ofile_of_srcfile_id(pb, i);
+      if (( err1 = objcache_put(&pb->objkeyv[i], ofile) ))
+        vlog("failed to add %s to object cache: %s", relpath(ofile), err_str(err1));
+    }
   }
   return err;
 }
@@ -1459,6 +2014,28 @@ static err_t link_lib_archive(pkgbuild_t* pb, const char* outfile) {
 }
 
 
+// pkgbuild_outfile returns outfile, or if it's empty, the default product file
+// (stored at *storage)
+static const char* nullable pkgbuild_outfile(
+  pkgbuild_t* pb, const char* outfile, str_t* storage)
+{
+  if (*outfile)
+    return outfile;
+  bool ok;
+  if (pb->flags & PKGBUILD_EXE) {
+    ok = pkg_exefile(pb->pkgc.pkg, pb->c, storage);
+  } else {
+    ok = pkg_libfile(pb->pkgc.pkg, pb->c, storage);
+  }
+  if (!ok) {
+    str_free(*storage);
+    *storage = (str_t){};
+    return NULL;
+  }
+  return storage->p;
+}
+
+
 err_t pkgbuild_link(pkgbuild_t* pb, const char* outfile) {
   if (pb->flags & PKGBUILD_NOLINK) {
     dlog("pkgbuild_link: skipped because PKGBUILD_NOLINK flag is set");
@@ -1467,24 +2044,12 @@ err_t pkgbuild_link(pkgbuild_t* pb, const char* outfile) {
 
   assert_promises_completed(pb);
 
-  pkg_t* pkg = pb->pkgc.pkg;
   str_t outfile_str = {};
   err_t err = 0;
 
   // if no outfile is given, use the default one
-  if (*outfile == 0) {
-    bool ok;
-    if (pb->flags & PKGBUILD_EXE) {
-      ok = pkg_exefile(pkg, pb->c, &outfile_str);
-    } else {
-      ok = pkg_libfile(pkg, pb->c, &outfile_str);
-    }
-    if (!ok) {
-      str_free(outfile_str);
-      return ErrNoMem;
-    }
-    outfile = outfile_str.p;
-  }
+  if (!( outfile = pkgbuild_outfile(pb, outfile, &outfile_str) ))
+    return ErrNoMem;
 
   pkgbuild_begintask(pb, "link %s", relpath(outfile));
 
@@ -1507,16 +2072,174 @@ err_t pkgbuild_link(pkgbuild_t* pb, const char* outfile) {
 }
 
 
-static err_t build_pkg(
+// The stampfile of a top-level package records the product of its last successful
+// build: the key of the build (see buildstamp_key) followed by the absolute path of
+// the executable or library. It is removed when a build of the package starts.
+#define PKG_STAMPFILE_NAME "build.stamp"
+
+
+// buildstamp_key computes a key of everything but sources and dependencies that
+// affects the product of a top-level build: the compiler, its configuration and
+// the output file.
+static bool buildstamp_key(sha256_t* key, const compiler_t* c, const char* outfile) {
+  str_t outfile_abs = {};
+  if (*outfile && !( outfile_abs = path_abs(outfile) ).p)
+    return false;
+
+  SHA256 state;
+  sha256_init(&state, key);
+  objcache_hash_compiler_version(&state);
+  sha256_write(&state, c->builddir, strlen(c->builddir) + 1);
+  sha256_write(&state, c->target.triple, strlen(c->target.triple) + 1);
+  const slice_t* flagsv[] = {
+    &c->flags_common, &c->cflags_common, &c->cflags_c, &c->cflags_co };
+  for (usize i = 0; i < countof(flagsv); i++) {
+    for (usize j = 0; j < flagsv[i]->len; j++) {
+      const char* flag = flagsv[i]->strings[j];
+      sha256_write(&state, flag, strlen(flag) + 1);
+    }
+  }
+  u8 config[] = {
+    c->buildmode, c->backend, (u8)c->lto, c->opt_nolto, c->opt_nomain,
+    c->opt_genasm, c->opt_nolibc, c->opt_nolibcxx, c->opt_nostdruntime,
+  };
+  sha256_write(&state, config, sizeof(config));
+  sha256_write(&state, outfile_abs.p ? outfile_abs.p : "", outfile_abs.len + 1);
+  sha256_close(&state);
+
+  str_free(outfile_abs);
+  return true;
+}
+
+
+// pkgbuild_stamp writes the stampfile of a top-level package
+static err_t pkgbuild_stamp(pkgbuild_t* pb, const char* outfile) {
+  if (pb->flags & PKGBUILD_NOLINK)
+    return 0;
+
+  err_t err = 0;
+  str_t filename = {}, outfile_str = {}, product = {};
+  buf_t buf = buf_make(pb->c->ma);
+  sha256_t key;
+  const char* productfile;
+
+  if (!pkg_buildfile(pb->pkgc.pkg, pb->c, &filename, PKG_STAMPFILE_NAME) ||
+      !buildstamp_key(&key, pb->c, outfile) ||
+      !( productfile = pkgbuild_outfile(pb, outfile, &outfile_str) ) ||
+      !( product = path_abs(productfile) ).p ||
+      !buf_append(&buf, &key, sizeof(key)) ||
+      !buf_append(&buf, product.p, product.len))
+  {
+    err = ErrNoMem;
+    goto end;
+  }
+
+  err = fs_writefile_mkdirs(filename.p, 0644, buf_slice(buf));
+
+end:
+  buf_dispose(&buf);
+  str_free(product);
+  str_free(outfile_str);
+  str_free(filename);
+  return err;
+}
+
+
+// pkgbuild_fingerprint computes the fingerprints of the package's source files
+// before they are read by the build (see srcfp.h), rehashing only files which
+// have been touched since the last build. The package's fingerprint database is
+// removed until pkgbuild_save_fingerprints writes it after a successful build;
+// also when building without c->opt_contenthash, as the database would be stale.
+static err_t pkgbuild_fingerprint(pkgbuild_t* pb) {
+  compiler_t* c = pb->c;
+  pkg_t* pkg = pb->pkgc.pkg;
+  err_t err = 0;
+  str_t dbfile = {};
+  srcfpdb_t prevdb;
+  srcfpdb_init(&prevdb, c->ma);
+
+  if (!pkg_buildfile(pkg, c, &dbfile, PKG_SRCFP_NAME)) {
+    err = ErrNoMem;
+    goto end;
+  }
+  if (c->opt_contenthash)
+    srcfpdb_load(&prevdb, dbfile.p);
+  unlink(dbfile.p);
+  if (!c->opt_contenthash)
+    goto end;
+
+  for (u32 i = 0; i < pkg->srcfiles.len; i++) {
+    const srcfile_t* f = pkg->srcfiles.v[i];
+    str_t path = pkg->dir.len ? path_join(pkg->dir.p, f->name.p) : str_make(f->name.p);
+    if (!path.p) {
+      err = ErrNoMem;
+      goto end;
+    }
+    srcfp_t fp;
+    if (( err = srcfp_make(&fp, path.p, srcfpdb_get(&prevdb, f->name.p)) )) {
+      elog("%s: %s", relpath(path.p), err_str(err));
+    } else {
+      err = srcfpdb_set(&pb->srcfpdb, f->name.p, &fp);
+    }
+    str_free(path);
+    if (err)
+      goto end;
+  }
+
+end:
+  srcfpdb_dispose(&prevdb);
+  str_free(dbfile);
+  return err;
+}
+
+
+// pkgbuild_save_fingerprints writes the fingerprints made by pkgbuild_fingerprint
+static err_t pkgbuild_save_fingerprints(pkgbuild_t* pb) {
+  if (!pb->c->opt_contenthash)
+    return 0;
+  str_t dbfile = {};
+  if (!pkg_buildfile(pb->pkgc.pkg, pb->c, &dbfile, PKG_SRCFP_NAME))
+    return ErrNoMem;
+  err_t err = srcfpdb_save(&pb->srcfpdb, dbfile.p);
+  str_free(dbfile);
+  return err;
+}
+
+
+// Each step is recorded on the timeline as the function name sans "pkgbuild_"
+// and its time is counted for phase. Time of NO_PHASE steps is not counted, but
+// it is still excluded from phases of a package which is building this one.
+#define NO_PHASE BUILDPHASE_COUNT
+#define DO_STEP(phase, fn, args...) { \
+  u64 step_start = timeline_begin(); \
+  buildtimer_t step_timer = buildstats_begin(pkg->stats); \
+  err = fn(pb, ##args); \
+  buildstats_end(pkg->stats, phase, &step_timer); \
+  timeline_end(step_start, &#fn[strlen("pkgbuild_")], pkg->path.p, NULL); \
+  if (err) { \
+    dlog("%s: %s", #fn, err_str(err)); \
+    goto end; \
+  } \
+}
+
+
+// build_pkg_begin creates a pkgbuild_t at *pbp and runs the build steps up until
+// and including pkgbuild_import, which starts loading the package's imports.
+// Unless *pbp is NULL, build_pkg_finish must be called, with the error returned,
+// once the imports have finished loading.
+static err_t build_pkg_begin(
+  pkgbuild_t**      pbp,
   pkgcell_t         pkgc,
   compiler_t*       c,
-  const char*       outfile,
   memalloc_t        api_ma,
   u32               pkgbuild_flags,
   enum build_reason build_reason)
 {
   err_t err;
-  bool did_await_compilation = false;
+  pkg_t* pkg = pkgc.pkg;
+  u64 timeline_start = timeline_begin();
+
+  *pbp = NULL;
 
   if UNLIKELY(compiler_errcount(c) > 0) {
     dlog("%s failing immediately (compiler has encountered errors)", __FUNCTION__);
@@ -1524,12 +2247,12 @@ static err_t build_pkg(
   }
 
   if (coverbose) {
-    const char* dir = relpath(pkgc.pkg->dir.p);
+    const char* dir = relpath(pkg->dir.p);
     if (build_reason == BUILD_REASON_DEFAULT) {
-      vlog("building package \"%s\" (%s)", pkgc.pkg->path.p, dir);
+      vlog("building package \"%s\" (%s)", pkg->path.p, dir);
     } else {
       const char* reason = build_reason_str(build_reason);
-      vlog("building package \"%s\" (%s) [%s]", pkgc.pkg->path.p, dir, reason);
+      vlog("building package \"%s\" (%s) [%s]", pkg->path.p, dir, reason);
     }
   }
 
@@ -1541,61 +2264,413 @@ static err_t build_pkg(
     mem_freex(c->ma, MEM(pb, sizeof(pkgbuild_t)));
     return err;
   }
-
-  #define DO_STEP(fn, args...) \
-    if (( err = fn(pb, ##args) )) { \
-      dlog("%s: %s", #fn, err_str(err)); \
-      goto end; \
-    }
+  *pbp = pb;
+  if (!buildstats_pkg_begin(pkg)) {
+    err = ErrNoMem;
+    goto end;
+  }
 
   // locate source files
-  DO_STEP(pkgbuild_locate_sources);
+  DO_STEP(NO_PHASE, pkgbuild_locate_sources);
+
+  // fingerprint source files (only removes old fingerprints unless c->opt_contenthash)
+  DO_STEP(NO_PHASE, pkgbuild_fingerprint);
 
   // begin compilation of C source files
-  DO_STEP(pkgbuild_begin_early_compilation);
+  DO_STEP(NO_PHASE, pkgbuild_begin_early_compilation);
 
   // parse source files
-  DO_STEP(pkgbuild_parse);
+  DO_STEP(BUILDPHASE_PARSE, pkgbuild_parse);
 
-  // resolve and import dependencies
-  DO_STEP(pkgbuild_import);
+  // resolve dependencies and start loading them
+  DO_STEP(BUILDPHASE_IMPORT, pkgbuild_import);
+
+end:
+  timeline_end(timeline_start, "build", pkg->path.p, NULL);
+  return err;
+}
+
+
+// build_pkg_finish runs the remaining build steps of pb, unless err is non-zero,
+// and then frees pb
+static err_t build_pkg_finish(pkgbuild_t* pb, err_t err, const char* outfile) {
+  pkg_t* pkg = pb->pkgc.pkg;
+  compiler_t* c = pb->c;
+  bool did_await_compilation = false;
+  u64 timeline_start = timeline_begin();
+
+  if (err)
+    goto end;
+
+  // wait for imported packages to load
+  DO_STEP(BUILDPHASE_IMPORT, pkgbuild_import_wait);
 
   // analyze (typecheck) package
-  DO_STEP(pkgbuild_analyze);
+  DO_STEP(NO_PHASE, pkgbuild_analyze);
 
   // set package info like pkg->api and pb->flags&PKGBUILD_EXE
-  DO_STEP(pkgbuild_setinfo);
+  DO_STEP(NO_PHASE, pkgbuild_setinfo);
 
   // generate public C API
-  DO_STEP(pkgbuild_cgen_pub);
+  DO_STEP(BUILDPHASE_CGEN, pkgbuild_cgen_pub);
 
   // generate package metadata (can run in parallel to the rest of these tasks)
-  DO_STEP(pkgbuild_metagen);
+  DO_STEP(BUILDPHASE_METAGEN, pkgbuild_metagen);
 
-  // generate package C code
-  DO_STEP(pkgbuild_cgen_pkg);
+  // generate package C code, compiling each C file as soon as it's been written
+  DO_STEP(BUILDPHASE_CGEN, pkgbuild_cgen_pkg);
 
-  // begin compilation of C source files generated from compis sources
-  DO_STEP(pkgbuild_begin_late_compilation);
+  // begin compilation of any generated C source files not yet being compiled
+  DO_STEP(NO_PHASE, pkgbuild_begin_late_compilation);
 
   // wait for compilation tasks to finish
   did_await_compilation = true;
-  DO_STEP(pkgbuild_await_compilation);
+  DO_STEP(NO_PHASE, pkgbuild_await_compilation);
 
   // link exe or library (does nothing if PKGBUILD_NOLINK flag is set)
-  DO_STEP(pkgbuild_link, outfile);
+  DO_STEP(BUILDPHASE_LINK, pkgbuild_link, outfile);
+
+  // record fingerprints of the sources built (does nothing unless c->opt_contenthash)
+  DO_STEP(NO_PHASE, pkgbuild_save_fingerprints);
+
+  // record the product of a top-level package, for toplevel_pkg_uptodate
+  if ((pb->flags & PKGBUILD_DEP) == 0)
+    DO_STEP(NO_PHASE, pkgbuild_stamp, outfile);
 
 end:
   if (!did_await_compilation)
     pkgbuild_await_compilation(pb);
-  if ((pkgbuild_flags & PKGBUILD_NOCLEANUP) == 0) {
+  buildstats_pkg_end(pkg, pb->ast_ma);
+  if ((pb->flags & PKGBUILD_NOCLEANUP) == 0) {
     pkgbuild_dispose(pb);
     mem_freet(c->ma, pb);
   }
-  #undef DO_STEP
+  timeline_end(timeline_start, "build", pkg->path.p, NULL);
   return err;
 }
 
+#undef DO_STEP
+#undef NO_PHASE
+
+
+static err_t build_pkg(
+  pkgcell_t         pkgc,
+  compiler_t*       c,
+  const char*       outfile,
+  memalloc_t        api_ma,
+  u32               pkgbuild_flags,
+  enum build_reason build_reason)
+{
+  pkgbuild_t* pb;
+  err_t err = build_pkg_begin(&pb, pkgc, c, api_ma, pkgbuild_flags, build_reason);
+  if (!pb)
+    return err;
+  return build_pkg_finish(pb, err, outfile);
+}
+
+
+// deps_linked_uptodate returns false if the library of any package pkg depends on
+// (directly or indirectly) is newer than product_mtime, or missing
+static bool deps_linked_uptodate(
+  compiler_t* c, const pkg_t* pkg, unixtime_t product_mtime, ptrarray_t* visited)
+{
+  for (u32 i = 0; i < pkg->imports.len; i++) {
+    const pkg_t* dep = pkg->imports.v[i];
+    bool added;
+    if (!ptrarray_sortedset_addptr(visited, c->ma, dep, &added))
+      return false;
+    if (!added)
+      continue;
+    str_t libfile = {};
+    unixtime_t libmtime = pkg_libfile(dep, c, &libfile) ? fs_mtime(libfile.p) : 0;
+    str_free(libfile);
+    if (libmtime == 0 || libmtime > product_mtime) {
+      trace_import("[%s] library of \"%s\" changed", pkg->path.p, dep->path.p);
+      return false;
+    }
+    if (!deps_linked_uptodate(c, dep, product_mtime, visited))
+      return false;
+  }
+  return true;
+}
+
+
+// toplevel_pkg_uptodate returns true if the product of the last build of top-level
+// package pkg is up to date, in which case pkg does not need to be built.
+// Like load_dependency does for dependencies, the package's metafile is checked
+// against its sources, and its dependencies are loaded and their APIs compared.
+// In addition, the build configuration and output file must be the same as for
+// the last build, and the product must be newer than the libraries linked into it.
+static bool toplevel_pkg_uptodate(
+  compiler_t* c, memalloc_t api_ma, pkg_t* pkg, const char* outfile, u32 pkgbuild_flags)
+{
+  // Ad-hoc packages are made of source files given on the command line, rather
+  // than of the files in pkg->dir. --no-link builds have no product and
+  // --print-ast etc. are only produced by building.
+  if (pkg->srcfiles.len > 0 || (pkgbuild_flags & PKGBUILD_NOLINK) ||
+      c->opt_printast || c->opt_printir || c->opt_genirdot)
+  {
+    return false;
+  }
+
+  bool ok = false;
+  err_t err;
+  str_t stampfile = {}, metafile = {}, product = {};
+  const void* stamp = NULL;
+  const void* encdata = NULL;
+  struct stat stampst, metast;
+  astdecoder_t* astdec = NULL;
+  sha256_t* api_sha256v = NULL;
+  u32 importcount = 0;
+  ptrarray_t visited = {};
+  pkgcell_t pkgc = { .pkg = pkg };
+  u64 timeline_start = timeline_begin();
+
+  if (!pkg_buildfile(pkg, c, &stampfile, PKG_STAMPFILE_NAME) ||
+      !pkg_buildfile(pkg, c, &metafile, PKG_METAFILE_NAME))
+  {
+    goto end;
+  }
+
+  // check that the last build had the same configuration
+  // note: stamp is set to NULL when mmap_file_ro fails
+  sha256_t key;
+  if (mmap_file_ro(stampfile.p, &stamp, &stampst) ||
+      (usize)stampst.st_size <= sizeof(key) ||
+      !buildstamp_key(&key, c, outfile) ||
+      memcmp(stamp, &key, sizeof(key)) != 0)
+  {
+    trace_import("[%s] no stampfile or build configuration changed", pkg->path.p);
+    goto end;
+  }
+
+  // check that the product of the last build is still there
+  product = str_makelen((const char*)stamp + sizeof(key), (usize)stampst.st_size - sizeof(key));
+  unixtime_t product_mtime = product.p ? fs_mtime(product.p) : 0;
+  if (product_mtime == 0) {
+    trace_import("[%s] product \"%s\" not found", pkg->path.p, product.p);
+    goto end;
+  }
+
+  // read srcfiles and imports from metafile
+  if (mmap_file_ro(metafile.p, &encdata, &metast))
+    goto end;
+  astdec = astdecoder_open(c, api_ma, metafile.p, encdata, metast.st_size);
+  if (!astdec || astdecoder_decode_header(astdec, pkg, &importcount))
+    goto end;
+  if (importcount > 0 && !( api_sha256v = mem_alloctv(c->ma, sha256_t, importcount) ))
+    goto end;
+  if (astdecoder_decode_imports(astdec, pkg, api_sha256v))
+    goto end;
+
+  // check if source files have been modified
+  pkg->mtime = MIN(product_mtime, unixtime_of_stat_mtime(&metast));
+  if (!check_pkg_src_uptodate(c, pkg, pkg->mtime)) {
+    trace_import("[%s] sources changed", pkg->path.p);
+    goto end;
+  }
+
+  // load dependencies (which might cause us to build them.)
+  // Note that we must wait for all of them since they refer to pkgc.
+  for (u32 i = 0; i < pkg->imports.len; i++) {
+    bool use_curr_thread = (i == pkg->imports.len - 1);
+    load_dependency(c, api_ma, &pkgc, pkg->imports.v[i], use_curr_thread);
+  }
+  err = 0;
+  for (u32 i = 0; i < pkg->imports.len; i++) {
+    err_t err1 = threadpool_future_wait(&((pkg_t*)pkg->imports.v[i])->loadfut);
+    if (!err)
+      err = err1;
+  }
+  if (err)
+    goto end;
+
+  // check if the API of any dependency changed
+  for (u32 i = 0; i < pkg->imports.len; i++) {
+    pkg_t* dep = pkg->imports.v[i];
+    if (memcmp(&api_sha256v[i], &dep->api_sha256, sizeof(sha256_t)) != 0) {
+      trace_import("[%s] dep \"%s\" changed", pkg->path.p, dep->path.p);
+      goto end;
+    }
+  }
+
+  // check if any library linked into the product changed
+  ok = deps_linked_uptodate(c, pkg, product_mtime, &visited);
+
+end:
+  if (!ok) {
+    // must clear any srcfiles & imports loaded from (possibly stale) metafile.
+    // pkg had no srcfiles on entry, so all of them are ours to free.
+    // (No nodes were decoded, so no locations refer to them via c->locmap.)
+    srcfilearray_dispose(&pkg->srcfiles);
+    pkg->imports.len = 0;
+    pkg->mtime = 0;
+  }
+  ptrarray_dispose(&visited, c->ma);
+  if (api_sha256v)
+    mem_freetv(c->ma, api_sha256v, importcount);
+  if (astdec)
+    astdecoder_close(astdec);
+  if (encdata)
+    mmap_unmap(encdata, metast.st_size);
+  if (stamp)
+    mmap_unmap(stamp, stampst.st_size);
+  str_free(product);
+  str_free(metafile);
+  str_free(stampfile);
+  timeline_end(timeline_start, "uptodate check", pkg->path.p, NULL);
+  return ok;
+}
+
+
+// pkggraph_t is the import graph of a top-level package, found by prescanning the
+// import statements of every package it depends on (see import_prescan) before
+// building anything. Its packages are then scheduled to load leaves first, in
+// order of the estimated cost of the import chain from each up to the top-level
+// package, so that work on the longest chain starts first.
+typedef struct {
+  compiler_t* c;
+  map_t       nodes; // pkg_t* => pkgnode_t*
+  ptrarray_t  order; // pkgnode_t*[], packages before the packages importing them
+} pkggraph_t;
+
+typedef struct {
+  pkgcell_t  pkgc;    // pkgc.parent is the first package found to import pkgc.pkg
+  ptrarray_t imports; // pkg_t*[] found by import_prescan
+  u64        cost;    // estimated cost of building the package, in source bytes
+  u64        prio;    // cost of the most costly import chain from pkg to the root
+  bool       visited; // true once all imports have been visited
+} pkgnode_t;
+
+// fixed cost of building a package (running clang, linking etc), in source bytes
+#define PKGNODE_BASE_COST 16384
+
+
+static err_t pkggraph_visit(pkggraph_t* g, const pkgcell_t* nullable parent, pkg_t* pkg) {
+  compiler_t* c = g->c;
+  err_t err = 0;
+
+  pkgnode_t** np = (pkgnode_t**)map_assign_ptr(&g->nodes, c->ma, pkg);
+  if (!np)
+    return ErrNoMem;
+  if (*np) {
+    // already visited, or an import cycle (which pkgbuild_import will report)
+    return (*np)->visited ? 0 : ErrCanceled;
+  }
+  pkgnode_t* n = mem_alloct(c->ma, pkgnode_t);
+  if (!n) {
+    map_del_ptr(&g->nodes, pkg);
+    return ErrNoMem;
+  }
+  *np = n;
+  n->pkgc = (pkgcell_t){ .parent = parent, .pkg = pkg };
+  n->cost = PKGNODE_BASE_COST;
+
+  if (( err = import_prescan(c, pkg, &n->imports, &n->cost) ))
+    return err;
+
+  // add automatic "std/runtime" dependency (see pkgbuild_import)
+  pkg_t* rt_pkg;
+  if (!c->opt_nostdruntime && compiler_get_runtime_pkg(c, &rt_pkg) == 0 && rt_pkg != pkg) {
+    if (!ptrarray_sortedset_addptr(&n->imports, c->ma, rt_pkg, NULL))
+      return ErrNoMem;
+  }
+
+  for (u32 i = 0; i < n->imports.len; i++) {
+    pkg_t* dep = n->imports.v[i];
+    // skip packages which are already loaded (e.g. by an earlier build in "serve")
+    err_t loaderr;
+    if (future_trywait(&dep->loadfut, &loaderr))
+      continue;
+    if (( err = pkggraph_visit(g, &n->pkgc, dep) ))
+      return err;
+  }
+
+  n->visited = true;
+  if (!ptrarray_push(&g->order, c->ma, n))
+    return ErrNoMem;
+  return 0;
+}
+
+
+static int pkgnode_cmp(const void* x, const void* y, void* ctx) {
+  const pkgnode_t* a = *(const pkgnode_t**)x;
+  const pkgnode_t* b = *(const pkgnode_t**)y;
+  if (a->prio != b->prio)
+    return a->prio < b->prio ? 1 : -1;
+  return strcmp(a->pkgc.pkg->path.p, b->pkgc.pkg->path.p);
+}
+
+
+static void pkggraph_free(pkggraph_t* g) {
+  for (const mapent_t* e = map_it(&g->nodes); map_itnext(&g->nodes, &e); ) {
+    pkgnode_t* n = e->value;
+    ptrarray_dispose(&n->imports, g->c->ma);
+    mem_freet(g->c->ma, n);
+  }
+  map_dispose(&g->nodes, g->c->ma);
+  ptrarray_dispose(&g->order, g->c->ma);
+}
+
+
+// pkggraph_schedule prescans the import graph of pkg and starts loading every
+// package in it. Returns false if the graph could not be prescanned, in which case
+// dependencies are loaded as they are discovered by pkgbuild_import.
+static bool pkggraph_schedule(pkggraph_t* g, compiler_t* c, memalloc_t api_ma, pkg_t* pkg) {
+  u64 timeline_start = timeline_begin();
+  g->c = c;
+  if (!map_init(&g->nodes, c->ma, 64))
+    return false;
+
+  err_t err = pkggraph_visit(g, NULL, pkg);
+  if (err) {
+    dlog("prescan of \"%s\" failed: %s", pkg->path.p, err_str(err));
+    pkggraph_free(g);
+    timeline_end(timeline_start, "prescan", pkg->path.p, NULL);
+    return false;
+  }
+
+  // Visit packages with importers before their imports (i.e. the reverse order)
+  // and compute the cost of the most costly path from the root to each package.
+  // Since any package costs more than nothing, every package gets a higher
+  // priority than all packages importing it.
+  for (u32 i = g->order.len; i-- > 0; ) {
+    pkgnode_t* n = g->order.v[i];
+    if (n->prio == 0)
+      n->prio = n->cost; // root
+    for (u32 j = 0; j < n->imports.len; j++) {
+      pkgnode_t** depp = (pkgnode_t**)map_lookup_ptr(&g->nodes, n->imports.v[j]);
+      if (depp)
+        (*depp)->prio = MAX((*depp)->prio, n->prio + (*depp)->cost);
+    }
+  }
+
+  // start loading packages, most costly chains first (root is last in order)
+  u32 ndeps = g->order.len - 1;
+  co_qsort(g->order.v, ndeps, sizeof(void*), pkgnode_cmp, NULL);
+  trace_import("\"%s\" prescan found %u packages to load:", pkg->path.p, ndeps);
+  for (u32 i = 0; i < ndeps; i++) {
+    pkgnode_t* n = g->order.v[i];
+    trace_import("  %s (prio %llu)", n->pkgc.pkg->path.p, n->prio);
+    load_dependency(c, api_ma, n->pkgc.parent, n->pkgc.pkg, /*sync*/false);
+  }
+
+  timeline_end(timeline_start, "prescan", pkg->path.p, NULL);
+  return true;
+}
+
+
+// pkggraph_dispose waits for packages loaded by pkggraph_schedule (which refer to
+// the graph's pkgcells) and frees the graph
+static void pkggraph_dispose(pkggraph_t* g) {
+  // note: root is last in order
+  for (u32 i = 0; i + 1 < g->order.len; i++) {
+    pkgnode_t* n = g->order.v[i];
+    threadpool_future_wait(&n->pkgc.pkg->loadfut);
+  }
+  pkggraph_free(g);
+}
+
 
 err_t build_toplevel_pkg(
   pkg_t* pkg, compiler_t* c, const char* outfile, u32 pkgbuild_flags)
@@ -1603,17 +2678,93 @@ err_t build_toplevel_pkg(
   assert((pkgbuild_flags & PKGBUILD_DEP) == 0);
 
   // create AST allocator for APIs, AST that needs to outlive any one package build
-  memalloc_t api_ma = memalloc_bump2(/*slabsize*/0, /*flags*/0);
-  if (api_ma == memalloc_null()) {
-    dlog("OOM: memalloc_bump_in_zeroed");
-    return ErrNoMem;
+  memalloc_t api_ma = c->pkgapi_ma;
+  if (!api_ma) {
+    api_ma = memalloc_bump2(/*slabsize*/0, /*flags*/0);
+    if (api_ma == memalloc_null()) {
+      dlog("OOM: memalloc_bump_in_zeroed");
+      return ErrNoMem;
+    }
+  }
+
+  err_t err = 0;
+
+  // if the product of the last build is up to date, there's nothing to do
+  if (toplevel_pkg_uptodate(c, api_ma, pkg, outfile, pkgbuild_flags)) {
+    vlog("package \"%s\" is up to date", pkg->path.p);
+  } else {
+    // remove stampfile; it's written again only if the build succeeds
+    str_t stampfile = {};
+    if (pkg_buildfile(pkg, c, &stampfile, PKG_STAMPFILE_NAME))
+      unlink(stampfile.p);
+    str_free(stampfile);
+
+    // Prescan the import graph and start loading dependencies right away, instead
+    // of discovering them one package at a time as each is parsed.
+    // Not worth it without threads, since packages are then loaded one at a time anyway.
+    pkggraph_t graph = {};
+    bool use_graph = comaxproc > 1;
+    if (use_graph)
+      use_graph = pkggraph_schedule(&graph, c, api_ma, pkg);
+
+    err = build_pkg(
+      (pkgcell_t){NULL,pkg}, c, outfile, api_ma, pkgbuild_flags, BUILD_REASON_DEFAULT);
+
+    if (use_graph)
+      pkggraph_dispose(&graph);
   }
 
-  err_t err = build_pkg(
-    (pkgcell_t){NULL,pkg}, c, outfile, api_ma, pkgbuild_flags, BUILD_REASON_DEFAULT);
+  buildstats_apimem(api_ma);
 
-  if ((pkgbuild_flags & PKGBUILD_NOCLEANUP) == 0)
+  if ((pkgbuild_flags & PKGBUILD_NOCLEANUP) == 0 && api_ma != c->pkgapi_ma)
     memalloc_bump2_dispose(api_ma);
 
   return err;
 }
+
+
+static bool pkg_loaded_uptodate(compiler_t* c, pkg_t* pkg) {
+  err_t err;
+  if (!future_trywait(&pkg->loadfut, &err))
+    return true; // never loaded; nothing to invalidate
+  if (err || pkg->mtime == 0)
+    return false;
+
+  // check that the library and metafile have not been replaced since we loaded them
+  // (e.g. by a "compis build" not using this compiler instance)
+  str_t libfile = {}, metafile = {};
+  bool ok = pkg_libfile(pkg, c, &libfile) &&
+            pkg_buildfile(pkg, c, &metafile, PKG_METAFILE_NAME) &&
+            MIN(fs_mtime(libfile.p), fs_mtime(metafile.p)) == pkg->mtime;
+  str_free(libfile);
+  str_free(metafile);
+  if (!ok) {
+    trace_import("[%s] build products changed", pkg->path.p);
+    return false;
+  }
+
+  if (!check_pkg_src_uptodate(c, pkg, pkg->mtime)) {
+    trace_import("[%s] sources changed", pkg->path.p);
+    return false;
+  }
+
+  // dependencies must still be in the index (i.e. not removed top-level packages)
+  for (u32 i = 0; i < pkg->imports.len; i++) {
+    const pkg_t* dep = pkg->imports.v[i];
+    pkg_t** depp = (pkg_t**)map_lookup(&c->pkgindex, dep->dir.p, dep->dir.len);
+    if (!depp || *depp != dep)
+      return false;
+  }
+
+  return true;
+}
+
+
+bool pkgindex_uptodate(compiler_t* c) {
+  bool ok = true;
+  rwmutex_rlock(&c->pkgindex_mu);
+  for (const mapent_t* e = map_it(&c->pkgindex); ok && map_itnext(&c->pkgindex, &e); )
+    ok = pkg_loaded_uptodate(c, e->value);
+  rwmutex_runlock(&c->pkgindex_mu);
+  return ok;
+}
@@ -2,6 +2,8 @@
 #include "compiler.h"
 #include "bgtask.h"
 #include "strlist.h"
+#include "sha256.h"
+#include "srcfp.h"
 ASSUME_NONNULL_BEGIN
 
 // flags
@@ -28,6 +30,10 @@ typedef struct {
   strlist_t     cfiles;   // ".c" file paths, indexed by pkg->file id
   strlist_t     ofiles;   // ".o" file paths, indexed by pkg->file id
   promise_t*    promisev; // one promise for each srcfile, indexed by pkg->file id
+  sha256_t*     objkeyv;  // objcache key for each .co.c, indexed by pkg->file id
+  bool*         startedv; // true once .o is being built (or is done), by pkg->file id
+  mutex_t*      bgtmu;    // guards bgt while cgen runs on several threads (or NULL)
+  srcfpdb_t     srcfpdb;  // fingerprints of srcfiles (with c->opt_contenthash)
   cgen_t        cgen;
   cgen_pkgapi_t pkgapi;
 } pkgbuild_t;
@@ -40,7 +46,8 @@ void pkgbuild_dispose(pkgbuild_t* pb);
 err_t pkgbuild_locate_sources(pkgbuild_t* pb);
 err_t pkgbuild_begin_early_compilation(pkgbuild_t* pb);
 err_t pkgbuild_parse(pkgbuild_t* pb);
-err_t pkgbuild_import(pkgbuild_t* pb);
+err_t pkgbuild_import(pkgbuild_t* pb); // starts loading imported packages
+err_t pkgbuild_import_wait(pkgbuild_t* pb); // waits for imported packages to load
 err_t pkgbuild_analyze(pkgbuild_t* pb);
 err_t pkgbuild_setinfo(pkgbuild_t* pb);
 err_t pkgbuild_metagen(pkgbuild_t* pb);
@@ -53,4 +60,9 @@ err_t pkgbuild_link(pkgbuild_t* pb, const char* outfile/*can be empty*/);
 err_t build_toplevel_pkg(
   pkg_t* pkg, compiler_t* c, const char* outfile, u32 pkgbuild_flags);
 
+// pkgindex_uptodate returns true if all packages loaded into c->pkgindex by
+// earlier builds are still up to date with their sources and build products,
+// meaning that c can be used for another build.
+bool pkgindex_uptodate(compiler_t* c);
+
 ASSUME_NONNULL_END
@@ -4,6 +4,8 @@
 #include "abuf.h"
 #include "unicode.h"
 
+#include <string.h> // memchr
+
 
 // DEBUG_INDENT: define to debug indentation
 //#define DEBUG_INDENT
@@ -23,18 +25,30 @@ static const struct { const char* s; u8 len; tok_t t; } keywordtab[] = {
 };
 
 
+// keywordhtab is a perfect hash table of keywords, mapping KEYWORD_HASH of a
+// keyword to its index in keywordtab + 1. It is built from keywordtab at load time.
+// A keyword added to tokens.h which collides with another one is not found by
+// maybe_keyword; the scanner_keywords unit test checks that there are no collisions.
+#define KEYWORD_MINLEN    2
+#define KEYWORD_HTAB_SIZE 32
+#define KEYWORD_HASH(p, len) \
+  (((usize)(p)[0] + ((usize)(p)[1] << 1) + (len)) & (KEYWORD_HTAB_SIZE - 1))
+static u8 keywordhtab[KEYWORD_HTAB_SIZE];
+
+__attribute__((constructor)) static void init_keywordhtab() {
+  static_assert(countof(keywordtab) < KEYWORD_HTAB_SIZE, "");
+  for (usize i = 0; i < countof(keywordtab); i++) {
+    usize h = KEYWORD_HASH((const u8*)keywordtab[i].s, keywordtab[i].len);
+    if (keywordhtab[h] == 0)
+      keywordhtab[h] = (u8)(i + 1);
+  }
+}
+
+
 bool scanner_init(scanner_t* s, compiler_t* c) {
   memset(s, 0, sizeof(*s));
   s->compiler = c;
   buf_init(&s->litbuf, c->ma);
-
-  // keywordtab must be sorted
-  #if DEBUG
-    for (usize i = 1; i < countof(keywordtab); i++)
-      assertf(strcmp(keywordtab[i-1].s, keywordtab[i].s) < 0,
-        "keywordtab out of order (%s)", keywordtab[i].s);
-  #endif
-
   return true;
 }
 
@@ -147,6 +161,240 @@ inline static void newline(scanner_t* s) {
 }
 
 
+//———————————————————————————————————————————————————————————————————————————————————————
+// vectorized byte classification
+//
+// Runs of identifier characters and whitespace, and the bodies of comments and
+// strings, are skipped SCAN_VECLEN bytes at a time. Vector ops classify each byte
+// of a vector and vec_mask converts the result to a bitmask with SCAN_MASKBITS
+// bits per byte, lowest address in the least significant bits.
+// Opt builds for x86_64 target x86-64-v3 (AVX2) and NEON is a baseline feature
+// of aarch64, so the implementation is selected at compile time.
+// Most identifiers and runs of whitespace are short, so the first SCAN_SHORTRUN
+// bytes are classified one at a time before switching to vectors.
+// The scalar loop of each function handles the tail of the input.
+
+#define SCAN_SHORTRUN 8
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+  #define SCAN_VECLEN   32
+  #define SCAN_MASKBITS 1
+  #define SCAN_FULLMASK 0xffffffffllu
+  typedef __m256i vec_t;
+  #define vec_load(p)  _mm256_loadu_si256((const __m256i*)(p))
+  #define vec_splat(c) _mm256_set1_epi8((char)(c))
+  #define vec_eq(v, c) _mm256_cmpeq_epi8((v), vec_splat(c))
+  #define vec_or(a, b) _mm256_or_si256((a), (b))
+  #define vec_mask(v)  ((u64)(u32)_mm256_movemask_epi8(v))
+  // vec_inrange classifies bytes lo <= c <= hi
+  inline static vec_t vec_inrange(vec_t v, u8 lo, u8 hi) {
+    vec_t d = _mm256_sub_epi8(v, vec_splat(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(d, vec_splat(hi - lo)), d);
+  }
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+  #define SCAN_VECLEN   16
+  #define SCAN_MASKBITS 1
+  #define SCAN_FULLMASK 0xffffllu
+  typedef __m128i vec_t;
+  #define vec_load(p)  _mm_loadu_si128((const __m128i*)(p))
+  #define vec_splat(c) _mm_set1_epi8((char)(c))
+  #define vec_eq(v, c) _mm_cmpeq_epi8((v), vec_splat(c))
+  #define vec_or(a, b) _mm_or_si128((a), (b))
+  #define vec_mask(v)  ((u64)(u32)_mm_movemask_epi8(v))
+  inline static vec_t vec_inrange(vec_t v, u8 lo, u8 hi) {
+    vec_t d = _mm_sub_epi8(v, vec_splat(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, vec_splat(hi - lo)), d);
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  #include <arm_neon.h>
+  #define SCAN_VECLEN   16
+  #define SCAN_MASKBITS 4
+  #define SCAN_FULLMASK 0xffffffffffffffffllu
+  typedef uint8x16_t vec_t;
+  #define vec_load(p)  vld1q_u8(p)
+  #define vec_splat(c) vdupq_n_u8((u8)(c))
+  #define vec_eq(v, c) vceqq_u8((v), vec_splat(c))
+  #define vec_or(a, b) vorrq_u8((a), (b))
+  // narrowing shift leaves 4 bits per byte
+  #define vec_mask(v)  vget_lane_u64(vreinterpret_u64_u8( \
+    vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0)
+  inline static vec_t vec_inrange(vec_t v, u8 lo, u8 hi) {
+    return vcleq_u8(vsubq_u8(v, vec_splat(lo)), vec_splat(hi - lo));
+  }
+#endif
+
+#ifdef SCAN_VECLEN
+  // byte index of the first, last and number of bytes set in a mask
+  #define MASK_FIRST(m) ((usize)__builtin_ctzll(m) / SCAN_MASKBITS)
+  #define MASK_LAST(m)  ((usize)(63 - __builtin_clzll(m)) / SCAN_MASKBITS)
+  #define MASK_COUNT(m) ((u32)__builtin_popcountll(m) / SCAN_MASKBITS)
+
+  // mask_below returns a mask of bytes [0, n)
+  inline static u64 mask_below(usize n) {
+    return n * SCAN_MASKBITS >= 64 ? ~0llu : (1llu << (n * SCAN_MASKBITS)) - 1;
+  }
+
+  // mask_clearfirst clears the bits of the first byte set in m
+  inline static u64 mask_clearfirst(u64 m) {
+    return m & ~(((1llu << SCAN_MASKBITS) - 1) << (MASK_FIRST(m) * SCAN_MASKBITS));
+  }
+
+  // [0-9A-Za-z_]
+  inline static vec_t vec_idchar(vec_t v) {
+    return vec_or(
+      vec_or(vec_inrange(v, '0', '9'), vec_inrange(vec_or(v, vec_splat(0x20)), 'a', 'z')),
+      vec_eq(v, '_'));
+  }
+
+  // SP, \t, \n, \v, \f, \r (same as isspace)
+  inline static vec_t vec_space(vec_t v) {
+    return vec_or(vec_eq(v, ' '), vec_inrange(v, '\t', '\r'));
+  }
+#endif
+
+
+// skip_idchars_long is the continuation of skip_idchars for runs longer than
+// SCAN_SHORTRUN bytes
+static const u8* skip_idchars_long(const u8* p, const u8* end) {
+  #ifdef SCAN_VECLEN
+  while ((usize)(end - p) >= SCAN_VECLEN) {
+    u64 m = ~vec_mask(vec_idchar(vec_load(p))) & SCAN_FULLMASK;
+    if (m)
+      return p + MASK_FIRST(m);
+    p += SCAN_VECLEN;
+  }
+  #endif
+  while (p < end && (isalnum(*p) || *p == '_'))
+    p++;
+  return p;
+}
+
+
+// skip_idchars returns the first byte at or after p which is not
+// an ASCII identifier character
+inline static const u8* skip_idchars(const u8* p, const u8* end) {
+  const u8* shortend = p + MIN((usize)(end - p), SCAN_SHORTRUN);
+  while (p < shortend && (isalnum(*p) || *p == '_'))
+    p++;
+  if (p < shortend)
+    return p;
+  return skip_idchars_long(p, end);
+}
+
+
+// skip_space_long is the continuation of skip_space for runs longer than
+// SCAN_SHORTRUN bytes
+static const u8* skip_space_long(scanner_t* s, const u8* p, bool* nlp) {
+  const u8* end = s->inend;
+  #ifdef SCAN_VECLEN
+  while ((usize)(end - p) >= SCAN_VECLEN) {
+    vec_t v = vec_load(p);
+    u64 m = ~vec_mask(vec_space(v)) & SCAN_FULLMASK;
+    usize n = m ? MASK_FIRST(m) : SCAN_VECLEN;
+    u64 nl = vec_mask(vec_eq(v, '\n')) & mask_below(n);
+    if (nl) {
+      *nlp = true;
+      s->lineno += MASK_COUNT(nl);
+      s->linestart = p + MASK_LAST(nl) + 1;
+    }
+    p += n;
+    if (m)
+      return p;
+  }
+  #endif
+  for (; p < end && isspace(*p); p++) {
+    if (*p == '\n') {
+      *nlp = true;
+      s->lineno++;
+      s->linestart = p + 1;
+    }
+  }
+  return p;
+}
+
+
+// skip_space returns the first non-whitespace byte at or after s->inp,
+// counting lines. Sets *nlp to true if a line break was skipped.
+inline static const u8* skip_space(scanner_t* s, bool* nlp) {
+  const u8* p = s->inp;
+  const u8* shortend = p + MIN((usize)(s->inend - p), SCAN_SHORTRUN);
+  for (; p < shortend && isspace(*p); p++) {
+    if (*p == '\n') {
+      *nlp = true;
+      s->lineno++;
+      s->linestart = p + 1;
+    }
+  }
+  if (p < shortend)
+    return p;
+  return skip_space_long(s, p, nlp);
+}
+
+
+// skip_blockcomment returns the byte after the "*/" ending a block comment,
+// or end if there is none, counting lines. p is the byte after "/*".
+static const u8* skip_blockcomment(scanner_t* s, const u8* p) {
+  const u8* end = s->inend;
+  const u8* startstar = p - 1; // make sure "/*/" != "/**/"
+  #ifdef SCAN_VECLEN
+  while ((usize)(end - p) >= SCAN_VECLEN) {
+    vec_t v = vec_load(p);
+    u64 m = vec_mask(vec_or(vec_eq(v, '/'), vec_eq(v, '\n')));
+    for (; m; m = mask_clearfirst(m)) {
+      const u8* q = p + MASK_FIRST(m);
+      if (*q == '\n') {
+        s->lineno++;
+        s->linestart = q + 1;
+      } else if (*(q - 1) == '*' && q - 1 != startstar) {
+        return q + 1;
+      }
+    }
+    p += SCAN_VECLEN;
+  }
+  #endif
+  for (; p < end; p++) {
+    if (*p == '\n') {
+      s->lineno++;
+      s->linestart = p + 1;
+    } else if (*p == '/' && *(p - 1) == '*' && p - 1 != startstar) {
+      return p + 1;
+    }
+  }
+  return p;
+}
+
+
+// skip_strchars_long is the continuation of skip_strchars for runs longer than
+// SCAN_SHORTRUN bytes
+static const u8* skip_strchars_long(const u8* p, const u8* end) {
+  #ifdef SCAN_VECLEN
+  while ((usize)(end - p) >= SCAN_VECLEN) {
+    vec_t v = vec_load(p);
+    u64 m = vec_mask(vec_or(vec_or(vec_eq(v, '"'), vec_eq(v, '\\')), vec_eq(v, '\n')));
+    if (m)
+      return p + MASK_FIRST(m);
+    p += SCAN_VECLEN;
+  }
+  #endif
+  while (p < end && *p != '"' && *p != '\\' && *p != '\n')
+    p++;
+  return p;
+}
+
+
+// skip_strchars returns the first '"', '\\' or '\n' at or after p, or end
+inline static const u8* skip_strchars(const u8* p, const u8* end) {
+  const u8* shortend = p + MIN((usize)(end - p), SCAN_SHORTRUN);
+  while (p < shortend && *p != '"' && *p != '\\' && *p != '\n')
+    p++;
+  if (p < shortend)
+    return p;
+  return skip_strchars_long(p, end);
+}
+
+
 static void prepare_litbuf(scanner_t* s, usize minlen) {
   buf_clear(&s->litbuf);
   if UNLIKELY(!buf_reserve(&s->litbuf, minlen))
@@ -539,7 +787,7 @@ static void string_buffered(scanner_t* s, usize extralen, bool ismultiline, loc_
         FLUSH_BUF(src);
         return;
       default:
-        src++;
+        src = skip_strchars(src + 1, s->inend);
     }
   }
 }
@@ -554,7 +802,7 @@ static void string(scanner_t* s) {
 
   buf_clear(&s->litbuf);
 
-  while (s->inp < s->inend) {
+  while (s->inp < s->inend && (s->inp = skip_strchars(s->inp, s->inend)) < s->inend) {
     switch (*s->inp) {
       case '\\':
         s->inp++; // eat next byte
@@ -740,7 +988,7 @@ static bool utf8seq(scanner_t* s) {
 }
 
 
-static void intern_identifier(scanner_t* s) {
+static void intern_identifier(scanner_t* s, usize hash) {
   slice_t lit = scanner_lit(s);
 
   if UNLIKELY(
@@ -751,7 +999,7 @@ static void intern_identifier(scanner_t* s) {
       "invalid identifier; prefix '" CO_ABI_GLOBAL_PREFIX "' reserved for internal use");
   }
 
-  s->sym = sym_intern(lit.chars, lit.len);
+  s->sym = sym_intern_hashed(lit.chars, lit.len, hash);
   loc_set_width(&s->loc, lit.len);
 }
 
@@ -768,50 +1016,32 @@ static void identifier_utf8(scanner_t* s) {
     }
   }
   s->tok = TID;
-  intern_identifier(s);
+  slice_t lit = scanner_lit(s);
+  intern_identifier(s, sym_hash(lit.chars, lit.len));
   // TODO utf8_len: loc_set_width(&s->loc, utf8_len);
 }
 
 
 static void maybe_keyword(scanner_t* s) {
-  // binary search for matching keyword & convert currtok to keyword
-  usize low = 0, high = countof(keywordtab), mid;
+  // look up keyword in perfect hash table & convert currtok to keyword
   slice_t lit = scanner_lit(s);
-  int cmp;
-
-  if (lit.len > KEYWORD_MAXLEN)
+  if (lit.len < KEYWORD_MINLEN || lit.len > KEYWORD_MAXLEN)
     return;
-
-  while (low < high) {
-    mid = (low + high) / 2;
-    cmp = strncmp(lit.chars, keywordtab[mid].s, lit.len);
-    // dlog("maybe_keyword %.*s <> %s = %d",
-    //  (int)lit.len, lit.chars, keywordtab[mid].s, cmp);
-    if (cmp == 0) {
-      if (lit.len < keywordtab[mid].len) {
-        high = mid;
-      } else {
-        s->tok = keywordtab[mid].t;
-        break;
-      }
-    } else if (cmp < 0) {
-      high = mid;
-    } else {
-      low = mid + 1;
-    }
-  }
+  u8 i = keywordhtab[KEYWORD_HASH(lit.bytes, lit.len)];
+  if (i-- && keywordtab[i].len == lit.len && memcmp(keywordtab[i].s, lit.chars, lit.len) == 0)
+    s->tok = keywordtab[i].t;
 }
 
 
 static void identifier(scanner_t* s) {
-  while (s->inp < s->inend && ( isalnum(*s->inp) || *s->inp == '_' ))
-    s->inp++;
+  s->inp = skip_idchars(s->inp, s->inend);
   if (s->inp < s->inend && (u8)*s->inp >= UTF8_SELF)
     return identifier_utf8(s);
   s->tok = TID;
   s->insertsemi = true;
-  loc_set_width(&s->loc, scanner_lit(s).len);
-  intern_identifier(s);
+  slice_t lit = scanner_lit(s);
+  loc_set_width(&s->loc, lit.len);
+  intern_identifier(s, sym_hash(lit.chars, lit.len));
   maybe_keyword(s);
 }
 
@@ -823,21 +1053,11 @@ static void scan_comment(scanner_t* s) {
   if (s->inp[1] == '/') {
     // line comment "// ... <LF>"
     s->inp += 2;
-    while (s->inp < s->inend && *s->inp != '\n')
-      s->inp++;
+    const u8* lf = memchr(s->inp, '\n', (usize)(s->inend - s->inp));
+    s->inp = lf ? lf : s->inend;
   } else {
     // block comment "/* ... */"
-    s->inp += 2;
-    const u8* startstar = s->inp - 1; // make sure "/*/" != "/**/"
-    while (s->inp < s->inend) {
-      if (*s->inp == '\n') {
-        newline(s);
-      } else if (*s->inp == '/' && *(s->inp - 1) == '*' && s->inp - 1 != startstar) {
-        s->inp++; // consume '*'
-        break;
-      }
-      s->inp++;
-    }
+    s->inp = skip_blockcomment(s, s->inp + 2);
   }
 
   // if comments parsing is enabled or the comment is a "special" comment,
@@ -1042,13 +1262,7 @@ indent_unwind:
 
   // skip whitespace
   bool is_linestart = s->inp == s->linestart;
-  while (s->inp < s->inend && isspace(*s->inp)) {
-    if (*s->inp == '\n') {
-      is_linestart = true;
-      newline(s);
-    }
-    s->inp++;
-  }
+  s->inp = skip_space(s, &is_linestart);
 
   if ((uintptr)(s->inend - s->inp) > 2 &&
       s->inp[0] == '/' && (s->inp[1] == '/' || s->inp[1] == '*'))
@@ -1237,6 +1451,7 @@ void scanner_next(scanner_t* s) {
   loc_set_col(&s->endloc, (u32)(uintptr)(s->tokend - s->linestart) + 1);
 
   scan0(s);
+  s->ntokens++;
 
   #ifdef DEBUG
   if (opt_trace_scan) {
@@ -1257,3 +1472,132 @@ void scanner_next(scanner_t* s) {
   }
   #endif
 }
+
+
+#ifdef CO_ENABLE_TESTS
+UNITTEST_DEF(scanner_skip) {
+  // vectorized skip functions must agree with byte-by-byte scanning,
+  // for inputs of all lengths and alignments
+  static const char charsets[][16] = {
+    "aZz_09@`{", " \t\n\r\v\f", "*/\n", "abc\"\\\n", "a \n/*\"\\\x80\xff",
+  };
+  u8 buf[96];
+  u32 rand = 1;
+  scanner_t s = {};
+
+  for (u32 iter = 0; iter < 20000; iter++) {
+    const char* charset = charsets[iter % countof(charsets)];
+    usize nchars = strlen(charset);
+    usize len = iter % (sizeof(buf) - 1);
+    usize start = (iter / 7) % 3;
+    for (usize i = 0; i < len; i++) {
+      rand = rand * 1103515245 + 12345;
+      buf[i] = charset[(rand >> 16) % nchars];
+    }
+    const u8* p = buf + MIN(start, len);
+    const u8* end = buf + len;
+    const u8* q;
+
+    // skip_idchars
+    for (q = p; q < end && (isalnum(*q) || *q == '_'); q++) {}
+    assert(skip_idchars(p, end) == q);
+
+    // skip_strchars
+    for (q = p; q < end && *q != '"' && *q != '\\' && *q != '\n'; q++) {}
+    assert(skip_strchars(p, end) == q);
+
+    // skip_space
+    u32 lineno = 1;
+    const u8* linestart = buf;
+    for (q = p; q < end && isspace(*q); q++) {
+      if (*q == '\n')
+        lineno++, linestart = q + 1;
+    }
+    bool nl = false;
+    s.inp = p, s.inend = end, s.lineno = 1, s.linestart = buf;
+    assert(skip_space(&s, &nl) == q);
+    assert(s.lineno == lineno);
+    assert(s.linestart == linestart);
+    assert(nl == (lineno > 1));
+
+    // skip_blockcomment (p must follow "/*")
+    if (p == buf)
+      continue;
+    lineno = 1;
+    linestart = buf;
+    for (q = p; q < end; q++) {
+      if (*q == '\n') {
+        lineno++, linestart = q + 1;
+      } else if (*q == '/' && q[-1] == '*' && q - 1 != p - 1) {
+        q++;
+        break;
+      }
+    }
+    s.inp = p, s.inend = end, s.lineno = 1, s.linestart = buf;
+    assert(skip_blockcomment(&s, p) == q);
+    assert(s.lineno == lineno);
+    assert(s.linestart == linestart);
+  }
+}
+
+
+UNITTEST_DEF(scanner_keywords) {
+  // perfect hash lookup must find exactly the keywords of keywordtab.
+  // Test all keywords with every byte replaced by every id byte, with one byte
+  // appended and removed, and all strings of length 2 and 3.
+  static const char idchars[] = "_0123456789"
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+  u8 buf[KEYWORD_MAXLEN + 2];
+  scanner_t s = {};
+
+  // every keyword must have a slot of its own (see init_keywordhtab)
+  for (usize i = 0; i < countof(keywordtab); i++) {
+    usize len = keywordtab[i].len;
+    assertf(len >= KEYWORD_MINLEN && len <= KEYWORD_MAXLEN,
+      "KEYWORD_MINLEN or KEYWORD_MAXLEN out of date (%s)", keywordtab[i].s);
+    usize h = KEYWORD_HASH((const u8*)keywordtab[i].s, len);
+    assertf(keywordhtab[h] == i + 1, "keyword hash collision: \"%s\" \"%s\"",
+      keywordtab[i].s, keywordtab[keywordhtab[h] - 1].s);
+  }
+
+  #define TEST_KEYWORD(n) { \
+    s.tokstart = buf, s.inp = buf + (n), s.tok = TID; \
+    maybe_keyword(&s); \
+    tok_t expect = TID; \
+    for (usize i = 0; i < countof(keywordtab); i++) { \
+      if (keywordtab[i].len == (n) && memcmp(keywordtab[i].s, buf, (n)) == 0) \
+        expect = keywordtab[i].t; \
+    } \
+    assertf(s.tok == expect, "\"%.*s\"", (int)(n), buf); \
+  }
+
+  for (usize k = 0; k < countof(keywordtab); k++) {
+    usize len = keywordtab[k].len;
+    memcpy(buf, keywordtab[k].s, len);
+    TEST_KEYWORD(len);
+    TEST_KEYWORD(len - 1);
+    for (usize c = 0; c < strlen(idchars); c++) {
+      buf[len] = idchars[c];
+      TEST_KEYWORD(len + 1);
+      for (usize i = 0; i < len; i++) {
+        memcpy(buf, keywordtab[k].s, len);
+        buf[i] = idchars[c];
+        TEST_KEYWORD(len);
+      }
+    }
+  }
+
+  for (usize a = 0; a < strlen(idchars); a++) {
+    for (usize b = 0; b < strlen(idchars); b++) {
+      buf[0] = idchars[a], buf[1] = idchars[b];
+      TEST_KEYWORD(2);
+      for (usize c = 0; c < strlen(idchars); c++) {
+        buf[2] = idchars[c];
+        TEST_KEYWORD(3);
+      }
+    }
+  }
+
+  #undef TEST_KEYWORD
+}
+#endif
@@ -200,15 +200,20 @@ void scope_dispose(scope_t* s, memalloc_t ma) {
 }
 
 
-// bool scope_copy(scope_t* dst, const scope_t* src, memalloc_t ma) {
-//   void* ptr = mem_allocv(ma, src->cap, sizeof(void*));
-//   if (!ptr)
-//     return false;
-//   memcpy(ptr, src->ptr, src->cap * sizeof(void*));
-//   *dst = *src;
-//   dst->ptr = ptr;
-//   return true;
-// }
+bool scope_copy(scope_t* dst, const scope_t* src, memalloc_t ma) {
+  if (dst->cap < src->len) {
+    void* ptr = mem_resizev(ma, dst->ptr, dst->cap, src->cap, sizeof(void*));
+    if UNLIKELY(!ptr)
+      return false;
+    dst->ptr = ptr;
+    dst->cap = src->cap;
+  }
+  if (src->len)
+    memcpy(dst->ptr, src->ptr, src->len * sizeof(void*));
+  dst->len = src->len;
+  dst->base = src->base;
+  return true;
+}
 
 
 static bool scope_grow(scope_t* s, memalloc_t ma) {
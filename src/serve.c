@@ -0,0 +1,446 @@
+// compile server, keeping compiler state resident between builds
+// SPDX-License-Identifier: Apache-2.0
+#include "colib.h"
+#include "serve.h"
+#include "buf.h"
+#include "path.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h> // getenv
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h> // timeval
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h> // nanosleep
+#include <unistd.h>
+
+// Wire format
+//
+// request:  header_t, followed by header.size bytes of NUL-terminated strings:
+//           the client's working directory followed by argv.
+//           The first sendmsg carries the client's stdout & stderr as SCM_RIGHTS.
+// response: i32 exit status
+//
+#define SERVE_MAGIC    0x31766f63 // "cov1" (little endian)
+#define MAX_REQUESTSIZE (1024u * 1024u)
+
+// REQUEST_TIMEOUT is the number of seconds a client has to send its request.
+// Requests are handled one at a time, so a client which connects but never
+// sends anything would otherwise stall the server.
+#define REQUEST_TIMEOUT 10
+
+// WORKER_EXIT_ACCEPT is the exit status of a worker process which stopped
+// because accept failed, meaning that the server should stop too
+#define WORKER_EXIT_ACCEPT 120
+
+typedef struct {
+  u32 magic;
+  u32 size;
+} header_t;
+
+
+void serve_sockpath(char buf[PATH_MAX]) {
+  const char* envvar = getenv("COSERVE");
+  if (envvar && *envvar) {
+    snprintf(buf, PATH_MAX, "%s", envvar);
+  } else {
+    snprintf(buf, PATH_MAX, "%s" PATH_SEP_STR "serve.sock", cocachedir);
+  }
+}
+
+
+static err_t sockaddr_make(struct sockaddr_un* addr, const char* sockpath) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  usize len = strlen(sockpath);
+  if (len >= sizeof(addr->sun_path))
+    return ErrNameTooLong;
+  memcpy(addr->sun_path, sockpath, len);
+  return 0;
+}
+
+
+static err_t writeall(int fd, const void* p, usize size) {
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return err_errno();
+    }
+    p += n;
+    size -= (usize)n;
+  }
+  return 0;
+}
+
+
+static err_t readall(int fd, void* p, usize size) {
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return err_errno();
+    }
+    if (n == 0)
+      return ErrEnd;
+    p += n;
+    size -= (usize)n;
+  }
+  return 0;
+}
+
+
+static err_t connect_server(const char* sockpath, int* fdp) {
+  struct sockaddr_un addr;
+  err_t err = sockaddr_make(&addr, sockpath);
+  if (err)
+    return err;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return err_errno();
+  while (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    if (errno == EINTR)
+      continue;
+    err = (errno == ENOENT || errno == ECONNREFUSED) ? ErrNotFound : err_errno();
+    close(fd);
+    return err;
+  }
+  *fdp = fd;
+  return 0;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// client
+
+
+err_t serve_request(const char* sockpath, int argc, char*const* argv, int* exitstatus) {
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd)))
+    return err_errno();
+
+  // encode request payload
+  buf_t payload = buf_make(memalloc_ctx());
+  bool ok = buf_append(&payload, cwd, strlen(cwd) + 1);
+  for (int i = 0; i < argc; i++)
+    ok &= buf_append(&payload, argv[i], strlen(argv[i]) + 1);
+  if (!ok) {
+    buf_dispose(&payload);
+    return ErrNoMem;
+  }
+  if (payload.len > MAX_REQUESTSIZE) {
+    buf_dispose(&payload);
+    return ErrOverflow;
+  }
+
+  int fd;
+  err_t err = connect_server(sockpath, &fd);
+  if (err) {
+    buf_dispose(&payload);
+    return err;
+  }
+
+  // send header along with our stdout and stderr
+  header_t h = { .magic = SERVE_MAGIC, .size = (u32)payload.len };
+  struct iovec iov = { .iov_base = &h, .iov_len = sizeof(h) };
+  int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } ctl;
+  memset(&ctl, 0, sizeof(ctl));
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = ctl.buf,
+    .msg_controllen = sizeof(ctl.buf),
+  };
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  ssize_t n;
+  while ((n = sendmsg(fd, &msg, 0)) < 0 && errno == EINTR) {}
+  if (n != (ssize_t)sizeof(h)) {
+    err = n < 0 ? err_errno() : ErrIO;
+  } else if (( err = writeall(fd, payload.p, payload.len) )) {
+    // fall through
+  } else {
+    // wait for the build to finish
+    i32 status;
+    if (( err = readall(fd, &status, sizeof(status)) )) {
+      if (err == ErrEnd)
+        err = ErrCanceled; // server went away before replying
+    } else {
+      *exitstatus = (int)status;
+    }
+  }
+
+  close(fd);
+  buf_dispose(&payload);
+  return err;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// server
+
+
+static int g_stdout = -1; // server's own stdout, while a request has STDOUT_FILENO
+static int g_stderr = -1; // server's own stderr, while a request has STDERR_FILENO
+
+
+// recv_request reads a request from connection fd.
+// On success, the client's stdout & stderr are stored in clientfds and
+// the payload in payload.
+static err_t recv_request(int fd, int clientfds[2], buf_t* payload) {
+  header_t h;
+  struct iovec iov = { .iov_base = &h, .iov_len = sizeof(h) };
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * 2)];
+    struct cmsghdr align;
+  } ctl;
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = ctl.buf,
+    .msg_controllen = sizeof(ctl.buf),
+  };
+
+  ssize_t n;
+  while ((n = recvmsg(fd, &msg, 0)) < 0 && errno == EINTR) {}
+  if (n < 0)
+    return err_errno();
+  if (n == 0)
+    return ErrEnd; // connection closed without a request (e.g. serve_listen probing)
+
+  // receive file descriptors first, so that we never leak them
+  int nfds = 0;
+  for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+      continue;
+    usize count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (usize i = 0; i < count; i++) {
+      int cfd;
+      memcpy(&cfd, CMSG_DATA(c) + i*sizeof(int), sizeof(int));
+      if (nfds < 2) {
+        clientfds[nfds++] = cfd;
+      } else {
+        close(cfd);
+      }
+    }
+  }
+  err_t err = 0;
+  if (nfds != 2 || (msg.msg_flags & MSG_CTRUNC) || n != (ssize_t)sizeof(h) ||
+      h.magic != SERVE_MAGIC || h.size == 0 || h.size > MAX_REQUESTSIZE)
+  {
+    err = ErrInvalid;
+    goto error;
+  }
+
+  // receive payload
+  if (!buf_reserve(payload, h.size)) {
+    err = ErrNoMem;
+    goto error;
+  }
+  if (( err = readall(fd, payload->p, h.size) ))
+    goto error;
+  payload->len = h.size;
+  if (payload->chars[payload->len - 1] != 0) {
+    err = ErrInvalid;
+    goto error;
+  }
+  return 0;
+
+error:
+  for (int i = 0; i < nfds; i++)
+    close(clientfds[i]);
+  return err;
+}
+
+
+static void redirect_output(int outfd, int errfd) {
+  fflush(stdout);
+  fflush(stderr);
+  dup2(outfd, STDOUT_FILENO);
+  dup2(errfd, STDERR_FILENO);
+}
+
+
+static int handle_request(int fd, serve_handler_t handler) {
+  int clientfds[2];
+  buf_t payload = buf_make(memalloc_ctx());
+  err_t err = recv_request(fd, clientfds, &payload);
+  if (err) {
+    if (err != ErrEnd)
+      elog("%s: invalid request (%s)", coprogname, err_str(err));
+    buf_dispose(&payload);
+    return -1;
+  }
+
+  // decode payload: cwd, followed by argv
+  int argc = -1;
+  for (usize i = 0; i < payload.len; i++)
+    argc += (payload.chars[i] == 0);
+  char** argv = mem_alloctv(memalloc_ctx(), char*, (usize)argc + 1);
+  int status = 1;
+  if (!argv) {
+    elog("%s: out of memory", coprogname);
+    goto end;
+  }
+  const char* cwd = payload.chars;
+  char* p = payload.chars + strlen(cwd) + 1;
+  for (int i = 0; i < argc; i++) {
+    argv[i] = p;
+    p += strlen(p) + 1;
+  }
+  argv[argc] = NULL;
+
+  u64 starttime = nanotime();
+  redirect_output(clientfds[0], clientfds[1]);
+
+  if (chdir(cwd) != 0) {
+    elog("%s: %s: %s", coprogname, cwd, err_str(err_errno()));
+  } else {
+    relpath_init();
+    status = handler(argc, argv);
+  }
+
+  redirect_output(g_stdout, g_stderr);
+
+  if (coverbose) {
+    char duration[25];
+    fmtduration(duration, nanotime() - starttime);
+    log("%s: %s%s (in %s): status %d (%s)", coprogname,
+      argc > 0 ? argv[0] : "", argc > 1 ? " ..." : "", cwd, status, duration);
+    fflush(stdout);
+  }
+
+  mem_freetv(memalloc_ctx(), argv, (usize)argc + 1);
+
+end:
+  close(clientfds[0]);
+  close(clientfds[1]);
+  buf_dispose(&payload);
+  return status;
+}
+
+
+// serve_requests accepts and handles requests on the listening socket fd,
+// one at a time. Returns only if accept fails.
+static err_t serve_requests(int fd, serve_handler_t handler) {
+  for (;;) {
+    int cfd = accept(fd, NULL, NULL);
+    if (cfd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return err_errno();
+    }
+    struct timeval timeout = { .tv_sec = REQUEST_TIMEOUT };
+    if (setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0)
+      vlog("%s: setsockopt SO_RCVTIMEO: %s", coprogname, err_str(err_errno()));
+    int status = handle_request(cfd, handler);
+    if (status >= 0) {
+      i32 status32 = (i32)status;
+      err_t err = writeall(cfd, &status32, sizeof(status32));
+      if (err)
+        vlog("%s: failed to reply to client: %s", coprogname, err_str(err));
+    }
+    close(cfd);
+  }
+}
+
+
+err_t serve_listen(const char* sockpath, serve_handler_t handler) {
+  struct sockaddr_un addr;
+  err_t err = sockaddr_make(&addr, sockpath);
+  if (err)
+    return err;
+
+  // check for another server, or clean up after one that went away
+  int fd;
+  if (( err = connect_server(sockpath, &fd) ) == 0) {
+    close(fd);
+    return ErrExists;
+  }
+  if (err == ErrNotFound && unlink(sockpath) != 0 && errno != ENOENT)
+    return err_errno();
+
+  char* dir = path_dir_alloca(sockpath);
+  if (( err = fs_mkdirs(dir, 0755, FS_VERBOSE) ))
+    return err;
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return err_errno();
+
+  // only the current user may connect, since requests run with our privileges
+  mode_t umask_prev = umask(0077);
+  int bindres = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+  umask(umask_prev);
+  if (bindres != 0 || listen(fd, 16) != 0) {
+    err = err_errno();
+    close(fd);
+    return err;
+  }
+
+  // a client going away in the middle of a build must not terminate the server
+  signal(SIGPIPE, SIG_IGN);
+
+  g_stdout = dup(STDOUT_FILENO);
+  g_stderr = dup(STDERR_FILENO);
+
+  // Requests are handled by a worker process which keeps resident state between
+  // builds. A build which crashes or calls exit (e.g. panic or errx) takes down
+  // only the worker, which we replace with a new one, losing only its state.
+  for (;;) {
+    u64 starttime = nanotime();
+    pid_t pid = fork();
+    if (pid < 0) {
+      err = err_errno();
+      break;
+    }
+    if (pid == 0) {
+      err = serve_requests(fd, handler);
+      elog("%s: accept: %s", coprogname, err_str(err));
+      fflush(stdout);
+      _exit(WORKER_EXIT_ACCEPT);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+      if (errno != EINTR) {
+        err = err_errno();
+        goto end;
+      }
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == WORKER_EXIT_ACCEPT) {
+      err = ErrIO;
+      break;
+    }
+    if (WIFSIGNALED(status)) {
+      elog("%s: build process terminated by signal %d; restarting",
+        coprogname, WTERMSIG(status));
+    } else {
+      elog("%s: build process exited with status %d; restarting",
+        coprogname, WEXITSTATUS(status));
+    }
+
+    // don't spin if the worker keeps dying right away
+    if (nanotime() - starttime < 1000000000ull) {
+      struct timespec ts = { .tv_sec = 1 };
+      nanosleep(&ts, NULL);
+    }
+  }
+
+end:
+  close(fd);
+  unlink(sockpath);
+  return err;
+}
@@ -0,0 +1,39 @@
+// compile server, keeping compiler state resident between builds
+// SPDX-License-Identifier: Apache-2.0
+//
+// "compis serve" listens on a unix socket for build requests made by
+// "compis build --server". A request carries the client's command line and
+// working directory, and its stdout and stderr file descriptors (SCM_RIGHTS),
+// so that the build's output goes straight to the client's terminal.
+// The server replies with the build's exit status.
+//
+// Requests are handled one at a time, in a long-lived worker process, which
+// means that state initialized once (LLVM, symbols, typeids, universe) and state
+// kept by main_build.c between builds (compiler instance, package index and
+// decoded APIs of dependencies) is reused. If a build crashes or exits (e.g. on
+// panic), the server starts a new worker and the client's request fails.
+// A client has REQUEST_TIMEOUT seconds (see serve.c) to send its request.
+//
+#pragma once
+ASSUME_NONNULL_BEGIN
+
+// serve_handler_t is called for each request with the client's working directory
+// as the current directory and stdout & stderr redirected to the client's.
+// Returns the exit status for the client.
+typedef int(*serve_handler_t)(int argc, char* argv[]);
+
+// serve_sockpath writes the path of the server socket to buf:
+// $COSERVE if set, otherwise {cocachedir}/serve.sock
+void serve_sockpath(char buf[PATH_MAX]);
+
+// serve_listen accepts requests on a unix socket at sockpath and calls handler
+// for each one. Returns only if the socket can't be created, or ErrExists if
+// another server is already listening at sockpath.
+err_t serve_listen(const char* sockpath, serve_handler_t handler);
+
+// serve_request sends a build request with argv to the server at sockpath and
+// waits for it to complete, setting *exitstatus to the build's exit status.
+// Returns ErrNotFound if no server is listening at sockpath.
+err_t serve_request(const char* sockpath, int argc, char*const* argv, int* exitstatus);
+
+ASSUME_NONNULL_END
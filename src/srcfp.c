@@ -0,0 +1,237 @@
+// source file fingerprints
+// SPDX-License-Identifier: Apache-2.0
+#include "colib.h"
+#include "srcfp.h"
+
+#include <sys/stat.h>
+
+// File format (host byte order; the database is never shared between hosts)
+//   file    = header entry*
+//   header  = "cofp" version:u32 count:u32
+//   entry   = srcfp_t namelen:u32 name:u8*namelen
+#define SRCFP_MAGIC   "cofp"
+#define SRCFP_VERSION 1u
+
+typedef struct {
+  str_t   name;
+  srcfp_t fp;
+} srcfpent_t;
+
+
+static int srcfpent_cmp(const srcfpent_t* a, const srcfpent_t* b, void* ctx) {
+  return strcmp(a->name.p, b->name.p);
+}
+
+
+bool srcfp_stat_eq(const srcfp_t* a, const srcfp_t* b) {
+  return a->size == b->size && a->mtime == b->mtime && a->ino == b->ino;
+}
+
+
+static void srcfp_of_stat(srcfp_t* fp, const struct stat* st) {
+  fp->size = (u64)st->st_size;
+  fp->mtime = unixtime_of_stat_mtime(st);
+  fp->ino = (u64)st->st_ino;
+}
+
+
+err_t srcfp_make(srcfp_t* fp, const char* path, const srcfp_t* nullable prev) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return err_errno();
+  srcfp_of_stat(fp, &st);
+
+  if (prev && srcfp_stat_eq(fp, prev)) {
+    fp->sha256 = prev->sha256;
+    return 0;
+  }
+
+  if (st.st_size == 0) {
+    sha256_data(&fp->sha256, "", 0);
+    return 0;
+  }
+
+  // note: fingerprint with the stat data of the file we actually read
+  const void* data;
+  err_t err = mmap_file_ro(path, &data, &st);
+  if (err)
+    return err;
+  srcfp_of_stat(fp, &st);
+  sha256_data(&fp->sha256, data, (usize)st.st_size);
+  mmap_unmap(data, (usize)st.st_size);
+  return 0;
+}
+
+
+void srcfpdb_init(srcfpdb_t* db, memalloc_t ma) {
+  *db = (srcfpdb_t){ .ma = ma };
+}
+
+
+void srcfpdb_dispose(srcfpdb_t* db) {
+  for (u32 i = 0; i < db->entries.len; i++)
+    str_free(array_at(srcfpent_t, &db->entries, i).name);
+  array_dispose(srcfpent_t, &db->entries, db->ma);
+}
+
+
+srcfp_t* nullable srcfpdb_get(const srcfpdb_t* db, const char* name) {
+  srcfpent_t key = { .name = { .p = (char*)name } };
+  u32 index;
+  srcfpent_t* ent = array_sortedset_lookup(
+    srcfpent_t, &db->entries, &key, &index, (array_sorted_cmp_t)srcfpent_cmp, NULL);
+  return ent ? &ent->fp : NULL;
+}
+
+
+err_t srcfpdb_set(srcfpdb_t* db, const char* name, const srcfp_t* fp) {
+  srcfpent_t key = { .name = { .p = (char*)name } };
+  srcfpent_t* ent = array_sortedset_assign(
+    srcfpent_t, &db->entries, db->ma, &key, (array_sorted_cmp_t)srcfpent_cmp, NULL);
+  if (!ent)
+    return ErrNoMem;
+  if (ent->name.p == NULL) {
+    // new entry
+    if (!( ent->name = str_make(name) ).p) {
+      u32 index = (u32)(ent - (srcfpent_t*)db->entries.ptr);
+      array_remove(srcfpent_t, &db->entries, index, 1);
+      return ErrNoMem;
+    }
+  } else if (memcmp(&ent->fp, fp, sizeof(*fp)) == 0) {
+    return 0;
+  }
+  ent->fp = *fp;
+  db->modified = true;
+  return 0;
+}
+
+
+bool srcfpdb_encode(const srcfpdb_t* db, buf_t* dst) {
+  u32 header[2] = { SRCFP_VERSION, db->entries.len };
+  buf_append(dst, SRCFP_MAGIC, 4);
+  buf_append(dst, header, sizeof(header));
+  for (u32 i = 0; i < db->entries.len; i++) {
+    const srcfpent_t* ent = array_ptr(srcfpent_t, &db->entries, i);
+    u32 namelen = (u32)ent->name.len;
+    buf_append(dst, &ent->fp, sizeof(ent->fp));
+    buf_append(dst, &namelen, sizeof(namelen));
+    buf_append(dst, ent->name.p, namelen);
+  }
+  return !dst->oom;
+}
+
+
+err_t srcfpdb_decode(srcfpdb_t* db, const void* data, usize size) {
+  const u8* p = data;
+  const u8* end = p + size;
+  u32 header[2];
+
+  assert(db->entries.len == 0);
+
+  if (size < 4 + sizeof(header) || memcmp(p, SRCFP_MAGIC, 4) != 0)
+    return ErrInvalid;
+  memcpy(header, p + 4, sizeof(header));
+  p += 4 + sizeof(header);
+  if (header[0] != SRCFP_VERSION)
+    return ErrInvalid;
+
+  // entries are written in sorted order, so we can simply append them
+  if (!array_reserve_exact(srcfpent_t, &db->entries, db->ma, header[1]))
+    return ErrNoMem;
+  for (u32 i = 0; i < header[1]; i++) {
+    srcfpent_t ent;
+    u32 namelen;
+    if ((usize)(end - p) < sizeof(ent.fp) + sizeof(namelen))
+      return ErrInvalid;
+    memcpy(&ent.fp, p, sizeof(ent.fp));
+    memcpy(&namelen, p + sizeof(ent.fp), sizeof(namelen));
+    p += sizeof(ent.fp) + sizeof(namelen);
+    if ((usize)(end - p) < namelen || namelen == 0)
+      return ErrInvalid;
+    if (!( ent.name = str_makelen((const char*)p, namelen) ).p)
+      return ErrNoMem;
+    p += namelen;
+    if (i > 0 && srcfpent_cmp(&ent, array_ptr(srcfpent_t, &db->entries, i-1), NULL) <= 0) {
+      str_free(ent.name);
+      return ErrInvalid;
+    }
+    array_push(srcfpent_t, &db->entries, db->ma, ent);
+  }
+
+  return p == end ? 0 : ErrInvalid;
+}
+
+
+err_t srcfpdb_load(srcfpdb_t* db, const char* filename) {
+  const void* data;
+  struct stat st;
+  err_t err = mmap_file_ro(filename, &data, &st);
+  if (err)
+    return err;
+  err = srcfpdb_decode(db, data, (usize)st.st_size);
+  mmap_unmap(data, (usize)st.st_size);
+  if (err) {
+    srcfpdb_dispose(db);
+    srcfpdb_init(db, db->ma);
+  }
+  db->modified = false;
+  return err;
+}
+
+
+err_t srcfpdb_save(const srcfpdb_t* db, const char* filename) {
+  buf_t buf = buf_make(db->ma);
+  err_t err = ErrNoMem;
+  if (srcfpdb_encode(db, &buf))
+    err = fs_writefile_mkdirs(filename, 0644, buf_slice(buf));
+  buf_dispose(&buf);
+  return err;
+}
+
+
+#ifdef CO_ENABLE_TESTS
+UNITTEST_DEF(srcfpdb) {
+  memalloc_t ma = memalloc_ctx();
+  srcfpdb_t db, db2;
+  srcfpdb_init(&db, ma);
+  srcfpdb_init(&db2, ma);
+
+  srcfp_t a = { .size = 1, .mtime = 2, .ino = 3 };
+  srcfp_t b = { .size = 4, .mtime = 5, .ino = 6 };
+  sha256_data(&a.sha256, "a", 1);
+  sha256_data(&b.sha256, "b", 1);
+
+  // entries are kept sorted by name regardless of insertion order
+  assert(srcfpdb_set(&db, "main.co", &b) == 0);
+  assert(srcfpdb_set(&db, "a.co", &a) == 0);
+  assert(db.modified);
+  assert(srcfpdb_get(&db, "b.co") == NULL);
+  assert(memcmp(srcfpdb_get(&db, "a.co"), &a, sizeof(a)) == 0);
+
+  // setting the same fingerprint again is not a modification
+  db.modified = false;
+  assert(srcfpdb_set(&db, "a.co", &a) == 0);
+  assert(!db.modified);
+
+  // round trip
+  buf_t buf = buf_make(ma);
+  assert(srcfpdb_encode(&db, &buf));
+  assert(srcfpdb_decode(&db2, buf.p, buf.len) == 0);
+  assert(db2.entries.len == 2);
+  assert(memcmp(srcfpdb_get(&db2, "a.co"), &a, sizeof(a)) == 0);
+  assert(memcmp(srcfpdb_get(&db2, "main.co"), &b, sizeof(b)) == 0);
+
+  // truncated data
+  srcfpdb_t db3;
+  srcfpdb_init(&db3, ma);
+  assert(srcfpdb_decode(&db3, buf.p, buf.len - 1) == ErrInvalid);
+  srcfpdb_dispose(&db3);
+  srcfpdb_init(&db3, ma);
+  assert(srcfpdb_decode(&db3, "cofp", 4) == ErrInvalid);
+  srcfpdb_dispose(&db3);
+
+  buf_dispose(&buf);
+  srcfpdb_dispose(&db2);
+  srcfpdb_dispose(&db);
+}
+#endif // CO_ENABLE_TESTS
@@ -0,0 +1,59 @@
+// source file fingerprints
+// SPDX-License-Identifier: Apache-2.0
+//
+// When building with --content-hash, each package gets a fingerprint database at
+// {builddir}/pkg/{path}/srcfp.db which records the size, mtime, inode and SHA-256
+// of its source files as they were when the package was built. Whether a source
+// file has changed since is then decided by its content, which is only rehashed
+// when the file's stat data differs from what was recorded. This way a fresh
+// checkout (all new mtimes) or a tool touching files without changing them does
+// not cause packages to be rebuilt.
+//
+#pragma once
+#include "compiler.h"
+#include "sha256.h"
+ASSUME_NONNULL_BEGIN
+
+#define PKG_SRCFP_NAME "srcfp.db"
+
+typedef struct {
+  u64        size;
+  unixtime_t mtime;
+  u64        ino;
+  sha256_t   sha256; // of file contents
+} srcfp_t;
+
+typedef struct {
+  memalloc_t ma;
+  array_t    entries;  // srcfpent_t[], sorted by name (see srcfp.c)
+  bool       modified; // true if entries changed since srcfpdb_load
+} srcfpdb_t;
+
+// srcfp_make stats the file at path and, unless its stat data is the same as
+// that of prev, computes the SHA-256 of its contents. The result is stored at fp.
+err_t srcfp_make(srcfp_t* fp, const char* path, const srcfp_t* nullable prev);
+
+// srcfp_stat_eq returns true if a and b have the same size, mtime and inode
+bool srcfp_stat_eq(const srcfp_t* a, const srcfp_t* b);
+
+void srcfpdb_init(srcfpdb_t* db, memalloc_t ma);
+void srcfpdb_dispose(srcfpdb_t* db);
+
+// srcfpdb_load reads filename into db, which must be empty.
+// Returns ErrNotFound if the file does not exist and ErrInvalid if it's corrupt.
+err_t srcfpdb_load(srcfpdb_t* db, const char* filename);
+
+// srcfpdb_save writes db to filename
+err_t srcfpdb_save(const srcfpdb_t* db, const char* filename);
+
+// srcfpdb_encode & srcfpdb_decode convert db to and from its file format
+bool srcfpdb_encode(const srcfpdb_t* db, buf_t* dst);
+err_t srcfpdb_decode(srcfpdb_t* db, const void* data, usize size);
+
+// srcfpdb_get returns the fingerprint recorded for source file name, if any
+srcfp_t* nullable srcfpdb_get(const srcfpdb_t* db, const char* name);
+
+// srcfpdb_set records fp as the fingerprint of source file name
+err_t srcfpdb_set(srcfpdb_t* db, const char* name, const srcfp_t* fp);
+
+ASSUME_NONNULL_END
@@ -1,6 +1,9 @@
 // SPDX-License-Identifier: Apache-2.0
 #include "colib.h"
 #include "subproc.h"
+#include "jobserver.h"
+#include "thread.h"
+#include "timeline.h"
 
 // enable posix_spawn_file_actions_addchdir_np
 #if defined(__APPLE__) || defined(__linux__)
@@ -107,10 +110,26 @@
 #endif // __APPLE__
 
 
-void subproc_open(subproc_t* p, pid_t pid) {
+void subproc_open(subproc_t* p, pid_t pid, u32 job) {
   assert(p->pid == 0);
   memset(p, 0, sizeof(*p));
   p->pid = pid;
+  p->job = job;
+  p->start_time = nanotime();
+  if (job)
+    jobserver_start(job, pid);
+}
+
+
+// subproc_waitpid waits for p's process (or process-group leader) to exit
+// and releases its job
+static int subproc_waitpid(subproc_t* p, int* status) {
+  if (p->job) {
+    u32 job = p->job;
+    p->job = 0;
+    return jobserver_wait(job, status);
+  }
+  return waitpid(p->pid, status, 0);
 }
 
 
@@ -139,7 +158,7 @@ err_t subproc_await(subproc_t* p) {
     darwin_pgrp_wait(p->pid);
 
     // get leader exit status
-    if (waitpid(p->pid, &status, 0) == -1 || !WIFEXITED(status)) {
+    if (subproc_waitpid(p, &status) == -1 || !WIFEXITED(status)) {
       trace("proc[%d] died or experienced an error", p->pid);
       p->err = ErrCanceled;
     } else {
@@ -151,7 +170,7 @@ err_t subproc_await(subproc_t* p) {
     }
   #elif defined(SUBPROC_USE_PGRP)
     // wait for process-group leader
-    if UNLIKELY(waitpid(p->pid, &status, 0) == -1) {
+    if UNLIKELY(subproc_waitpid(p, &status) == -1) {
       trace("proc[%d] died or experienced an error", p->pid);
       p->err = errno ? err_errno() : ErrIO;
     } else {
@@ -165,7 +184,7 @@ err_t subproc_await(subproc_t* p) {
         p->pid, status, p->err ? err_str(p->err) : "ok");
     }
   #else // not SUBPROC_USE_PGRP
-    if (waitpid(p->pid, &status, 0) == -1) {
+    if (subproc_waitpid(p, &status) == -1) {
       p->err = errno ? err_errno() : ErrIO;
       trace("proc[%d] died or experienced an error: %s", p->pid, err_str(p->err));
       log_errno("waitpid %d", p->pid);
@@ -184,6 +203,8 @@ err_t subproc_await(subproc_t* p) {
     }
   #endif
 
+  if (p->traced)
+    timeline_subproc_end(p->pid);
   subproc_close(p);
   return p->err;
 }
@@ -247,12 +268,14 @@ err_t subproc_spawn(
   #endif
 
   pid_t pid;
+  u32 job = jobserver_acquire();
   if CHECKERR( posix_spawn(&pid, exefile, &actions, attrs, argv, environ) ) {
     log_errno("posix_spawn(%s ...)", exefile);
+    jobserver_release(job);
     goto err2;
   }
-  trace("proc[%d] spawned", pid);
-  subproc_open(p, pid);
+  trace("proc[%d] spawned (job %u)", pid, job);
+  subproc_open(p, pid, job);
   posix_spawn_file_actions_destroy(&actions);
 
   #ifndef HAS_SPAWN_ADDCHDIR
@@ -303,7 +326,12 @@ err_t _subproc_fork(
   #endif
 
   pid_t pid;
-  RETURN_ON_ERROR( (pid = fork()) );
+  u32 job = jobserver_acquire();
+  if UNLIKELY((pid = fork()) == -1) {
+    warn("fork");
+    jobserver_release(job);
+    return ErrCanceled;
+  }
   if (pid == 0) {
     // child process
 
@@ -336,12 +364,12 @@ err_t _subproc_fork(
     close(fds[0]);
   #endif
 
-  trace("proc[%d] spawned (fork of %d)", pid, getpid());
+  trace("proc[%d] spawned (fork of %d, job %u)", pid, getpid(), job);
 
   #undef RETURN_ON_ERROR
   #undef EXIT_ON_ERROR
 
-  subproc_open(p, pid);
+  subproc_open(p, pid, job);
   return 0;
 }
 
@@ -351,6 +379,11 @@ void subprocs_cancel(subprocs_t* sp) {
     if (sp->procs[i].pid)
       kill(sp->procs[i].pid, /*SIGINT*/2);
   }
+  // reap the processes so that their jobs are returned to the jobserver
+  for (u32 i = 0; i < sp->cap; i++) {
+    if (sp->procs[i].pid)
+      subproc_await(&sp->procs[i]);
+  }
   if (sp->promise)
     sp->promise->await = NULL;
   mem_freet(sp->ma, sp);
@@ -367,7 +400,10 @@ static err_t _subprocs_await(subprocs_t* sp, u32 maxcount) {
       continue;
 
     nawait++;
+    u64 start_time = proc->start_time;
     err_t err1 = subproc_await(proc);
+    if (sp->lifetime)
+      AtomicAdd(sp->lifetime, nanotime() - start_time, memory_order_relaxed);
     if (err == 0)
       err = err1;
 
@@ -6,6 +6,9 @@ ASSUME_NONNULL_BEGIN
 typedef struct {
   pid_t pid;
   err_t err;
+  u32   job;        // jobserver job id
+  bool  traced;     // timeline_subproc_begin was called (see timeline.h)
+  u64   start_time; // nanotime when started
 } subproc_t;
 
 typedef struct {
@@ -13,9 +16,10 @@ typedef struct {
   subproc_t*          procs;
   u32                 cap;
   promise_t* nullable promise;
+  _Atomic(u64)* nullable lifetime; // if set, sum of process lifetimes is added to it
 } subprocs_t;
 
-void subproc_open(subproc_t* p, pid_t pid);
+void subproc_open(subproc_t* p, pid_t pid, u32 job);
 void subproc_close(subproc_t* p);
 err_t subproc_await(subproc_t* p);
 
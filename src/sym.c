@@ -11,9 +11,42 @@
 extern usize strnlen(const char* s, usize maxlen); // libc
 #endif
 
-static strset_t   symbols;
+// Symbols are stored in SYM_NSHARDS independent shards, selected by the high bits
+// of a symbol's hash. Each shard has an open-addressing table of pointers to
+// symbol records. Entries are only ever added, and records never move, so lookups
+// are lock free. Inserts take the shard's mutex.
+// When a shard's table grows, the new table is published atomically and the old
+// table is kept, since other threads may still be reading it. (The old tables of
+// a shard use less memory, combined, than its current table.) A lookup that misses
+// in an old table retries under the mutex, on the current table.
+#define SYM_SHARD_BITS    6
+#define SYM_NSHARDS       (1u << SYM_SHARD_BITS)
+#define SYM_SHARD_INITCAP 64   // initial table capacity per shard (power of two)
+#define SYM_CHUNK_SIZE    4096 // memory for records is allocated in chunks of this size
+
+typedef struct {
+  usize hash;
+  u32   len;
+  char  chars[]; // NUL terminated
+} symrec_t;
+
+typedef struct {
+  usize              cap; // power of two
+  _Atomic(symrec_t*) entries[];
+} symtab_t;
+
+typedef struct {
+  _Atomic(symtab_t*) tab;
+  _Atomic(usize)     len;        // number of entries in tab
+  mutex_t            mu;         // held while inserting
+  void*              chunk;      // free memory for records
+  usize              chunkavail; // bytes available at chunk
+} __attribute__((aligned(64))) symshard_t; // own cache line, to avoid false sharing
+
+static symshard_t sym_shards[SYM_NSHARDS];
+static usize      sym_seed;
 static memalloc_t sym_ma;
-static rwmutex_t  sym_mu;
+static mutex_t    sym_ma_mu; // sym_ma is not necessarily thread safe
 
 #define FOREACH_PREDEFINED_SYMBOL(_/*(name)*/) \
   _(_) \
@@ -65,7 +98,129 @@ FOREACH_NODEKIND_PRIMTYPE(_)
 sym_t _sym_primtype_nametab[PRIMTYPE_COUNT] = {};
 
 
+usize sym_hash(const char* key, usize keylen) {
+  return strset_hashfn(sym_seed, &(slice_t){ .p = key, .len = keylen });
+}
+
+
 sym_t sym_intern(const char* key, usize keylen) {
+  return sym_intern_hashed(key, keylen, sym_hash(key, keylen));
+}
+
+
+inline static symrec_t* symrec_of(sym_t sym) {
+  return (symrec_t*)(sym - offsetof(symrec_t, chars));
+}
+
+
+inline static bool symrec_eq(const symrec_t* r, const char* key, usize keylen, usize hash) {
+  return r->hash == hash && r->len == keylen && memcmp(r->chars, key, keylen) == 0;
+}
+
+
+static sym_t nullable symtab_lookup(
+  const symtab_t* tab, const char* key, usize keylen, usize hash)
+{
+  usize mask = tab->cap - 1;
+  for (usize i = hash & mask; ; i = (i + 1) & mask) {
+    symrec_t* r = AtomicLoadAcq(&tab->entries[i]);
+    if (!r)
+      return NULL;
+    if (symrec_eq(r, key, keylen, hash))
+      return r->chars;
+  }
+}
+
+
+static void symtab_insert(symtab_t* tab, symrec_t* r) {
+  usize mask = tab->cap - 1;
+  usize i = r->hash & mask;
+  while (AtomicLoad(&tab->entries[i], memory_order_relaxed))
+    i = (i + 1) & mask;
+  AtomicStoreRel(&tab->entries[i], r);
+}
+
+
+static void* sym_ma_alloc(usize size) {
+  mutex_lock(&sym_ma_mu);
+  void* p = mem_alloc_zeroed(sym_ma, size).p;
+  mutex_unlock(&sym_ma_mu);
+  if UNLIKELY(!p)
+    panic("out of memory");
+  return p;
+}
+
+
+static symtab_t* symtab_alloc(usize cap) {
+  return sym_ma_alloc(sizeof(symtab_t) + cap*sizeof(((symtab_t*)0)->entries[0]));
+}
+
+
+// symshard_grow replaces the table of shard with one twice as large.
+// Caller must hold sh->mu.
+static symtab_t* symshard_grow(symshard_t* sh, symtab_t* tab) {
+  symtab_t* newtab = symtab_alloc(tab->cap * 2);
+  newtab->cap = tab->cap * 2;
+  for (usize i = 0; i < tab->cap; i++) {
+    symrec_t* r = AtomicLoad(&tab->entries[i], memory_order_relaxed);
+    if (r)
+      symtab_insert(newtab, r);
+  }
+  AtomicStoreRel(&sh->tab, newtab);
+  return newtab;
+}
+
+
+// symshard_newrec allocates a record for key. Caller must hold sh->mu.
+static symrec_t* symshard_newrec(symshard_t* sh, const char* key, usize keylen, usize hash) {
+  safecheckf(keylen < U32_MAX, "symbol too long");
+  usize size = ALIGN2(sizeof(symrec_t) + keylen + 1, sizeof(usize));
+  symrec_t* r;
+  if (size > SYM_CHUNK_SIZE/4) {
+    r = sym_ma_alloc(size);
+  } else {
+    if (sh->chunkavail < size) {
+      sh->chunk = sym_ma_alloc(SYM_CHUNK_SIZE);
+      sh->chunkavail = SYM_CHUNK_SIZE;
+    }
+    r = sh->chunk;
+    sh->chunk += size;
+    sh->chunkavail -= size;
+  }
+  r->hash = hash;
+  r->len = (u32)keylen;
+  memcpy(r->chars, key, keylen);
+  r->chars[keylen] = 0;
+  return r;
+}
+
+
+static sym_t symshard_intern(symshard_t* sh, const char* key, usize keylen, usize hash) {
+  // lookup without locking
+  symtab_t* tab = AtomicLoadAcq(&sh->tab);
+  sym_t sym = symtab_lookup(tab, key, keylen, hash);
+  if (sym)
+    return sym;
+
+  // not found; lookup again and insert while holding the shard's lock,
+  // since the symbol may have been added by another thread, to a newer table
+  mutex_lock(&sh->mu);
+  tab = AtomicLoad(&sh->tab, memory_order_relaxed);
+  if (!( sym = symtab_lookup(tab, key, keylen, hash) )) {
+    usize len = AtomicLoad(&sh->len, memory_order_relaxed);
+    if (len >= tab->cap/2)
+      tab = symshard_grow(sh, tab);
+    symrec_t* r = symshard_newrec(sh, key, keylen, hash);
+    symtab_insert(tab, r);
+    AtomicStore(&sh->len, len + 1, memory_order_relaxed);
+    sym = r->chars;
+  }
+  mutex_unlock(&sh->mu);
+  return sym;
+}
+
+
+sym_t sym_intern_hashed(const char* key, usize keylen, usize hash) {
   #ifdef DEBUG
     // check for prohibited bytes in key.
     // Note: AST encoder cannot handle symbols containing LF (0x0A '\n')
@@ -78,24 +233,11 @@ sym_t sym_intern(const char* key, usize keylen) {
           tmpz, tmp, i, c, c);
       }
     }
+    assert(hash == sym_hash(key, keylen));
   #endif
 
-  // lookup under read-only lock
-  rwmutex_rlock(&sym_mu);
-  slice_t* ent = strset_lookup(&symbols, key, keylen);
-  rwmutex_runlock(&sym_mu);
-  if (!ent) {
-    // not found; assign under full write lock
-    rwmutex_lock(&sym_mu);
-    ent = strset_assign(&symbols, key, keylen, NULL);
-    rwmutex_unlock(&sym_mu);
-    if UNLIKELY(!ent)
-      goto oom;
-  }
-  return ent->chars;
-
-oom:
-  panic("out of memory");
+  symshard_t* sh = &sym_shards[hash >> (sizeof(usize)*8 - SYM_SHARD_BITS)];
+  return symshard_intern(sh, key, keylen, hash);
 }
 
 
@@ -109,49 +251,27 @@ sym_t sym_snprintf(char* buf, usize bufcap, const char* fmt, ...) {
 }
 
 
-static sym_t def_static_symn(const char* static_key, usize keylen) {
-  assert(static_key[keylen] == 0); // must be NUL terminated
-
-  #ifdef DEBUG
-    bool added;
-  #endif
-
-  UNUSED slice_t* ent;
-
-  ent = hashtable_assign(
-    (hashtable_t*)&symbols,
-    strset_hashfn,
-    strset_eqfn,
-    sizeof(slice_t),
-    &(slice_t){ .p = static_key, .len = keylen },
-    #ifdef DEBUG
-      &added
-    #else
-      NULL
-    #endif
-  );
-
-  safecheckf(ent, "out of memory");
-  assertf(added, "%s", static_key);
-  assert(ent->len == keylen);
-  assert(ent->p == static_key);
-
-  return static_key;
-}
-
-
-inline static sym_t def_static_sym(const char* static_cstr) {
-  return def_static_symn(static_cstr, strlen(static_cstr));
+usize sym_count() {
+  usize n = 0;
+  for (u32 i = 0; i < SYM_NSHARDS; i++)
+    n += AtomicLoad(&sym_shards[i].len, memory_order_relaxed);
+  return n;
 }
 
 
 void sym_init(memalloc_t ma) {
-  safecheckx(rwmutex_init(&sym_mu) == 0);
+  safecheckx(mutex_init(&sym_ma_mu) == 0);
   sym_ma = ma;
-  UNUSED err_t err = strset_init(&symbols, ma, 4096/sizeof(slice_t)/2);
-  safecheckf(err == 0, "strset_init: %s", err_str(err));
+  sym_seed = fastrand();
+  for (u32 i = 0; i < SYM_NSHARDS; i++) {
+    symshard_t* sh = &sym_shards[i];
+    safecheckx(mutex_init(&sh->mu) == 0);
+    symtab_t* tab = symtab_alloc(SYM_SHARD_INITCAP);
+    tab->cap = SYM_SHARD_INITCAP;
+    AtomicStoreRel(&sh->tab, tab);
+  }
 
-  #define _(NAME) sym_##NAME = def_static_sym(#NAME);
+  #define _(NAME) sym_##NAME = sym_cstr(#NAME);
   FOREACH_PREDEFINED_SYMBOL(_)
   #undef _
 
@@ -163,16 +283,212 @@ void sym_init(memalloc_t ma) {
 
   // // sym_NAME = "NAME"  (e.g. sym_int = "int")
   // #define _(kind, TYPE, enctag, NAME, size) \
-  //   sym_##NAME = def_static_sym(#NAME); \
-  //   sym_##NAME##_typeid = def_static_symn(typeid_symtab[kind - TYPE_VOID], 1); \
+  //   sym_##NAME = sym_cstr(#NAME); \
+  //   sym_##NAME##_typeid = sym_intern(typeid_symtab[kind - TYPE_VOID], 1); \
   //   _sym_primtype_nametab[kind - TYPE_VOID] = sym_##NAME;
   // FOREACH_NODEKIND_PRIMTYPE(_)
   // #undef _
 
   // sym_NAME = "NAME"  (e.g. sym_int = "int")
   #define _(kind, TYPE, enctag, NAME, size) \
-    sym_##NAME = def_static_sym(#NAME); \
+    sym_##NAME = sym_cstr(#NAME); \
     _sym_primtype_nametab[kind - TYPE_VOID] = sym_##NAME;
   FOREACH_NODEKIND_PRIMTYPE(_)
   #undef _
 }
+
+
+#ifdef CO_ENABLE_TESTS
+
+// symtest_keys generates n distinct keys, with lengths of typical identifiers
+static slice_t* symtest_keys(memalloc_t ma, const char* prefix, u32 n) {
+  static const char* namev[] = { "x", "get_", "node", "compiler_config_", "T" };
+  slice_t* keyv = mem_alloctv(ma, slice_t, n);
+  assertnotnull(keyv);
+  for (u32 i = 0; i < n; i++) {
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "%s%s%u", prefix, namev[i % countof(namev)], i);
+    keyv[i].p = mem_strdup(ma, (slice_t){ .p = buf, .len = (usize)len }, 0);
+    keyv[i].len = (usize)len;
+  }
+  return keyv;
+}
+
+
+// symtest_baseline_intern interns symbols the way sym_intern did before sharding:
+// a single table, with lookups under a shared lock and inserts under an exclusive lock
+static strset_t  symtest_baseline_set;
+static rwmutex_t symtest_baseline_mu;
+
+static sym_t symtest_baseline_intern(const char* key, usize keylen) {
+  rwmutex_rlock(&symtest_baseline_mu);
+  slice_t* ent = strset_lookup(&symtest_baseline_set, key, keylen);
+  sym_t sym = ent ? ent->chars : NULL;
+  rwmutex_runlock(&symtest_baseline_mu);
+  if (!sym) {
+    rwmutex_lock(&symtest_baseline_mu);
+    ent = strset_assign(&symtest_baseline_set, key, keylen, NULL);
+    sym = assertnotnull(ent)->chars;
+    rwmutex_unlock(&symtest_baseline_mu);
+  }
+  return sym;
+}
+
+
+typedef struct {
+  thrd_t         t;
+  const slice_t* keyv;
+  const u32*     idxv;  // indices into keyv, in the order to intern them
+  u32            nidx;
+  sym_t* nullable symv; // sym of keyv[i] at symv[i]
+  bool           baseline;
+  sema_t*        sem_go;
+} symtest_thread_t;
+
+
+static int symtest_thread(symtest_thread_t* t) {
+  if (t->sem_go)
+    sema_wait(t->sem_go);
+  for (u32 j = 0; j < t->nidx; j++) {
+    const slice_t* key = &t->keyv[t->idxv[j]];
+    sym_t sym = t->baseline ?
+      symtest_baseline_intern(key->chars, key->len) :
+      sym_intern(key->chars, key->len);
+    if (t->symv)
+      t->symv[t->idxv[j]] = sym;
+  }
+  return 0;
+}
+
+
+// symtest_run interns keyv[idxv[i][j]] on thread i and returns the wall time
+static u64 symtest_run(
+  symtest_thread_t* threadv, u32 nthreads, const slice_t* keyv,
+  u32** idxv, u32 nidx, bool baseline)
+{
+  sema_t sem_go;
+  safecheckx(sema_init(&sem_go, 0) == 0);
+  for (u32 i = 0; i < nthreads; i++) {
+    symtest_thread_t* t = &threadv[i];
+    t->keyv = keyv;
+    t->idxv = idxv[i];
+    t->nidx = nidx;
+    t->baseline = baseline;
+    t->sem_go = &sem_go;
+    safecheckx(thrd_create(&t->t, (thrd_start_t)symtest_thread, t) == thrd_success);
+  }
+  u64 start = nanotime();
+  sema_signal(&sem_go, nthreads);
+  for (u32 i = 0; i < nthreads; i++)
+    safecheckx(thrd_join(threadv[i].t, NULL) == thrd_success);
+  u64 nsec = nanotime() - start;
+  sema_dispose(&sem_go);
+  return nsec;
+}
+
+
+// symtest_order fills idxv with n key indices drawn from [0, nkeys): half of them
+// from the first 64 keys (e.g. "int" and local variable names) and half uniformly
+static void symtest_order(u32* idxv, u32 n, u32 nkeys, u64 seed) {
+  for (u32 j = 0; j < n; j++) {
+    seed = wyhash64(seed, j);
+    idxv[j] = (seed & 1) ? (u32)((seed >> 1) % MIN(nkeys, 64u)) : (u32)((seed >> 1) % nkeys);
+  }
+}
+
+
+UNITTEST_DEF(sym_intern_mt) {
+  // threads racing to intern the same new keys must all get the same symbols
+  memalloc_t ma = memalloc_ctx();
+  const u32 nthreads = 8, nkeys = 4000;
+  slice_t* keyv = symtest_keys(ma, "symtest_mt_", nkeys);
+  symtest_thread_t* threadv = mem_alloctv(ma, symtest_thread_t, nthreads);
+  u32** idxv = mem_alloctv(ma, u32*, nthreads);
+  assert(threadv && idxv);
+  for (u32 i = 0; i < nthreads; i++) {
+    threadv[i].symv = mem_alloctv(ma, sym_t, nkeys);
+    assert(( idxv[i] = mem_alloctv(ma, u32, nkeys) ));
+    // every thread interns every key, starting at a different key
+    for (u32 j = 0; j < nkeys; j++)
+      idxv[i][j] = (j + i*(nkeys / nthreads)) % nkeys;
+  }
+
+  usize count = sym_count();
+  symtest_run(threadv, nthreads, keyv, idxv, nkeys, false);
+  assertf(sym_count() == count + nkeys, "%zu", sym_count() - count);
+
+  for (u32 k = 0; k < nkeys; k++) {
+    sym_t sym = threadv[0].symv[k];
+    assert(strlen(sym) == keyv[k].len && memcmp(sym, keyv[k].p, keyv[k].len) == 0);
+    assert(sym == sym_intern(keyv[k].chars, keyv[k].len));
+    for (u32 i = 1; i < nthreads; i++)
+      assertf(threadv[i].symv[k] == sym, "thread %u key %u", i, k);
+  }
+}
+
+
+// bench_sym measures throughput of sym_intern at 1, 2, 4 ... maxthreads threads,
+// compared to a single table guarded by a rwmutex.
+// "hit" interns symbols which exist, like most identifiers when parsing.
+// "new" has all threads race to intern the same new symbols.
+int bench_sym(u32 maxthreads) {
+  const u32 nkeys = 20000, nidx = 200000, nrounds = 3;
+  memalloc_t ma = memalloc_bump2(0, 0);
+  safecheckx(ma != memalloc_null());
+  symtest_thread_t* threadv = mem_alloctv(ma, symtest_thread_t, maxthreads);
+  u32** idxv = mem_alloctv(ma, u32*, maxthreads);
+  safecheckx(threadv && idxv);
+  for (u32 i = 0; i < maxthreads; i++) {
+    safecheckx(( idxv[i] = mem_alloctv(ma, u32, nidx) ));
+    threadv[i].symv = NULL;
+  }
+  safecheckx(rwmutex_init(&symtest_baseline_mu) == 0);
+  safecheckx(strset_init(&symtest_baseline_set, ma, 4096/sizeof(slice_t)/2) == 0);
+
+  slice_t* keyv = symtest_keys(ma, "bench_hit_", nkeys);
+  for (u32 k = 0; k < nkeys; k++) {
+    sym_intern(keyv[k].chars, keyv[k].len);
+    symtest_baseline_intern(keyv[k].chars, keyv[k].len);
+  }
+
+  printf("workload\timpl\tthreads\tops\tbest_ns\tmops_per_sec\n");
+  u32 generation = 0;
+  for (u32 w = 0; w < 2; w++) {
+    const char* workload = w == 0 ? "hit" : "new";
+    u32 n = w == 0 ? nidx : nkeys; // symbols interned per thread
+    for (u32 i = 0; i < maxthreads && w == 0; i++)
+      symtest_order(idxv[i], n, nkeys, i + 1);
+    for (u32 nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+      for (u32 impl = 0; impl < 2; impl++) {
+        u64 best = U64_MAX;
+        for (u32 round = 0; round < nrounds; round++) {
+          if (w == 1) {
+            // fresh keys for every round; each thread interns all of them
+            char prefix[32];
+            snprintf(prefix, sizeof(prefix), "bench_new%u_", generation++);
+            keyv = symtest_keys(ma, prefix, nkeys);
+            for (u32 i = 0; i < nthreads; i++) {
+              for (u32 j = 0; j < n; j++)
+                idxv[i][j] = (j + i*(nkeys / nthreads)) % nkeys;
+            }
+          }
+          u64 t = symtest_run(threadv, nthreads, keyv, idxv, n, impl == 1);
+          best = MIN(best, t);
+        }
+        u64 ops = (u64)nthreads * n;
+        printf("%s\t%s\t%u\t%llu\t%llu\t%.1f\n",
+          workload, impl == 0 ? "sym_intern" : "rwmutex", nthreads,
+          (unsigned long long)ops, (unsigned long long)best,
+          (f64)ops * 1000.0 / (f64)MAX(best, 1ull));
+        fflush(stdout);
+      }
+    }
+  }
+
+  strset_dispose(&symtest_baseline_set);
+  rwmutex_dispose(&symtest_baseline_mu);
+  memalloc_bump2_dispose(ma);
+  return 0;
+}
+
+#endif // CO_ENABLE_TESTS
@@ -59,6 +59,13 @@ void sym_init(memalloc_t);
 sym_t sym_intern(const char* key, usize keylen);
 inline static sym_t sym_cstr(const char* s) { return sym_intern(s, strlen(s)); }
 sym_t sym_snprintf(char* buf, usize bufcap, const char* fmt, ...)ATTR_FORMAT(printf,3,4);
+usize sym_count(); // number of interned symbols
+
+// sym_hash returns the hash of a key, for use with sym_intern_hashed
+usize sym_hash(const char* key, usize keylen);
+
+// sym_intern_hashed is like sym_intern but uses a hash precomputed with sym_hash
+sym_t sym_intern_hashed(const char* key, usize keylen, usize hash);
 
 
 ASSUME_NONNULL_END
@@ -1,4 +1,4 @@
-// simple globally-shared thread pool
+// globally-shared work-stealing thread pool
 // SPDX-License-Identifier: Apache-2.0
 #include "colib.h"
 #include "threadpool.h"
@@ -13,11 +13,6 @@
 #endif
 
 
-typedef struct {
-  thrd_t t;
-} worker_thread_t;
-
-
 typedef struct {
   _threadpool_fun_t fn;
   const void* a;
@@ -25,31 +20,65 @@ typedef struct {
   const void* c;
   const void* d;
   const void* e;
+  const void* nullable key; // what the job produces (see threadpool_submit_for)
+  u32 seq;                  // order of submission on the submitting thread's queue
   #ifdef CO_TRACE_THREADPOOL
   u32 trace_id;
   #endif
 } message_t;
 
 
+// jobqueue_t is a double-ended queue of jobs (a growable ring buffer.)
+// The owning thread pushes and pops at the back (LIFO, which keeps a job's
+// sub-jobs close to it) while other threads steal from the front (FIFO, which
+// tends to take larger units of work, e.g. packages higher up an import graph.)
+typedef struct {
+  mutex_t      mu;
+  message_t*   v;
+  u32          cap;
+  u32          head;    // index of front
+  u32          nextseq; // seq of next pushed job
+  _Atomic(u32) len;     // written with mu held; read without mu to skip empty queues
+} jobqueue_t;
+
+
+typedef struct {
+  thrd_t     t;
+  jobqueue_t q; // jobs submitted by this thread
+} worker_thread_t;
+
+
 static worker_thread_t* g_threadv = NULL;
 static mutex_t          g_spawnmu;
 static u32              g_threadcap = 0;
 static _Atomic(u32)     g_threadlen = 0;
-static chan_t*          g_workch = NULL;
+static jobqueue_t       g_injectq;               // jobs submitted by non-pool threads
+static _Atomic(u32)     g_nqueued = 0;           // jobs waiting in any queue
+static _Atomic(u32)     g_nidle = 0;             // worker threads waiting on g_wakesem
+static sema_t           g_wakesem;               // signalled when a job is queued
 static _Atomic(u32)     g_inflightcount = 0; // current workloads in process
 #ifdef CO_TRACE_THREADPOOL
 static _Atomic(u32)     g_trace_idgen = 0;
 #endif
 
+static _Thread_local worker_thread_t* t_worker = NULL; // NULL if not a pool thread
+
 
 // SPAWN_THRESHOLD: spawn more threads when there are at least these many queued
 // work requests. 1 seems like an obvious number, but some work is usually completed
 // sooner than it takes to spawn a new thread and have it start accepting work.
 #define SPAWN_THRESHOLD 2
 
+// HELP_POLL_USECS: how long threadpool_future_wait and threadpool_sema_wait block
+// before looking for queued jobs to run again, when there was nothing to run.
+// (A job may be queued just after the future it produces has been acquired.)
+#define HELP_POLL_USECS 1000
+
 
 #ifdef CO_TRACE_THREADPOOL
   static u32 worker_trace_id(const worker_thread_t* t) {
+    if (t == NULL)
+      return U32_MAX;
     u32 worker_id = 0;
     for (; worker_id < g_threadcap && t != &g_threadv[worker_id]; worker_id++) {}
     return worker_id;
@@ -57,51 +86,300 @@ static _Atomic(u32)     g_trace_idgen = 0;
 #endif
 
 
+static err_t jobqueue_init(jobqueue_t* q) {
+  q->v = NULL;
+  q->cap = 0;
+  q->head = 0;
+  q->nextseq = 0;
+  q->len = 0;
+  return mutex_init(&q->mu);
+}
+
+
+static bool jobqueue_push(jobqueue_t* q, const message_t* msg) {
+  mutex_lock(&q->mu);
+  u32 len = AtomicLoad(&q->len, memory_order_relaxed);
+  if UNLIKELY(len == q->cap) {
+    u32 newcap = MAX(16u, q->cap * 2);
+    message_t* v = mem_alloctv(memalloc_default(), message_t, newcap);
+    if UNLIKELY(!v) {
+      mutex_unlock(&q->mu);
+      return false;
+    }
+    // unwrap ring buffer into new array
+    for (u32 i = 0; i < len; i++)
+      v[i] = q->v[(q->head + i) % q->cap];
+    if (q->v)
+      mem_freetv(memalloc_default(), q->v, q->cap);
+    q->v = v;
+    q->cap = newcap;
+    q->head = 0;
+  }
+  message_t* m = &q->v[(q->head + len) % q->cap];
+  *m = *msg;
+  m->seq = q->nextseq++;
+  AtomicStore(&q->len, len + 1, memory_order_release);
+  mutex_unlock(&q->mu);
+  return true;
+}
+
+
+// jobqueue_pop takes the most recently pushed job
+static bool jobqueue_pop(jobqueue_t* q, message_t* msg) {
+  if (AtomicLoad(&q->len, memory_order_acquire) == 0)
+    return false;
+  mutex_lock(&q->mu);
+  u32 len = AtomicLoad(&q->len, memory_order_relaxed);
+  bool ok = len > 0;
+  if (ok) {
+    *msg = q->v[(q->head + len - 1) % q->cap];
+    AtomicStore(&q->len, len - 1, memory_order_relaxed);
+  }
+  mutex_unlock(&q->mu);
+  return ok;
+}
+
+
+// jobqueue_steal takes the least recently pushed job
+static bool jobqueue_steal(jobqueue_t* q, message_t* msg) {
+  if (AtomicLoad(&q->len, memory_order_acquire) == 0)
+    return false;
+  mutex_lock(&q->mu);
+  u32 len = AtomicLoad(&q->len, memory_order_relaxed);
+  bool ok = len > 0;
+  if (ok) {
+    *msg = q->v[q->head];
+    q->head = (q->head + 1) % q->cap;
+    AtomicStore(&q->len, len - 1, memory_order_relaxed);
+  }
+  mutex_unlock(&q->mu);
+  return ok;
+}
+
+
+// jobqueue_nextseq returns the seq that the next job pushed to q will have
+static u32 jobqueue_nextseq(jobqueue_t* q) {
+  mutex_lock(&q->mu);
+  u32 seq = q->nextseq;
+  mutex_unlock(&q->mu);
+  return seq;
+}
+
+
+// jobqueue_pop_since takes the most recently pushed job, if it was pushed
+// no earlier than seq
+static bool jobqueue_pop_since(jobqueue_t* q, u32 seq, message_t* msg) {
+  if (AtomicLoad(&q->len, memory_order_acquire) == 0)
+    return false;
+  mutex_lock(&q->mu);
+  u32 len = AtomicLoad(&q->len, memory_order_relaxed);
+  bool ok = len > 0;
+  if (ok) {
+    const message_t* m = &q->v[(q->head + len - 1) % q->cap];
+    if ((ok = (i32)(m->seq - seq) >= 0)) {
+      *msg = *m;
+      AtomicStore(&q->len, len - 1, memory_order_relaxed);
+    }
+  }
+  mutex_unlock(&q->mu);
+  return ok;
+}
+
+
+// jobqueue_take_key takes the job submitted for key, if any
+static bool jobqueue_take_key(jobqueue_t* q, const void* key, message_t* msg) {
+  if (AtomicLoad(&q->len, memory_order_acquire) == 0)
+    return false;
+  mutex_lock(&q->mu);
+  u32 len = AtomicLoad(&q->len, memory_order_relaxed);
+  bool ok = false;
+  for (u32 i = 0; i < len; i++) {
+    if (q->v[(q->head + i) % q->cap].key != key)
+      continue;
+    *msg = q->v[(q->head + i) % q->cap];
+    // close the gap
+    for (; i + 1 < len; i++)
+      q->v[(q->head + i) % q->cap] = q->v[(q->head + i + 1) % q->cap];
+    AtomicStore(&q->len, len - 1, memory_order_relaxed);
+    ok = true;
+    break;
+  }
+  mutex_unlock(&q->mu);
+  return ok;
+}
+
+
+// take_job finds a queued job to run on the calling thread.
+// Looks in the order: own queue, g_injectq, other threads' queues.
+// self is NULL when the calling thread is not a pool thread.
+static bool take_job(worker_thread_t* nullable self, message_t* msg) {
+  if (AtomicLoad(&g_nqueued, memory_order_acquire) == 0)
+    return false;
+
+  if (self && jobqueue_pop(&self->q, msg))
+    goto found;
+  if (jobqueue_steal(&g_injectq, msg))
+    goto found;
+
+  // steal from other threads, starting with the one after us
+  u32 threadlen = AtomicLoadAcq(&g_threadlen);
+  u32 start = self ? (u32)(self - g_threadv) + 1 : 0;
+  for (u32 i = 0; i < threadlen; i++) {
+    worker_thread_t* t = &g_threadv[(start + i) % threadlen];
+    if (t != self && jobqueue_steal(&t->q, msg)) {
+      trace("worker#%u stole job#%u from worker#%u",
+        worker_trace_id(self), msg->trace_id, worker_trace_id(t));
+      goto found;
+    }
+  }
+  return false;
+
+found:
+  AtomicSub(&g_nqueued, 1, memory_order_relaxed);
+  return true;
+}
+
+
+// take_job_for finds the queued job submitted for key
+static bool take_job_for(const void* key, message_t* msg) {
+  if (AtomicLoad(&g_nqueued, memory_order_acquire) == 0)
+    return false;
+  if (t_worker && jobqueue_take_key(&t_worker->q, key, msg))
+    goto found;
+  if (jobqueue_take_key(&g_injectq, key, msg))
+    goto found;
+  u32 threadlen = AtomicLoadAcq(&g_threadlen);
+  for (u32 i = 0; i < threadlen; i++) {
+    worker_thread_t* t = &g_threadv[i];
+    if (t != t_worker && jobqueue_take_key(&t->q, key, msg))
+      goto found;
+  }
+  return false;
+found:
+  AtomicSub(&g_nqueued, 1, memory_order_relaxed);
+  return true;
+}
+
+
+static void run_job(message_t* msg) {
+  trace("worker#%u got job#%u (%p,%p,%p,%p,%p)",
+    worker_trace_id(t_worker), msg->trace_id, msg->a, msg->b, msg->c, msg->d, msg->e);
+  msg->fn(msg->a, msg->b, msg->c, msg->d, msg->e);
+  AtomicSub(&g_inflightcount, 1, memory_order_release);
+}
+
+
 static int worker_thread(worker_thread_t* t) {
   message_t msg;
+  t_worker = t;
 
-  #ifdef CO_TRACE_THREADPOOL
-    u32 worker_id = worker_trace_id(t);
-  #endif
-
-  // receive messages and call job functions until g_workch is closed
+  // run jobs until there are none, then sleep until more are submitted
   for (;;) {
-    trace("worker#%u waiting for a job...", worker_id);
-    if (!chan_recv(g_workch, &msg))
-      break; // channel closed
-    trace("worker#%u got job#%u (%p,%p,%p,%p,%p)",
-      worker_id, msg.trace_id, msg.a, msg.b, msg.c, msg.d, msg.e);
-    msg.fn(msg.a, msg.b, msg.c, msg.d, msg.e);
-    AtomicSub(&g_inflightcount, 1, memory_order_release);
+    if (take_job(t, &msg)) {
+      run_job(&msg);
+      continue;
+    }
+    trace("worker#%u waiting for a job...", worker_trace_id(t));
+    // Note: the sequentially-consistent g_nidle increment & g_nqueued load here,
+    // paired with the g_nqueued increment & g_nidle load in _threadpool_submit,
+    // guarantees that either we see the new job or the submitter sees us idle.
+    AtomicAdd(&g_nidle, 1, memory_order_seq_cst);
+    if (AtomicLoad(&g_nqueued, memory_order_seq_cst) == 0)
+      safecheckx(sema_wait(&g_wakesem));
+    AtomicSub(&g_nidle, 1, memory_order_relaxed);
   }
 
-  trace("worker#%u exit", worker_id);
+  trace("worker#%u exit", worker_trace_id(t));
   return 0;
 }
 
 
+// help_seq returns the seq to pass to help when starting to wait
+static u32 help_seq() {
+  return t_worker ? jobqueue_nextseq(&t_worker->q) : 0;
+}
+
+
+// help runs a queued job on the calling thread, which is waiting for key.
+// Only two kinds of jobs are safe to run here: the job producing key, and jobs
+// submitted by the calling thread since it started waiting (seq.) Both only
+// depend on things "below" what we are waiting for. Any other job might end up
+// waiting for something the calling thread is busy producing further down its
+// stack, which would deadlock.
+static bool help(const void* key, u32 seq) {
+  message_t msg;
+  if (take_job_for(key, &msg)) {
+    run_job(&msg);
+    return true;
+  }
+  if (t_worker && jobqueue_pop_since(&t_worker->q, seq, &msg)) {
+    AtomicSub(&g_nqueued, 1, memory_order_relaxed);
+    run_job(&msg);
+    return true;
+  }
+  return false;
+}
+
+
+err_t threadpool_future_wait(future_t* f) {
+  if (g_threadcap == 0)
+    return future_wait(f);
+  err_t err;
+  u32 seq = help_seq();
+  while (!future_trywait(f, &err)) {
+    if (help(f, seq))
+      continue;
+    // nothing to run; the job(s) f depends on are running on other threads
+    if (future_timedwait(f, HELP_POLL_USECS, &err))
+      break;
+  }
+  return err;
+}
+
+
+void threadpool_sema_wait(sema_t* sem) {
+  if (g_threadcap == 0) {
+    safecheckx(sema_wait(sem));
+    return;
+  }
+  u32 seq = help_seq();
+  while (!sema_trywait(sem)) {
+    if (help(sem, seq))
+      continue;
+    if (sema_timedwait(sem, HELP_POLL_USECS))
+      break;
+  }
+}
+
+
 err_t _threadpool_submit(
-  _threadpool_fun_t fn,
+  const void* key, _threadpool_fun_t fn,
   const void* a, const void* b, const void* c, const void* d, const void* e)
 {
   if (g_threadcap == 0)
     return ErrNotSupported;
 
-  message_t msg = { .fn=fn, .a=a, .b=b, .c=c, .d=d, .e=e };
+  message_t msg = { .fn=fn, .a=a, .b=b, .c=c, .d=d, .e=e, .key=key };
   #ifdef CO_TRACE_THREADPOOL
     msg.trace_id = AtomicAdd(&g_trace_idgen, 1, memory_order_relaxed);
   #endif
 
-  if UNLIKELY(!chan_send(g_workch, &msg)) {
-    // channel closed
-    trace("submit job#%u failed: submission channel closed", msg.trace_id);
-    return ErrEnd;
+  // increment g_inflightcount
+  u32 inflightcount = AtomicAdd(&g_inflightcount, 1, memory_order_acquire);
+
+  jobqueue_t* q = t_worker ? &t_worker->q : &g_injectq;
+  if UNLIKELY(!jobqueue_push(q, &msg)) {
+    trace("submit job#%u failed: out of memory", msg.trace_id);
+    AtomicSub(&g_inflightcount, 1, memory_order_relaxed);
+    return ErrNoMem;
   }
 
-  trace("submit job#%u ok", msg.trace_id);
+  trace("submit job#%u ok (worker#%u)", msg.trace_id, worker_trace_id(t_worker));
 
-  // increment g_inflightcount
-  u32 inflightcount = AtomicAdd(&g_inflightcount, 1, memory_order_acquire);
+  // wake up an idle worker, if any
+  AtomicAdd(&g_nqueued, 1, memory_order_seq_cst);
+  if (AtomicLoad(&g_nidle, memory_order_seq_cst) > 0)
+    sema_signal(&g_wakesem, 1);
 
   // spawn additional thread if needed
   inflightcount++; // +1 since AtomicAdd returns previous value
@@ -173,12 +451,10 @@ err_t threadpool_init() {
     return err;
   }
 
-  // open a channel
-  u32 chan_bufcap = g_threadcap; // + SPAWN_THRESHOLD;
-  g_workch = chan_open(memalloc_default(), sizeof(message_t), chan_bufcap);
-  if (!g_workch) {
-    elog("%s chan_open failed", __FUNCTION__);
-    return ErrNoMem;
+  // initialize job queues and the semaphore idle worker threads wait on
+  if (( err = sema_init(&g_wakesem, 0) ) || ( err = jobqueue_init(&g_injectq) )) {
+    dlog("threadpool_init: %s", err_str(err));
+    return err;
   }
 
   // allocate storage for worker threads
@@ -188,6 +464,13 @@ err_t threadpool_init() {
     g_threadcap = 0;
     return ErrNoMem;
   }
+  for (u32 i = 0; i < g_threadcap; i++) {
+    if (( err = jobqueue_init(&g_threadv[i].q) )) {
+      dlog("jobqueue_init: %s", err_str(err));
+      g_threadcap = 0;
+      return err;
+    }
+  }
 
   // spawn threads
   trace("init: spawning %u threads", g_threadlen);
@@ -213,9 +496,10 @@ err_t threadpool_init() {
 
 
 /*void threadpool_stop() {
-  // stop accepting work
+  // stop accepting work and wake up idle worker threads.
   // this causes worker threads to exit once they are out of work
-  chan_close(g_workch);
+  AtomicStoreRel(&g_stopped, true);
+  sema_signal(&g_wakesem, g_threadcap);
 
   // wait for worker threads to exit
   u32 threadlen = AtomicLoadAcq(&g_threadlen);
@@ -230,7 +514,13 @@ err_t threadpool_init() {
   }
 
   // free memory
-  chan_free(g_workch);
+  for (u32 i = 0; i < g_threadcap; i++) {
+    jobqueue_t* q = &g_threadv[i].q;
+    if (q->v)
+      mem_freetv(memalloc_default(), q->v, q->cap);
+    mutex_dispose(&q->mu);
+  }
+  sema_dispose(&g_wakesem);
   mutex_dispose(&g_spawnmu);
   mem_freetv(memalloc_default(), g_threadv, g_threadcap);
 }*/
@@ -244,6 +534,90 @@ static void test_work_fun(chan_t* ch, u32 a, u32 b, u32 c) {
   chan_send(ch, &result);
 }
 
+// test_diamond simulates loading a deep import graph with blocking waits:
+// each package submits all but its last import, loads the last one itself, then
+// waits for all imports. Packages are laid out in TEST_DIAMOND_DEPTH layers of
+// TEST_DIAMOND_WIDTH, each importing two packages of the layer below, forming a
+// lattice of diamonds. With more waiting packages than threads, this deadlocks
+// unless waiting threads run queued jobs.
+#define TEST_DIAMOND_WIDTH 10
+#define TEST_DIAMOND_DEPTH 50
+#define TEST_DIAMOND_NPKG  (TEST_DIAMOND_WIDTH * TEST_DIAMOND_DEPTH)
+
+typedef struct {
+  future_t fut;
+  u64      npaths; // number of import paths from this package to the bottom layer
+} testpkg_t;
+
+static _Atomic(u32) test_diamond_nloaded;
+static _Atomic(u32) test_diamond_nfinalized; // future_finalize calls that returned
+
+static void test_diamond_load(testpkg_t* pkgv, u32 i, bool sync);
+
+static void test_diamond_load0(testpkg_t* pkgv, u32 i) {
+  u32 layer = i / TEST_DIAMOND_WIDTH;
+  u64 npaths = 1;
+  if (layer + 1 < TEST_DIAMOND_DEPTH) {
+    u32 base = (layer + 1) * TEST_DIAMOND_WIDTH;
+    u32 importv[2] = {
+      base + (i % TEST_DIAMOND_WIDTH),
+      base + ((i + 1) % TEST_DIAMOND_WIDTH),
+    };
+    test_diamond_load(pkgv, importv[0], false);
+    test_diamond_load(pkgv, importv[1], true);
+    npaths = 0;
+    for (u32 j = 0; j < countof(importv); j++) {
+      err_t err = threadpool_future_wait(&pkgv[importv[j]].fut);
+      assertf(!err, "%s", err_str(err));
+      npaths += pkgv[importv[j]].npaths;
+    }
+  }
+  pkgv[i].npaths = npaths;
+  AtomicAdd(&test_diamond_nloaded, 1, memory_order_relaxed);
+  future_finalize(&pkgv[i].fut, 0);
+  AtomicAdd(&test_diamond_nfinalized, 1, memory_order_release);
+}
+
+static void test_diamond_load(testpkg_t* pkgv, u32 i, bool sync) {
+  if (!future_acquire(&pkgv[i].fut))
+    return;
+  if (sync || threadpool_submit_for(&pkgv[i].fut, test_diamond_load0, pkgv, i))
+    test_diamond_load0(pkgv, i);
+}
+
+static void test_threadpool_diamond() {
+  testpkg_t* pkgv = mem_alloctv(memalloc_default(), testpkg_t, TEST_DIAMOND_NPKG);
+  assertnotnull(pkgv);
+  for (u32 i = 0; i < TEST_DIAMOND_NPKG; i++)
+    safecheckx(future_init(&pkgv[i].fut) == 0);
+
+  // "import" every package of the top layer
+  for (u32 i = 0; i < TEST_DIAMOND_WIDTH; i++)
+    test_diamond_load(pkgv, i, i == TEST_DIAMOND_WIDTH - 1);
+  for (u32 i = 0; i < TEST_DIAMOND_WIDTH; i++) {
+    err_t err = threadpool_future_wait(&pkgv[i].fut);
+    assertf(!err, "%s", err_str(err));
+  }
+
+  // every package is loaded exactly once and sees the results of its imports.
+  // Each package has two imports, so there are 2^(DEPTH-1) paths to the bottom.
+  assertf(test_diamond_nloaded == TEST_DIAMOND_NPKG,
+    "%u == %u", test_diamond_nloaded, TEST_DIAMOND_NPKG);
+  for (u32 i = 0; i < TEST_DIAMOND_WIDTH; i++) {
+    assertf(pkgv[i].npaths == (u64)1 << (TEST_DIAMOND_DEPTH - 1),
+      "pkg %u: npaths %llu", i, pkgv[i].npaths);
+  }
+
+  // The top layer finishing does not mean that future_finalize has returned
+  // for every package; lower layers may still be running waiter callbacks.
+  while (AtomicLoadAcq(&test_diamond_nfinalized) < TEST_DIAMOND_NPKG)
+    thread_yield();
+
+  for (u32 i = 0; i < TEST_DIAMOND_NPKG; i++)
+    future_dispose(&pkgv[i].fut);
+  mem_freetv(memalloc_default(), pkgv, TEST_DIAMOND_NPKG);
+}
+
 static void test_threadpool() {
   trace("begin test");
 
@@ -289,6 +663,8 @@ static void test_threadpool() {
   chan_close(ch);
   chan_free(ch);
 
+  test_threadpool_diamond();
+
   trace("end test");
   log("%s PASSED", __FUNCTION__);
 }
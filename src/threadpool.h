@@ -33,10 +33,33 @@ ASSUME_NONNULL_BEGIN
 
 // threadpool_submit enqueues fn to be called on a thread in the pool along with
 // a channel for completion results and optional arguments.
-// Returns ErrEnd if threadpool_stop has been called.
+// When called from a pool thread, the job is queued on that thread's own queue,
+// from which idle threads may steal it.
+// Returns ErrNoMem if the job queue could not grow.
 // Returns ErrNotSupported if comaxproc==1 or threadpool_init failed to mem_alloc.
 err_t threadpool_submit(void(*)(/*arg void* ...*/), ...);
 
+// threadpool_submit_for is like threadpool_submit, for a job which completes key,
+// a future_t or sema_t. If the job has not yet started when a thread calls
+// threadpool_future_wait or threadpool_sema_wait with key, the waiting thread
+// runs the job itself.
+err_t threadpool_submit_for(const void* key, void(*)(/*arg void* ...*/), ...);
+
+// threadpool_future_wait is like future_wait but runs queued jobs while waiting:
+// the job submitted for f and jobs submitted by the calling thread while waiting.
+// This keeps pool threads from idling while blocked on jobs that are still queued.
+// Other queued jobs are deliberately left alone: the caller is usually in the
+// middle of producing something further up its stack (e.g. a package that is
+// loading its imports), and an unrelated job may itself wait for that, which
+// would deadlock the caller on its own stack. Jobs for f and the caller's own
+// sub-jobs only depend on things "below" f, so they are always safe to run.
+// When there is nothing safe to run, the caller blocks and idle workers pick
+// up the remaining jobs.
+err_t threadpool_future_wait(future_t* f);
+
+// threadpool_sema_wait is like threadpool_future_wait, for a sema_t
+void threadpool_sema_wait(sema_t* sem);
+
 err_t threadpool_init();
 
 //———————————————————————————————————————————————————————————————————————————————————————
@@ -46,12 +69,15 @@ typedef void(*_threadpool_fun_t)(
   const void* a, const void* b, const void* c, const void* d, const void* e);
 
 err_t _threadpool_submit(
-  _threadpool_fun_t,
+  const void* nullable key, _threadpool_fun_t,
   const void* nullable a, const void* nullable b, const void* nullable c,
   const void* nullable d, const void* nullable e);
 
 #define threadpool_submit(fn, ...) \
-  __VARG_DISP(_threadpool_submit, fn, ##__VA_ARGS__)
+  __VARG_DISP(_threadpool_submit, NULL, fn, ##__VA_ARGS__)
+
+#define threadpool_submit_for(key, fn, ...) \
+  __VARG_DISP(_threadpool_submit, key, fn, ##__VA_ARGS__)
 
 #define _threadpool_arg(x) _Generic((x), \
   i8:      (void*)(uintptr)(x), \
@@ -66,43 +92,42 @@ err_t _threadpool_submit(
   default: (x) \
 )
 
-#define _threadpool_submit1(fn) \
-  _threadpool_submit(((_threadpool_fun_t)(fn)), \
+#define _threadpool_submit2(key, fn) \
+  _threadpool_submit((key), ((_threadpool_fun_t)(fn)), \
     NULL,NULL,NULL,NULL,NULL)
 
-#define _threadpool_submit2(fn, a) \
-  _threadpool_submit(((_threadpool_fun_t)(fn)), \
+#define _threadpool_submit3(key, fn, a) \
+  _threadpool_submit((key), ((_threadpool_fun_t)(fn)), \
     _threadpool_arg(a), \
     NULL,NULL,NULL,NULL)
 
-#define _threadpool_submit3(fn, a, b) \
-  _threadpool_submit(((_threadpool_fun_t)(fn)), \
+#define _threadpool_submit4(key, fn, a, b) \
+  _threadpool_submit((key), ((_threadpool_fun_t)(fn)), \
     _threadpool_arg(a), \
     _threadpool_arg(b), \
     NULL,NULL,NULL)
 
-#define _threadpool_submit4(fn, a, b, c) \
-  _threadpool_submit(((_threadpool_fun_t)(fn)), \
+#define _threadpool_submit5(key, fn, a, b, c) \
+  _threadpool_submit((key), ((_threadpool_fun_t)(fn)), \
     _threadpool_arg(a), \
     _threadpool_arg(b), \
     _threadpool_arg(c), \
     NULL,NULL)
 
-#define _threadpool_submit5(fn, a, b, c, d) \
-  _threadpool_submit(((_threadpool_fun_t)(fn)), \
+#define _threadpool_submit6(key, fn, a, b, c, d) \
+  _threadpool_submit((key), ((_threadpool_fun_t)(fn)), \
     _threadpool_arg(a), \
     _threadpool_arg(b), \
     _threadpool_arg(c), \
     _threadpool_arg(d), \
     NULL)
 
-#define _threadpool_submit6(fn, a, b, c, d, e) \
-  _threadpool_submit(((_threadpool_fun_t)(fn)), \
+#define _threadpool_submit7(key, fn, a, b, c, d, e) \
+  _threadpool_submit((key), ((_threadpool_fun_t)(fn)), \
     _threadpool_arg(a), \
     _threadpool_arg(b), \
     _threadpool_arg(c), \
     _threadpool_arg(d), \
     _threadpool_arg(e))
 
-
 ASSUME_NONNULL_END
@@ -0,0 +1,200 @@
+// build timeline recording in Chrome's trace event format
+// SPDX-License-Identifier: Apache-2.0
+//
+// Format reference:
+// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+//
+#include "colib.h"
+#include "timeline.h"
+#include "buf.h"
+#include "path.h"
+#include "thread.h"
+
+// process ids of tracks
+#define PID_COMPILER 1
+#define PID_SUBPROC  2
+
+bool g_timeline_enabled = false;
+
+static mutex_t     g_mu;        // protects fields below
+static buf_t       g_events;    // JSON events, each ending with ",\n"
+static const char* g_filename;
+static u64         g_start;     // nanotime of timeline_open
+
+static _Atomic(u32) g_thread_id_counter = 0;
+
+
+static u32 thread_id() {
+  static _Thread_local u32 _thread_id = 0;
+  u32 tid = _thread_id;
+  if (tid == 0) {
+    tid = AtomicAdd(&g_thread_id_counter, 1, memory_order_relaxed) + 1;
+    _thread_id = tid;
+  }
+  return tid;
+}
+
+
+static void print_jsonstr(buf_t* b, const char* s) {
+  buf_push(b, '"');
+  for (; *s; s++) {
+    u8 c = *(const u8*)s;
+    if (c == '"' || c == '\\') {
+      buf_push(b, '\\');
+      buf_push(b, c);
+    } else if (c < 0x20) {
+      buf_printf(b, "\\u%04x", c);
+    } else {
+      buf_push(b, c);
+    }
+  }
+  buf_push(b, '"');
+}
+
+
+// print_us prints a duration in microseconds, with nanosecond precision
+static void print_us(buf_t* b, u64 ns) {
+  buf_printf(b, "%llu.%03u", (unsigned long long)(ns / 1000), (u32)(ns % 1000));
+}
+
+
+// print_ts prints a nanotime timestamp, relative to g_start
+static void print_ts(buf_t* b, u64 t) {
+  print_us(b, t > g_start ? t - g_start : 0);
+}
+
+
+// begin_event starts an event in g_events. Caller must hold g_mu.
+static void begin_event(const char* ph, const char* nullable name, u32 pid, u32 tid) {
+  buf_printf(&g_events, "{\"ph\":\"%s\",\"pid\":%u,\"tid\":%u", ph, pid, tid);
+  if (name) {
+    buf_print(&g_events, ",\"name\":");
+    print_jsonstr(&g_events, name);
+  }
+}
+
+
+static void print_args(const char* nullable pkg, const char* nullable file) {
+  if (!pkg && !file)
+    return;
+  buf_print(&g_events, ",\"args\":{");
+  if (pkg) {
+    buf_print(&g_events, "\"pkg\":");
+    print_jsonstr(&g_events, pkg);
+  }
+  if (file) {
+    buf_print(&g_events, &",\"file\":"[!pkg]);
+    print_jsonstr(&g_events, relpath(file));
+  }
+  buf_push(&g_events, '}');
+}
+
+
+static void end_event() {
+  buf_print(&g_events, "},\n");
+}
+
+
+err_t timeline_open(memalloc_t ma, const char* filename) {
+  assert(!g_timeline_enabled);
+  err_t err = mutex_init(&g_mu);
+  if (err)
+    return err;
+  g_events = buf_make(ma);
+  g_filename = filename;
+  g_start = nanotime();
+
+  // name the tracks
+  begin_event("M", "process_name", PID_COMPILER, 0);
+  buf_print(&g_events, ",\"args\":{\"name\":\"compis\"}");
+  end_event();
+  begin_event("M", "process_name", PID_SUBPROC, 0);
+  buf_print(&g_events, ",\"args\":{\"name\":\"subprocesses\"}");
+  end_event();
+
+  if (!buf_reserve(&g_events, 64*1024)) {
+    mutex_dispose(&g_mu);
+    buf_dispose(&g_events);
+    return ErrNoMem;
+  }
+
+  g_timeline_enabled = true;
+  return 0;
+}
+
+
+err_t timeline_close() {
+  if (!g_timeline_enabled)
+    return 0;
+
+  mutex_lock(&g_mu);
+  g_timeline_enabled = false;
+
+  // replace trailing ",\n" of last event
+  assert(g_events.len >= 2);
+  g_events.len -= 2;
+  buf_print(&g_events, "\n]}\n");
+  err_t err = 0;
+  if (!buf_insert(&g_events, 0, "{\"traceEvents\":[\n", 17)) {
+    err = ErrNoMem;
+  } else {
+    err = fs_writefile_mkdirs(g_filename, 0644, buf_slice(g_events));
+  }
+  if (err)
+    elog("failed to write %s: %s", g_filename, err_str(err));
+
+  buf_dispose(&g_events);
+  mutex_unlock(&g_mu);
+  mutex_dispose(&g_mu);
+  return err;
+}
+
+
+void _timeline_end(
+  u64 start_time, const char* name, const char* nullable pkg, const char* nullable file)
+{
+  u64 end_time = nanotime();
+  u32 tid = thread_id();
+  mutex_lock(&g_mu);
+  if (g_timeline_enabled) {
+    begin_event("X", name, PID_COMPILER, tid);
+    buf_print(&g_events, ",\"ts\":");
+    print_ts(&g_events, start_time);
+    buf_print(&g_events, ",\"dur\":");
+    print_us(&g_events, end_time - start_time);
+    print_args(pkg, file);
+    end_event();
+  }
+  mutex_unlock(&g_mu);
+}
+
+
+bool timeline_subproc_begin(pid_t pid, const char* name, const char* nullable file) {
+  if (!g_timeline_enabled)
+    return false;
+  u64 t = nanotime();
+  mutex_lock(&g_mu);
+  bool ok = g_timeline_enabled;
+  if (ok) {
+    begin_event("B", name, PID_SUBPROC, (u32)pid);
+    buf_print(&g_events, ",\"ts\":");
+    print_ts(&g_events, t);
+    print_args(NULL, file);
+    end_event();
+  }
+  mutex_unlock(&g_mu);
+  return ok;
+}
+
+
+void timeline_subproc_end(pid_t pid) {
+  u64 t = nanotime();
+  mutex_lock(&g_mu);
+  if (g_timeline_enabled) {
+    begin_event("E", NULL, PID_SUBPROC, (u32)pid);
+    buf_print(&g_events, ",\"ts\":");
+    print_ts(&g_events, t);
+    end_event();
+  }
+  mutex_unlock(&g_mu);
+}
@@ -0,0 +1,49 @@
+// build timeline recording in Chrome's trace event format
+// SPDX-License-Identifier: Apache-2.0
+//
+// Records spans of time (e.g. "parse foo.co" or "link") which are written as
+// a JSON file that can be viewed with https://ui.perfetto.dev or
+// chrome://tracing. Enabled with "compis build --trace-json=<file>".
+//
+// Spans are recorded per thread of the compiler process. Subprocesses (clang)
+// are recorded as separate tracks of a second "subprocesses" process, one per pid.
+//
+// When not recording, timeline_begin is a load and a branch, and every other
+// function returns immediately.
+//
+#pragma once
+ASSUME_NONNULL_BEGIN
+
+extern bool g_timeline_enabled; // true while recording; read-only
+
+// timeline_open starts recording. The timeline is written to filename
+// by timeline_close.
+err_t timeline_open(memalloc_t ma, const char* filename);
+
+// timeline_close stops recording and writes the timeline file.
+// Does nothing if not recording.
+err_t timeline_close();
+
+// timeline_begin returns the start time of a span, or 0 if not recording
+inline static u64 timeline_begin() {
+  return UNLIKELY(g_timeline_enabled) ? nanotime() : 0;
+}
+
+void _timeline_end(u64, const char*, const char* nullable, const char* nullable);
+
+// timeline_end records a span which started at start_time (from timeline_begin)
+// and ends now, on the calling thread. Does nothing if start_time is 0.
+// pkg and file are optional details shown with the span.
+inline static void timeline_end(
+  u64 start_time, const char* name, const char* nullable pkg, const char* nullable file)
+{
+  if UNLIKELY(start_time)
+    _timeline_end(start_time, name, pkg, file);
+}
+
+// timeline_subproc_begin records the start of subprocess pid, which ends
+// with timeline_subproc_end. Returns false if not recording.
+bool timeline_subproc_begin(pid_t pid, const char* name, const char* nullable file);
+void timeline_subproc_end(pid_t pid);
+
+ASSUME_NONNULL_END
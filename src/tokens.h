@@ -76,7 +76,7 @@ _( TBYTELIT, "byte literal" )
 _( TSTRLIT, "string literal" )
 _( TCHARLIT, "character literal" )
 
-// keywords (must be sorted)
+// keywords
 KEYWORD( "const",  TCONST )
 KEYWORD( "else",   TELSE )
 KEYWORD( "false",  TFALSE )
@@ -4,6 +4,8 @@
 #include "compiler.h"
 #include "hashtable.h"
 #include "ast_field.h"
+#include "buildstats.h"
+#include "threadpool.h"
 
 #include <stdlib.h> // strtof
 
@@ -35,10 +37,33 @@ typedef struct {
 } didyoumean_t;
 
 
+// funbody_t is the body of a unit-level function, checked after all
+// unit-level declarations of the package have been checked
+typedef struct {
+  fun_t*      fn;
+  u32         unit_i;  // index of unit in funbodies_t.unitv
+  err_t       err;
+  diaglog_t   diaglog; // diagnostics, reported in source order after checking
+  nodearray_t ctuses;  // shared declarations used at compile time (applied after)
+} funbody_t;
+
+
+// funbodies_t is the package-level list of deferred function bodies
+typedef struct {
+  array_type(funbody_t) v;
+  u32       ndone;       // number of v entries that have been checked
+  u32       unit_i;      // unit currently being checked
+  unit_t**  unitv;
+  scope_t*  unitscopes;  // unit-level scope of each unit
+  u32*      ndidyoumean; // didyoumean.len at the end of each unit
+} funbodies_t;
+
+
 // typecheck_t
 typedef struct {
   compiler_t*     compiler;
   pkg_t*          pkg;
+  const nsexpr_t* rtns;      // API of std/runtime (NULL if not auto-imported)
   memalloc_t      ma;        // compiler->ma
   memalloc_t      ast_ma;    // compiler->ast_ma
   scope_t         scope;
@@ -48,10 +73,10 @@ typedef struct {
   type_t*         typectx;
   ptrarray_t      typectxstack;
   ptrarray_t      nspath;
-  map_t           usertypes;
-  map_t           postanalyze;    // set of nodes to analyze at the very end (keys only)
+  map_t*          usertypes;      // (shared)
+  map_t*          postanalyze;    // set of nodes to analyze at the very end (shared)
   maparray_t      freemaps;
-  map_t           templateimap;   // typeid_t => usertype_t*
+  map_t*          templateimap;   // typeid_t => usertype_t* (shared)
   buf_t           tmpbuf;
   bool            reported_error; // true if an error diagnostic has been reported
   u32             varidgen;       // variable ID generator
@@ -59,6 +84,15 @@ typedef struct {
   u32             templatenest;   // NF_TEMPLATE nesting level
   nodearray_t     visitstack;
 
+  // Function bodies are checked after all unit-level declarations, in parallel
+  // when possible, each by a typecheck_t of its own which shares the package-level
+  // maps above, guarded by sharedmu.
+  funbodies_t* nullable funbodies;  // NULL when checking a deferred function body
+  mutex_t* nullable     sharedmu;   // non-NULL while bodies are checked in parallel
+  u32                   sharedlock; // sharedmu lock nesting level
+  diaglog_t* nullable   diaglog;    // diagnostics are recorded here when non-NULL
+  funbody_t* nullable   funbody;    // deferred function body being checked
+
 
   // didyoumean tracks names that we might want to consider for help messages
   // when an identifier can not be resolved
@@ -163,8 +197,37 @@ static const char* fmtkind(const void* node) {
 #endif
 
 
+// Function bodies which are checked in parallel share package-level declarations
+// and the types they use. Flags, nuse and other fields of nodes which may be shared
+// are therefore updated atomically, so that concurrent updates are not lost.
+
 #define CHECK_ONCE(node) \
-  ( ((node)->flags & NF_CHECKED) == 0 && ((node)->flags |= NF_CHECKED) )
+  ( ((node)->flags & NF_CHECKED) == 0 && \
+    (__atomic_fetch_or(&(node)->flags, NF_CHECKED, __ATOMIC_RELAXED) & NF_CHECKED) == 0 )
+
+
+static void node_flags_or(void* node, nodeflag_t flags) {
+  __atomic_fetch_or(&((node_t*)node)->flags, flags, __ATOMIC_RELAXED);
+}
+
+
+// node_update_visibility sets the visibility of node to vis, or if upgrade is true,
+// to vis only if vis is greater than the node's current visibility
+static void node_update_visibility(void* node, nodeflag_t vis, bool upgrade) {
+  node_t* n = node;
+  nodeflag_t flags = __atomic_load_n(&n->flags, __ATOMIC_RELAXED);
+  for (;;) {
+    nodeflag_t curr = flags & NF_VIS_MASK;
+    if (curr == vis || (upgrade && curr > vis))
+      return;
+    nodeflag_t newflags = (flags & ~NF_VIS_MASK) | vis;
+    if (__atomic_compare_exchange_n(
+          &n->flags, &flags, newflags, /*weak*/true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+      return;
+    }
+  }
+}
 
 
 // field_of_member returns the EXPR_FIELD that member m points to,
@@ -189,9 +252,10 @@ static void incuse_read(void* node) {
   node_t* n = node;
   while (!node_islocal(n) || ((local_t*)n)->name != sym__) {
     // dlog("%s %s#%p %s", __FUNCTION__, nodekind_name(n->kind), n, fmtnode(0,n));
-    if UNLIKELY(__builtin_add_overflow(n->nuse, 1, &n->nuse)) {
+    // note: atomic since function bodies may be checked in parallel
+    if UNLIKELY(__atomic_add_fetch(&n->nuse, 1, __ATOMIC_RELAXED) == 0) {
       // wrap around to 1 on overflow, not to 0
-      n->nuse = 1;
+      __atomic_store_n(&n->nuse, 1, __ATOMIC_RELAXED);
     }
     if (n->kind != EXPR_ID || (n = ((idexpr_t*)n)->ref) == NULL)
       break;
@@ -199,13 +263,34 @@ static void incuse_read(void* node) {
 }
 
 
+static void out_of_mem(typecheck_t* a);
+
+
+// is_shared_decl returns true if n is a declaration which may be used by
+// function bodies checked in parallel
+static bool is_shared_decl(const node_t* n) {
+  if (n->is_external)
+    return true;
+  if (node_islocal(n))
+    return ((local_t*)n)->nsparent != NULL; // set for unit-level variables
+  return !node_isexpr(n) || n->kind == EXPR_FUN;
+}
+
+
 // decrement nuse and set used_at_compile_time=true
-static void nuse_count_1_as_compile_time(void* node) {
+static void nuse_count_1_as_compile_time(typecheck_t* a, void* node) {
   node_t* n = node;
   while (!node_islocal(n) || ((local_t*)n)->name != sym__) {
     assert(n->nuse > 0);
-    n->nuse--;
-    n->used_at_compile_time = true;
+    __atomic_sub_fetch(&n->nuse, 1, __ATOMIC_RELAXED);
+    if (a->sharedmu && is_shared_decl(n)) {
+      // used_at_compile_time is a bitfield which can't be updated atomically.
+      // It's only read for shared declarations after all bodies have been checked.
+      if (!nodearray_push(&a->funbody->ctuses, a->ma, n))
+        out_of_mem(a);
+    } else {
+      n->used_at_compile_time = true;
+    }
     if (n->kind != EXPR_ID || (n = ((idexpr_t*)n)->ref) == NULL)
       break;
   }
@@ -218,13 +303,13 @@ static void incuse_write(void* node) {
     case EXPR_PARAM:
     case EXPR_VAR:
     case EXPR_LET: { local_t* n = node;
-      n->written = true;
+      __atomic_store_n(&n->written, true, __ATOMIC_RELAXED);
       return;
     }
     case EXPR_MEMBER: { member_t* n = node;
       local_t* field = field_of_member(n);
       if (field)
-        field->written = true;
+        __atomic_store_n(&field->written, true, __ATOMIC_RELAXED);
       return;
     }
     case EXPR_ID: { idexpr_t* n = node;
@@ -569,6 +654,41 @@ bool type_isconvertible(const type_t* dst, const type_t* src) {
 }
 
 
+ATTR_FORMAT(printf,4,5)
+static void typecheck_diag(
+  typecheck_t* a, origin_t origin, diagkind_t kind, const char* fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  if (a->diaglog) {
+    diaglog_addv(a->diaglog, origin, kind, fmt, ap);
+  } else {
+    report_diagv(a->compiler, origin, kind, fmt, ap);
+  }
+  va_end(ap);
+}
+
+
+// errcount returns the number of errors reported so far, including errors
+// recorded (but not yet reported) while checking a deferred function body
+static u32 errcount(typecheck_t* a) {
+  return compiler_errcount(a->compiler) + (a->diaglog ? a->diaglog->errcount : 0);
+}
+
+
+// shared_lock guards package-level state shared by function body checkers.
+// It's recursive and a no-op unless function bodies are checked in parallel.
+static void shared_lock(typecheck_t* a) {
+  if (a->sharedmu && a->sharedlock++ == 0)
+    mutex_lock(a->sharedmu);
+}
+
+static void shared_unlock(typecheck_t* a) {
+  if (a->sharedmu && --a->sharedlock == 0)
+    mutex_unlock(a->sharedmu);
+}
+
+
 static void seterr(typecheck_t* a, err_t err) {
   if (!a->err)
     a->err = err;
@@ -576,7 +696,7 @@ static void seterr(typecheck_t* a, err_t err) {
 
 
 static bool noerror(typecheck_t* a) {
-  return (!a->err) & (compiler_errcount(a->compiler) == 0);
+  return (!a->err) & (errcount(a) == 0);
 }
 
 
@@ -604,7 +724,7 @@ inline static locmap_t* locmap(typecheck_t* a) {
 // void diag(typecheck_t*, T origin, diagkind_t diagkind, const char* fmt, ...)
 // where T is one of: origin_t | loc_t | node_t* | expr_t*
 #define diag(a, origin, diagkind, fmt, args...) \
-  report_diag((a)->compiler, to_origin((a), (origin)), (diagkind), (fmt), ##args)
+  typecheck_diag((a), to_origin((a), (origin)), (diagkind), (fmt), ##args)
 
 #define error(a, origin, fmt, args...) \
   ((a)->reported_error = true, diag((a), origin, DIAG_ERR, (fmt), ##args))
@@ -644,10 +764,10 @@ static node_t* _mknode(typecheck_t* a, usize size, nodekind_t kind) {
 static void transfer_1_nuse_to_wrapper(void* wrapper_node, void* wrapee_node) {
   node_t* wrapper = wrapper_node;
   node_t* wrapee = wrapee_node;
-  u32 one_use = (u32)!!wrapee->nuse;
+  u32 one_use = (u32)!!__atomic_load_n(&wrapee->nuse, __ATOMIC_RELAXED);
   wrapper->nuse = one_use;
   if (!node_islocal(wrapee))
-    wrapee->nuse -= one_use;
+    __atomic_sub_fetch(&wrapee->nuse, one_use, __ATOMIC_RELAXED);
 }
 
 
@@ -746,9 +866,7 @@ static expr_t* mkretexpr(typecheck_t* a, expr_t* value, loc_t loc) {
 }
 
 
-// intern_usertype interns *tp in c->usertypes.
-// Returns true if *tp was newfound, false if *tp was updated to other, existing type.
-static bool intern_usertype(typecheck_t* a, usertype_t** tp) {
+static bool intern_usertype1(typecheck_t* a, usertype_t** tp) {
   assertnotnull(*tp);
   assert(nodekind_isusertype((*tp)->kind));
 
@@ -756,10 +874,10 @@ static bool intern_usertype(typecheck_t* a, usertype_t** tp) {
   // add all usertypes from imported packages to a->usertypes during import
 
   if (a->pubnest)
-    node_set_visibility((node_t*)*tp, NF_VIS_PUB);
+    node_update_visibility(*tp, NF_VIS_PUB, /*upgrade*/false);
 
   typeid_t typeid = typeid_intern((type_t*)*tp);
-  usertype_t** p = (usertype_t**)map_assign_ptr(&a->usertypes, a->ma, typeid);
+  usertype_t** p = (usertype_t**)map_assign_ptr(a->usertypes, a->ma, typeid);
 
   if UNLIKELY(!p)
     return out_of_mem(a), false;
@@ -799,6 +917,16 @@ static bool intern_usertype(typecheck_t* a, usertype_t** tp) {
 }
 
 
+// intern_usertype interns *tp in a->usertypes.
+// Returns true if *tp was newfound, false if *tp was updated to other, existing type.
+static bool intern_usertype(typecheck_t* a, usertype_t** tp) {
+  shared_lock(a);
+  bool newfound = intern_usertype1(a, tp);
+  shared_unlock(a);
+  return newfound;
+}
+
+
 static const char* narrowinfo_fmt(u32 bufindex, narrowinfo_t info);
 static narrowinfo_t narrowinfo_lookup(typecheck_t* a, const void* storage_node);
 
@@ -1149,19 +1277,33 @@ static void narrowinfo_define(
 }
 
 
+// lookup_pkg looks up name at the package level, which includes the API of
+// std/runtime (see autoimport_runtime)
+static node_t* nullable lookup_pkg(typecheck_t* a, sym_t name) {
+  node_t* n = pkg_def_get(a->pkg, name);
+  if (n || !a->rtns)
+    return n;
+  for (u32 i = 0; i < a->rtns->members.len; i++) {
+    if (a->rtns->member_names[i] == name)
+      return pkg_api_member(a->rtns->pkg, i);
+  }
+  return NULL;
+}
+
+
 static node_t* nullable lookup(typecheck_t* a, sym_t name) {
   assert(name != sym__);
   node_t* n = scope_lookup(&a->scope, name, U32_MAX);
   trace("lookup \"%s\" in scope => %s", name, n ? nodekind_name(n->kind) : "(null)");
   if (!n) {
-    if (!( n = pkg_def_get(a->pkg, name) )) {
+    if (!( n = lookup_pkg(a, name) )) {
       trace("lookup \"%s\" in pkg => (null)", name);
       return NULL;
     }
     trace("lookup \"%s\" in pkg => %s", name, nodekind_name(n->kind));
 
     // mark the node as being used across translations units of the same package
-    node_upgrade_visibility(n, NF_VIS_PKG);
+    node_update_visibility(n, NF_VIS_PKG, /*upgrade*/true);
 
     // // define in current scope to reduce number of package lookups
     // if (!scope_define(&a->scope, a->ma, name, n))
@@ -1199,6 +1341,7 @@ static void define(typecheck_t* a, sym_t name, void* n) {
 
 static void _type(typecheck_t* a, type_t** tp);
 static void stmt(typecheck_t* a, stmt_t** np);
+static void check_pending_fun_bodies(typecheck_t* a);
 static void exprp(typecheck_t* a, expr_t** np);
 #define expr(a, n)  exprp(a, (expr_t**)&(n))
 
@@ -1722,6 +1865,7 @@ static void vardef(typecheck_t* a, local_t* n) {
       case EXPR_ARRAYLIT:
         break;
       default: {
+        check_pending_fun_bodies(a);
         ctimeflag_t ctflag = 0;
         node_t* constval = comptime_eval(a->compiler, n->init, ctflag);
         assert(node_isexpr(constval));
@@ -1834,8 +1978,10 @@ static void structtype(typecheck_t* a, structtype_t** tp) {
   // }
 
   if (!(st->flags & NF_SUBOWNERS)) {
-    if UNLIKELY(!map_assign_ptr(&a->postanalyze, a->ma, *tp))
+    shared_lock(a);
+    if UNLIKELY(!map_assign_ptr(a->postanalyze, a->ma, *tp))
       out_of_mem(a);
+    shared_unlock(a);
   }
 }
 
@@ -1853,14 +1999,17 @@ static void arraytype(typecheck_t* a, arraytype_t** tp) {
     expr(a, at->lenexpr);
     typectx_pop(a);
 
-    if (compiler_errcount(a->compiler) > 0)
+    if (errcount(a) > 0)
       return;
 
+    if (at->lenexpr->kind != EXPR_INTLIT)
+      check_pending_fun_bodies(a);
+
     // note: comptime_eval_uint has already reported the error when returning false
     if (!comptime_eval_uint(a->compiler, at->lenexpr, /*flags*/0, &at->len))
       return;
 
-    if UNLIKELY(at->len == 0 && compiler_errcount(a->compiler) == 0)
+    if UNLIKELY(at->len == 0 && errcount(a) == 0)
       error(a, at, "zero length array");
   }
 
@@ -2009,7 +2158,9 @@ static bool typefun_add(
 
   // next, add (or retrieve existing) function to the type-function table
   if (!existing) {
+    shared_lock(a);
     fun_t* fn2 = typefuntab_add(&a->pkg->tfundefs, recvt, name, fn);
+    shared_unlock(a);
     if UNLIKELY(!fn2)
       return out_of_mem(a), false;
     if (fn2 != fn)
@@ -2030,6 +2181,76 @@ static bool typefun_add(
 }
 
 
+// defer_fun_body adds the body of function n to a->funbodies, to be checked
+// after the declarations of all units, if n is a unit-level function with an
+// explicit result type. (An inferred result type depends on the body.)
+static bool defer_fun_body(typecheck_t* a, fun_t* n) {
+  funbodies_t* fb = a->funbodies;
+  if (!fb || a->visitstack.len != 1 || a->templatenest ||
+      ((funtype_t*)n->type)->result == type_unknown)
+  {
+    return false;
+  }
+  funbody_t* b = array_alloc(funbody_t, (array_t*)&fb->v, a->ma, 1);
+  if UNLIKELY(!b)
+    return false;
+  *b = (funbody_t){ .fn = n, .unit_i = fb->unit_i };
+  trace("defer body of %s", fmtnode(0, n));
+  return true;
+}
+
+
+// fun_body checks the body of function n, in the function's scope
+static void fun_body(typecheck_t* a, fun_t* n) {
+  funtype_t* ft = (funtype_t*)n->type;
+
+  // define parameters
+  for (u32 i = 0; i < n->params.len; i++) {
+    local_t* param = (local_t*)n->params.v[i];
+    define(a, param->name, param);
+  }
+
+  // If the function returns a value, mark the block as rvalue.
+  // This causes block_noscope() to treat the last expression specially.
+  n->body->flags = COND_FLAG(n->body->flags, NF_RVALUE, ft->result != type_void);
+
+  // visit body
+  enter_ns(a, n);
+    typectx_push(a, ft->result);
+      block_noscope(a, n->body);
+    typectx_pop(a);
+  leave_ns(a);
+
+  // handle implicit return
+  if (ft->result != type_void && (n->body->flags & NF_EXIT) == 0) {
+    // function body should return a value, but block does not contain "return";
+    // the last expression is converted to a "return" statement.
+    if UNLIKELY(n->body->children.len == 0) {
+      // error will be reported by check_retval
+      expr_t* lastexpr = NULL;
+      check_retval(a, n->body, &lastexpr);
+    } else {
+      expr_t** lastexpr = (expr_t**)&n->body->children.v[n->body->children.len - 1];
+      // if the function has inferred result type, it's the type of body
+      // e.g. "fun foo(x int) = x * x" => "fun foo(x int) int = x * x"
+      if (ft->result == type_unknown)
+        ft->result = n->body->type;
+      check_retval(a, *lastexpr, lastexpr);
+      *lastexpr = mkretexpr(a, *lastexpr, (*lastexpr)->loc);
+    }
+  } else if (ft->result == type_unknown) {
+    ft->result = n->body->type;
+  }
+
+  // check for unused parameters
+  check_unused(a, (const node_t**)n->params.v, n->params.len);
+
+  // is this the "main" function?
+  if (ast_is_main_fun(n))
+    main_fun(a, n);
+}
+
+
 static void fun(typecheck_t* a, fun_t* n) {
   fun_t* outer_fun = a->fun;
   a->fun = n;
@@ -2075,7 +2296,7 @@ static void fun(typecheck_t* a, fun_t* n) {
     if (ft->result == type_void && ft->params.len == 1) {
       local_t* param0 = (local_t*)ft->params.v[0];
       ok = param0->type->kind == TYPE_MUTREF;
-      n->recvt->flags |= NF_DROP;
+      node_flags_or(n->recvt, NF_DROP);
       assert(node_isusertype((node_t*)n->recvt));
       ((usertype_t*)n->recvt)->dropfun = n;
     }
@@ -2085,52 +2306,10 @@ static void fun(typecheck_t* a, fun_t* n) {
 
   // body
   if (n->body) {
-    // define parameters
-    for (u32 i = 0; i < n->params.len; i++) {
-      local_t* param = (local_t*)n->params.v[i];
-      define(a, param->name, param);
-    }
-
-    // If the function returns a value, mark the block as rvalue.
-    // This causes block_noscope() to treat the last expression specially.
-    n->body->flags = COND_FLAG(n->body->flags, NF_RVALUE, ft->result != type_void);
-
-    // visit body
-    enter_ns(a, n);
-      typectx_push(a, ft->result);
-        block_noscope(a, n->body);
-      typectx_pop(a);
-    leave_ns(a);
-
-    // handle implicit return
-    if (ft->result != type_void && (n->body->flags & NF_EXIT) == 0) {
-      // function body should return a value, but block does not contain "return";
-      // the last expression is converted to a "return" statement.
-      if UNLIKELY(n->body->children.len == 0) {
-        // error will be reported by check_retval
-        expr_t* lastexpr = NULL;
-        check_retval(a, n->body, &lastexpr);
-      } else {
-        expr_t** lastexpr = (expr_t**)&n->body->children.v[n->body->children.len - 1];
-        // if the function has inferred result type, it's the type of body
-        // e.g. "fun foo(x int) = x * x" => "fun foo(x int) int = x * x"
-        if (ft->result == type_unknown)
-          ft->result = n->body->type;
-        check_retval(a, *lastexpr, lastexpr);
-        *lastexpr = mkretexpr(a, *lastexpr, (*lastexpr)->loc);
-      }
-    } else if (ft->result == type_unknown) {
-      ft->result = n->body->type;
-    }
-
-    // check for unused parameters
-    check_unused(a, (const node_t**)n->params.v, n->params.len);
-
-    // is this the "main" function?
-    if (ast_is_main_fun(n))
-      main_fun(a, n);
+    if (!defer_fun_body(a, n))
+      fun_body(a, n);
   } else {
-    node_upgrade_visibility((node_t*)n, NF_VIS_PKG);
+    node_update_visibility(n, NF_VIS_PKG, /*upgrade*/true);
   }
 
   if (n->recvt)
@@ -3075,6 +3254,7 @@ static fun_t* nullable find_typefun(
 {
   type_t* bt = type_unwrap_ptr(recvt); // e.g. &MyMyT => MyMyT
   type_t* bt2 = recvt2 ? type_unwrap_ptr(recvt2) : NULL;
+  shared_lock(a);
   fun_t* fn = typefuntab_lookup(&a->pkg->tfundefs, bt, name);
 
   if (fn) {
@@ -3087,6 +3267,10 @@ static fun_t* nullable find_typefun(
       //   fun example(x &Foo)
       //     x.bar() // error: Foo.bar requires mutable receiver
     }
+  }
+  shared_unlock(a);
+
+  if (fn) {
     *restypep = ((funtype_t*)assertnotnull(fn->type))->result;
     return fn;
   }
@@ -3704,6 +3888,20 @@ static void arraylit(typecheck_t* a, arraylit_t* n) {
 }
 
 
+// pkgns_member returns member i of package namespace ns, decoding it if needed
+static node_t* nullable pkgns_member(
+  typecheck_t* a, origin_t origin, const nsexpr_t* ns, u32 i)
+{
+  assert(ns->flags & NF_PKGNS);
+  node_t* n = pkg_api_member(ns->pkg, i);
+  if UNLIKELY(!n) {
+    error(a, origin, "failed to load \"%s\" from package \"%s\"",
+      ns->member_names[i], ns->pkg->path.p);
+  }
+  return n;
+}
+
+
 static void member_ns(typecheck_t* a, member_t* n) {
   nsexpr_t* ns = (nsexpr_t*)unwrap_id(n->recv);
   if (ns->kind != EXPR_NS) {
@@ -3717,11 +3915,22 @@ static void member_ns(typecheck_t* a, member_t* n) {
 
   for (u32 i = 0; i < ns->members.len; i++) {
     if (ns->member_names[i] == name) {
-      if UNLIKELY(!node_isexpr(ns->members.v[i])) {
-        error(a, n, "names a %s", nodekind_fmt(ns->members.v[i]->kind));
+      // note: members of a package namespace may be decoded concurrently by
+      // other threads, so they must be accessed via pkgns_member
+      node_t* member;
+      if (ns->flags & NF_PKGNS) {
+        if UNLIKELY(!( member = pkgns_member(a, to_origin(a, n), ns, i) )) {
+          n->type = a->typectx;
+          return;
+        }
+      } else {
+        member = ns->members.v[i];
+      }
+      if UNLIKELY(!node_isexpr(member)) {
+        error(a, n, "names a %s", nodekind_fmt(member->kind));
         return;
       }
-      target = (expr_t*)ns->members.v[i];
+      target = (expr_t*)member;
       incuse_read(target);
       n->target = target;
       n->type = target->type;
@@ -3789,7 +3998,7 @@ static expr_t* nullable find_builtin_member_len_or_cap(
       if (((arraytype_t*)recvbt)->len > 0) {
         // constant expression means we won't read the receiver,
         // but we still logically use it so mark it as "used at compile time."
-        nuse_count_1_as_compile_time(n->recv);
+        nuse_count_1_as_compile_time(a, n->recv);
       }
       break;
     default:
@@ -4369,7 +4578,7 @@ static void call_type(typecheck_t* a, call_t** np, type_t* t) {
 
   case TYPE_UNRESOLVED:
     // this only happens when there was a type error
-    assert(compiler_errcount(a->compiler) > 0);
+    assert(errcount(a) > 0);
     break;
 
   default:
@@ -4607,7 +4816,7 @@ static void templateimap_add(
 
   void* v = mem_alloc(a->ma, a->tmpbuf.len).p;
   if (v) memcpy(v, a->tmpbuf.p, a->tmpbuf.len);
-  void** p = map_assign(&a->templateimap, a->ma, v, a->tmpbuf.len);
+  void** p = map_assign(a->templateimap, a->ma, v, a->tmpbuf.len);
   if UNLIKELY(!p || a->tmpbuf.oom || !v)
     return out_of_mem(a);
 
@@ -4634,7 +4843,7 @@ static usertype_t* nullable templateimap_lookup(
   a->tmpbuf.len = 0;
   templateimap_mkkey(&a->tmpbuf, template, template_args);
 
-  void** p = map_lookup(&a->templateimap, a->tmpbuf.p, a->tmpbuf.len);
+  void** p = map_lookup(a->templateimap, a->tmpbuf.p, a->tmpbuf.len);
   usertype_t* instance = p ? assertnotnull(*p) : NULL;
 
   #if 0
@@ -4659,7 +4868,7 @@ static usertype_t* nullable templateimap_lookup(
 }
 
 
-static void instantiate_templatetype(typecheck_t* a, templatetype_t** tp) {
+static void instantiate_templatetype1(typecheck_t* a, templatetype_t** tp) {
   templatetype_t* tt = *tp;
   usertype_t* template = tt->recv;
   assert(tt->args.len <= template->templateparams.len);
@@ -4769,6 +4978,15 @@ static void instantiate_templatetype(typecheck_t* a, templatetype_t** tp) {
 }
 
 
+static void instantiate_templatetype(typecheck_t* a, templatetype_t** tp) {
+  // instances are shared by all function bodies of the package, so instantiation
+  // (including checking of a new instance) must not interleave with other threads
+  shared_lock(a);
+  instantiate_templatetype1(a, tp);
+  shared_unlock(a);
+}
+
+
 static void templatetype(typecheck_t* a, templatetype_t** tp) {
   // Use of template, e.g. var x Foo<int>
   //                             ~~~~~~~~
@@ -4789,7 +5007,7 @@ static void templatetype(typecheck_t* a, templatetype_t** tp) {
 
   // stop now if we encountered errors
   if (nrequired != ntotal) {
-    if (compiler_errcount(a->compiler))
+    if (errcount(a))
       return;
   }
 
@@ -4891,7 +5109,9 @@ static void unresolvedtype(typecheck_t* a, unresolvedtype_t** tp) {
 
   if LIKELY(nodekind_istype(t->kind)) {
     type(a, &t);
-    t->nuse = (*tp)->nuse; //incuse_read(t); t->nuse += (*tp)->nuse;
+    // note: atomic since t may be shared with function bodies checked in parallel
+    __atomic_store_n(&t->nuse, (*tp)->nuse, __ATOMIC_RELAXED);
+    //incuse_read(t); t->nuse += (*tp)->nuse;
     (*tp)->resolved = t;
     *(type_t**)tp = t;
 
@@ -4953,7 +5173,7 @@ static void aliastype(typecheck_t* a, aliastype_t** tp) {
         fmtnode(0, t->elem), t->name);
       help(a, t->elem, "mark %s `pub`", fmtnode(0, t->elem));
     }
-    node_set_visibility((node_t*)t, NF_VIS_PUB);
+    node_update_visibility(t, NF_VIS_PUB, /*upgrade*/false);
   }
 }
 
@@ -4969,7 +5189,9 @@ static void importedtype(typecheck_t* a, importedtype_t** tp) {
 
   for (u32 i = 0; i < api_ns->members.len; i++) {
     if (api_ns->member_names[i] == imt->name) {
-      node_t* n = api_ns->members.v[i];
+      node_t* n = pkgns_member(a, to_origin(a, imt->nameloc), api_ns, i);
+      if UNLIKELY(!n)
+        return;
       if (n->kind == STMT_TYPEDEF) {
         n = (node_t*)((typedef_t*)n)->type;
       } else if (!node_istype(n)) {
@@ -5261,7 +5483,7 @@ static void postanalyze_dependency(typecheck_t* a, void* np) {
   node_t* n = np;
   if (n->kind != TYPE_STRUCT)
     return;
-  void** vp = map_assign_ptr(&a->postanalyze, a->ma, n);
+  void** vp = map_assign_ptr(a->postanalyze, a->ma, n);
   if UNLIKELY(!vp)
     return out_of_mem(a);
   if (*vp == (void*)1)
@@ -5294,8 +5516,8 @@ static void postanalyze(typecheck_t* a) {
   // Keep going until map only has "done" entries (value==1).
   // postanalyze_any may cause additions to the map.
 again:
-  mapent_t* e = map_it_mut(&a->postanalyze);
-  while (map_itnext_mut(&a->postanalyze, &e)) {
+  mapent_t* e = map_it_mut(a->postanalyze);
+  while (map_itnext_mut(a->postanalyze, &e)) {
     if (e->value == (void*)1)
       continue;
     e->value = (void*)1;
@@ -5343,7 +5565,9 @@ static void import_members(typecheck_t* a, import_t* im) {
         // note: parser has already checked for duplicate definitions
         // dlog("importing %s as %s => %s",
         //   origname, imid->name, nodekind_name(api_ns->members.v[i]->kind));
-        define(a, imid->name, api_ns->members.v[i]);
+        node_t* n = pkgns_member(a, to_origin(a, imid->orignameloc), api_ns, i);
+        if (n)
+          define(a, imid->name, n);
         break;
       }
     }
@@ -5384,7 +5608,7 @@ static void import_members(typecheck_t* a, import_t* im) {
     // So we have to check for duplicate definitions here.
     node_t* existing = scope_lookup(&a->scope, name, 0);
     if (!existing) // also look in pkg scope
-      existing = pkg_def_get(a->pkg, name);
+      existing = lookup_pkg(a, name);
     if UNLIKELY(existing) {
       dlog("existing %s %u", nodekind_name(existing->kind), loc_line(existing->loc));
       if (scope_lookup(&a->scope, name, 0)) {
@@ -5404,7 +5628,9 @@ static void import_members(typecheck_t* a, import_t* im) {
         }
       }
     } else {
-      define(a, name, api_ns->members.v[i]);
+      node_t* n = pkgns_member(a, to_origin(a, (node_t*)star_imid), api_ns, i);
+      if (n)
+        define(a, name, n);
     }
   }
 }
@@ -5414,9 +5640,10 @@ static void import(typecheck_t* a, import_t* im) {
   if (im->name != sym__) {
     // e.g. import "foo/bar" as lol
     assertnotnull(im->pkg); // should have been resolved by pkgbuild
-    assertnotnull(im->pkg->api_ns);
+    nsexpr_t* api_ns = assertnotnull(im->pkg->api_ns);
     trace("define \"%s\" = namespace of pkg \"%s\"", im->name, im->pkg->path.p);
-    define(a, im->name, im->pkg->api_ns);
+    // note: members are decoded as they are accessed (see member_ns)
+    define(a, im->name, api_ns);
   }
 
   if (im->idlist)
@@ -5475,35 +5702,264 @@ static err_t autoimport_runtime(typecheck_t* a) {
   if (a->pkg == rt_pkg)
     return 0;
 
-  // add runtime's API to our package-level scope
-  const nsexpr_t* ns = assertnotnull(rt_pkg->api_ns);
-  return pkg_def_addm(a->pkg, a->ma, ns->member_names, ns->members.v, ns->members.len);
+  // make runtime's API visible at the package level (see lookup_pkg.)
+  // Note that members are not added to pkg->defs since that would require all of
+  // them to be decoded, even though a package usually uses just a few of them.
+  a->rtns = assertnotnull(rt_pkg->api_ns);
+  return 0;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// deferred function bodies
+//
+// After the unit-level declarations of all units have been checked, the bodies of
+// unit-level functions only depend on shared state through lookups of checked
+// declarations, interning of types and instantiation of templates. The bodies are
+// then checked on the threadpool, each by a typecheck_t of its own with the scope
+// of the function's unit. Shared maps are guarded by typecheck_t.sharedmu and the
+// diagnostics of each body are recorded and reported in source order, so that
+// results do not depend on the number of threads.
+
+
+// FUNBODY_MIN_PER_THREAD is the minimum number of function bodies per thread
+#define FUNBODY_MIN_PER_THREAD 8
+
+
+typedef struct {
+  typecheck_t*  a;              // package-level typecheck_t
+  memalloc_t    ma;
+  u32           end;            // check a->funbodies->v[next:end]
+  bool          parallel;       // sharedmu is used
+  bool          reported_error; // a->reported_error before checking the bodies
+  _Atomic(u32)  next;           // index of next body to check
+  _Atomic(u32)  nremaining;     // number of bodies not yet checked
+  _Atomic(u32)  refcount;       // threads referencing this struct
+  sema_t        donesem;        // signalled when nremaining reaches zero
+  mutex_t       sharedmu;
+} funbodyjob_t;
+
+
+static void typecheck_dispose_scratch(typecheck_t* a) {
+  scope_dispose(&a->scope, a->ma);
+  scope_dispose(&a->narrowscope, a->ma);
+  ptrarray_dispose(&a->nspath, a->ma);
+  ptrarray_dispose(&a->typectxstack, a->ma);
+  nodearray_dispose(&a->visitstack, a->ma);
+  buf_dispose(&a->tmpbuf);
+  for (u32 i = 0; i < a->freemaps.len; i++)
+    if (a->freemaps.v[i].cap) map_dispose(&a->freemaps.v[i], a->ma);
+  maparray_dispose(&a->freemaps, a->ma);
+}
+
+
+static void save_unit_scope(typecheck_t* a) {
+  funbodies_t* fb = a->funbodies;
+  if (!scope_copy(&fb->unitscopes[fb->unit_i], &a->scope, a->ma))
+    out_of_mem(a);
+  fb->ndidyoumean[fb->unit_i] = a->didyoumean.len;
+}
+
+
+static void check_fun_body(typecheck_t* a, funbodies_t* fb, funbody_t* b, bool reperr) {
+  fun_t* n = b->fn;
+  trace("check deferred body of %s", fmtnode(0, n));
+
+  diaglog_init(&b->diaglog, a->ma);
+  a->diaglog = &b->diaglog;
+  a->funbody = b;
+  a->err = 0;
+  a->reported_error = reperr;
+  a->varidgen = 0;
+
+  // restore state at the end of the function's unit
+  a->didyoumean.len = fb->ndidyoumean[b->unit_i];
+  if (!scope_copy(&a->scope, &fb->unitscopes[b->unit_i], a->ma))
+    out_of_mem(a);
+  scope_clear(&a->narrowscope);
+  if (!scope_push(&a->narrowscope, a->ma) || !scope_push(&a->narrowscope, a->ma))
+    out_of_mem(a);
+  a->nspath.len = 0;
+  enter_ns(a, fb->unitv[b->unit_i]);
+
+  // this mirrors what fun() does around fun_body()
+  a->fun = n;
+  a->pubnest = (u32)!!(n->flags & NF_VIS_PUB);
+  visitstack_push(a, n);
+  if (n->recvt)
+    enter_ns(a, n->recvt);
+  enter_scope(a);
+
+  fun_body(a, n);
+
+  leave_scope(a);
+  if (n->recvt)
+    leave_ns(a);
+  visitstack_pop(a);
+  a->fun = NULL;
+
+  b->err = a->err;
+  a->diaglog = NULL;
+  a->funbody = NULL;
+}
+
+
+static void fun_bodies_run(funbodyjob_t* job) {
+  typecheck_t w;
+  bool w_init = false;
+
+  for (;;) {
+    u32 i = AtomicAdd(&job->next, 1, memory_order_relaxed);
+    if (i >= job->end)
+      break;
+    typecheck_t* a = job->a; // valid since body i has not been checked
+    pkgstats_t* stats = a->pkg->stats;
+    buildtimer_t timer = buildstats_begin(stats);
+    if (!w_init) {
+      w_init = true;
+      w = (typecheck_t){
+        .compiler = a->compiler,
+        .pkg = a->pkg,
+        .rtns = a->rtns,
+        .ma = a->ma,
+        .ast_ma = a->ast_ma,
+        .typectx = type_void,
+        .usertypes = a->usertypes,
+        .postanalyze = a->postanalyze,
+        .templateimap = a->templateimap,
+        .sharedmu = job->parallel ? &job->sharedmu : NULL,
+        .didyoumean = a->didyoumean, // read-only, owned by a
+      };
+      buf_init(&w.tmpbuf, w.ma);
+    }
+    check_fun_body(&w, a->funbodies, &a->funbodies->v.v[i], job->reported_error);
+    buildstats_end_cpu(stats, BUILDPHASE_TYPECHECK, &timer);
+    if (AtomicSub(&job->nremaining, 1, memory_order_acq_rel) == 1)
+      sema_signal(&job->donesem, 1);
+  }
+
+  if (w_init)
+    typecheck_dispose_scratch(&w);
+}
+
+
+static void funbodyjob_release(funbodyjob_t* job) {
+  if (AtomicSub(&job->refcount, 1, memory_order_acq_rel) > 1)
+    return;
+  sema_dispose(&job->donesem);
+  if (job->parallel)
+    mutex_dispose(&job->sharedmu);
+  mem_freet(job->ma, job);
+}
+
+
+static void fun_bodies_thread(funbodyjob_t* job) {
+  fun_bodies_run(job);
+  funbodyjob_release(job);
+}
+
+
+// check_fun_bodies checks deferred function bodies which have not yet been checked
+// and reports their diagnostics
+static void check_fun_bodies(typecheck_t* a, bool allow_parallel) {
+  funbodies_t* fb = a->funbodies;
+  u32 start = fb->ndone, end = fb->v.len;
+  if (start == end)
+    return;
+
+  u32 nthreads = 1;
+  if (allow_parallel && !opt_trace_typecheck)
+    nthreads = MAX(1u, MIN(comaxproc, (end - start) / FUNBODY_MIN_PER_THREAD));
+
+  // Note: job is heap allocated since threads that start after all bodies have
+  // been checked (by other threads) may outlive this function call.
+  funbodyjob_t* job = mem_alloct(a->ma, funbodyjob_t);
+  if UNLIKELY(!job)
+    return out_of_mem(a);
+  job->a = a;
+  job->ma = a->ma;
+  job->end = end;
+  job->reported_error = a->reported_error;
+  job->next = start;
+  job->nremaining = end - start;
+  safecheckx(sema_init(&job->donesem, 0) == 0);
+  job->parallel = nthreads > 1 && mutex_init(&job->sharedmu) == 0;
+  if (!job->parallel)
+    nthreads = 1;
+  job->refcount = nthreads;
+
+  trace("checking %u function bodies using %u threads", end - start, nthreads);
+
+  for (u32 i = 1; i < nthreads; i++) {
+    if (threadpool_submit(fun_bodies_thread, job))
+      AtomicSub(&job->refcount, 1, memory_order_relaxed);
+  }
+  fun_bodies_run(job);
+  safecheckx(sema_wait(&job->donesem));
+  funbodyjob_release(job);
+
+  // report diagnostics in source order
+  for (u32 i = start; i < end; i++) {
+    funbody_t* b = &fb->v.v[i];
+    a->reported_error |= b->diaglog.errcount > 0;
+    diaglog_report(&b->diaglog, a->compiler);
+    diaglog_dispose(&b->diaglog);
+    for (u32 j = 0; j < b->ctuses.len; j++)
+      b->ctuses.v[j]->used_at_compile_time = true;
+    nodearray_dispose(&b->ctuses, a->ma);
+    if (b->err)
+      seterr(a, b->err);
+  }
+  fb->ndone = end;
+}
+
+
+// check_pending_fun_bodies checks deferred function bodies right away.
+// Used before comptime evaluation during unit-level checking, which may call functions.
+static void check_pending_fun_bodies(typecheck_t* a) {
+  if (!a->funbodies || a->funbodies->ndone == a->funbodies->v.len)
+    return;
+  save_unit_scope(a);
+  check_fun_bodies(a, /*allow_parallel*/false);
 }
 
 
 err_t typecheck(
   compiler_t* c, memalloc_t ast_ma, pkg_t* pkg, unit_t** unitv, u32 unitc)
 {
+  map_t postanalyze_map, templateimap, usertypes;
+  funbodies_t funbodies = { .unitv = unitv };
   typecheck_t a = {
     .compiler = c,
     .pkg = pkg,
     .ma = c->ma,
     .ast_ma = ast_ma,
     .typectx = type_void,
+    .postanalyze = &postanalyze_map,
+    .templateimap = &templateimap,
+    .usertypes = &usertypes,
+    .funbodies = &funbodies,
   };
 
-  if (!map_init(&a.postanalyze, a.ma, 32))
+  if (!map_init(&postanalyze_map, a.ma, 32))
     return ErrNoMem;
-  if (!map_init(&a.templateimap, a.ma, 32)) {
+  if (!map_init(&templateimap, a.ma, 32)) {
     a.err = ErrNoMem;
     goto end1;
   }
-  if (!map_init(&a.usertypes, a.ma, 32)) {
+  if (!map_init(&usertypes, a.ma, 32)) {
     a.err = ErrNoMem;
     goto end2;
   }
   buf_init(&a.tmpbuf, a.ma);
 
+  funbodies.unitscopes = mem_alloctv(a.ma, scope_t, unitc);
+  funbodies.ndidyoumean = mem_alloctv(a.ma, u32, unitc);
+  if (!funbodies.unitscopes || !funbodies.ndidyoumean) {
+    a.err = ErrNoMem;
+    goto end3;
+  }
+
   // expose runtime functions
   if (( a.err = autoimport_runtime(&a) ))
     goto end3;
@@ -5512,6 +5968,7 @@ err_t typecheck(
 
   for (u32 unit_i = 0; unit_i < unitc; unit_i++) {
     unit_t* unit = unitv[unit_i];
+    funbodies.unit_i = unit_i;
 
     enter_scope(&a);
     enter_ns(&a, unit);
@@ -5525,13 +5982,19 @@ err_t typecheck(
       define_at_unit_level(&a, unit->children.v[i]);
     }
 
+    // check declarations; bodies of functions are deferred (see defer_fun_body)
     for (u32 i = 0; i < unit->children.len; i++)
       stmt(&a, (stmt_t**)&unit->children.v[i]);
 
+    save_unit_scope(&a);
+
     leave_ns(&a);
     leave_scope(&a);
   }
 
+  // check function bodies
+  check_fun_bodies(&a, /*allow_parallel*/true);
+
   // TODO: should this run after each unit?
   postanalyze(&a);
 
@@ -5560,21 +6023,23 @@ err_t typecheck(
   }
 
 end3:
-  scope_dispose(&a.scope, a.ma);
-  scope_dispose(&a.narrowscope, a.ma);
-  ptrarray_dispose(&a.nspath, a.ma);
-  ptrarray_dispose(&a.typectxstack, a.ma);
-  nodearray_dispose(&a.visitstack, a.ma);
+  if (funbodies.unitscopes) {
+    for (u32 i = 0; i < unitc; i++)
+      scope_dispose(&funbodies.unitscopes[i], a.ma);
+    mem_freetv(a.ma, funbodies.unitscopes, unitc);
+  }
+  if (funbodies.ndidyoumean)
+    mem_freetv(a.ma, funbodies.ndidyoumean, unitc);
+  array_dispose(funbody_t, (array_t*)&funbodies.v, a.ma);
+  typecheck_dispose_scratch(&a);
   array_dispose(didyoumean_t, (array_t*)&a.didyoumean, a.ma);
-  buf_dispose(&a.tmpbuf);
-  map_dispose(&a.usertypes, a.ma);
-  for (u32 i = 0; i < a.freemaps.len; i++)
-    if (a.freemaps.v[i].cap) map_dispose(&a.freemaps.v[i], a.ma);
-  maparray_dispose(&a.freemaps, a.ma);
+  map_dispose(&usertypes, a.ma);
 end2:
-  map_dispose(&a.templateimap, a.ma);
+  if (pkg->stats)
+    pkg->stats->ninstances += templateimap.len;
+  map_dispose(&templateimap, a.ma);
 end1:
-  map_dispose(&a.postanalyze, a.ma);
+  map_dispose(&postanalyze_map, a.ma);
 
   return a.err;
 }
@@ -22,9 +22,22 @@
 // #define TYPEID_TAG_TID   '$'
 
 
-static memalloc_t  typeid_ma;
-static rwmutex_t   typeid_mu;
-static hashtable_t typeid_ht;
+// Interned typeids are stored in TYPEID_NSHARDS independent tables, selected by
+// the high bits of a typeid's hash, so that threads interning different typeids
+// rarely contend for the same lock. Lookups take a shard's shared lock; only
+// inserts take its exclusive lock. All shards use the same hash seed, so that a
+// typeid's hash can be computed once, up front (see typeid_intern_hash.)
+#define TYPEID_SHARD_BITS 4
+#define TYPEID_NSHARDS    (1u << TYPEID_SHARD_BITS)
+
+typedef struct {
+  rwmutex_t   mu;
+  hashtable_t ht;
+} __attribute__((aligned(64))) typeidshard_t; // own cache line, to avoid false sharing
+
+static memalloc_t    typeid_ma;
+static usize         typeid_seed;
+static typeidshard_t typeid_shards[TYPEID_NSHARDS];
 
 
 // Conversion of f64 <-> u64
@@ -43,6 +56,11 @@ usize typeid_hash(usize seed, typeid_t typeid) {
 }
 
 
+usize typeid_intern_hash(typeid_t typeid) {
+  return typeid_hash(typeid_seed, typeid);
+}
+
+
 static usize _typeid_hash(usize seed, const void* typeidp) {
   typeid_t typeid = *(typeid_t*)typeidp;
   return typeid_hash(seed, typeid);
@@ -58,19 +76,52 @@ static bool typeid_eq(const void* ap, const void* bp) {
 
 void typeid_init(memalloc_t ma) {
   typeid_ma = ma;
-  safecheckx(rwmutex_init(&typeid_mu) == 0);
-  UNUSED err_t err = hashtable_init(&typeid_ht, ma, sizeof(typeid_t), 256);
-  safecheckf(err == 0, "hashtable_init: %s", err_str(err));
+  typeid_seed = fastrand();
+  for (u32 i = 0; i < TYPEID_NSHARDS; i++) {
+    typeidshard_t* sh = &typeid_shards[i];
+    safecheckx(rwmutex_init(&sh->mu) == 0);
+    UNUSED err_t err = hashtable_init(&sh->ht, ma, sizeof(typeid_t), 256/TYPEID_NSHARDS);
+    safecheckf(err == 0, "hashtable_init: %s", err_str(err));
+    sh->ht.seed = typeid_seed;
+  }
 }
 
 
-typeid_t typeid_intern_typeid(typeid_t typeid) {
+#ifdef TYPEID_TRACE
+static void typeid_trace(const char* what, typeid_t typeid) {
+  buf_t tmpbuf = buf_make(typeid_ma);
+  buf_appendrepr(&tmpbuf, typeid->bytes, typeid->len);
+  trace("%s typeid %p (%u) '%.*s'",
+    what, typeid, typeid->len, (int)tmpbuf.len, tmpbuf.chars);
+  buf_dispose(&tmpbuf);
+}
+#else
+  #define typeid_trace(what, typeid) ((void)0)
+#endif
+
 
-  rwmutex_lock(&typeid_mu);
+typeid_t typeid_intern_typeid_hashed(typeid_t typeid, usize hash) {
+  assert(hash == typeid_intern_hash(typeid));
+  typeidshard_t* sh = &typeid_shards[hash >> (sizeof(usize)*8 - TYPEID_SHARD_BITS)];
+
+  // lookup under shared lock
+  rwmutex_rlock(&sh->mu);
+  typeid_t* ent = hashtable_lookup_hashed(
+    &sh->ht, typeid_eq, sizeof(typeid_t), &typeid, hash);
+  typeid_t existing = ent ? *ent : NULL;
+  rwmutex_runlock(&sh->mu);
+  if (existing) {
+    typeid_trace("use existing", existing);
+    return existing;
+  }
+
+  // not found; assign under exclusive lock.
+  // Another thread may have added it since we looked.
+  rwmutex_lock(&sh->mu);
 
   bool did_insert;
-  typeid_t* ent = hashtable_assign(
-    &typeid_ht, _typeid_hash, typeid_eq, sizeof(typeid_t), &typeid, &did_insert);
+  ent = hashtable_assign_hashed(
+    &sh->ht, _typeid_hash, typeid_eq, sizeof(typeid_t), &typeid, hash, &did_insert);
   if UNLIKELY(!ent)
     goto oom;
 
@@ -82,63 +133,32 @@ typeid_t typeid_intern_typeid(typeid_t typeid) {
     memcpy(typeid2, typeid, nbyte);
     *ent = typeid2;
   }
+  typeid = *ent;
 
-  #ifdef TYPEID_TRACE
-  {
-    typeid = *ent;
-    buf_t tmpbuf = buf_make(typeid_ma);
-    buf_appendrepr(&tmpbuf, typeid->bytes, typeid->len);
-    trace("[%s] %s typeid %p (%u) '%.*s'", __FUNCTION__,
-      did_insert ? "add" : "use existing",
-      typeid, typeid->len, (int)tmpbuf.len, tmpbuf.chars);
-    buf_dispose(&tmpbuf);
-  }
-  #endif
-
-  rwmutex_unlock(&typeid_mu);
+  rwmutex_unlock(&sh->mu);
 
-  return *ent;
+  typeid_trace(did_insert ? "add" : "use existing", typeid);
+  return typeid;
 oom:
   panic("out of memory");
   UNREACHABLE;
 }
 
 
-static typeid_t typeid_map_intern(typeid_t typeid) {
-  #ifdef TYPEID_TRACE
-  {
-    buf_t tmpbuf = buf_make(typeid_ma);
-    buf_appendrepr(&tmpbuf, typeid->bytes, typeid->len);
-    trace("[%s] typeid(%u)='%.*s' (hash=0x%lx)", __FUNCTION__,
-      typeid->len, (int)tmpbuf.len, tmpbuf.chars,
-      typeid_hash(typeid_ht.seed, typeid));
-    buf_dispose(&tmpbuf);
-  }
-  #endif
-
-  // lookup under read-only lock
-  rwmutex_rlock(&typeid_mu);
-  typeid_t* ent = hashtable_lookup(
-    &typeid_ht, _typeid_hash, typeid_eq, sizeof(typeid_t), &typeid);
-  rwmutex_runlock(&typeid_mu);
+typeid_t typeid_intern_typeid(typeid_t typeid) {
+  return typeid_intern_typeid_hashed(typeid, typeid_intern_hash(typeid));
+}
 
-  if (ent) {
-    #ifdef TYPEID_TRACE
-    {
-      typeid = *ent;
-      buf_t tmpbuf = buf_make(typeid_ma);
-      buf_appendrepr(&tmpbuf, typeid->bytes, typeid->len);
-      trace("use existing typeid %p (%u) '%.*s'",
-        typeid, typeid->len, (int)tmpbuf.len, tmpbuf.chars);
-      buf_dispose(&tmpbuf);
-    }
-    #endif
 
-    return *ent;
+usize typeid_count() {
+  usize n = 0;
+  for (u32 i = 0; i < TYPEID_NSHARDS; i++) {
+    typeidshard_t* sh = &typeid_shards[i];
+    rwmutex_rlock(&sh->mu);
+    n += sh->ht.len;
+    rwmutex_runlock(&sh->mu);
   }
-
-  // not found; assign under full write lock
-  return typeid_intern_typeid(typeid);
+  return n;
 }
 
 
@@ -167,7 +187,7 @@ static typeid_t typeid_make(PARAMS, type_t* t) {
   safecheck(buf->len - (start_offs + 4) <= (usize)U32_MAX);
   typeid->len = (u32)(buf->len - (start_offs + 4));
 
-  typeid = (typeid_data_t*)typeid_map_intern(typeid);
+  typeid = (typeid_data_t*)typeid_intern_typeid(typeid);
 
   // reset buffer
   buf->len = buf_offs;
@@ -358,3 +378,73 @@ typeid_t _typeid(type_t* t, bool intern) {
 
   return typeid;
 }
+
+
+#ifdef CO_ENABLE_TESTS
+
+typedef struct {
+  thrd_t          t;
+  typeid_t*       keyv;
+  typeid_t*       resv; // interned typeid of keyv[i] at resv[i]
+  u32             nkeys, start;
+} typeidtest_thread_t;
+
+
+static int typeidtest_thread(typeidtest_thread_t* t) {
+  for (u32 j = 0; j < t->nkeys; j++) {
+    u32 i = (t->start + j) % t->nkeys;
+    t->resv[i] = (j & 1) ?
+      typeid_intern_typeid_hashed(t->keyv[i], typeid_intern_hash(t->keyv[i])) :
+      typeid_intern_typeid(t->keyv[i]);
+  }
+  return 0;
+}
+
+
+UNITTEST_DEF(typeid_intern_mt) {
+  // threads racing to intern the same new typeids must all get the same result
+  memalloc_t ma = memalloc_ctx();
+  const u32 nthreads = 8, nkeys = 2000;
+  typeid_t* keyv = mem_alloctv(ma, typeid_t, nkeys);
+  typeidtest_thread_t* threadv = mem_alloctv(ma, typeidtest_thread_t, nthreads);
+  assert(keyv && threadv);
+  for (u32 i = 0; i < nkeys; i++) {
+    char buf[32];
+    u32 len = (u32)snprintf(buf, sizeof(buf), "typeidtest_%u", i);
+    typeid_data_t* key = mem_alloc(ma, sizeof(typeid_data_t) + len).p;
+    assertnotnull(key);
+    key->len = len;
+    memcpy(key->bytes, buf, len);
+    keyv[i] = key;
+  }
+
+  usize count = typeid_count();
+  for (u32 i = 0; i < nthreads; i++) {
+    typeidtest_thread_t* t = &threadv[i];
+    t->keyv = keyv;
+    t->nkeys = nkeys;
+    t->start = i*(nkeys / nthreads);
+    assert(( t->resv = mem_alloctv(ma, typeid_t, nkeys) ));
+    safecheckx(thrd_create(&t->t, (thrd_start_t)typeidtest_thread, t) == thrd_success);
+  }
+  for (u32 i = 0; i < nthreads; i++)
+    safecheckx(thrd_join(threadv[i].t, NULL) == thrd_success);
+  assertf(typeid_count() == count + nkeys, "%zu", typeid_count() - count);
+
+  for (u32 k = 0; k < nkeys; k++) {
+    typeid_t tid = threadv[0].resv[k];
+    assert(tid != keyv[k] && typeid_eq(&tid, &keyv[k]));
+    assert(tid == typeid_intern_typeid(keyv[k]));
+    for (u32 i = 1; i < nthreads; i++)
+      assertf(threadv[i].resv[k] == tid, "thread %u key %u", i, k);
+  }
+
+  for (u32 i = 0; i < nthreads; i++)
+    mem_freetv(ma, threadv[i].resv, nkeys);
+  mem_freetv(ma, threadv, nthreads);
+  for (u32 i = 0; i < nkeys; i++)
+    mem_free(ma, &(mem_t){ (void*)keyv[i], sizeof(typeid_data_t) + keyv[i]->len });
+  mem_freetv(ma, keyv, nkeys);
+}
+
+#endif // CO_ENABLE_TESTS
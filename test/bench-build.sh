@@ -0,0 +1,178 @@
+#!/usr/bin/env bash
+#
+# Measures end-to-end build times of a generated multi-package project:
+#   cold      build with an empty build directory
+#   noop      rebuild with nothing changed (everything up to date)
+#   leaf      rebuild after editing the main package, which nothing depends on
+#   rootapi   rebuild after changing the public API of the package that all
+#             other packages depend on
+#
+# For each scenario the best wall time of N rounds is reported, together with
+# peak RSS of the compiler process, number of clang processes spawned and
+# number of packages (re)built in that round. Output is tab-separated values.
+#
+set -euo pipefail
+source "$(dirname "$0")/../etc/lib.sh"
+PWD0=$PWD
+cd "$(dirname "$0")"
+
+COEXE=${COEXE:-}
+NLIBS=8
+NFUNS=200
+ROUNDS=3
+BUILD_ARGS=()
+WORK_DIR="$OUT_DIR/bench-build"
+
+while [[ $# -gt 0 ]]; do case "$1" in
+  --coexe=*)  COEXE=${1:8}; shift ;;
+  --libs=*)   NLIBS=${1:7}; shift ;;
+  --funs=*)   NFUNS=${1:7}; shift ;;
+  --rounds=*) ROUNDS=${1:9}; shift ;;
+  -h|-help|--help) cat << _END
+Usage: $0 [options] [--] [<co build arg> ...]
+Options:
+  --coexe=<file>  Benchmark specific, existing compis executable
+  --libs=<n>      Number of library packages (default $NLIBS)
+  --funs=<n>      Number of functions per library package (default $NFUNS)
+  --rounds=<n>    Number of times to run each scenario (default $ROUNDS)
+  -h, --help      Show help on stdout and exit
+<co build arg>
+  Extra arguments for "co build", e.g. --debug or --no-link
+_END
+    exit ;;
+  --) shift; BUILD_ARGS+=( "$@" ); break ;;
+  -*) _err "Unknown option: $1" ;;
+  *)  BUILD_ARGS+=( "$1" ); shift ;;
+esac; done
+
+[ -n "${EPOCHREALTIME:-}" ] || _err "bash 5 or later is required (for EPOCHREALTIME)"
+
+# unless coexe is provided, use default build
+if [ -n "$COEXE" ]; then
+  f="$COEXE"
+  [[ "$COEXE" == "/"* ]] || f="$PWD0/$f"
+  [ -x "$f" ] || _err "$COEXE: not an executable file"
+  COEXE="$(realpath "$f")"
+else
+  COEXE="$OUT_DIR/opt-$HOST_ARCH-$HOST_SYS/co"
+  echo "$(_relpath "$PROJECT/build.sh") -no-lto" >&2
+  $BASH "$PROJECT/build.sh" -no-lto >&2
+fi
+
+SRC_DIR="$WORK_DIR/src"
+BUILD_DIR="$WORK_DIR/build"
+STATS_FILE="$WORK_DIR/stats.txt"
+TRACE_FILE="$WORK_DIR/trace.json"
+
+#———————————————————————————————————————————————————————————————————————————————————————
+# generate project
+#
+# base      root package; imported by all other packages
+# libN      imports base and lib(N-1)
+# app       main package; imports all libN
+
+_gen_lib() { # <name> <import> ...
+  local name=$1 ; shift
+  local dir="$SRC_DIR/$name" nfiles=4 f i
+  mkdir -p "$dir"
+  for (( f = 0; f < nfiles; f++ )); do
+    {
+      for imp in "$@"; do
+        echo "import \"$imp\" { * }"
+      done
+      for (( i = f; i < NFUNS; i += nfiles )); do
+        echo "pub fun ${name}_f$i(x, y int) int {"
+        echo "  let a = x + y * $(( i % 7 + 1 ))"
+        echo "  if a > $i { return a - y }"
+        if [ $i -ge $nfiles ]; then
+          echo "  ${name}_f$(( i - nfiles ))(a, x)"
+        else
+          echo "  a + x"
+        fi
+        echo "}"
+        echo "pub type ${name}_T$i {"
+        echo "  a int"
+        echo "  b f64"
+        echo "}"
+      done
+    } > "$dir/f$f.co"
+  done
+}
+
+_edit_root_api() { # <n>
+  echo "pub fun base_edit$1() int { $1 }" > "$SRC_DIR/base/edit.co"
+}
+
+_edit_leaf() { # <n>
+  echo "fun edit() int { $1 }" > "$SRC_DIR/app/edit.co"
+}
+
+rm -rf "$WORK_DIR"
+mkdir -p "$SRC_DIR"
+_gen_lib base
+_edit_root_api 0
+for (( n = 1; n <= NLIBS; n++ )); do
+  if [ $n -eq 1 ]; then
+    _gen_lib lib$n base
+  else
+    _gen_lib lib$n base lib$(( n - 1 ))
+  fi
+done
+mkdir -p "$SRC_DIR/app"
+{
+  for (( n = 1; n <= NLIBS; n++ )); do
+    echo "import \"lib$n\" { lib${n}_f0 }"
+  done
+  echo "fun main() {"
+  echo "  var x = edit()"
+  for (( n = 1; n <= NLIBS; n++ )); do
+    echo "  x = lib${n}_f0(x, $n)"
+  done
+  echo "}"
+} > "$SRC_DIR/app/main.co"
+_edit_leaf 0
+
+#———————————————————————————————————————————————————————————————————————————————————————
+# run
+
+# _build runs "co build" and sets WALL_MS, RSS_KB, NCLANG and NPKGS
+_build() {
+  local t0 t1
+  t0=$EPOCHREALTIME
+  (cd "$SRC_DIR" &&
+   "$COEXE" build --build-dir="$BUILD_DIR" --stats --trace-json="$TRACE_FILE" \
+     ${BUILD_ARGS[@]:+"${BUILD_ARGS[@]}"} app > "$STATS_FILE") ||
+    _err "build failed (see $(_relpath "$STATS_FILE"))"
+  t1=$EPOCHREALTIME
+  WALL_MS=$(( (${t1/./} - ${t0/./}) / 1000 ))
+  RSS_KB=$(( $(awk '$1 == "peak" && $2 == "RSS" { print $4 }' "$STATS_FILE") / 1024 ))
+  NCLANG=$(grep -c '"ph":"B","pid":2' "$TRACE_FILE" || true)
+  NPKGS=$(sed -nE 's/^total \(([0-9]+) packages\)$/\1/p' "$STATS_FILE")
+}
+
+# warm up: make sure sysroot & std packages are cached, outside of measurements
+_build
+rm -rf "$BUILD_DIR"
+
+printf "scenario\twall_ms\tpeak_rss_kb\tclang_spawns\tpkgs_built\n"
+
+_run() { # <scenario> <prepare-command>
+  local scenario=$1 prepare=$2 round best=
+  local best_rss best_nclang best_npkgs
+  for (( round = 1; round <= ROUNDS; round++ )); do
+    $prepare $round
+    _build
+    if [ -z "$best" ] || [ $WALL_MS -lt $best ]; then
+      best=$WALL_MS best_rss=$RSS_KB best_nclang=$NCLANG best_npkgs=$NPKGS
+    fi
+  done
+  printf "%s\t%d\t%d\t%d\t%d\n" $scenario $best $best_rss $best_nclang $best_npkgs
+}
+
+_prepare_cold() { rm -rf "$BUILD_DIR"; }
+_prepare_noop() { :; }
+
+_run cold    _prepare_cold
+_run noop    _prepare_noop
+_run leaf    _edit_leaf
+_run rootapi _edit_root_api
@@ -0,0 +1,54 @@
+# build with the LLVM backend and compare program output with the C backend
+cat << _END_ > main.c
+#include <stdio.h>
+long long fib(long long n);
+long long collatz(long long n);
+double mix(double x, unsigned char y, _Bool neg);
+int narrow(signed char x, signed char y, unsigned char z);
+int main() {
+  printf("%lld %lld %.3f %.3f\n", fib(50), collatz(27), mix(1.5, 200, 0), mix(1.5, 200, 1));
+  printf("%d %d\n", narrow(-128, -1, 200), narrow(100, 3, 255));
+  return 0;
+}
+_END_
+
+cat << _END_ > lib.co
+fun fib_next(n, x, y i64) i64 {
+  if n == 0 { x } else { fib_next(n - 1, y, x + y) }
+}
+
+pub "c" fun fib(n i64) i64 {
+  fib_next(n, 0, 1)
+}
+
+fun collatz_next(n i64) i64 {
+  if n % 2 == 0 { n / 2 } else { 3*n + 1 }
+}
+
+fun collatz_steps(n, steps i64) i64 {
+  if n == 1 { steps } else { collatz_steps(collatz_next(n), steps + 1) }
+}
+
+pub "c" fun collatz(n i64) i64 {
+  collatz_steps(n, 0)
+}
+
+pub "c" fun mix(x f64, y u8, neg bool) f64 {
+  var r = x * f64(y)
+  if neg && r > 0.0
+    r = 0.0 - r
+  r
+}
+
+pub "c" fun narrow(x, y i8, z u8) i32 {
+  i32(x / y) + i32(z + z) + i32(z >> 1)
+}
+_END_
+
+co build --backend=c -o c.exe main.c lib.co
+co build --backend=llvm -v -o llvm.exe main.c lib.co 2>&1 | tee build.log
+grep -q "(llvm)" build.log || _err "lib.co was not compiled by the LLVM backend"
+
+./c.exe > c.out
+./llvm.exe > llvm.out
+diff -u c.out llvm.out
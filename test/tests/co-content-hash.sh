@@ -0,0 +1,27 @@
+# --content-hash decides if sources changed by their content rather than mtime
+mkdir -p app
+echo 'fun main() { }' > app/main.co
+co build --content-hash -v -o a.exe ./app > build1.log
+[ -x a.exe ] || _err "a.exe not built (see build1.log)"
+
+# touching a source file without changing it does not cause a rebuild
+sleep 1
+touch app/main.co
+co build --content-hash -v -o a.exe ./app > build2.log
+grep -q 'is up to date' build2.log || _err "touched package was rebuilt (see build2.log)"
+
+# ...neither the second time, now that its new mtime has been recorded
+co build --content-hash -v -o a.exe ./app > build3.log
+grep -q 'is up to date' build3.log || _err "touched package was rebuilt (see build3.log)"
+
+# modified source is rebuilt
+echo '// modified' >> app/main.co
+co build --content-hash -v -o a.exe ./app > build4.log
+grep -q 'is up to date' build4.log && _err "modified package reported up to date"
+
+# without --content-hash, mtime decides
+sleep 1
+touch app/main.co
+co build -v -o a.exe ./app > build5.log
+grep -q 'is up to date' build5.log && _err "touched package reported up to date without --content-hash"
+[ -x a.exe ] || _err "a.exe not built (see build5.log)"
@@ -0,0 +1,28 @@
+# rebuilding a package which has not changed does not build or link anything
+mkdir -p app
+echo 'fun main() { }' > app/main.co
+co build -v -o a.exe ./app > build1.log
+[ -x a.exe ] || _err "a.exe not built (see build1.log)"
+grep -q 'is up to date' build1.log && _err "first build reported up to date (see build1.log)"
+
+cp -p a.exe a.exe.orig
+co build -v -o a.exe ./app > build2.log
+grep -q 'is up to date' build2.log || _err "second build was not a no-op (see build2.log)"
+[ a.exe -nt a.exe.orig ] && _err "a.exe relinked by no-op build"
+
+# a different output file is a different product
+co build -v -o b.exe ./app > build3.log
+grep -q 'is up to date' build3.log && _err "build with new -o reported up to date"
+[ -x b.exe ] || _err "b.exe not built (see build3.log)"
+
+# modified source is rebuilt
+sleep 1
+echo '// modified' >> app/main.co
+co build -v -o b.exe ./app > build4.log
+grep -q 'is up to date' build4.log && _err "modified package reported up to date"
+
+# removed product is rebuilt
+rm b.exe
+co build -v -o b.exe ./app > build5.log
+grep -q 'is up to date' build5.log && _err "missing product reported up to date"
+[ -x b.exe ] || _err "b.exe not rebuilt (see build5.log)"
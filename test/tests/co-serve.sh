@@ -0,0 +1,52 @@
+# builds sent to "compis serve" behave like builds made by "compis build"
+SOCKDIR=$(mktemp -d)  # short path; unix socket paths are limited to ~100 bytes
+export COSERVE="$SOCKDIR/serve.sock"
+
+co serve > serve.log 2>&1 &
+SERVE_PID=$!
+trap "kill $SERVE_PID 2>/dev/null; rm -rf '$SOCKDIR'" EXIT
+
+for i in $(seq 100); do
+  [ -S "$COSERVE" ] && break
+  kill -0 $SERVE_PID 2>/dev/null || _err "co serve exited: $(cat serve.log)"
+  sleep 0.1
+done
+[ -S "$COSERVE" ] || _err "co serve did not start"
+
+cat << _END_ > main.c
+#include <stdio.h>
+long long value(void);
+int main() { printf("%lld\n", value()); return 0; }
+_END_
+
+echo 'pub "c" fun value() i64 { 1 }' > lib.co
+# first build may build std/runtime, which means the next build starts over
+co build --server -v -o a.exe main.c lib.co > build1.log
+co build --server -v -o a.exe main.c lib.co > build2.log
+[ "$(./a.exe)" = "1" ] || _err "unexpected output from a.exe: $(./a.exe)"
+
+# modify source; the server should reuse its compiler instance
+echo 'pub "c" fun value() i64 { 2 }' > lib.co
+co build --server -v -o b.exe main.c lib.co > build3.log
+grep -q "reusing compiler instance" build3.log ||
+  _err "server did not reuse compiler instance (see build3.log)"
+[ "$(./b.exe)" = "2" ] || _err "unexpected output from b.exe: $(./b.exe)"
+
+# errors are reported to the client, along with a non-zero exit status
+echo 'pub "c" fun value() i64 { nope }' > lib.co
+if co build --server -o c.exe main.c lib.co 2> build4.log; then
+  _err "expected build to fail"
+fi
+grep -q "nope" build4.log || _err "error not reported to client (see build4.log)"
+
+# and the server recovers from them
+echo 'pub "c" fun value() i64 { 3 }' > lib.co
+co build --server -o d.exe main.c lib.co
+[ "$(./d.exe)" = "3" ] || _err "unexpected output from d.exe: $(./d.exe)"
+
+# -j only applies to the build it was given to
+co build --server -j1 -o e.exe main.c lib.co
+co build --server -v -o f.exe main.c lib.co > build6.log
+grep -q "COMAXPROC: 1$" build6.log && _err "-j1 was used by a later build"
+
+kill -0 $SERVE_PID || _err "co serve exited: $(cat serve.log)"
@@ -0,0 +1,13 @@
+# --stats prints time spent in compiler phases and counters, per package and in total
+echo 'pub "c" fun value() i64 { 1 }' > lib.co
+co build --stats --no-link lib.co > stats.txt
+
+grep -q '^package std/runtime$' stats.txt || _err "no stats for std/runtime (see stats.txt)"
+grep -q '^total (2 packages)$' stats.txt || _err "no total stats (see stats.txt)"
+for phase in parse typecheck iranalyze cgen metagen clang; do
+  grep -qE "^  $phase +[0-9.]+ +([0-9.]+|-)\$" stats.txt ||
+    _err "no time for phase $phase (see stats.txt)"
+done
+grep -qE '^  tokens +[1-9][0-9]*$' stats.txt || _err "no tokens counted (see stats.txt)"
+grep -qE '^  peak RSS bytes +[1-9][0-9]*$' stats.txt || _err "no peak RSS (see stats.txt)"
+grep -qE '^  slabs mapped +[1-9][0-9]*$' stats.txt || _err "no slabs mapped (see stats.txt)"
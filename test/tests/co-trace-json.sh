@@ -0,0 +1,18 @@
+# --trace-json writes a timeline of the build in Chrome's trace event format
+cat << _END_ > main.c
+#include <stdio.h>
+long long value(void);
+int main() { printf("%lld\n", value()); return 0; }
+_END_
+echo 'pub "c" fun value() i64 { 1 }' > lib.co
+
+co build --trace-json=trace.json -o a.exe main.c lib.co
+[ "$(./a.exe)" = "1" ] || _err "unexpected output from a.exe: $(./a.exe)"
+
+head -n1 trace.json | grep -q '^{"traceEvents":\[$' || _err "not a trace file"
+tail -n1 trace.json | grep -q '^\]}$' || _err "trace file is incomplete"
+for span in parse typecheck iranalyze cgen metagen link; do
+  grep -q "\"ph\":\"X\",.*\"name\":\"$span\"" trace.json ||
+    _err "no \"$span\" span in trace.json"
+done
+grep -q '"ph":"B",.*"name":"cc"' trace.json || _err "no clang subprocess in trace.json"